@@ -48,6 +48,7 @@
 #include <string.h>
 
 #include "ntimed.h"
+#include "stats.h"
 
 
 struct cd_stat {
@@ -89,8 +90,8 @@ CD_New(void)
 }
 
 static void
-cd_try_peak(const struct combine_delta *cd, double *mx, double *my, double x,
-    struct cd_stat *st)
+cd_try_peak(const struct combine_delta *cd, const struct cd_source *skip,
+    double *mx, double *my, double x, struct cd_stat *st)
 {
 	struct cd_source *cs;
 
@@ -101,7 +102,7 @@ cd_try_peak(const struct combine_delta *cd, double *mx, double *my, double x,
 	st->quorum = 0;
 
 	TAILQ_FOREACH(cs, &cd->head, list) {
-		if (cs->tb_gen != TB_generation)
+		if (cs == skip || cs->tb_gen != TB_generation)
 			continue;
 		if (x < cs->low)
 			continue;
@@ -153,12 +154,19 @@ cd_find_peak(struct ocx *ocx, const struct combine_delta *cd)
 	TAILQ_FOREACH(cs, &cd->head, list) {
 		if (cs->tb_gen != TB_generation)
 			continue;
-		cd_try_peak(cd, &max_x, &max_y, cs->low, &st[m++]);
-		cd_try_peak(cd, &max_x, &max_y, cs->mid, &st[m++]);
-		cd_try_peak(cd, &max_x, &max_y, cs->high, &st[m++]);
+		cd_try_peak(cd, NULL, &max_x, &max_y, cs->low, &st[m++]);
+		cd_try_peak(cd, NULL, &max_x, &max_y, cs->mid, &st[m++]);
+		cd_try_peak(cd, NULL, &max_x, &max_y, cs->high, &st[m++]);
 	}
-	Put(ocx, OCX_TRACE,
+	Trace(ocx, OCX_TRC_COMBINE,
 	    " %.3e %.3e %.3e\n", max_x, max_y, log(max_y)/log(10.));
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		stats_seg->cd_peak = max_x;
+		stats_seg->cd_weight = max_y;
+		stats_seg->cd_nsrc = cd->nsrc;
+		Stats_End();
+	}
 	PLL(ocx, max_x, max_y);
 	qsort(st, cd->nsrc * 3L, sizeof st[0], stat_cmp);
 }
@@ -183,13 +191,47 @@ cd_filter(struct ocx *ocx, const struct combiner *cb,
 	cs->high = high;
 	cs->tb_gen = TB_generation;
 
-	Put(ocx, OCX_TRACE,
+	Trace(ocx, OCX_TRC_COMBINE,
 	    "Combine %s %s %.6f %.6f %.6f", cb->name1, cb->name2,
 	    cs->low, cs->mid, cs->high);
 
 	cd_find_peak(ocx, cd);
 }
 
+/**********************************************************************
+ * What all the other sources say, for sources which can not tell the
+ * whole time by themselves (see refclock.c).  Returns zero if there
+ * are no others to ask.
+ */
+
+int
+CD_Estimate(const struct combiner *cb, double *offset)
+{
+	struct cd_source *cs, *cs2;
+	struct combine_delta *cd;
+	struct cd_stat st;
+	double max_x = 0;
+	double max_y = 0;
+
+	CHECK_OBJ_NOTNULL(cb, COMBINER_MAGIC);
+	CAST_OBJ_NOTNULL(cs, cb->priv, CD_SOURCE_MAGIC);
+	cd = cs->cd;
+	CHECK_OBJ_NOTNULL(cd, COMBINE_DELTA_MAGIC);
+	AN(offset);
+
+	TAILQ_FOREACH(cs2, &cd->head, list) {
+		if (cs2 == cs || cs2->tb_gen != TB_generation)
+			continue;
+		cd_try_peak(cd, cs, &max_x, &max_y, cs2->low, &st);
+		cd_try_peak(cd, cs, &max_x, &max_y, cs2->mid, &st);
+		cd_try_peak(cd, cs, &max_x, &max_y, cs2->high, &st);
+	}
+	if (max_y == 0)
+		return (0);
+	*offset = max_x;
+	return (1);
+}
+
 struct combiner *
 CD_AddSource(struct combine_delta *cd, const char *name1, const char *name2)
 {
@@ -213,3 +255,19 @@ CD_AddSource(struct combine_delta *cd, const char *name1, const char *name2)
 
 	return (&cs->combiner);
 }
+
+void
+CD_RemoveSource(struct combiner *cb)
+{
+	struct cd_source *cs;
+	struct combine_delta *cd;
+
+	CHECK_OBJ_NOTNULL(cb, COMBINER_MAGIC);
+	CAST_OBJ_NOTNULL(cs, cb->priv, CD_SOURCE_MAGIC);
+	cd = cs->cd;
+	CHECK_OBJ_NOTNULL(cd, COMBINE_DELTA_MAGIC);
+
+	TAILQ_REMOVE(&cd->head, cs, list);
+	cd->nsrc -= 1;
+	FREE_OBJ(cs);
+}
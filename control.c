@@ -0,0 +1,337 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Control socket
+ * ==============
+ *
+ * A UNIX domain stream socket through which a running client can be
+ * examined and adjusted without restarting it (and thereby throwing
+ * away everything the PLL has learned).
+ *
+ * The protocol is one command per connection: Send a single line, get
+ * the output back, the last line of which is "OK" or "FAIL", and the
+ * connection is closed.  "--control" does that from the command line.
+ *
+ * Everything happens in a todo-list job, so no locking is necessary
+ * against the rest of the program.  The output of a command is sent to
+ * the connection by giving it its own struct ocx.
+ *
+ * Nothing ever waits for a connection: Reads are MSG_DONTWAIT and the
+ * sockets are non-blocking, so output the client does not read is
+ * dropped.  A connection which has not sent its command by the next
+ * tick is dropped too.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+
+#define CONTROL_TICK	1.0		// Seconds between accept(2)s
+#define CONTROL_TMO	1		// Ticks, per connection
+#define CONTROL_MAXCMD	1024
+#define CONTROL_MAXSESS	8
+
+struct ctl_sess {
+	int			fd;
+	unsigned		age;
+	size_t			len;
+	char			buf[CONTROL_MAXCMD];
+};
+
+struct control {
+	unsigned		magic;
+#define CONTROL_MAGIC		0x2c4e1d97
+	int			fd;
+	struct ntp_peerset	*nps;
+	struct ocx		*ocx;
+	struct ctl_sess		sess[CONTROL_MAXSESS];
+};
+
+static const char * const ctl_state[] = {
+#define NTP_STATE(n, l, u, d)	[n] = #l,
+#include "ntp_tbl.h"
+#undef NTP_STATE
+};
+
+/**********************************************************************
+ * Commands
+ */
+
+typedef int ctl_cmd_f(struct ocx *, struct control *, const char *arg);
+
+static ctl_cmd_f ctl_help;
+
+static int __match_proto__(ctl_cmd_f)
+ctl_param(struct ocx *ocx, struct control *ctl, const char *arg)
+{
+
+	(void)ctl;
+	if (*arg == '\0') {
+		Param_Report(ocx, OCX_DIAG);
+		return (0);
+	}
+	return (Param_Cmd(ocx, arg));
+}
+
+static int __match_proto__(ctl_cmd_f)
+ctl_peers(struct ocx *ocx, struct control *ctl, const char *arg)
+{
+	struct ntp_peer *np;
+
+	(void)arg;
+	NTP_PeerSet_Foreach(np, ctl->nps) {
+		CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+		Put(ocx, OCX_DIAG, "%s %s %s nmiss %u\n",
+		    np->hostname, np->ip, ctl_state[np->state], np->nmiss);
+		if (np->filter_priv != NULL) {
+			Put(ocx, OCX_DIAG, "\t");
+			NF_Report(ocx, OCX_DIAG, np);
+		}
+	}
+	return (0);
+}
+
+static int __match_proto__(ctl_cmd_f)
+ctl_add(struct ocx *ocx, struct control *ctl, const char *arg)
+{
+	int i;
+
+	if (*arg == '\0') {
+		Put(ocx, OCX_DIAG, "Usage: add hostname\n");
+		return (-1);
+	}
+	i = NTP_PeerSet_Insert(ocx, ctl->nps, arg);
+	if (i < 0)
+		return (-1);
+	Put(ocx, OCX_DIAG, "Added %d peers\n", i);
+	return (0);
+}
+
+static int __match_proto__(ctl_cmd_f)
+ctl_remove(struct ocx *ocx, struct control *ctl, const char *arg)
+{
+	int i;
+
+	if (*arg == '\0') {
+		Put(ocx, OCX_DIAG, "Usage: remove hostname\n");
+		return (-1);
+	}
+	i = NTP_PeerSet_Remove(ocx, ctl->nps, arg);
+	if (i < 0)
+		return (-1);
+	Put(ocx, OCX_DIAG, "Removed %d peers\n", i);
+	return (0);
+}
+
+static const struct ctl_cmd {
+	const char		*name;
+	ctl_cmd_f		*func;
+	const char		*args;
+	const char		*help;
+} ctl_cmds[] = {
+	{ "help",	ctl_help,	"",
+	    "This list" },
+	{ "param",	ctl_param,	"[? | name | name=value]",
+	    "Show all, list, describe or set parameters" },
+	{ "peers",	ctl_peers,	"",
+	    "Peers and their filter state" },
+	{ "add",	ctl_add,	"hostname",
+	    "Add the peers hostname resolves to" },
+	{ "remove",	ctl_remove,	"hostname",
+	    "Remove the peers added for hostname" },
+	{ NULL,		NULL,		NULL,	NULL },
+};
+
+static int __match_proto__(ctl_cmd_f)
+ctl_help(struct ocx *ocx, struct control *ctl, const char *arg)
+{
+	const struct ctl_cmd *cc;
+
+	(void)ctl;
+	(void)arg;
+	for (cc = ctl_cmds; cc->name != NULL; cc++)
+		Put(ocx, OCX_DIAG, "%-7s %-24s %s\n",
+		    cc->name, cc->args, cc->help);
+	return (0);
+}
+
+static int
+ctl_exec(struct control *ctl, char *line)
+{
+	const struct ctl_cmd *cc;
+	char *p, *arg;
+
+	/* Command, optionally followed by whitespace and one argument */
+	for (p = strchr(line, '\0'); p > line && isspace((int)p[-1]); p--)
+		continue;
+	*p = '\0';
+	while (isspace((int)*line))
+		line++;
+	for (arg = line; *arg != '\0' && !isspace((int)*arg); arg++)
+		continue;
+	if (*arg != '\0')
+		*arg++ = '\0';
+	while (isspace((int)*arg))
+		arg++;
+
+	for (cc = ctl_cmds; cc->name != NULL; cc++)
+		if (!strcmp(cc->name, line))
+			return (cc->func(ctl->ocx, ctl, arg));
+	Put(ctl->ocx, OCX_DIAG, "Unknown command '%s' (try 'help')\n", line);
+	return (-1);
+}
+
+/**********************************************************************
+ * Connections
+ */
+
+/* Returns zero if the session is still waiting for its command */
+
+static int
+ctl_session(struct control *ctl, struct ctl_sess *cs)
+{
+	char *p;
+	ssize_t l;
+	int i;
+
+	while (1) {
+		l = recv(cs->fd, cs->buf + cs->len,
+		    sizeof cs->buf - 1L - cs->len, MSG_DONTWAIT);
+		if (l <= 0)
+			break;
+		cs->len += (size_t)l;
+		if (memchr(cs->buf, '\n', cs->len) != NULL ||
+		    cs->len == sizeof cs->buf - 1L)
+			break;
+	}
+	cs->buf[cs->len] = '\0';
+	p = memchr(cs->buf, '\n', cs->len);
+	if (p == NULL) {
+		if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR) && cs->age++ < CONTROL_TMO)
+			return (0);
+		return (1);	// Timeout, EOF, error or too long
+	}
+
+	OCX_Sink(ctl->ocx, OCX_DIAG, cs->fd);
+	OCX_Sink(ctl->ocx, OCX_DEBUG, cs->fd);
+	*p = '\0';
+	i = ctl_exec(ctl, cs->buf);
+	Put(ctl->ocx, OCX_DIAG, "%s\n", i ? "FAIL" : "OK");
+	OCX_Sink(ctl->ocx, OCX_DIAG, -1);
+	OCX_Sink(ctl->ocx, OCX_DEBUG, -1);
+	return (1);
+}
+
+static enum todo_e __match_proto__(todo_f)
+ctl_poll(struct ocx *ocx, struct todolist *tdl, void *priv)
+{
+	struct control *ctl;
+	struct ctl_sess *cs;
+	int i;
+
+	(void)ocx;
+	AN(tdl);
+	CAST_OBJ_NOTNULL(ctl, priv, CONTROL_MAGIC);
+	for (cs = ctl->sess; cs < ctl->sess + CONTROL_MAXSESS; cs++) {
+		if (cs->fd < 0) {
+			cs->fd = accept(ctl->fd, NULL, NULL);
+			if (cs->fd < 0)
+				continue;
+			/* Linux does not pass O_NONBLOCK on from ctl->fd */
+			i = fcntl(cs->fd, F_GETFL);
+			assert(i != -1);
+			AZ(fcntl(cs->fd, F_SETFL, i | O_NONBLOCK));
+			cs->age = 0;
+			cs->len = 0;
+		}
+		if (ctl_session(ctl, cs)) {
+			AZ(close(cs->fd));
+			cs->fd = -1;
+		}
+	}
+	return (TODO_OK);
+}
+
+/**********************************************************************/
+
+void
+Control_New(struct ocx *ocx, const char *path, struct todolist *tdl,
+    struct ntp_peerset *nps)
+{
+	struct control *ctl;
+	struct sockaddr_un sau;
+	int i;
+
+	AN(path);
+	AN(tdl);
+	AN(nps);
+
+	memset(&sau, 0, sizeof sau);
+	if (strlen(path) >= sizeof sau.sun_path)
+		Fail(ocx, 0, "Control socket path too long '%s'", path);
+	sau.sun_family = AF_UNIX;
+	strcpy(sau.sun_path, path);
+
+	ALLOC_OBJ(ctl, CONTROL_MAGIC);
+	AN(ctl);
+	ctl->nps = nps;
+	ctl->ocx = OCX_New();
+	AN(ctl->ocx);
+	for (i = 0; i < CONTROL_MAXSESS; i++)
+		ctl->sess[i].fd = -1;
+
+	ctl->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctl->fd < 0)
+		Fail(ocx, 1, "Could not create control socket");
+	(void)unlink(path);
+	if (bind(ctl->fd, (void*)&sau, sizeof sau))
+		Fail(ocx, 1, "Could not bind control socket '%s'", path);
+	/* Anybody who can talk to it can steer the clock */
+	if (chmod(path, 0600))
+		Fail(ocx, 1, "Could not chmod control socket '%s'", path);
+	if (listen(ctl->fd, 8))
+		Fail(ocx, 1, "Could not listen on control socket '%s'", path);
+	i = fcntl(ctl->fd, F_GETFL);
+	assert(i != -1);
+	AZ(fcntl(ctl->fd, F_SETFL, i | O_NONBLOCK));
+
+	/* A client going away must not kill us */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	(void)TODO_ScheduleRel(tdl, ctl_poll, ctl, CONTROL_TICK, CONTROL_TICK,
+	    "Control");
+}
@@ -0,0 +1,1092 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Cryptographic primitives
+ * ========================
+ *
+ * Just enough for NTP symmetric key authentication (ntp_auth.c) and
+ * Network Time Security (nts.c):
+ *	AES-CMAC (RFC 4493, RFC 8573)
+ *	SHA-1 (FIPS 180-4), for the traditional digest(key || packet)
+ *	AEAD_AES_SIV_CMAC_256 (RFC 5297), the AEAD NTS uses
+ *
+ * With OpenSSL (HAVE_OPENSSL, see configure) these are its EVP "CMAC"
+ * MAC, "SHA1" digest and "AES-128-SIV" cipher.  The algorithms are
+ * fetched once, and a context is made for each operation, so the key
+ * structures are just the key, and can be copied and thrown away
+ * without ceremony.
+ *
+ * Without OpenSSL, a fallback implementation is compiled instead.  It
+ * is written to run in constant time: the AES S-box is a bitsliced
+ * boolean circuit (Boyar & Peralta) rather than a table, nothing
+ * branches on or indexes by secret data, so it does not leak keys
+ * through the cache to local processes.  The price is speed, a block
+ * costs a few microseconds, which is plenty for NTP.
+ *
+ * AES-SIV works in place and on the caller's buffers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <pthread.h>
+
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/params.h>
+#endif
+
+#include "ntimed.h"
+#include "ntimed_endian.h"
+
+/**********************************************************************
+ * dbl() of RFC 5297, which is also how CMAC subkeys are derived.
+ * The carry is masked in rather than branched on, the input is secret.
+ */
+
+static void
+cmac_dbl(uint8_t *dst, const uint8_t *src)
+{
+	unsigned u;
+	uint8_t c;
+
+	c = (uint8_t)(0x87 & -(src[0] >> 7));
+	for (u = 0; u < 15; u++)
+		dst[u] = (uint8_t)((src[u] << 1) | (src[u + 1] >> 7));
+	dst[15] = (uint8_t)((src[15] << 1) ^ c);
+}
+
+#ifdef HAVE_OPENSSL
+
+/**********************************************************************
+ * OpenSSL
+ */
+
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+static EVP_MAC *crypto_cmac;
+static EVP_CIPHER *crypto_siv;
+static EVP_MD *crypto_sha1;
+
+static void
+crypto_fetch(void)
+{
+
+	crypto_cmac = EVP_MAC_fetch(NULL, "CMAC", NULL);
+	crypto_siv = EVP_CIPHER_fetch(NULL, "AES-128-SIV", NULL);
+	crypto_sha1 = EVP_MD_fetch(NULL, "SHA1", NULL);
+	if (crypto_cmac == NULL || crypto_siv == NULL || crypto_sha1 == NULL)
+		Fail(NULL, 0, "OpenSSL lacks AES-CMAC, AES-SIV or SHA-1\n");
+}
+
+void
+CMAC_Key(struct cmac *cm, const uint8_t *key)
+{
+
+	AN(cm);
+	AN(key);
+	memcpy(cm->key, key, sizeof cm->key);
+}
+
+void
+CMAC_Sum(const struct cmac *cm, const void *ptr, size_t len, uint8_t *mac)
+{
+	EVP_MAC_CTX *ctx;
+	OSSL_PARAM par[2];
+	size_t l;
+
+	AN(cm);
+	AN(mac);
+	AZ(pthread_once(&crypto_once, crypto_fetch));
+	par[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER,
+	    (char *)(uintptr_t)"AES-128-CBC", 0);
+	par[1] = OSSL_PARAM_construct_end();
+	ctx = EVP_MAC_CTX_new(crypto_cmac);
+	AN(ctx);
+	assert(EVP_MAC_init(ctx, cm->key, sizeof cm->key, par) == 1);
+	if (len > 0)
+		assert(EVP_MAC_update(ctx, ptr, len) == 1);
+	assert(EVP_MAC_final(ctx, mac, &l, 16) == 1);
+	assert(l == 16);
+	EVP_MAC_CTX_free(ctx);
+}
+
+void
+Sha1_Init(struct sha1 *sc)
+{
+
+	AN(sc);
+	AZ(pthread_once(&crypto_once, crypto_fetch));
+	sc->ctx = EVP_MD_CTX_new();
+	AN(sc->ctx);
+	assert(EVP_DigestInit_ex(sc->ctx, crypto_sha1, NULL) == 1);
+}
+
+void
+Sha1_Update(struct sha1 *sc, const void *ptr, size_t len)
+{
+
+	AN(sc);
+	AN(sc->ctx);
+	assert(EVP_DigestUpdate(sc->ctx, ptr, len) == 1);
+}
+
+void
+Sha1_Final(struct sha1 *sc, uint8_t *digest)
+{
+	unsigned l;
+
+	AN(sc);
+	AN(sc->ctx);
+	AN(digest);
+	assert(EVP_DigestFinal_ex(sc->ctx, digest, &l) == 1);
+	assert(l == 20);
+	EVP_MD_CTX_free(sc->ctx);
+	sc->ctx = NULL;
+}
+
+void
+AES_SIV_Key(struct aes_siv *siv, const uint8_t *key)
+{
+
+	AN(siv);
+	AN(key);
+	memcpy(siv->key, key, sizeof siv->key);
+}
+
+/*
+ * OpenSSL 3.0 does not finish a SIV without any plaintext, which is
+ * what NTS requests mostly are, so S2V is done by hand for those: the
+ * CMAC is OpenSSL's all the same, and there is no CTR to do.
+ */
+
+static void
+siv_s2v_empty(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, uint8_t *v)
+{
+	struct cmac cm;
+	uint8_t d[16], t[16];
+	unsigned u, i;
+
+	CMAC_Key(&cm, siv->key);
+	memset(d, 0, sizeof d);
+	CMAC_Sum(&cm, d, sizeof d, d);
+	for (i = 0; i < nad; i++) {
+		cmac_dbl(d, d);
+		CMAC_Sum(&cm, ad[i].ptr, ad[i].len, t);
+		for (u = 0; u < 16; u++)
+			d[u] ^= t[u];
+	}
+	cmac_dbl(d, d);
+	d[0] ^= 0x80;
+	CMAC_Sum(&cm, d, sizeof d, v);
+	memset(&cm, 0, sizeof cm);
+}
+
+/* OpenSSL silently skips empty associated data, which S2V does not */
+
+static EVP_CIPHER_CTX *
+siv_ctx(const struct aes_siv *siv, int enc, const struct crypto_vec *ad,
+    unsigned nad)
+{
+	EVP_CIPHER_CTX *ctx;
+	unsigned i;
+	int l;
+
+	ctx = EVP_CIPHER_CTX_new();
+	AN(ctx);
+	assert(EVP_CipherInit_ex2(ctx, crypto_siv, siv->key, NULL, enc,
+	    NULL) == 1);
+	for (i = 0; i < nad; i++) {
+		assert(ad[i].len > 0 && ad[i].len < 0x10000);
+		assert(EVP_CipherUpdate(ctx, NULL, &l, ad[i].ptr,
+		    (int)ad[i].len) == 1);
+	}
+	return (ctx);
+}
+
+void
+AES_SIV_Seal(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, const void *pt, size_t len, void *out)
+{
+	EVP_CIPHER_CTX *ctx;
+	uint8_t *o = out;
+	int l;
+
+	AN(siv);
+	assert(nad == 0 || ad != NULL);
+	assert(len == 0 || pt != NULL);
+	AN(out);
+	AZ(pthread_once(&crypto_once, crypto_fetch));
+	if (len == 0) {
+		siv_s2v_empty(siv, ad, nad, o);
+		return;
+	}
+	assert(len < 0x10000);
+	ctx = siv_ctx(siv, 1, ad, nad);
+	/* pt may be o + 16, the tag is only written at the end */
+	assert(EVP_EncryptUpdate(ctx, o + 16, &l, pt, (int)len) == 1);
+	assert(EVP_EncryptFinal_ex(ctx, o + 16, &l) == 1);
+	assert(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, o) == 1);
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+int
+AES_SIV_Open(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, const void *ct, size_t len, void *out)
+{
+	EVP_CIPHER_CTX *ctx;
+	const uint8_t *c = ct;
+	uint8_t v[16];
+	int i, l;
+
+	AN(siv);
+	assert(nad == 0 || ad != NULL);
+	AN(ct);
+	AN(out);
+	AZ(pthread_once(&crypto_once, crypto_fetch));
+	if (len < 16 || len >= 0x10000)
+		return (-1);
+	if (len == 16) {
+		siv_s2v_empty(siv, ad, nad, v);
+		return (Crypto_Equal(v, c, sizeof v) ? 0 : -1);
+	}
+	memcpy(v, c, sizeof v);
+	ctx = siv_ctx(siv, 0, ad, nad);
+	assert(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, v) == 1);
+	i = EVP_DecryptUpdate(ctx, out, &l, c + 16, (int)(len - 16));
+	if (i == 1)
+		i = EVP_DecryptFinal_ex(ctx, out, &l);
+	EVP_CIPHER_CTX_free(ctx);
+	if (i != 1) {
+		memset(out, 0, len - 16);
+		return (-1);
+	}
+	return (0);
+}
+
+#else /* !HAVE_OPENSSL */
+
+/**********************************************************************
+ * Constant time fallback: AES-128, encryption only
+ *
+ * The S-box is the Boyar-Peralta circuit of 113 gates, evaluated on
+ * bit-planes: bit b of byte u of the input is bit u of q[b].
+ */
+
+static void
+aes_sbox_bs(uint32_t *q)
+{
+	uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+	uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+	uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+	uint32_t y20, y21;
+	uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+	uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+	uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+
+	/* Top linear transformation */
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	/* Non-linear section */
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	/* Bottom linear transformation */
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+}
+
+static void
+aes_subbytes(uint8_t *s, unsigned n)
+{
+	uint32_t q[8];
+	unsigned u, b;
+
+	assert(n <= 32);
+	memset(q, 0, sizeof q);
+	for (u = 0; u < n; u++)
+		for (b = 0; b < 8; b++)
+			q[b] |= (uint32_t)((s[u] >> b) & 1) << u;
+	aes_sbox_bs(q);
+	for (u = 0; u < n; u++) {
+		s[u] = 0;
+		for (b = 0; b < 8; b++)
+			s[u] |= (uint8_t)(((q[b] >> u) & 1) << b);
+	}
+}
+
+static uint8_t
+aes_xtime(uint8_t x)
+{
+
+	return ((uint8_t)((x << 1) ^ (0x1b & -(x >> 7))));
+}
+
+static void
+aes_mixcolumn(uint8_t *a)
+{
+	uint8_t a0, a1, a2, a3, x;
+
+	a0 = a[0];
+	a1 = a[1];
+	a2 = a[2];
+	a3 = a[3];
+	x = a0 ^ a1 ^ a2 ^ a3;
+	a[0] = a0 ^ x ^ aes_xtime(a0 ^ a1);
+	a[1] = a1 ^ x ^ aes_xtime(a1 ^ a2);
+	a[2] = a2 ^ x ^ aes_xtime(a2 ^ a3);
+	a[3] = a3 ^ x ^ aes_xtime(a3 ^ a0);
+}
+
+static void
+aes128_key(struct aes128 *aes, const uint8_t *key)
+{
+	uint8_t *rk, t[4], c, rcon = 1;
+	unsigned u, i;
+
+	AN(aes);
+	AN(key);
+	rk = aes->rk;
+	memcpy(rk, key, 16);
+	for (u = 16; u < sizeof aes->rk; u += 4) {
+		memcpy(t, rk + u - 4, sizeof t);
+		if ((u & 15) == 0) {
+			c = t[0];
+			t[0] = t[1];
+			t[1] = t[2];
+			t[2] = t[3];
+			t[3] = c;
+			aes_subbytes(t, 4);
+			t[0] ^= rcon;
+			rcon = aes_xtime(rcon);
+		}
+		for (i = 0; i < 4; i++)
+			rk[u + i] = rk[u - 16 + i] ^ t[i];
+	}
+}
+
+static void
+aes128_encrypt(const struct aes128 *aes, const uint8_t *in, uint8_t *out)
+{
+	uint8_t s[16], t[16];
+	unsigned r, u;
+
+	AN(aes);
+	AN(in);
+	AN(out);
+	for (u = 0; u < 16; u++)
+		s[u] = in[u] ^ aes->rk[u];
+	for (r = 1; r <= 10; r++) {
+		aes_subbytes(s, 16);
+		/* ShiftRows: row i, the bytes at i + 4n, rotates i left */
+		for (u = 0; u < 16; u++)
+			t[u] = s[(u + 4 * (u & 3)) & 15];
+		if (r < 10)
+			for (u = 0; u < 16; u += 4)
+				aes_mixcolumn(t + u);
+		for (u = 0; u < 16; u++)
+			s[u] = t[u] ^ aes->rk[16 * r + u];
+	}
+	memcpy(out, s, 16);
+}
+
+/**********************************************************************
+ * Constant time fallback: AES-CMAC (RFC 4493)
+ */
+
+void
+CMAC_Key(struct cmac *cm, const uint8_t *key)
+{
+	uint8_t l[16];
+
+	AN(cm);
+	aes128_key(&cm->aes, key);
+	memset(l, 0, sizeof l);
+	aes128_encrypt(&cm->aes, l, l);
+	cmac_dbl(cm->k1, l);
+	cmac_dbl(cm->k2, cm->k1);
+}
+
+void
+CMAC_Sum(const struct cmac *cm, const void *ptr, size_t len, uint8_t *mac)
+{
+	const uint8_t *p = ptr;
+	uint8_t x[16];
+	unsigned u;
+
+	AN(cm);
+	AN(mac);
+	memset(x, 0, sizeof x);
+	for (; len > 16; len -= 16, p += 16) {
+		for (u = 0; u < 16; u++)
+			x[u] ^= p[u];
+		aes128_encrypt(&cm->aes, x, x);
+	}
+	/* Last block: complete ones get K1, padded ones K2 */
+	for (u = 0; u < len; u++)
+		x[u] ^= p[u];
+	if (len == 16) {
+		for (u = 0; u < 16; u++)
+			x[u] ^= cm->k1[u];
+	} else {
+		x[len] ^= 0x80;
+		for (u = 0; u < 16; u++)
+			x[u] ^= cm->k2[u];
+	}
+	aes128_encrypt(&cm->aes, x, mac);
+}
+
+/**********************************************************************
+ * Incremental AES-CMAC, for S2V which needs to fold a block into the
+ * end of a message without copying it.  The last block is held back
+ * until cmac_final(), because it gets the subkey.
+ */
+
+struct cmac_ctx {
+	uint8_t			x[16];
+	uint8_t			buf[16];
+	size_t			n;
+};
+
+static void
+cmac_init(struct cmac_ctx *cc)
+{
+
+	memset(cc, 0, sizeof *cc);
+}
+
+static void
+cmac_update(const struct cmac *cm, struct cmac_ctx *cc, const void *ptr,
+    size_t len)
+{
+	const uint8_t *p = ptr;
+	size_t l;
+	unsigned u;
+
+	while (len > 0) {
+		if (cc->n == 16) {
+			for (u = 0; u < 16; u++)
+				cc->x[u] ^= cc->buf[u];
+			aes128_encrypt(&cm->aes, cc->x, cc->x);
+			cc->n = 0;
+		}
+		l = 16 - cc->n;
+		if (l > len)
+			l = len;
+		memcpy(cc->buf + cc->n, p, l);
+		cc->n += l;
+		p += l;
+		len -= l;
+	}
+}
+
+static void
+cmac_final(const struct cmac *cm, struct cmac_ctx *cc, uint8_t *mac)
+{
+	unsigned u;
+
+	for (u = 0; u < cc->n; u++)
+		cc->x[u] ^= cc->buf[u];
+	if (cc->n == 16) {
+		for (u = 0; u < 16; u++)
+			cc->x[u] ^= cm->k1[u];
+	} else {
+		cc->x[cc->n] ^= 0x80;
+		for (u = 0; u < 16; u++)
+			cc->x[u] ^= cm->k2[u];
+	}
+	aes128_encrypt(&cm->aes, cc->x, mac);
+}
+
+/**********************************************************************
+ * AEAD_AES_SIV_CMAC_256 (RFC 5297)
+ *
+ * The first half of the key is for S2V, the second for CTR.  The
+ * associated data is a vector of strings, the nonce (if any) being
+ * the last of them.  The output is the 16 byte synthetic IV followed
+ * by the ciphertext, which is as long as the plaintext.
+ */
+
+void
+AES_SIV_Key(struct aes_siv *siv, const uint8_t *key)
+{
+
+	AN(siv);
+	AN(key);
+	CMAC_Key(&siv->s2v, key);
+	aes128_key(&siv->ctr, key + 16);
+}
+
+static void
+siv_s2v(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, const uint8_t *pt, size_t len, uint8_t *v)
+{
+	struct cmac_ctx cc;
+	uint8_t d[16], t[16];
+	unsigned u, i;
+
+	memset(d, 0, sizeof d);
+	CMAC_Sum(&siv->s2v, d, sizeof d, d);
+	for (i = 0; i < nad; i++) {
+		cmac_dbl(d, d);
+		CMAC_Sum(&siv->s2v, ad[i].ptr, ad[i].len, t);
+		for (u = 0; u < 16; u++)
+			d[u] ^= t[u];
+	}
+	cmac_init(&cc);
+	if (len >= 16) {
+		/* xorend: fold D into the last 16 bytes */
+		cmac_update(&siv->s2v, &cc, pt, len - 16);
+		for (u = 0; u < 16; u++)
+			t[u] = pt[len - 16 + u] ^ d[u];
+		cmac_update(&siv->s2v, &cc, t, 16);
+	} else {
+		cmac_dbl(d, d);
+		memset(t, 0, sizeof t);
+		if (len > 0)
+			memcpy(t, pt, len);
+		t[len] = 0x80;
+		for (u = 0; u < 16; u++)
+			d[u] ^= t[u];
+		cmac_update(&siv->s2v, &cc, d, 16);
+	}
+	cmac_final(&siv->s2v, &cc, v);
+}
+
+static void
+siv_ctr(const struct aes_siv *siv, const uint8_t *v, const uint8_t *in,
+    uint8_t *out, size_t len)
+{
+	uint8_t q[16], ks[16];
+	size_t l;
+	unsigned u;
+	int i;
+
+	memcpy(q, v, sizeof q);
+	q[8] &= 0x7f;
+	q[12] &= 0x7f;
+	while (len > 0) {
+		aes128_encrypt(&siv->ctr, q, ks);
+		l = len < 16 ? len : 16;
+		for (u = 0; u < l; u++)
+			out[u] = in[u] ^ ks[u];
+		in += l;
+		out += l;
+		len -= l;
+		for (i = 15; i >= 0 && ++q[i] == 0; i--)
+			continue;
+	}
+}
+
+void
+AES_SIV_Seal(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, const void *pt, size_t len, void *out)
+{
+	uint8_t v[16], *o = out;
+
+	AN(siv);
+	assert(nad == 0 || ad != NULL);
+	assert(len == 0 || pt != NULL);
+	AN(out);
+	siv_s2v(siv, ad, nad, pt, len, v);
+	/* pt may be o + 16, CTR does not look back */
+	siv_ctr(siv, v, pt, o + 16, len);
+	memcpy(o, v, sizeof v);
+}
+
+int
+AES_SIV_Open(const struct aes_siv *siv, const struct crypto_vec *ad,
+    unsigned nad, const void *ct, size_t len, void *out)
+{
+	const uint8_t *c = ct;
+	uint8_t v[16], t[16];
+
+	AN(siv);
+	assert(nad == 0 || ad != NULL);
+	AN(ct);
+	AN(out);
+	if (len < 16)
+		return (-1);
+	memcpy(v, c, sizeof v);
+	siv_ctr(siv, v, c + 16, out, len - 16);
+	siv_s2v(siv, ad, nad, out, len - 16, t);
+	if (!Crypto_Equal(t, v, sizeof v)) {
+		memset(out, 0, len - 16);
+		return (-1);
+	}
+	return (0);
+}
+
+/**********************************************************************
+ * Fallback: SHA-1
+ */
+
+#define ROTL32(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	unsigned u;
+
+	for (u = 0; u < 16; u++)
+		w[u] = Be32dec(p + 4 * u);
+	for (; u < 80; u++)
+		w[u] = ROTL32(w[u - 3] ^ w[u - 8] ^ w[u - 14] ^ w[u - 16], 1);
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	for (u = 0; u < 80; u++) {
+		if (u < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (u < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (u < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROTL32(a, 5) + f + e + k + w[u];
+		e = d;
+		d = c;
+		c = ROTL32(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void
+Sha1_Init(struct sha1 *sc)
+{
+
+	AN(sc);
+	sc->h[0] = 0x67452301;
+	sc->h[1] = 0xefcdab89;
+	sc->h[2] = 0x98badcfe;
+	sc->h[3] = 0x10325476;
+	sc->h[4] = 0xc3d2e1f0;
+	sc->len = 0;
+}
+
+void
+Sha1_Update(struct sha1 *sc, const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+	size_t n, have;
+
+	AN(sc);
+	have = (size_t)(sc->len & 63);
+	sc->len += len;
+	if (have > 0) {
+		n = 64 - have;
+		if (n > len)
+			n = len;
+		memcpy(sc->buf + have, p, n);
+		p += n;
+		len -= n;
+		if (have + n < 64)
+			return;
+		sha1_block(sc->h, sc->buf);
+	}
+	for (; len >= 64; len -= 64, p += 64)
+		sha1_block(sc->h, p);
+	memcpy(sc->buf, p, len);
+}
+
+void
+Sha1_Final(struct sha1 *sc, uint8_t *digest)
+{
+	uint8_t pad[72];
+	uint64_t bits;
+	size_t n;
+	unsigned u;
+
+	AN(sc);
+	AN(digest);
+	bits = sc->len << 3;
+	n = 64 - (size_t)((sc->len + 8) & 63);
+	memset(pad, 0, sizeof pad);
+	pad[0] = 0x80;
+	Be32enc(pad + n, (uint32_t)(bits >> 32));
+	Be32enc(pad + n + 4, (uint32_t)bits);
+	Sha1_Update(sc, pad, n + 8);
+	assert((sc->len & 63) == 0);
+	for (u = 0; u < 5; u++)
+		Be32enc(digest + 4 * u, sc->h[u]);
+}
+
+#endif /* HAVE_OPENSSL */
+
+/**********************************************************************
+ * Random bytes for nonces, keys and unique identifiers.
+ */
+
+static int crypto_random_fd = -1;
+
+void
+Crypto_Random(void *ptr, size_t len)
+{
+	uint8_t *p = ptr;
+	ssize_t l;
+
+	if (crypto_random_fd < 0) {
+		crypto_random_fd = open("/dev/urandom", O_RDONLY);
+		if (crypto_random_fd < 0)
+			Fail(NULL, errno, "Cannot open /dev/urandom");
+	}
+	while (len > 0) {
+		l = read(crypto_random_fd, p, len);
+		if (l <= 0)
+			Fail(NULL, errno, "Cannot read /dev/urandom");
+		p += l;
+		len -= (size_t)l;
+	}
+}
+
+/**********************************************************************
+ * Compare MACs without telling how much of them matched
+ */
+
+int
+Crypto_Equal(const void *p1, const void *p2, size_t len)
+{
+	const uint8_t *a = p1, *b = p2;
+	uint8_t d = 0;
+
+	while (len--)
+		d |= *a++ ^ *b++;
+	return (d == 0);
+}
+
+/**********************************************************************
+ * Known answer tests
+ */
+
+static int
+crypto_hex(uint8_t *dst, const char *hex)
+{
+	unsigned u;
+	int n = 0;
+
+	while (*hex != '\0') {
+		AN(sscanf(hex, "%2x", &u));
+		dst[n++] = (uint8_t)u;
+		hex += 2;
+	}
+	return (n);
+}
+
+static int
+crypto_check(struct ocx *ocx, const char *what, const uint8_t *got,
+    const char *hex)
+{
+	uint8_t want[64];
+	int n;
+
+	n = crypto_hex(want, hex);
+	if (!memcmp(got, want, (size_t)n))
+		return (0);
+	Put(ocx, OCX_DIAG, "Crypto_RunTest: %s failed\n", what);
+	return (1);
+}
+
+void
+Crypto_RunTest(struct ocx *ocx)
+{
+	static const char * const cmac_msg[4] = {
+		"",
+		"6bc1bee22e409f96e93d7e117393172a",
+		"6bc1bee22e409f96e93d7e117393172a"
+		"ae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411",
+		"6bc1bee22e409f96e93d7e117393172a"
+		"ae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52ef"
+		"f69f2445df4f9b17ad2b417be66c3710",
+	};
+	static const char * const cmac_mac[4] = {
+		"bb1d6929e95937287fa37d129b756746",
+		"070a16b46b4d4144f79bdd9dd04a287c",
+		"dfa66747de9ae63030ca32611497c827",
+		"51f0bebf7e3b9d92fc49741779363cfe",
+	};
+#ifndef HAVE_OPENSSL
+	struct aes128 aes;
+#endif
+	struct cmac cm;
+	struct sha1 sc;
+	struct aes_siv siv;
+	struct crypto_vec ad[3];
+	uint8_t key[32], buf[64], out[64];
+	uint8_t a1[48], a2[16], a3[16];
+	unsigned u;
+	int n, nf = 0;
+
+#ifndef HAVE_OPENSSL
+	/* FIPS 197, Appendix C.1 */
+	(void)crypto_hex(key, "000102030405060708090a0b0c0d0e0f");
+	(void)crypto_hex(buf, "00112233445566778899aabbccddeeff");
+	aes128_key(&aes, key);
+	aes128_encrypt(&aes, buf, out);
+	nf += crypto_check(ocx, "AES-128", out,
+	    "69c4e0d86a7b0430d8cdb78070b4c55a");
+#endif
+
+	/* RFC 4493, section 4 */
+	(void)crypto_hex(key, "2b7e151628aed2a6abf7158809cf4f3c");
+	CMAC_Key(&cm, key);
+#ifndef HAVE_OPENSSL
+	nf += crypto_check(ocx, "CMAC K1", cm.k1,
+	    "fbeed618357133667c85e08f7236a8de");
+#endif
+	for (u = 0; u < 4; u++) {
+		n = crypto_hex(buf, cmac_msg[u]);
+		CMAC_Sum(&cm, buf, (size_t)n, out);
+		nf += crypto_check(ocx, "AES-CMAC", out, cmac_mac[u]);
+	}
+
+	/* FIPS 180-2, Appendix A.1 and A.2 */
+	Sha1_Init(&sc);
+	Sha1_Update(&sc, "abc", 3);
+	Sha1_Final(&sc, out);
+	nf += crypto_check(ocx, "SHA-1", out,
+	    "a9993e364706816aba3e25717850c26c9cd0d89d");
+	Sha1_Init(&sc);
+	for (u = 0; u < 56; u++)
+		Sha1_Update(&sc, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnl"
+		    "mnomnopnopq" + u, 1);
+	Sha1_Final(&sc, out);
+	nf += crypto_check(ocx, "SHA-1", out,
+	    "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+	/* RFC 5297, Appendix A.1, deterministic */
+	(void)crypto_hex(key, "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0"
+	    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	AES_SIV_Key(&siv, key);
+	ad[0].ptr = a1;
+	ad[0].len = (size_t)crypto_hex(a1, "101112131415161718191a1b1c1d1e1f"
+	    "2021222324252627");
+	n = crypto_hex(buf, "112233445566778899aabbccddee");
+	AES_SIV_Seal(&siv, ad, 1, buf, (size_t)n, out);
+	nf += crypto_check(ocx, "AES-SIV", out,
+	    "85632d07c6e8f37f950acd320a2ecc93"
+	    "40c02b9690c4dc04daef7f6afe5c");
+	memset(buf, 0, sizeof buf);
+	if (AES_SIV_Open(&siv, ad, 1, out, (size_t)n + 16, buf))
+		nf++;
+	nf += crypto_check(ocx, "AES-SIV open", buf,
+	    "112233445566778899aabbccddee");
+	out[20] ^= 1;
+	if (!AES_SIV_Open(&siv, ad, 1, out, (size_t)n + 16, buf)) {
+		Put(ocx, OCX_DIAG, "Crypto_RunTest: AES-SIV forgery opened\n");
+		nf++;
+	}
+
+	/* RFC 5297, Appendix A.2, nonce based, sealed in place */
+	(void)crypto_hex(key, "7f7e7d7c7b7a79787776757473727170"
+	    "404142434445464748494a4b4c4d4e4f");
+	AES_SIV_Key(&siv, key);
+	ad[0].len = (size_t)crypto_hex(a1, "00112233445566778899aabbccddeeff"
+	    "deaddadadeaddadaffeeddccbbaa9988"
+	    "7766554433221100");
+	ad[1].ptr = a2;
+	ad[1].len = (size_t)crypto_hex(a2, "102030405060708090a0");
+	ad[2].ptr = a3;
+	ad[2].len = (size_t)crypto_hex(a3, "09f911029d74e35bd84156c5635688c0");
+	n = crypto_hex(out + 16, "7468697320697320736f6d6520706c61"
+	    "696e7465787420746f20656e63727970"
+	    "74207573696e67205349562d414553");
+	AES_SIV_Seal(&siv, ad, 3, out + 16, (size_t)n, out);
+	nf += crypto_check(ocx, "AES-SIV", out,
+	    "7bdb6e3b432667eb06f4d14bff2fbd0f"
+	    "cb900f2fddbe404326601965c889bf17"
+	    "dba77ceb094fa663b7a3f748ba8af829"
+	    "ea64ad544a272e9c485b62a3fd5c0d");
+
+	/* No plaintext, as in NTS requests: just the S2V of the above */
+	AES_SIV_Seal(&siv, ad, 3, NULL, 0, out);
+	nf += crypto_check(ocx, "AES-SIV empty", out,
+	    "86562183257fdf3130419a0a5d3ef6b8");
+	if (AES_SIV_Open(&siv, ad, 3, out, 16, buf))
+		nf++;
+	out[0] ^= 1;
+	if (!AES_SIV_Open(&siv, ad, 3, out, 16, buf)) {
+		Put(ocx, OCX_DIAG, "Crypto_RunTest: AES-SIV forgery opened\n");
+		nf++;
+	}
+
+	Debug(ocx, "Crypto_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
@@ -32,6 +32,7 @@
 
 #include "ntimed.h"
 #include "ntp.h"
+#include "refclock.h"
 
 /*************************************************************************/
 
@@ -52,6 +53,15 @@ main_run_tests(int argc, char * const * argv)
 
 	Time_Unix_Passive();
 
+	Crypto_RunTest(NULL);
+	NTP_Packet_RunTest(NULL);
+	NTP_Auth_RunTest(NULL);
+	NTS_RunTest(NULL);
+	NTP_RateLimit_RunTest(NULL);
+	NTP_PeerSet_RunTest(NULL);
+	NTP_Bcast_RunTest(NULL);
+	RC_SHM_RunTest(NULL);
+	RC_PPS_RunTest(NULL);
 	TS_RunTest(NULL);
 
 	return (0);
@@ -65,8 +75,22 @@ main(int argc, char * const *argv)
 
 	if (argc > 1 && !strcmp(argv[1], "--poll-server"))
 		return (main_poll_server(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--serve"))
+		return (main_serve(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--shm-write"))
+		return (main_shm_write(argc - 1, argv + 1));
 	if (argc > 1 && !strcmp(argv[1], "--sim-client"))
 		return (main_sim_client(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--sim-bench"))
+		return (main_sim_bench(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--sim-gen"))
+		return (main_sim_gen(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--control"))
+		return (main_control(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--stats"))
+		return (main_stats(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "--convert"))
+		return (main_convert(argc - 1, argv + 1));
 	if (argc > 1 && !strcmp(argv[1], "--run-tests"))
 		return (main_run_tests(argc - 1, argv + 1));
 
@@ -33,10 +33,13 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "ntimed.h"
 #include "ntp.h"
+#include "refclock.h"
 #include "udp.h"
 
 #define PARAM_CLIENT PARAM_INSTANCE
@@ -45,7 +48,13 @@
 #undef PARAM_TABLE_NAME
 #undef PARAM_CLIENT
 
+#define MC_NREFCLOCK	8
+
 static volatile sig_atomic_t restart = 1;
+static const struct ntp_key *mc_key;
+static int mc_nts;
+static int mc_ileave;
+static const char *mc_cafile;
 
 static void __match_proto__()
 sig_hup(int siginfo)
@@ -55,6 +64,36 @@ sig_hup(int siginfo)
 	restart = 1;
 }
 
+static void __match_proto__(ntp_peerset_f)
+mc_attach(struct ocx *ocx, struct ntp_peer *np, void *priv)
+{
+	struct combine_delta *cd = priv;
+
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	NF_New(np);
+	np->key = mc_key;
+	if (mc_nts) {
+		np->nts = NTS_New(np->hostname, np->sa, np->sa_len,
+		    mc_cafile);
+		NTS_Start(ocx, np->nts);
+	}
+	if (mc_ileave)
+		NTP_Peer_Interleave(np);
+	np->combiner = CD_AddSource(cd, np->hostname, np->ip);
+}
+
+static void __match_proto__(ntp_peerset_f)
+mc_detach(struct ocx *ocx, struct ntp_peer *np, void *priv)
+{
+
+	(void)ocx;
+	(void)priv;
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	CD_RemoveSource(np->combiner);
+	np->combiner = NULL;
+	NF_Destroy(np);
+}
+
 int
 main_client(int argc, char *const *argv)
 {
@@ -64,6 +103,12 @@ main_client(int argc, char *const *argv)
 	struct todolist *tdl;
 	struct combine_delta *cd;
 	struct udp_socket *usc;
+	const char *ctlpath = NULL;
+	char *group = NULL, *ifaddr = NULL;
+	struct ntp_keys *nks = NULL;
+	unsigned long keyid = 0;
+	const char *rcspec[MC_NREFCLOCK];
+	unsigned nrc = 0, u;
 	int npeer = 0;
 
 	setbuf(stdout, NULL);
@@ -79,17 +124,63 @@ main_client(int argc, char *const *argv)
 	Param_Register(client_param_table);
 	NF_Init();
 
-	while ((ch = getopt(argc, argv, "p:t:")) != -1) {
+	while ((ch = getopt(argc, argv, "c:C:Ik:K:m:M:Np:R:s:t:T:")) != -1) {
 		switch(ch) {
+		case 'c':
+			ctlpath = optarg;
+			break;
+		case 'C':
+			mc_cafile = optarg;
+			break;
+		case 'I':
+			mc_ileave = 1;
+			break;
+		case 'k':
+			if (nks == NULL)
+				nks = NTP_Keys_New();
+			NTP_Keys_Load(NULL, nks, optarg);
+			break;
+		case 'K':
+			keyid = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			/* group[@ifaddr] */
+			group = strdup(optarg);
+			AN(group);
+			ifaddr = strchr(group, '@');
+			if (ifaddr != NULL)
+				*ifaddr++ = '\0';
+			break;
+		case 'M':
+			ArgTraceMask(optarg);
+			break;
+		case 'N':
+			mc_nts = 1;
+			break;
 		case 'p':
 			Param_Tweak(NULL, optarg);
 			break;
+		case 'R':
+			if (nrc == MC_NREFCLOCK)
+				Fail(NULL, 0, "Too many reference clocks (-R)");
+			rcspec[nrc++] = optarg;
+			break;
+		case 's':
+			Stats_Open(NULL, optarg);
+			break;
 		case 't':
 			ArgTracefile(optarg);
 			break;
+		case 'T':
+			ArgTracefileBin(optarg);
+			break;
 		default:
 			Fail(NULL, 0,
-			    "Usage %s [-p param] [-t tracefile] servers...",
+			    "Usage %s [-c control-socket] [-I] [-k keyfile] "
+			    "[-K keyid] [-m group[@ifaddr]] [-N] [-C cafile] "
+			    "[-p param] [-R refclock] [-s statsfile] "
+			    "[-t tracefile] [-T binary-tracefile] "
+			    "[-M tracemask] servers...",
 			    argv[0]);
 			break;
 		}
@@ -97,10 +188,23 @@ main_client(int argc, char *const *argv)
 	argc -= optind;
 	argv += optind;
 
+	/* XXX: One key, or NTS, for all servers */
+	if (keyid != 0 && mc_nts)
+		Fail(NULL, 0, "-K and -N are mutually exclusive");
+	if (group != NULL && mc_nts)
+		Fail(NULL, 0, "Broadcasts (-m) cannot be NTS (-N)");
+	if (keyid != 0) {
+		if (nks == NULL)
+			Fail(NULL, 0, "-K needs a keyfile (-k)");
+		mc_key = NTP_Keys_Find(nks, (uint32_t)keyid);
+		if (mc_key == NULL)
+			Fail(NULL, 0, "Key-ID %lu not in keyfile", keyid);
+	}
+
 	for (ch = 0; ch < argc; ch++)
 		npeer += NTP_PeerSet_Add(NULL, nps, argv[ch]);
-	if (npeer == 0)
-		Fail(NULL, 0, "No NTP peers found");
+	if (npeer == 0 && nrc == 0)
+		Fail(NULL, 0, "No NTP peers or reference clocks found");
 
 	Put(NULL, OCX_TRACE, "# NTIMED Format client 1.0\n");
 	Put(NULL, OCX_TRACE, "# Found %d peers\n", npeer);
@@ -113,10 +217,23 @@ main_client(int argc, char *const *argv)
 
 	cd = CD_New();
 
-	NTP_PeerSet_Foreach(np, nps) {
-		NF_New(np);
-		np->combiner = CD_AddSource(cd, np->hostname, np->ip);
-	}
+	NTP_PeerSet_Foreach(np, nps)
+		mc_attach(NULL, np, cd);
+	NTP_PeerSet_Hooks(nps, mc_attach, mc_detach, cd);
+
+	/* The NTS-KEs run in parallel, get their cookies before polling */
+	NTP_PeerSet_Foreach(np, nps)
+		if (np->nts != NULL)
+			NTS_Wait(np->nts);
+
+	for (u = 0; u < nrc; u++)
+		(void)RC_New(NULL, tdl, cd, rcspec[u]);
+
+	if (ctlpath != NULL)
+		Control_New(NULL, ctlpath, tdl, nps);
+
+	if (group != NULL)
+		(void)NTP_Bcast_New(NULL, tdl, nps, group, ifaddr, mc_key);
 
 	do {
 		if (restart) {
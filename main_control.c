@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * control
+ *	socket		As given to the client with -c
+ *	command ...	Joined with spaces, "help" lists them
+ *
+ * Sends one command to a running client's control socket (see
+ * control.c) and prints the answer.  Exits non-zero if the command
+ * failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ntimed.h"
+
+int
+main_control(int argc, char *const *argv)
+{
+	struct sockaddr_un sau;
+	char *buf, *p;
+	size_t len, size;
+	ssize_t l;
+	int fd, i;
+
+	if (argc < 3)
+		Fail(NULL, 0, "Usage %s socket command [argument]", argv[0]);
+
+	memset(&sau, 0, sizeof sau);
+	if (strlen(argv[1]) >= sizeof sau.sun_path)
+		Fail(NULL, 0, "Control socket path too long '%s'", argv[1]);
+	sau.sun_family = AF_UNIX;
+	strcpy(sau.sun_path, argv[1]);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		Fail(NULL, 1, "Could not create socket");
+	if (connect(fd, (void*)&sau, sizeof sau))
+		Fail(NULL, 1, "Could not connect to '%s'", argv[1]);
+
+	for (i = 2; i < argc; i++) {
+		l = (ssize_t)strlen(argv[i]);
+		if (write(fd, argv[i], (size_t)l) != l ||
+		    write(fd, i + 1 < argc ? " " : "\n", 1) != 1)
+			Fail(NULL, 1, "Could not send command");
+	}
+
+	/* The answer is small, slurp it all, then split off the status */
+	len = 0;
+	size = 1024;
+	buf = malloc(size);
+	AN(buf);
+	while (1) {
+		if (len == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+			AN(buf);
+		}
+		l = read(fd, buf + len, size - len);
+		if (l <= 0)
+			break;
+		len += (size_t)l;
+	}
+	AZ(close(fd));
+
+	for (p = buf + len; p > buf && p[-1] == '\n'; p--)
+		continue;
+	while (p > buf && p[-1] != '\n')
+		p--;
+	i = (p + 3 == buf + len && !memcmp(p, "OK\n", 3));
+	if (i || (p + 5 == buf + len && !memcmp(p, "FAIL\n", 5)))
+		len = (size_t)(p - buf);
+	(void)fwrite(buf, 1, len, stdout);
+	free(buf);
+	return (i ? 0 : 1);
+}
@@ -0,0 +1,374 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * convert
+ *	infile		Tracefile, text or binary
+ *	outfile		Where to write it in the other format
+ *
+ * Binary tracefiles (see trace.h) are converted to exactly the text
+ * which would have been written in the first place.
+ *
+ * Text tracefiles are converted line by line.  Lines which cannot be
+ * turned into a binary record and back without changing even a single
+ * character are stored as TEXT records.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntimed.h"
+#include "trace.h"
+
+struct mcv_peer {
+	unsigned			magic;
+#define MCV_PEER_MAGIC			0x6e0a41b7
+	TAILQ_ENTRY(mcv_peer)		list;
+	uint32_t			id;
+	int				declared;
+	char				*hostname;
+	char				*ip;
+};
+
+#define MCV_NHASH			1024
+
+struct mcv {
+	unsigned			magic;
+#define MCV_MAGIC			0x1b5fd93a
+	FILE				*fo;
+	const char			*fn;
+
+	/* Binary to text */
+	struct mcv_peer			**byid;
+	uint32_t			nbyid;
+
+	/* Text to binary */
+	TAILQ_HEAD(, mcv_peer)		byname[MCV_NHASH];
+	uint32_t			nextid;
+
+	uintmax_t			nrec;
+	uintmax_t			ntext;
+};
+
+/**********************************************************************/
+
+static struct mcv_peer *
+mcv_peer_new(const char *hostname, size_t hl, const char *ip, size_t il)
+{
+	struct mcv_peer *mp;
+
+	ALLOC_OBJ(mp, MCV_PEER_MAGIC);
+	AN(mp);
+	mp->hostname = strndup(hostname, hl);
+	AN(mp->hostname);
+	mp->ip = strndup(ip, il);
+	AN(mp->ip);
+	return (mp);
+}
+
+static void
+mcv_peer_destroy(struct mcv_peer *mp)
+{
+
+	CHECK_OBJ_NOTNULL(mp, MCV_PEER_MAGIC);
+	free(mp->hostname);
+	free(mp->ip);
+	FREE_OBJ(mp);
+}
+
+static void
+mcv_write(struct mcv *mc, const void *ptr, size_t len)
+{
+
+	if (len > 0 && fwrite(ptr, len, 1, mc->fo) != 1)
+		Fail(NULL, 1, "Could not write to '%s'", mc->fn);
+}
+
+/**********************************************************************
+ * Binary to text
+ */
+
+static void
+mcv_bin_peer(struct mcv *mc, const struct trace_rec *tr, const char *fn)
+{
+	uint32_t n;
+
+	if (tr->id >= TRACE_BIN_MAXID)
+		Fail(NULL, 0, "Peer id %u too large in '%s'", tr->id, fn);
+	if (tr->id >= mc->nbyid) {
+		n = mc->nbyid ? mc->nbyid : 64;
+		while (tr->id >= n)
+			n *= 2;
+		mc->byid = realloc(mc->byid, n * sizeof *mc->byid);
+		AN(mc->byid);
+		memset(mc->byid + mc->nbyid, 0,
+		    (n - mc->nbyid) * sizeof *mc->byid);
+		mc->nbyid = n;
+	}
+	if (mc->byid[tr->id] != NULL)
+		mcv_peer_destroy(mc->byid[tr->id]);
+	mc->byid[tr->id] =
+	    mcv_peer_new(tr->str, tr->strlen, tr->str2, tr->str2len);
+}
+
+static void
+mcv_bin2txt(struct mcv *mc, FILE *fi, const char *fn)
+{
+	uint8_t *buf;
+	char obuf[1024];
+	const struct mcv_peer *mp;
+	size_t len, have = 0, off = 0, n;
+	struct trace_rec tr;
+	ssize_t l;
+	int i, eof = 0;
+
+	len = 2 * TRACE_BIN_MAXREC;
+	buf = malloc(len);
+	AN(buf);
+
+	while (1) {
+		if (have - off < TRACE_BIN_MAXREC && !eof) {
+			memmove(buf, buf + off, have - off);
+			have -= off;
+			off = 0;
+			n = fread(buf + have, 1, len - have, fi);
+			if (ferror(fi))
+				Fail(NULL, 1, "Could not read '%s'", fn);
+			eof = (n < len - have);
+			have += n;
+		}
+		if (off == have)
+			break;
+		l = TraceBin_Decode(&tr, buf + off, have - off);
+		if (l == 0)
+			Fail(NULL, 0, "Truncated record in '%s'", fn);
+		if (l < 0)
+			Fail(NULL, 0, "Bad record in '%s' at offset %ju",
+			    fn, (uintmax_t)(off + TRACE_BIN_HDRLEN));
+		off += (size_t)l;
+		mc->nrec++;
+
+		mp = NULL;
+		switch (tr.type) {
+		case TRACE_TEXT:
+			mc->ntext++;
+			mcv_write(mc, tr.str, tr.strlen);
+			continue;
+		case TRACE_PEER:
+			mcv_bin_peer(mc, &tr, fn);
+			break;
+		case TRACE_PKT:
+		case TRACE_FILTER:
+			if (tr.id >= mc->nbyid || mc->byid[tr.id] == NULL)
+				Fail(NULL, 0, "Undeclared peer %u in '%s'",
+				    tr.id, fn);
+			mp = mc->byid[tr.id];
+			break;
+		default:
+			break;
+		}
+		i = TraceBin_Format(obuf, sizeof obuf, &tr,
+		    mp == NULL ? NULL : mp->hostname,
+		    mp == NULL ? NULL : mp->ip);
+		if (i < 0)
+			Fail(NULL, 0, "Oversize record in '%s'", fn);
+		mcv_write(mc, obuf, (size_t)i);
+	}
+	free(buf);
+}
+
+/**********************************************************************
+ * Text to binary
+ */
+
+static void
+mcv_text(struct mcv *mc, const char *str, size_t len)
+{
+	struct trace_rec tr;
+	char buf[TRACE_BIN_MAXREC];
+	size_t l;
+
+	while (len > 0) {
+		INIT_OBJ(&tr, TRACE_REC_MAGIC);
+		tr.type = TRACE_TEXT;
+		tr.str = str;
+		tr.strlen = len > 65535 ? 65535 : len;
+		l = TraceBin_Encode(buf, sizeof buf, &tr);
+		assert(l > 0);
+		mc->nrec++;
+		mc->ntext++;
+		mcv_write(mc, buf, l);
+		str += tr.strlen;
+		len -= tr.strlen;
+	}
+}
+
+static struct mcv_peer *
+mcv_txt_peer(struct mcv *mc, const char *hostname, const char *ip)
+{
+	struct mcv_peer *mp;
+	unsigned h = 2166136261U;
+	const char *p;
+
+	for (p = hostname; *p != '\0'; p++)
+		h = (h ^ (uint8_t)*p) * 16777619U;
+	for (p = ip; *p != '\0'; p++)
+		h = (h ^ (uint8_t)*p) * 16777619U;
+	h %= MCV_NHASH;
+
+	TAILQ_FOREACH(mp, &mc->byname[h], list)
+		if (!strcmp(mp->hostname, hostname) && !strcmp(mp->ip, ip))
+			return (mp);
+	mp = mcv_peer_new(hostname, strlen(hostname), ip, strlen(ip));
+	mp->id = ++mc->nextid;
+	TAILQ_INSERT_TAIL(&mc->byname[h], mp, list);
+	return (mp);
+}
+
+static int
+mcv_line(struct mcv *mc, char *line, size_t len)
+{
+	struct trace_rec tr, td;
+	struct mcv_peer *mp = NULL;
+	char hn[256], ip[256];
+	char buf[1024];
+	size_t l;
+	int i;
+
+	assert(len > 0 && line[len - 1] == '\n');
+	line[len - 1] = '\0';
+	i = TraceBin_Scan(&tr, line);
+	line[len - 1] = '\n';
+	if (i)
+		return (-1);
+
+	if (tr.type == TRACE_PEER || tr.type == TRACE_PKT ||
+	    tr.type == TRACE_FILTER) {
+		if (tr.strlen >= sizeof hn || tr.str2len >= sizeof ip)
+			return (-1);
+		memcpy(hn, tr.str, tr.strlen);
+		hn[tr.strlen] = '\0';
+		memcpy(ip, tr.str2, tr.str2len);
+		ip[tr.str2len] = '\0';
+		mp = mcv_txt_peer(mc, hn, ip);
+		tr.id = mp->id;
+	}
+
+	i = TraceBin_Format(buf, sizeof buf, &tr, hn, ip);
+	if (i < 0 || (size_t)i != len || memcmp(buf, line, len))
+		return (-1);
+	l = TraceBin_Encode(buf, sizeof buf, &tr);
+	if (l == 0)
+		return (-1);
+
+	if (tr.type == TRACE_PEER) {
+		mp->declared = 1;
+	} else if (mp != NULL && !mp->declared) {
+		td = tr;
+		td.type = TRACE_PEER;
+		td.tag = TRACE_PEER_SILENT;
+		td.str = mp->hostname;
+		td.strlen = strlen(mp->hostname);
+		td.str2 = mp->ip;
+		td.str2len = strlen(mp->ip);
+		mcv_write(mc, buf + l,
+		    TraceBin_Encode(buf + l, sizeof buf - l, &td));
+		mp->declared = 1;
+		mc->nrec++;
+	}
+	mcv_write(mc, buf, l);
+	mc->nrec++;
+	return (0);
+}
+
+static void
+mcv_txt2bin(struct mcv *mc, FILE *fi, const char *fn)
+{
+	char buf[TRACE_BIN_HDRLEN];
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+
+	mcv_write(mc, buf, TraceBin_Header(buf, sizeof buf));
+	while ((len = getline(&line, &linecap, fi)) > 0) {
+		if (line[len - 1] != '\n' ||
+		    mcv_line(mc, line, (size_t)len))
+			mcv_text(mc, line, (size_t)len);
+	}
+	if (ferror(fi))
+		Fail(NULL, 1, "Could not read '%s'", fn);
+	free(line);
+}
+
+/**********************************************************************/
+
+int
+main_convert(int argc, char *const *argv)
+{
+	struct mcv *mc;
+	FILE *fi;
+	uint8_t hdr[TRACE_BIN_HDRLEN];
+	size_t n;
+	ssize_t i;
+
+	if (argc != 3)
+		Fail(NULL, 0, "Usage %s infile outfile", argv[0]);
+
+	ALLOC_OBJ(mc, MCV_MAGIC);
+	AN(mc);
+	for (n = 0; n < MCV_NHASH; n++)
+		TAILQ_INIT(&mc->byname[n]);
+
+	fi = fopen(argv[1], "r");
+	if (fi == NULL)
+		Fail(NULL, 1, "Could not open '%s' for reading", argv[1]);
+	mc->fn = argv[2];
+	mc->fo = fopen(argv[2], "w");
+	if (mc->fo == NULL)
+		Fail(NULL, 1, "Could not open '%s' for writing", argv[2]);
+
+	n = fread(hdr, 1, sizeof hdr, fi);
+	i = TraceBin_CheckHeader(hdr, n);
+	if (i < 0)
+		Fail(NULL, 0, "Unsupported binary trace version in '%s'",
+		    argv[1]);
+	if (i > 0) {
+		mcv_bin2txt(mc, fi, argv[1]);
+	} else {
+		rewind(fi);
+		mcv_txt2bin(mc, fi, argv[1]);
+	}
+
+	AZ(fclose(fi));
+	if (fclose(mc->fo))
+		Fail(NULL, 1, "Could not write to '%s'", argv[2]);
+	Put(NULL, OCX_DIAG, "%s: %ju records, %ju as text\n",
+	    i > 0 ? "Binary to text" : "Text to binary",
+	    mc->nrec, mc->ntext);
+
+	/* Peers are not freed, we are about to exit anyway */
+	FREE_OBJ(mc);
+	return (0);
+}
@@ -24,37 +24,55 @@
  * SUCH DAMAGE.
  *
  * poll-server
+ *	[-b burst]	Survey mode token bucket depth (default: rate)
  *	[-d duration]	When to stop
  *	[-m monitor]	Poll this monitor every 32 seconds
+ *	[-r rate]	Survey mode, at most this many packets per second
  *	[-t tracefile]	Where to save the output (if not stdout)
+ *	[-T tracefile]	Same, but in the binary format (see trace.h)
  *	server ...	What servers to poll
  *
+ * Survey mode
+ * -----------
+ *
+ * Normally peers are polled one at a time by the peerset scheduler,
+ * waiting for each reply before moving on.  That is fine for a handful
+ * of servers, but surveying a pool of thousands takes forever.
+ *
+ * With -r, all peers share a single socket and requests are sent as
+ * fast as a token bucket allows, without waiting for replies, so any
+ * number of requests can be in flight.  Replies are matched to peers
+ * on source address and origin timestamp.  Every peer is polled at
+ * most once per SURVEY_PERIOD seconds.
+ *
+ * The output has the same format as the normal mode, so it can be fed
+ * to --sim-client.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/socket.h>
 
 #include "ntimed.h"
 #include "ntp.h"
 #include "udp.h"
+#include "trace.h"
 
 static struct udp_socket *usc;
 
 static void
-mps_filter(struct ocx *ocx, const struct ntp_peer *np)
+mps_filter(struct ocx *ocx, struct ntp_peer *np)
 {
-	char buf[256];
 
-	NTP_Tool_Format(buf, sizeof buf, np->rx_pkt);
-	Put(ocx, OCX_TRACE, "Poll %s %s %s\n", np->hostname, np->ip, buf);
+	Trace_Pkt(ocx, TRACE_PKT_POLL, np, np->rx_pkt);
 }
 
 static enum todo_e __match_proto__(todo_f)
 mps_mon(struct ocx *ocx, struct todolist *tdl, void *priv)
 {
-	char buf[256];
 	struct ntp_peer *np;
 	int i;
 
@@ -63,9 +81,7 @@ mps_mon(struct ocx *ocx, struct todolist *tdl, void *priv)
 	CAST_OBJ_NOTNULL(np, priv, NTP_PEER_MAGIC);
 	i = NTP_Peer_Poll(ocx, usc, np, 0.2);
 	if (i == 1) {
-		NTP_Tool_Format(buf, sizeof buf, np->rx_pkt);
-		Put(ocx, OCX_TRACE,
-		    "Monitor %s %s %s\n", np->hostname, np->ip, buf);
+		Trace_Pkt(ocx, TRACE_PKT_MONITOR, np, np->rx_pkt);
 	} else {
 		Put(ocx, OCX_TRACE,
 		    "Monitor_err %s %s %d\n", np->hostname, np->ip, i);
@@ -82,6 +98,177 @@ mps_end(struct ocx *ocx, struct todolist *tdl, void *priv)
 	return(TODO_FAIL);
 }
 
+/**********************************************************************
+ * Survey mode
+ */
+
+#define SURVEY_PERIOD	64.0		// XXX: param ?
+#define MONITOR_PERIOD	32.0
+
+struct mps_survey {
+	unsigned		magic;
+#define MPS_SURVEY_MAGIC	0x4a1d7e05
+	struct ntp_peerset	*npl;
+	struct ntp_peer		*mon;
+	double			rate;
+	double			burst;
+
+	double			tokens;
+	struct timestamp	t_tok;
+	struct timestamp	t_mon;
+	struct timestamp	t_cycle;
+	struct ntp_peer		*next;
+
+	uintmax_t		n_tx;
+	uintmax_t		n_txerr;
+	uintmax_t		n_rx;
+	uintmax_t		n_stray;
+};
+
+static void
+mps_survey_tx(struct ocx *ocx, struct mps_survey *ms, const struct ntp_peer *np)
+{
+	char buf[48];
+	size_t len;
+	ssize_t l;
+
+	len = NTP_Packet_Pack(buf, sizeof buf, np->tx_pkt);
+	l = Udp_Send(ocx, usc, np->sa, np->sa_len, buf, len);
+	if (l != (ssize_t)len) {
+		Debug(ocx, "Tx peer %s %s got %zd (%s)\n",
+		    np->hostname, np->ip, l, strerror(errno));
+		ms->n_txerr++;
+	} else {
+		ms->n_tx++;
+	}
+}
+
+static void
+mps_survey_rx(struct ocx *ocx, struct mps_survey *ms, double tmo)
+{
+	char buf[100];
+	struct sockaddr_storage rss;
+	socklen_t rssl;
+	struct timestamp t2;
+	struct ntp_peer *np;
+	struct ntp_packet pkt;
+	ssize_t i;
+
+	while (1) {
+		i = UdpTimedRx(ocx, usc, AF_UNSPEC, &rss, &rssl, &t2,
+		    buf, sizeof buf, tmo);
+		if (i == 0)
+			return;
+		if (i < 0)
+			Fail(ocx, 1, "Rx failed\n");
+		tmo = 1e-6;		// Drain whatever else is queued
+
+		if (i != 48 || NTP_Packet_Unpack(&pkt, buf, i) == NULL) {
+			ms->n_stray++;
+			continue;
+		}
+		np = NTP_PeerSet_FindSa(ms->npl, &rss, rssl);
+		if (np != NULL && TS_Diff(&np->tx_pkt->ntp_transmit,
+		    &pkt.ntp_origin) != 0.0)
+			np = NULL;
+		if (np == NULL && ms->mon != NULL &&
+		    SA_Equal(ms->mon->sa, ms->mon->sa_len, &rss, rssl) &&
+		    TS_Diff(&ms->mon->tx_pkt->ntp_transmit,
+		    &pkt.ntp_origin) == 0.0)
+			np = ms->mon;
+		if (np == NULL) {
+			ms->n_stray++;
+			continue;
+		}
+		ms->n_rx++;
+		*np->rx_pkt = pkt;
+		np->rx_pkt->ts_rx = t2;
+
+		Trace_Now(ocx, &t2, "Survey");
+		if (np == ms->mon) {
+			Trace_Pkt(ocx, TRACE_PKT_MONITOR, np, np->rx_pkt);
+		} else if (np->filter_func != NULL) {
+			np->filter_func(ocx, np);
+		}
+	}
+}
+
+static void
+mps_survey(struct ocx *ocx, struct mps_survey *ms, double duration)
+{
+	struct timestamp t0, now;
+	double dt, tmo;
+
+	CHECK_OBJ_NOTNULL(ms, MPS_SURVEY_MAGIC);
+
+	(void)TB_Now(&t0);
+	ms->t_tok = t0;
+	ms->t_mon = t0;
+	ms->t_cycle = t0;
+	ms->tokens = ms->burst;
+
+	while (1) {
+		(void)TB_Now(&now);
+		if (TS_Diff(&now, &t0) >= duration)
+			break;
+
+		/* Refill the token bucket */
+		ms->tokens += TS_Diff(&now, &ms->t_tok) * ms->rate;
+		if (ms->tokens > ms->burst)
+			ms->tokens = ms->burst;
+		ms->t_tok = now;
+
+		if (ms->mon != NULL && TS_Diff(&now, &ms->t_mon) >= 0.0 &&
+		    ms->tokens >= 1.0) {
+			mps_survey_tx(ocx, ms, ms->mon);
+			ms->tokens -= 1.0;
+			TS_Add(&ms->t_mon, MONITOR_PERIOD);
+		}
+
+		while (ms->tokens >= 1.0) {
+			if (ms->next == NULL) {
+				/* Start a new cycle, if it is time */
+				if (TS_Diff(&now, &ms->t_cycle) < 0.0)
+					break;
+				ms->t_cycle = now;
+				TS_Add(&ms->t_cycle, SURVEY_PERIOD);
+				ms->next = NTP_PeerSet_Iter0(ms->npl);
+				if (ms->next == NULL)
+					break;
+			}
+			/*
+			 * A duplicate's reply would be matched to the peer
+			 * it duplicates (NTP_PeerSet_FindSa), and be stray.
+			 */
+			if (ms->next->state != NTP_STATE_DUPLICATE) {
+				mps_survey_tx(ocx, ms, ms->next);
+				ms->tokens -= 1.0;
+			}
+			ms->next = NTP_PeerSet_IterN(ms->npl, ms->next);
+		}
+
+		/* Wait for replies until the next token is due */
+		if (ms->next == NULL)
+			tmo = TS_Diff(&ms->t_cycle, &now);
+		else
+			tmo = (1.0 - ms->tokens) / ms->rate;
+		dt = duration - TS_Diff(&now, &t0);
+		if (tmo > dt)
+			tmo = dt;
+		if (tmo > 0.1)
+			tmo = 0.1;
+		if (tmo < 1e-3)
+			tmo = 1e-3;
+		mps_survey_rx(ocx, ms, tmo);
+	}
+	Put(ocx, OCX_TRACE,
+	    "# Survey tx %ju txerr %ju rx %ju stray %ju\n",
+	    ms->n_tx, ms->n_txerr, ms->n_rx, ms->n_stray);
+	Put(ocx, OCX_TRACE, "# Run completed\n");
+}
+
+/**********************************************************************/
+
 int
 main_poll_server(int argc, char *const *argv)
 {
@@ -92,7 +279,9 @@ main_poll_server(int argc, char *const *argv)
 	struct ntp_peer *mon = NULL;
 	struct ntp_peer *np;
 	struct todolist *tdl;
+	struct mps_survey *ms;
 	double duration = 1800;
+	double rate = 0.0, burst = 0.0;
 
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
@@ -105,8 +294,13 @@ main_poll_server(int argc, char *const *argv)
 	npl = NTP_PeerSet_New(NULL);
 	AN(npl);
 
-	while ((ch = getopt(argc, argv, "d:m:t:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:d:m:r:t:T:")) != -1) {
 		switch(ch) {
+		case 'b':
+			burst = strtod(optarg, &p);
+			if (*p != '\0' || burst < 1.0)
+				Fail(NULL, 0, "Invalid -b argument");
+			break;
 		case 'd':
 			duration = strtod(optarg, &p);
 			if (*p != '\0' || duration < 1.0)
@@ -117,13 +311,22 @@ main_poll_server(int argc, char *const *argv)
 			if (mon == NULL)
 				Fail(NULL, 0, "Monitor (-m) didn't resolve.");
 			break;
+		case 'r':
+			rate = strtod(optarg, &p);
+			if (*p != '\0' || rate <= 0.0)
+				Fail(NULL, 0, "Invalid -r argument");
+			break;
 		case 't':
 			ArgTracefile(optarg);
 			break;
+		case 'T':
+			ArgTracefileBin(optarg);
+			break;
 		default:
 			Fail(NULL, 0,
-			    "Usage %s [-d duration] [-m monitor] "
-			    "[-t tracefile] server...", argv[0]);
+			    "Usage %s [-b burst] [-d duration] [-m monitor] "
+			    "[-r rate] [-t tracefile] [-T binary-tracefile] "
+			    "server...", argv[0]);
 			break;
 		}
 	}
@@ -138,17 +341,29 @@ main_poll_server(int argc, char *const *argv)
 		Fail(NULL, 0, "No peers found");
 
 	NTP_PeerSet_Foreach(np, npl) {
-		Put(NULL, OCX_TRACE, "# Peer %s %s\n", np->hostname, np->ip);
+		Trace_Peer(NULL, TRACE_PEER_PEER, np);
 		np->filter_func = mps_filter;
 	}
 
 	if (mon != NULL)
-		Put(NULL, OCX_TRACE,
-		    "# Monitor %s %s\n", mon->hostname, mon->ip);
+		Trace_Peer(NULL, TRACE_PEER_MONITOR, mon);
 
 	usc = UdpTimedSocket(NULL);
 	assert(usc != NULL);
 
+	if (rate > 0.0) {
+		ALLOC_OBJ(ms, MPS_SURVEY_MAGIC);
+		AN(ms);
+		ms->npl = npl;
+		ms->mon = mon;
+		ms->rate = rate;
+		ms->burst = burst > 0.0 ? burst : rate;
+		if (ms->burst < 1.0)
+			ms->burst = 1.0;
+		mps_survey(NULL, ms, duration);
+		return (0);
+	}
+
 	TODO_ScheduleRel(tdl, mps_end, NULL, duration, 0, "End task");
 
 	if (mon != NULL)
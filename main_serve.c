@@ -0,0 +1,506 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * serve
+ *	[-a address]	Address to serve on (default: all)
+ *	[-A]		Only answer authenticated requests
+ *	[-b burst]	Rate limit burst, in packets (default: 8)
+ *	[-d duration]	When to stop (default: never)
+ *	[-i interval]	Seconds between broadcasts (default: 64)
+ *	[-k keyfile]	Keys for authenticated requests (see ntp_auth.c)
+ *	[-K keyid]	Sign broadcasts with this key from the keyfile
+ *	[-m address]	Broadcast to this multicast group or broadcast address
+ *	[-n pemfile]	Serve NTS, with this certificate and key (see nts.c)
+ *	[-P port]	Port to serve on (default: ntp)
+ *	[-r rate]	Rate limit per source, packets/s (default: none)
+ *	[-S stratum]	Stratum to claim (default: 10)
+ *
+ * A minimal NTP server, answering client requests from the local
+ * clock without steering it.  It is a stand-in for testing clients,
+ * authentication in particular, not a real server: it does not know
+ * or care how good the local clock is.
+ *
+ * Requests are read in batches of up to UDP_BATCH, their MACs checked
+ * in one go by NTP_Auth_VerifyBatch(), and answers to authenticated
+ * requests are signed with the same key.  Requests with an unknown key
+ * or a bad MAC get a crypto-NAK.
+ *
+ * With -n, NTS-KE is served on TCP port 4460 of the same address, and
+ * requests with extension fields but no MAC are taken to be NTS.
+ *
+ * Interleaved mode (see ntp_peer.c) is offered to all clients: the
+ * time each reply actually left is remembered in a table hashed on
+ * its receive timestamp, and a request whose origin timestamp finds
+ * its entry gets that as its transmit timestamp.  Entries are simply
+ * overwritten, a client which loses its entry falls back to basic mode.
+ *
+ * With -r, each source address gets a token bucket (ntp_ratelimit.c),
+ * checked before any crypto is done, and sources over the limit get
+ * an occasional RATE Kiss-o'-Death, otherwise nothing.
+ *
+ * With -m, a broadcast mode packet is sent every interval to the
+ * address, out of the interface with the -a address if given, for
+ * clients listening with -m (see ntp_bcast.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ntimed.h"
+#include "ntimed_endian.h"
+#include "ntp.h"
+#include "udp.h"
+
+#define MSE_ILEAVE_BITS		12
+#define MSE_ILEAVE		(1U << MSE_ILEAVE_BITS)
+
+struct mse_ileave {
+	uint8_t			rx[8];	// As sent in the reply
+	struct timestamp	tx;	// When the reply left
+};
+
+struct mse {
+	unsigned		magic;
+#define MSE_MAGIC		0x1f6c0b7e
+	struct udp_socket	*usc;
+	struct ntp_keys		*nks;
+	struct nts_server	*nts;
+	struct ntp_ratelimit	*rl;
+	int			require_auth;
+	uint8_t			stratum;
+
+	struct sockaddr_storage	bc_ss;
+	socklen_t		bc_sl;
+	double			bc_interval;
+	const struct ntp_key	*bc_key;
+
+	uintmax_t		n_rx;
+	uintmax_t		n_tx;
+	uintmax_t		n_auth;
+	uintmax_t		n_nts;
+	uintmax_t		n_ileave;
+	uintmax_t		n_nak;
+	uintmax_t		n_kod;
+	uintmax_t		n_drop;
+	uintmax_t		n_bcast;
+
+	struct mse_ileave	ileave[MSE_ILEAVE];
+};
+
+static struct mse_ileave *
+mse_ileave(struct mse *ms, const uint8_t *rx)
+{
+
+	return (&ms->ileave[(Be32dec(rx + 4) * 0x9e3779b1U) >>
+	    (32 - MSE_ILEAVE_BITS)]);
+}
+
+static size_t
+mse_reply(struct mse *ms, const struct udp_msg *um,
+    const struct ntp_packet *rq, uint8_t *buf, size_t size)
+{
+	static const uint8_t zero[8];
+	const uint8_t *org = (const uint8_t *)um->ptr + 24;
+	struct mse_ileave *il = NULL;
+	struct ntp_packet tx;
+	size_t len;
+
+	INIT_OBJ(&tx, NTP_PACKET_MAGIC);
+	tx.ntp_leap = NTP_LEAP_NONE;
+	tx.ntp_version = rq->ntp_version;
+	tx.ntp_mode = NTP_MODE_SERVER;
+	tx.ntp_stratum = ms->stratum;
+	tx.ntp_poll = rq->ntp_poll;
+	tx.ntp_precision = -20;
+	INIT_OBJ(&tx.ntp_delay, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_dispersion, TIMESTAMP_MAGIC);
+	memcpy(tx.ntp_refid, "LOCL", 4);
+	tx.ntp_reference = um->ts;
+	tx.ntp_reference.frac = 0;
+	tx.ntp_origin = rq->ntp_transmit;
+	tx.ntp_receive = um->ts;
+
+	/* Interleaved, if the client asks and we know the previous reply */
+	if (memcmp(org, zero, sizeof zero)) {
+		il = mse_ileave(ms, org);
+		if (memcmp(il->rx, org, sizeof il->rx))
+			il = NULL;
+	}
+	if (il != NULL) {
+		/* The reference must not be after the transmit timestamp */
+		tx.ntp_reference = il->tx;
+		tx.ntp_reference.frac = 0;
+		tx.ntp_origin = rq->ntp_receive;
+	}
+	len = NTP_Packet_Pack(buf, (ssize_t)size, &tx);
+	if (il != NULL) {
+		NTP_Packet_Transmit(buf, &il->tx);
+		ms->n_ileave++;
+	}
+	return (len);
+}
+
+/* One broadcast mode packet, for all the clients listening */
+
+static void
+mse_bcast(struct ocx *ocx, struct mse *ms)
+{
+	struct ntp_packet tx;
+	uint8_t buf[NTP_AUTH_MAXLEN];
+	size_t len;
+
+	INIT_OBJ(&tx, NTP_PACKET_MAGIC);
+	tx.ntp_leap = NTP_LEAP_NONE;
+	tx.ntp_version = 4;
+	tx.ntp_mode = NTP_MODE_BCAST;
+	tx.ntp_stratum = ms->stratum;
+	for (tx.ntp_poll = 0; tx.ntp_poll < 17 &&
+	    (1U << tx.ntp_poll) < ms->bc_interval; tx.ntp_poll++)
+		continue;
+	tx.ntp_precision = -20;
+	INIT_OBJ(&tx.ntp_delay, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_dispersion, TIMESTAMP_MAGIC);
+	memcpy(tx.ntp_refid, "LOCL", 4);
+	TB_Now(&tx.ntp_reference);
+	tx.ntp_reference.frac = 0;
+	INIT_OBJ(&tx.ntp_origin, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_receive, TIMESTAMP_MAGIC);
+	len = NTP_Packet_Pack(buf, sizeof buf, &tx);
+	if (ms->bc_key != NULL)
+		len = NTP_Auth_Sign(ms->bc_key, buf, len, sizeof buf);
+	if (Udp_Send(ocx, ms->usc, &ms->bc_ss, ms->bc_sl, buf, len) ==
+	    (ssize_t)len)
+		ms->n_bcast++;
+}
+
+/* Tell a client to slow down, RFC 5905 section 7.4 */
+
+static size_t
+mse_kod(struct mse *ms, const struct udp_msg *um,
+    const struct ntp_packet *rq, uint8_t *buf, size_t size)
+{
+	struct ntp_packet tx;
+
+	ms->n_kod++;
+	INIT_OBJ(&tx, NTP_PACKET_MAGIC);
+	tx.ntp_leap = NTP_LEAP_UNKNOWN;
+	tx.ntp_version = rq->ntp_version;
+	tx.ntp_mode = NTP_MODE_SERVER;
+	tx.ntp_stratum = 0;
+	tx.ntp_poll = rq->ntp_poll;
+	tx.ntp_precision = -20;
+	INIT_OBJ(&tx.ntp_delay, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_dispersion, TIMESTAMP_MAGIC);
+	memcpy(tx.ntp_refid, "RATE", 4);
+	INIT_OBJ(&tx.ntp_reference, TIMESTAMP_MAGIC);
+	tx.ntp_origin = rq->ntp_transmit;
+	tx.ntp_receive = um->ts;
+	return (NTP_Packet_Pack(buf, (ssize_t)size, &tx));
+}
+
+/* Answer a request with a MAC, or without */
+
+static size_t
+mse_auth(struct mse *ms, const struct udp_msg *um,
+    const struct ntp_packet *rq, const struct ntp_auth_msg *am,
+    uint8_t *buf, size_t size)
+{
+	enum ntp_auth a;
+	size_t len;
+
+	if (ms->nks != NULL)
+		a = am->result;
+	else if (rq->ntp_maclen == 0)
+		a = NTP_AUTH_NONE;
+	else
+		a = NTP_AUTH_NOKEY;
+
+	switch (a) {
+	case NTP_AUTH_NONE:
+		if (ms->require_auth)
+			return (0);
+		return (mse_reply(ms, um, rq, buf, size));
+	case NTP_AUTH_OK:
+		len = mse_reply(ms, um, rq, buf, size);
+		ms->n_auth++;
+		return (NTP_Auth_Sign(am->key, buf, len, size));
+	case NTP_AUTH_NOKEY:
+	case NTP_AUTH_BAD:
+		len = mse_reply(ms, um, rq, buf, size);
+		memset(buf + len, 0, 4);
+		ms->n_nak++;
+		return (len + 4);
+	default:
+		return (0);
+	}
+}
+
+/* Answer a NTS request, with a NTS NAK if we cannot authenticate it */
+
+static size_t
+mse_nts(struct mse *ms, const struct udp_msg *um,
+    const struct ntp_packet *rq, uint8_t *buf, size_t size)
+{
+	size_t len;
+
+	len = mse_reply(ms, um, rq, buf, size);
+	len = NTS_Serve(ms->nts, um->ptr, (size_t)um->len, buf, len, size);
+	if (len == 0)
+		return (0);
+	if (buf[1] == 0)
+		ms->n_nak++;
+	else
+		ms->n_nts++;
+	return (len);
+}
+
+static void
+mse_batch(struct ocx *ocx, struct mse *ms, struct udp_msg *um, unsigned n)
+{
+	struct ntp_auth_msg am[UDP_BATCH];
+	enum ntp_rate rate[UDP_BATCH];
+	struct ntp_packet rq;
+	struct mse_ileave *il;
+	struct timestamp ts;
+	uint8_t buf[NTP_MAXLEN];
+	size_t len;
+	unsigned u;
+
+	for (u = 0; u < n; u++) {
+		rate[u] = NTP_RATE_OK;
+		if (ms->rl != NULL && um[u].len > 0)
+			rate[u] = NTP_RateLimit(ms->rl, &um[u].ss, &um[u].ts);
+		am[u].ptr = um[u].ptr;
+		am[u].len = um[u].len < 0 || rate[u] != NTP_RATE_OK ?
+		    0 : (size_t)um[u].len;
+	}
+	if (ms->nks != NULL)
+		NTP_Auth_VerifyBatch(ms->nks, am, n);
+
+	for (u = 0; u < n; u++) {
+		ms->n_rx++;
+		if (rate[u] == NTP_RATE_DROP ||
+		    NTP_Packet_Unpack(&rq, um[u].ptr, um[u].len) == NULL ||
+		    rq.ntp_mode != NTP_MODE_CLIENT)
+			len = 0;
+		else if (rate[u] == NTP_RATE_KOD)
+			len = mse_kod(ms, &um[u], &rq, buf, sizeof buf);
+		else if (ms->nts != NULL && rq.ntp_next > 0 &&
+		    um[u].len == 48 + (ssize_t)rq.ntp_extlen)
+			len = mse_nts(ms, &um[u], &rq, buf, sizeof buf);
+		else
+			len = mse_auth(ms, &um[u], &rq, &am[u],
+			    buf, sizeof buf);
+		if (len == 0) {
+			ms->n_drop++;
+			continue;
+		}
+		if (Udp_SendTimed(ocx, ms->usc, &um[u].ss, um[u].sl,
+		    buf, len, &ts) != (ssize_t)len)
+			continue;
+		ms->n_tx++;
+		il = mse_ileave(ms, buf + 32);
+		memcpy(il->rx, buf + 32, sizeof il->rx);
+		il->tx = ts;
+	}
+}
+
+int
+main_serve(int argc, char *const *argv)
+{
+	int ch;
+	char *p;
+	const char *addr = NULL, *port = "ntp", *pemfile = NULL;
+	const char *group = NULL;
+	double duration = 0, d, rate = 0;
+	unsigned burst = 8;
+	unsigned long keyid = 0;
+	struct addrinfo hints, *res;
+	struct timestamp bc_next;
+	long l;
+	struct mse *ms;
+	struct udp_msg um[UDP_BATCH];
+	struct servent *se;
+	static uint8_t rxbuf[UDP_BATCH][NTP_MAXLEN];
+	struct timestamp t0, now;
+	unsigned u, n;
+
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	Time_Unix_Passive();
+
+	ALLOC_OBJ(ms, MSE_MAGIC);
+	AN(ms);
+	ms->stratum = 10;
+	ms->bc_interval = 64;
+
+	while ((ch = getopt(argc, argv, "a:Ab:d:i:k:K:m:n:P:r:S:")) != -1) {
+		switch(ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'A':
+			ms->require_auth = 1;
+			break;
+		case 'b':
+			l = strtol(optarg, &p, 0);
+			if (*p != '\0' || l < 1 || l > 65535)
+				Fail(NULL, 0, "Invalid -b argument");
+			burst = (unsigned)l;
+			break;
+		case 'd':
+			duration = strtod(optarg, &p);
+			if (*p != '\0' || duration < 0.0)
+				Fail(NULL, 0, "Invalid -d argument");
+			break;
+		case 'i':
+			ms->bc_interval = strtod(optarg, &p);
+			if (*p != '\0' || ms->bc_interval < 1.0)
+				Fail(NULL, 0, "Invalid -i argument");
+			break;
+		case 'k':
+			if (ms->nks == NULL)
+				ms->nks = NTP_Keys_New();
+			NTP_Keys_Load(NULL, ms->nks, optarg);
+			break;
+		case 'K':
+			keyid = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			group = optarg;
+			break;
+		case 'n':
+			pemfile = optarg;
+			break;
+		case 'P':
+			port = optarg;
+			break;
+		case 'r':
+			rate = strtod(optarg, &p);
+			if (*p != '\0' || rate <= 0.0)
+				Fail(NULL, 0, "Invalid -r argument");
+			break;
+		case 'S':
+			l = strtol(optarg, &p, 0);
+			if (*p != '\0' || l < 1 || l > 15)
+				Fail(NULL, 0, "Invalid -S argument");
+			ms->stratum = (uint8_t)l;
+			break;
+		default:
+			Fail(NULL, 0,
+			    "Usage %s [-a address] [-A] [-b burst] "
+			    "[-d duration] [-i interval] [-k keyfile] "
+			    "[-K keyid] [-m address] [-n pemfile] "
+			    "[-P port] [-r rate] [-S stratum]",
+			    argv[0]);
+			break;
+		}
+	}
+	if (ms->require_auth && ms->nks == NULL)
+		Fail(NULL, 0, "-A needs a keyfile (-k)");
+	if (keyid != 0) {
+		if (ms->nks == NULL)
+			Fail(NULL, 0, "-K needs a keyfile (-k)");
+		ms->bc_key = NTP_Keys_Find(ms->nks, (uint32_t)keyid);
+		if (ms->bc_key == NULL)
+			Fail(NULL, 0, "Key-ID %lu not in keyfile", keyid);
+	}
+
+	ms->usc = UdpTimedServer(NULL, addr, port);
+	if (rate > 0.0)
+		ms->rl = NTP_RateLimit_New(rate, burst);
+
+	if (group != NULL) {
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		l = getaddrinfo(group, port, &hints, &res);
+		if (l)
+			Fail(NULL, 0, "address '%s': %s\n",
+			    group, gai_strerror((int)l));
+		assert(res->ai_addrlen <= sizeof ms->bc_ss);
+		memcpy(&ms->bc_ss, res->ai_addr, res->ai_addrlen);
+		ms->bc_sl = res->ai_addrlen;
+		freeaddrinfo(res);
+		Udp_McastTx(NULL, ms->usc, addr, 1);
+	}
+
+	if (pemfile != NULL) {
+		/* NTS-KE tells clients which port, if not the usual */
+		l = strtol(port, &p, 10);
+		if (*p != '\0') {
+			se = getservbyname(port, "udp");
+			l = se == NULL ? 123 : ntohs((uint16_t)se->s_port);
+		}
+		ms->nts = NTS_Server_New();
+		NTS_KE_Server(NULL, ms->nts, pemfile, addr, (unsigned)l);
+	}
+
+	for (u = 0; u < UDP_BATCH; u++) {
+		um[u].ptr = rxbuf[u];
+		um[u].size = sizeof rxbuf[u];
+	}
+
+	TB_Now(&t0);
+	bc_next = t0;
+	while (1) {
+		TB_Now(&now);
+		d = 1.0;
+		if (duration > 0) {
+			d = duration - TS_Diff(&now, &t0);
+			if (d <= 0)
+				break;
+			if (d > 1.0)
+				d = 1.0;
+		}
+		if (ms->bc_sl > 0) {
+			if (TS_Diff(&now, &bc_next) >= 0.0) {
+				mse_bcast(NULL, ms);
+				bc_next = now;
+				TS_Add(&bc_next, ms->bc_interval);
+			}
+			if (TS_Diff(&bc_next, &now) < d)
+				d = TS_Diff(&bc_next, &now);
+		}
+		if (d < 1e-3)
+			d = 1e-3;
+		n = UdpTimedRxMany(NULL, ms->usc, um, UDP_BATCH, d);
+		if (n > 0)
+			mse_batch(NULL, ms, um, n);
+	}
+	printf("Served rx %ju tx %ju auth %ju nts %ju interleaved %ju"
+	    " nak %ju kod %ju drop %ju broadcast %ju\n",
+	    ms->n_rx, ms->n_tx, ms->n_auth, ms->n_nts, ms->n_ileave,
+	    ms->n_nak, ms->n_kod, ms->n_drop, ms->n_bcast);
+	if (ms->rl != NULL)
+		NTP_RateLimit_Destroy(&ms->rl);
+	return (0);
+}
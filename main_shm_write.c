@@ -0,0 +1,117 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Stand-in for a SHM reference clock writer
+ * =========================================
+ *
+ * shm-write
+ *	[-u unit]	SHM unit (default: 2)
+ *	[-o offset]	Pretend our clock is this many seconds ahead
+ *	[-p precision]	Seconds (default: 1e-6)
+ *	[-i interval]	Seconds between samples (default: 1)
+ *	[-d duration]	Stop after this many seconds (default: 60)
+ *
+ * Writes samples into the shared memory segment the way gpsd does, so
+ * the SHM driver (refclock_shm.c) can be tried without a GNSS receiver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "refclock.h"
+
+int
+main_shm_write(int argc, char *const *argv)
+{
+	int ch;
+	char *p;
+	unsigned long unit = 2;
+	double offset = 0, interval = 1, duration = 60, precision = 1e-6;
+	struct refclock_sample smp;
+	struct timestamp t0;
+	struct rc_shm *rs;
+	unsigned n = 0;
+
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	Time_Unix_Passive();
+
+	while ((ch = getopt(argc, argv, "d:i:o:p:u:")) != -1) {
+		switch(ch) {
+		case 'd':
+			duration = strtod(optarg, &p);
+			if (*p != '\0' || duration < 0.0)
+				Fail(NULL, 0, "Invalid -d argument");
+			break;
+		case 'i':
+			interval = strtod(optarg, &p);
+			if (*p != '\0' || interval <= 0.0)
+				Fail(NULL, 0, "Invalid -i argument");
+			break;
+		case 'o':
+			offset = strtod(optarg, &p);
+			if (*p != '\0')
+				Fail(NULL, 0, "Invalid -o argument");
+			break;
+		case 'p':
+			precision = strtod(optarg, &p);
+			if (*p != '\0' || precision <= 0.0)
+				Fail(NULL, 0, "Invalid -p argument");
+			break;
+		case 'u':
+			unit = strtoul(optarg, &p, 0);
+			if (*p != '\0' || unit > 255)
+				Fail(NULL, 0, "Invalid -u argument");
+			break;
+		default:
+			Fail(NULL, 0,
+			    "Usage %s [-u unit] [-o offset] [-p precision] "
+			    "[-i interval] [-d duration]", argv[0]);
+			break;
+		}
+	}
+
+	rs = RC_SHM_Open(NULL, (unsigned)unit);
+
+	memset(&smp, 0, sizeof smp);
+	smp.precision = precision;
+	smp.leap = NTP_LEAP_NONE;
+	(void)TB_Now(&t0);
+	do {
+		(void)TB_Now(&smp.local);
+		smp.ref = smp.local;
+		TS_Add(&smp.ref, -offset);
+		RC_SHM_Put(rs, &smp);
+		n++;
+		if (TB_Sleep(interval))
+			break;
+	} while (TS_Diff(&smp.local, &t0) + interval < duration);
+	printf("Wrote %u samples to SHM unit %lu\n", n, unit);
+	return (0);
+}
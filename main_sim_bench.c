@@ -0,0 +1,391 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * sim_bench
+ *	[-b baseline]	Compare results to this baseline file
+ *	[-w baseline]	Write results as a new baseline file
+ *	[-r slack]	Allowed relative regression (default: 0.2)
+ *	[-c slack]	Allowed relative CPU regression (default: 1.0)
+ *	[-l lock]	Lock threshold (default 1e-3 s)
+ *	[tracefile ...]	Recorded traces to include
+ *
+ * Regression benchmark for the clock-steering code.
+ *
+ * A fixed set of synthetic scenarios is generated with --sim-gen's
+ * model, and replayed through the simulator with default parameters,
+ * together with any recorded tracefiles given as arguments.  For each
+ * of them we report:
+ *
+ *	lock	Simulated seconds until the offset stayed within -l.
+ *	rms	RMS offset after lock.
+ *	peak	Largest absolute offset after lock.
+ *	cpu/h	CPU seconds per simulated hour.
+ *
+ * A scenario fails if it does not lock, if it exceeds the limits
+ * compiled into the table below, or, given a -b baseline, if any
+ * result is more than the slack worse than in the baseline.  The
+ * exit status is non-zero if anything failed.
+ *
+ * The usual routine is to "-w" a baseline before hacking on the PLL,
+ * filter or combiner code, and "-b" it afterwards.
+ */
+
+#include <libgen.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "ntimed.h"
+
+#define MSB_MAXPARAM	6
+
+struct msb_scenario {
+	const char		*name;
+	double			duration;
+	unsigned		nserver;
+	uint64_t		seed;
+	const char		*param[MSB_MAXPARAM];
+	/* Limits, zero means no limit */
+	double			max_lock;
+	double			max_rms;
+	double			max_peak;
+};
+
+static const struct msb_scenario msb_scenarios[] = {
+	{ "default", 2 * 86400, 4, 1,
+	    { NULL },
+	    3600, 6e-4, 5e-3 },
+	{ "noisy", 2 * 86400, 4, 2,
+	    { "sim_gen_queue_up=2e-3", "sim_gen_queue_down=5e-3", NULL },
+	    7200, 4e-3, 15e-3 },
+	{ "falseticker", 2 * 86400, 5, 3,
+	    { "sim_gen_falsetickers=1", NULL },
+	    3600, 6e-4, 5e-3 },
+	{ "badxtal", 2 * 86400, 4, 4,
+	    { "sim_gen_freq=-200", "sim_gen_rwfm=1e-9",
+	      "sim_gen_temp_swing=15", NULL },
+	    3600, 1e-3, 6e-3 },
+	{ "lossy", 2 * 86400, 4, 5,
+	    { "sim_gen_loss=0.3", "sim_gen_route_rate=12", NULL },
+	    3600, 1.2e-3, 1e-2 },
+	{ "slowpoll", 7 * 86400, 4, 6,
+	    { "sim_gen_poll=1024", NULL },
+	    5 * 86400, 2e-3, 5e-3 },
+};
+
+#define MSB_NSCENARIO	(sizeof msb_scenarios / sizeof msb_scenarios[0])
+
+struct msb_result {
+	char			name[64];
+	int			ok;
+	double			lock;
+	double			rms;
+	double			peak;
+	double			cpu_h;
+};
+
+static double msb_lock_thr = 1e-3;
+
+/**********************************************************************/
+
+static void
+msb_wait(pid_t pid, int *st, double *cpu)
+{
+	struct rusage ru;
+
+	if (wait4(pid, st, 0, &ru) != pid)
+		Fail(NULL, 1, "wait4 failed");
+	if (cpu != NULL)
+		*cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		    1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void
+msb_generate(const struct msb_scenario *sc, const char *fn)
+{
+	pid_t pid;
+	int st;
+	unsigned u;
+
+	pid = fork();
+	if (pid < 0)
+		Fail(NULL, 1, "fork failed");
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			_exit(2);
+		TraceLossless(1);
+		ArgTracefileBin(fn);
+		SimGen_Init();
+		for (u = 0; u < MSB_MAXPARAM && sc->param[u] != NULL; u++)
+			Param_Tweak(NULL, sc->param[u]);
+		SimGen_Run(sc->duration, sc->nserver, sc->seed);
+		exit(0);	// Not _exit(), we need the trace flushed
+	}
+	msb_wait(pid, &st, NULL);
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0)
+		Fail(NULL, 0, "Generating scenario %s failed", sc->name);
+}
+
+static void
+msb_measure(const char *fn, struct msb_result *mr)
+{
+	struct sim_result res;
+	pid_t pid;
+	int st, fd[2];
+	double cpu;
+
+	AZ(pipe(fd));
+	pid = fork();
+	if (pid < 0)
+		Fail(NULL, 1, "fork failed");
+	if (pid == 0) {
+		AZ(close(fd[0]));
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			_exit(2);
+		SimClient_Measure(fn, msb_lock_thr, &res);
+		if (write(fd[1], &res, sizeof res) != sizeof res)
+			_exit(2);
+		_exit(0);
+	}
+	AZ(close(fd[1]));
+	msb_wait(pid, &st, &cpu);
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0 ||
+	    read(fd[0], &res, sizeof res) != sizeof res ||
+	    res.magic != SIM_RESULT_MAGIC)
+		memset(&res, 0, sizeof res);
+	AZ(close(fd[0]));
+
+	mr->ok = res.locked;
+	mr->lock = res.lock;
+	mr->rms = res.rms;
+	mr->peak = res.peak;
+	mr->cpu_h = res.simtime > 0 ? cpu * 3600. / res.simtime : 0;
+}
+
+/**********************************************************************
+ * Baseline files are text, one line per scenario:
+ *	name lock rms peak cpu/h
+ */
+
+static struct msb_result *
+msb_read_baseline(const char *fn, unsigned *nbase)
+{
+	FILE *fi;
+	char buf[BUFSIZ];
+	struct msb_result *base = NULL, *mr;
+	unsigned n = 0;
+
+	fi = fopen(fn, "r");
+	if (fi == NULL)
+		Fail(NULL, 1, "Cannot open baseline file (%s)", fn);
+	while (fgets(buf, sizeof buf, fi) != NULL) {
+		if (*buf == '#' || *buf == '\n')
+			continue;
+		base = realloc(base, (n + 1L) * sizeof *base);
+		AN(base);
+		mr = &base[n];
+		memset(mr, 0, sizeof *mr);
+		if (sscanf(buf, "%63s %lg %lg %lg %lg", mr->name,
+		    &mr->lock, &mr->rms, &mr->peak, &mr->cpu_h) != 5)
+			Fail(NULL, 0, "Bad line in baseline file (%s): %s",
+			    fn, buf);
+		mr->ok = 1;
+		n++;
+	}
+	AZ(fclose(fi));
+	*nbase = n;
+	return (base);
+}
+
+static void
+msb_write_baseline(const char *fn, const struct msb_result *res,
+    unsigned nres)
+{
+	FILE *fo;
+	unsigned u;
+
+	fo = fopen(fn, "w");
+	if (fo == NULL)
+		Fail(NULL, 1, "Cannot create baseline file (%s)", fn);
+	fprintf(fo, "# ntimed-client --sim-bench baseline\n");
+	fprintf(fo, "# name lock rms peak cpu/h\n");
+	for (u = 0; u < nres; u++)
+		if (res[u].ok)
+			fprintf(fo, "%s %.0f %.6e %.6e %.6e\n", res[u].name,
+			    res[u].lock, res[u].rms, res[u].peak,
+			    res[u].cpu_h);
+	AZ(fclose(fo));
+}
+
+/*
+ * Compare one metric, the small absolute allowance keeps quantization
+ * (lock time comes in poll intervals) and timer noise from tripping
+ * us up.
+ */
+
+static int
+msb_worse(char *why, size_t len, const char *what, double val,
+    double limit, double slack, double floor)
+{
+	size_t l;
+
+	if (limit <= 0.0 || val <= limit * (1.0 + slack) + floor)
+		return (0);
+	l = strlen(why);
+	(void)snprintf(why + l, len - l, "%s%s", l ? "," : "", what);
+	return (1);
+}
+
+/**********************************************************************/
+
+int
+main_sim_bench(int argc, char *const *argv)
+{
+	int ch, failed = 0, bad;
+	char *p, *dir, fn[BUFSIZ], why[BUFSIZ];
+	const char *b_fn = NULL, *w_fn = NULL;
+	double slack = 0.2, cpu_slack = 1.0;
+	struct msb_result *res, *base = NULL, *mb;
+	const struct msb_scenario *sc;
+	unsigned nres, nbase = 0, u, v;
+	char tmpl[] = "/tmp/ntimed-bench.XXXXXX";
+
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	while ((ch = getopt(argc, argv, "b:c:l:r:w:")) != -1) {
+		switch(ch) {
+		case 'b':
+			b_fn = optarg;
+			break;
+		case 'c':
+			cpu_slack = strtod(optarg, &p);
+			if (*p != '\0' || cpu_slack < 0.0)
+				Fail(NULL, 0, "bad -c argument");
+			break;
+		case 'l':
+			msb_lock_thr = strtod(optarg, &p);
+			if (*p != '\0' || msb_lock_thr <= 0.0)
+				Fail(NULL, 0, "bad -l argument");
+			break;
+		case 'r':
+			slack = strtod(optarg, &p);
+			if (*p != '\0' || slack < 0.0)
+				Fail(NULL, 0, "bad -r argument");
+			break;
+		case 'w':
+			w_fn = optarg;
+			break;
+		default:
+			Fail(NULL, 0,
+			    "Usage %s [-b baseline] [-w baseline] [-r slack]"
+			    " [-c cpu-slack] [-l lock] [tracefile ...]",
+			    argv[0]);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (b_fn != NULL)
+		base = msb_read_baseline(b_fn, &nbase);
+
+	nres = MSB_NSCENARIO + (unsigned)argc;
+	res = calloc(nres, sizeof *res);
+	AN(res);
+
+	dir = mkdtemp(tmpl);
+	if (dir == NULL)
+		Fail(NULL, 1, "Cannot create temporary directory");
+
+	printf("#%-15s %10s %10s %10s %10s  %s\n",
+	    "scenario", "lock", "rms", "peak", "cpu/h", "result");
+	for (u = 0; u < nres; u++) {
+		sc = NULL;
+		if (u < MSB_NSCENARIO) {
+			sc = &msb_scenarios[u];
+			bprintf(res[u].name, "%s", sc->name);
+			bprintf(fn, "%s/%s.nttb", dir, sc->name);
+			msb_generate(sc, fn);
+		} else {
+			bprintf(fn, "%s", argv[u - MSB_NSCENARIO]);
+			bprintf(res[u].name, "%s", basename(fn));
+			bprintf(fn, "%s", argv[u - MSB_NSCENARIO]);
+		}
+
+		msb_measure(fn, &res[u]);
+		if (sc != NULL)
+			(void)unlink(fn);
+
+		*why = '\0';
+		bad = !res[u].ok;
+		if (!bad && sc != NULL) {
+			bad |= msb_worse(why, sizeof why, "lock",
+			    res[u].lock, sc->max_lock, 0, 0);
+			bad |= msb_worse(why, sizeof why, "rms",
+			    res[u].rms, sc->max_rms, 0, 0);
+			bad |= msb_worse(why, sizeof why, "peak",
+			    res[u].peak, sc->max_peak, 0, 0);
+		}
+		mb = NULL;
+		for (v = 0; v < nbase; v++)
+			if (!strcmp(base[v].name, res[u].name))
+				mb = &base[v];
+		if (!bad && mb != NULL) {
+			bad |= msb_worse(why, sizeof why, "lock",
+			    res[u].lock, mb->lock, slack, 60.);
+			bad |= msb_worse(why, sizeof why, "rms",
+			    res[u].rms, mb->rms, slack, 1e-6);
+			bad |= msb_worse(why, sizeof why, "peak",
+			    res[u].peak, mb->peak, slack, 1e-6);
+			bad |= msb_worse(why, sizeof why, "cpu",
+			    res[u].cpu_h, mb->cpu_h, cpu_slack, 1e-3);
+		}
+		failed |= bad;
+
+		if (!res[u].ok)
+			printf(" %-15s %10s %10s %10s %10s  %s\n",
+			    res[u].name, "-", "-", "-", "-", "NO LOCK");
+		else
+			printf(" %-15s %10.0f %10.3e %10.3e %10.3e  %s%s%s\n",
+			    res[u].name, res[u].lock, res[u].rms,
+			    res[u].peak, res[u].cpu_h,
+			    bad ? "FAIL (" : mb != NULL ? "ok" : "-",
+			    why, bad ? ")" : "");
+	}
+	(void)rmdir(dir);
+
+	if (w_fn != NULL)
+		msb_write_baseline(w_fn, res, nres);
+
+	free(res);
+	free(base);
+	return (failed ? 1 : 0);
+}
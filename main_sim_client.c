@@ -24,16 +24,33 @@
  * SUCH DAMAGE.
  *
  * sim_client
- *	-s simfile	Output file from poll-server
- *	server_numbers ...
+ *	-s simfile	Output file from poll-server, text or binary
+ *	[-p param=val]	Tweak parameter
+ *	[-t tracefile]	Where to save the output
+ *	[-T tracefile]	Same, but in the binary format (see trace.h)
+ *	[-M tracemask]	What to trace (see ArgTraceMask())
+ *	[-B when,freq,phase]	Bump the simulated clock
+ *	[-P param=val,...]	Sweep parameter (see below)
+ *	[-j jobs]	Parallel runs in sweep (default: #CPUs)
+ *	[-l lock]	Lock threshold for sweep results (default 1e-3 s)
  */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "ntimed.h"
 #include "ntp.h"
+#include "trace.h"
 
 #define PARAM_CLIENT PARAM_INSTANCE
 #define PARAM_TABLE_NAME client_param_table
@@ -47,54 +64,220 @@ struct sim_file {
 	unsigned		magic;
 #define SIM_FILE_MAGIC		0x7f847bd0
 	char			*filename;
-	FILE			*input;
+	const char		*map;
+	size_t			maplen;
+	const char		*ptr;
+	const char		*end;
+	int			binary;
+	unsigned		nrec;		// Lines or records read
+	char			*lastline;
+	struct ntp_peer		**byid;
+	uint32_t		nbyid;
 	unsigned		n_peer;
 	struct ntp_peerset	*npl;
 	struct timestamp	when;
 	unsigned		t0;
+	uintptr_t		hdl;
 };
 
+/**********************************************************************
+ * The -s file is mapped into memory and scanned in place.
+ *
+ * Binary files (see trace.h) are just decoded, text files are chopped
+ * into the same trace records by a minimal tokenizer which only knows
+ * the lines we care about.
+ */
+
+static struct ntp_peer *
+simfile_findpeer(const struct sim_file *sf, const struct trace_rec *tr)
+{
+	char hn[256], ip[256];
+
+	if (tr->strlen >= sizeof hn || tr->str2len >= sizeof ip)
+		return (NULL);
+	memcpy(hn, tr->str, tr->strlen);
+	hn[tr->strlen] = '\0';
+	memcpy(ip, tr->str2, tr->str2len);
+	ip[tr->str2len] = '\0';
+	return (NTP_PeerSet_FindName(sf->npl, hn, ip));
+}
+
 static void
-simfile_poll(struct ocx *ocx, const struct sim_file *sf, char *buf)
+simfile_setid(struct ocx *ocx, struct sim_file *sf, uint32_t id,
+    struct ntp_peer *np)
 {
-	char *hostname;
-	char *ip;
-	char *pkt;
-	struct ntp_peer *np;
-	struct ntp_packet *rxp;
-	struct ntp_packet *txp;
+	uint32_t n;
+
+	if (id >= TRACE_BIN_MAXID)
+		Fail(ocx, 0, "Peer id %u too large in -s file (%s)"
+		    " record %u", id, sf->filename, sf->nrec);
+	if (id >= sf->nbyid) {
+		n = sf->nbyid ? sf->nbyid : 64;
+		while (id >= n)
+			n *= 2;
+		sf->byid = realloc(sf->byid, n * sizeof *sf->byid);
+		AN(sf->byid);
+		memset(sf->byid + sf->nbyid, 0,
+		    (n - sf->nbyid) * sizeof *sf->byid);
+		sf->nbyid = n;
+	}
+	sf->byid[id] = np;
+}
 
-	CHECK_OBJ_NOTNULL(sf, SIM_FILE_MAGIC);
-	AN(buf);
-
-	if (memcmp(buf, "Poll ", 5))
-		Fail(ocx, 0, "Bad 'Poll' line (%s)\n", buf);
-	hostname = buf + 5;
-	ip = strchr(hostname, ' ');
-	if (ip == NULL)
-		Fail(ocx, 0, "Bad 'Poll' line (%s)\n", buf);
-	pkt = strchr(ip + 1, ' ');
-	if (pkt == NULL)
-		Fail(ocx, 0, "Bad 'Poll' line (%s)\n", buf);
-
-	*ip++ = '\0';
-	*pkt++ = '\0';
-
-	NTP_PeerSet_Foreach(np, sf->npl)
-		if (!strcmp(np->hostname, hostname) && !strcmp(np->ip, ip))
+static int
+simfile_words(struct trace_rec *tr, const char *p, const char *e,
+    const char **rest)
+{
+	const char *q;
+
+	q = memchr(p, ' ', (size_t)(e - p));
+	if (q == NULL || q == p)
+		return (-1);
+	tr->str = p;
+	tr->strlen = (size_t)(q - p);
+	p = q + 1;
+	q = memchr(p, ' ', (size_t)(e - p));
+	if (rest == NULL && q == NULL)
+		q = e;
+	if (q == NULL || q == p)
+		return (-1);
+	tr->str2 = p;
+	tr->str2len = (size_t)(q - p);
+	if (rest != NULL)
+		*rest = q + 1;
+	return (0);
+}
+
+static void
+simfile_text(struct ocx *ocx, struct sim_file *sf, struct trace_rec *tr)
+{
+	const char *p, *e, *q;
+	char *r;
+	size_t len;
+
+	e = memchr(sf->ptr, '\n', (size_t)(sf->end - sf->ptr));
+	if (e != NULL) {
+		p = sf->ptr;
+		sf->ptr = e + 1;
+	} else {
+		/* Last line is unterminated, make a terminated copy */
+		len = (size_t)(sf->end - sf->ptr);
+		free(sf->lastline);
+		sf->lastline = malloc(len + 1);
+		AN(sf->lastline);
+		memcpy(sf->lastline, sf->ptr, len);
+		sf->lastline[len] = '\0';
+		p = sf->lastline;
+		e = p + len;
+		sf->ptr = sf->end;
+	}
+	q = memchr(p, '\r', (size_t)(e - p));
+	if (q != NULL)
+		e = q;
+
+	INIT_OBJ(tr, TRACE_REC_MAGIC);
+	tr->type = TRACE_TEXT;
+	tr->str = p;
+	tr->strlen = (size_t)(e - p);
+
+	if (e - p > 4 && !memcmp(p, "Now ", 4)) {
+		if (!isdigit((unsigned char)p[4]))
+			Fail(ocx, 0, "Bad 'Now' line (%.*s)", (int)(e - p), p);
+		tr->sec = strtoul(p + 4, &r, 10);
+		if (*r != '.' || !isdigit((unsigned char)r[1]))
+			Fail(ocx, 0, "Bad 'Now' line (%.*s)", (int)(e - p), p);
+		tr->nsec = (uint32_t)strtoul(r + 1, NULL, 10);
+		tr->type = TRACE_NOW;
+	} else if (e - p > 5 && !memcmp(p, "Poll ", 5)) {
+		if (simfile_words(tr, p + 5, e, &q))
+			Fail(ocx, 0, "Bad 'Poll' line (%.*s)\n",
+			    (int)(e - p), p);
+		if (NTP_Tool_ScanFields(&tr->pkt, q))
+			Fail(ocx, 0, "Cannot parse packet (%.*s)\n",
+			    (int)(e - p), p);
+		tr->type = TRACE_PKT;
+		tr->tag = TRACE_PKT_POLL;
+	} else if (e - p > 7 && !memcmp(p, "# Peer ", 7)) {
+		if (!simfile_words(tr, p + 7, e, NULL)) {
+			tr->type = TRACE_PEER;
+			tr->tag = TRACE_PEER_PEER;
+		}
+	}
+}
+
+/*
+ * Get the next record, returns zero on EOF.  For Poll records the peer
+ * is looked up as well.
+ */
+
+static int
+simfile_next(struct ocx *ocx, struct sim_file *sf, struct trace_rec *tr,
+    struct ntp_peer **npp)
+{
+	ssize_t l;
+
+	*npp = NULL;
+	if (sf->ptr >= sf->end)
+		return (0);
+	sf->nrec++;
+
+	if (!sf->binary) {
+		simfile_text(ocx, sf, tr);
+		if (tr->type == TRACE_PKT) {
+			*npp = simfile_findpeer(sf, tr);
+			if (*npp == NULL)
+				Fail(ocx, 0, "Peer not found (%.*s, %.*s)\n",
+				    (int)tr->strlen, tr->str,
+				    (int)tr->str2len, tr->str2);
+		}
+		return (1);
+	}
+
+	l = TraceBin_Decode(tr, sf->ptr, (size_t)(sf->end - sf->ptr));
+	if (l <= 0)
+		Fail(ocx, 0, "Bad record in -s file (%s) at offset %zd",
+		    sf->filename, sf->ptr - sf->map);
+	sf->ptr += l;
+	switch (tr->type) {
+	case TRACE_TEXT:
+		while (tr->strlen > 0 && (tr->str[tr->strlen - 1] == '\n' ||
+		    tr->str[tr->strlen - 1] == '\r'))
+			tr->strlen--;
+		break;
+	case TRACE_PEER:
+		simfile_setid(ocx, sf, tr->id, simfile_findpeer(sf, tr));
+		break;
+	case TRACE_PKT:
+		if (tr->tag != TRACE_PKT_POLL)
 			break;
-	if (np == NULL)
-		Fail(ocx, 0, "Peer not found (%s, %s)\n", hostname, ip);
+		if (tr->id < sf->nbyid)
+			*npp = sf->byid[tr->id];
+		if (*npp == NULL)
+			Fail(ocx, 0, "Peer not found (id %u)\n", tr->id);
+		break;
+	default:
+		break;
+	}
+	return (1);
+}
+
+/**********************************************************************/
+
+static void
+simfile_poll(struct ocx *ocx, struct ntp_peer *np,
+    const struct ntp_fields *nf)
+{
+	struct ntp_packet *rxp;
+	struct ntp_packet *txp;
 
 	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	AN(nf);
 
 	txp = np->tx_pkt;
 	INIT_OBJ(txp, NTP_PACKET_MAGIC);
 
 	rxp = np->rx_pkt;
-	if (NTP_Tool_Scan(rxp, pkt))
-		Fail(ocx, 0, "Cannot parse packet (%s, %s, %s)\n",
-		    hostname, ip, pkt);
+	NTP_Tool_Packet(rxp, nf);
 
 	TS_Add(&rxp->ntp_origin, Time_Sim_delta);
 	TS_Add(&rxp->ts_rx, Time_Sim_delta);
@@ -109,7 +292,8 @@ static enum todo_e
 simfile_readline(struct ocx *ocx, struct todolist *tdl, void *priv)
 {
 	struct sim_file *sf;
-	char buf[BUFSIZ], *p;
+	struct trace_rec tr;
+	struct ntp_peer *np;
 	struct timestamp t0;
 	unsigned u1, u2;
 	double dt;
@@ -120,104 +304,434 @@ simfile_readline(struct ocx *ocx, struct todolist *tdl, void *priv)
 	TB_Now(&t0);
 
 	while (1) {
-		if (fgets(buf, sizeof buf, sf->input) == NULL) {
+		if (!simfile_next(ocx, sf, &tr, &np)) {
 			Debug(ocx, "EOF on -s file (%s)\n", sf->filename);
-			exit(0);
+			return (TODO_DONE);
 		}
-		p = strchr(buf, '\r');
-		if (p != NULL)
-			*p = '\0';
-		p = strchr(buf, '\n');
-		if (p != NULL)
-			*p = '\0';
-
-		if (!strncmp(buf, "Now ", 4)) {
-			if (sscanf(buf, "Now %u.%u", &u1, &u2) != 2)
-				Fail(ocx, 0, "Bad 'Now' line (%s)", buf);
+
+		if (tr.type == TRACE_NOW) {
+			u1 = (unsigned)tr.sec;
+			u2 = tr.nsec;
 			if (sf->t0 == 0)
 				sf->t0 = u1 - t0.sec;
 			u1 -= sf->t0;
 			TS_Nanosec(&sf->when, u1, u2);
 			dt = TS_Diff(&sf->when, &t0);
-			if (dt >= 1e-3) {
-				TODO_ScheduleAbs(tdl, simfile_readline, priv,
-				    &sf->when, 0.0, "Readline");
+			if (dt >= 1e-3 && sf->hdl != 0) {
+				TODO_RescheduleAbs(tdl, sf->hdl, &sf->when);
+				return (TODO_OK);
+			} else if (dt >= 1e-3) {
+				sf->hdl = TODO_ScheduleAbs(tdl,
+				    simfile_readline, priv, &sf->when, 0.0,
+				    "Readline");
 				return (TODO_OK);
 			}
-		} else if (!strncmp(buf, "Poll ", 5)) {
-			simfile_poll(ocx, sf, buf);
+		} else if (np != NULL) {
+			simfile_poll(ocx, np, &tr.pkt);
 		}
 		/* We ignore things we don't understand */
 	}
 }
 
+static int
+simfile_is(const struct trace_rec *tr, const char *s)
+{
+
+	return (tr->type == TRACE_TEXT && tr->strlen == strlen(s) &&
+	    !memcmp(tr->str, s, tr->strlen));
+}
+
 static struct sim_file *
-SimFile_Open(struct ocx *ocx, const char *fn, struct todolist *tdl,
-    struct ntp_peerset *npl)
+SimFile_Open(struct ocx *ocx, const char *fn)
 {
 	struct sim_file *sf;
-	char buf[BUFSIZ];
-	char buf2[BUFSIZ];
-	char buf3[BUFSIZ];
-	char *e;
-	int s;
-	unsigned fpeer = 0;
+	struct stat st;
+	void *map;
+	ssize_t i;
+	int fd;
 
 	AN(fn);
-	AN(tdl);
-	AN(npl);
 
 	ALLOC_OBJ(sf, SIM_FILE_MAGIC);
 	AN(sf);
 
-	sf->input = fopen(fn, "r");
-	if (sf->input == NULL)
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
 		Fail(ocx, 1, "Could not open -s file (%s)", fn);
+	if (fstat(fd, &st))
+		Fail(ocx, 1, "Could not stat -s file (%s)", fn);
+	if (st.st_size == 0)
+		Fail(ocx, 1, "Premature EOF on -s file (%s)", fn);
+	sf->maplen = (size_t)st.st_size;
+	map = mmap(NULL, sf->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		Fail(ocx, 1, "Could not mmap -s file (%s)", fn);
+	AZ(close(fd));
+	(void)posix_madvise(map, sf->maplen, POSIX_MADV_SEQUENTIAL);
+	sf->map = map;
+	sf->ptr = sf->map;
+	sf->end = sf->map + sf->maplen;
+
+	i = TraceBin_CheckHeader(sf->map, sf->maplen);
+	if (i < 0)
+		Fail(ocx, 0, "Unsupported binary -s file (%s)", fn);
+	if (i > 0) {
+		sf->binary = 1;
+		sf->ptr += i;
+	}
+
 	sf->filename = strdup(fn);
 	AN(sf->filename);
+	return (sf);
+}
+
+static void
+SimFile_Start(struct ocx *ocx, struct sim_file *sf, struct todolist *tdl,
+    struct ntp_peerset *npl)
+{
+	struct trace_rec tr;
+	struct ntp_peer *np;
+	char buf[BUFSIZ];
+	char buf2[BUFSIZ];
+	char buf3[BUFSIZ];
+	const char *fn;
+	int s;
+	unsigned fpeer = 0;
+
+	CHECK_OBJ_NOTNULL(sf, SIM_FILE_MAGIC);
+	AN(tdl);
+	AN(npl);
+	fn = sf->filename;
 	sf->npl = npl;
 
 	for (s = 0; s < 3; ) {
-		if (fgets(buf, sizeof buf, sf->input) == NULL)
+		if (!simfile_next(ocx, sf, &tr, &np))
 			Fail(ocx, 1, "Premature EOF on -s file (%s)", fn);
-		e = strchr(buf, '\0');
-		AN(e);
-		if (e == buf)
+		if (tr.type == TRACE_TEXT && tr.strlen == 0)
 			continue;
-		if (e[-1] == '\n')
-			*--e = '\0';
-		Debug(ocx, ">>> %s\n", buf);
+		if (tr.type == TRACE_TEXT)
+			Debug(ocx, ">>> %.*s\n", (int)tr.strlen, tr.str);
 		switch(s) {
 		case 0:
-			if (strcmp(buf, "# NTIMED Format poll-server 1.0"))
+			if (!simfile_is(&tr, "# NTIMED Format poll-server 1.0"))
 				Fail(ocx, 0,
 				    "Wrong fileformat in -s file (%s)", fn);
 			s++;
 			break;
 		case 1:
+			if (tr.type != TRACE_TEXT || tr.strlen >= sizeof buf)
+				Fail(ocx, 0,
+				    "Expected '# Found ... peers' line");
+			memcpy(buf, tr.str, tr.strlen);
+			buf[tr.strlen] = '\0';
 			if (sscanf(buf, "# Found %u peers", &sf->n_peer) != 1)
 				Fail(ocx, 0,
 				    "Expected '# Found ... peers' line");
 			s++;
 			break;
 		case 2:
-			if (sscanf(buf, "# Peer %s %s", buf2, buf3) != 2)
+			if (tr.type != TRACE_PEER ||
+			    tr.tag != TRACE_PEER_PEER ||
+			    tr.strlen >= sizeof buf2 ||
+			    tr.str2len >= sizeof buf3)
 				Fail(ocx, 0, "Expected '# Peer' line");
+			memcpy(buf2, tr.str, tr.strlen);
+			buf2[tr.strlen] = '\0';
+			memcpy(buf3, tr.str2, tr.str2len);
+			buf3[tr.str2len] = '\0';
 
 			NTP_PeerSet_AddSim(ocx, npl, buf2, buf3);
+			if (sf->binary)
+				simfile_setid(ocx, sf, tr.id,
+				    NTP_PeerSet_FindName(npl, buf2, buf3));
 			if (++fpeer == sf->n_peer)
 				s++;
 			break;
 		default:
-			Debug(ocx, "<%s>\n", buf);
 			Fail(ocx, 0,
 			    "XXX: Wrong state (%d) in open_sim_file", s);
 		}
 	}
 	(void)simfile_readline(NULL, tdl, sf);
-	return (sf);
 }
 
+/**********************************************************************
+ * Parameter sweeps
+ * ----------------
+ *
+ * With one or more "-P param=v1,v2,..." arguments, the simulation is
+ * run once for every combination of values, -j of them at a time.
+ *
+ * The simulator is full of global state, so each run is a fork(2)'ed
+ * child of a parent which has already mapped the -s file, that way it
+ * is only read from disk once and shared by all the runs.
+ *
+ * Each child watches the offsets fed to the PLL and reports back:
+ *
+ *	lock	Simulated time until the offset stayed within -l seconds
+ *		(default 1ms) for MSC_LOCK_N updates in a row.
+ *	rms	RMS offset from lock time until the end.
+ *	peak	Largest absolute offset from lock time until the end.
+ *	cpu	CPU seconds used by the run.
+ */
+
+#define MSC_LOCK_N	8
+#define MSC_MAXSWEEP	16
+
+struct msc_sweep {
+	char			*name;
+	char			**val;
+	unsigned		nval;
+};
+
+static double msc_lock_thr = 1e-3;
+static pll_f *msc_pll_next;
+static struct timestamp msc_t0;
+static unsigned msc_run;
+static double msc_t_cand, msc_sum2;
+static unsigned msc_n;
+static struct sim_result msc_res;
+
+static void __match_proto__(pll_f)
+msc_pll(struct ocx *ocx, double offset, double weight)
+{
+	struct timestamp now;
+	double t, a;
+
+	TB_Now(&now);
+	t = TS_Diff(&now, &msc_t0);
+	a = fabs(offset);
+	msc_res.nsample++;
+	msc_res.simtime = t;
+
+	if (!msc_res.locked && a > msc_lock_thr) {
+		msc_run = 0;
+	} else {
+		if (msc_run++ == 0 && !msc_res.locked) {
+			msc_t_cand = t;
+			msc_sum2 = 0.0;
+			msc_n = 0;
+			msc_res.peak = 0.0;
+		}
+		msc_sum2 += offset * offset;
+		msc_n++;
+		if (a > msc_res.peak)
+			msc_res.peak = a;
+		if (msc_run >= MSC_LOCK_N && !msc_res.locked) {
+			msc_res.locked = 1;
+			msc_res.lock = msc_t_cand;
+		}
+	}
+	msc_pll_next(ocx, offset, weight);
+}
+
+static void
+msc_simulate(struct sim_file *sf, struct todolist *tdl,
+    struct ntp_peerset *npl)
+{
+	struct combine_delta *cd;
+	struct ntp_peer *np;
+
+	SimFile_Start(NULL, sf, tdl, npl);
+
+	cd = CD_New();
+
+	NTP_PeerSet_Foreach(np, npl) {
+		NF_New(np);
+		np->combiner = CD_AddSource(cd, np->hostname, np->ip);
+	}
+
+	(void)TODO_Run(NULL, tdl);
+}
+
+static void
+msc_sweep_arg(struct msc_sweep *sw, const char *arg)
+{
+	char *p, *q;
+
+	p = strdup(arg);
+	AN(p);
+	q = strchr(p, '=');
+	if (q == NULL || q == p || q[1] == '\0')
+		Fail(NULL, 0, "bad -P argument \"param=value,value,...\"");
+	*q++ = '\0';
+	sw->name = p;
+	sw->nval = 0;
+	sw->val = NULL;
+	for (p = strtok(q, ","); p != NULL; p = strtok(NULL, ",")) {
+		sw->val = realloc(sw->val, (sw->nval + 1L) * sizeof *sw->val);
+		AN(sw->val);
+		sw->val[sw->nval++] = p;
+	}
+	if (sw->nval == 0)
+		Fail(NULL, 0, "bad -P argument \"param=value,value,...\"");
+}
+
+static void
+msc_sweep_args(char *buf, size_t len, const struct msc_sweep *sw,
+    unsigned nsw, unsigned run)
+{
+	unsigned u;
+	size_t l = 0;
+
+	*buf = '\0';
+	for (u = 0; u < nsw && l < len; u++) {
+		l += (size_t)snprintf(buf + l, len - l, "%s%s=%s",
+		    u ? " " : "", sw[u].name, sw[u].val[run % sw[u].nval]);
+		run /= sw[u].nval;
+	}
+}
+
+static void
+msc_measure(struct sim_file *sf, struct todolist *tdl,
+    struct ntp_peerset *npl, struct sim_result *res)
+{
+
+	INIT_OBJ(&msc_res, SIM_RESULT_MAGIC);
+	TB_Now(&msc_t0);
+	msc_pll_next = PLL;
+	PLL = msc_pll;
+
+	msc_simulate(sf, tdl, npl);
+
+	if (msc_n > 0)
+		msc_res.rms = sqrt(msc_sum2 / msc_n);
+	*res = msc_res;
+}
+
+/*
+ * Replay a -s file with default parameters and measure it, for
+ * the benefit of --sim-bench.  Must be called in a fresh process.
+ */
+
+void
+SimClient_Measure(const char *fn, double lock_thr, struct sim_result *res)
+{
+	struct todolist *tdl;
+	struct ntp_peerset *npl;
+	struct sim_file *sf;
+
+	AN(fn);
+	AN(res);
+	TraceLossless(1);
+	tdl = TODO_NewList();
+	Time_Sim(tdl);
+	PLL_Init();
+	npl = NTP_PeerSet_New(NULL);
+	Param_Register(client_param_table);
+	NF_Init();
+
+	sf = SimFile_Open(NULL, fn);
+	AN(sf);
+	msc_lock_thr = lock_thr;
+	msc_measure(sf, tdl, npl, res);
+}
+
+static void
+msc_child(struct sim_file *sf, struct todolist *tdl,
+    struct ntp_peerset *npl, const struct msc_sweep *sw, unsigned nsw,
+    unsigned run, int fd)
+{
+	struct sim_result res;
+	char buf[BUFSIZ];
+	unsigned u;
+
+	/* Keep Debug() output out of the results table */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		_exit(2);
+
+	for (u = 0; u < nsw; u++) {
+		bprintf(buf, "%s=%s", sw[u].name, sw[u].val[run % sw[u].nval]);
+		Param_Tweak(NULL, buf);
+		run /= sw[u].nval;
+	}
+
+	msc_measure(sf, tdl, npl, &res);
+	if (write(fd, &res, sizeof res) != sizeof res)
+		_exit(2);
+	_exit(0);
+}
+
+static void
+msc_sweep(struct sim_file *sf, struct todolist *tdl,
+    struct ntp_peerset *npl, const struct msc_sweep *sw, unsigned nsw,
+    unsigned jobs)
+{
+	struct sim_result *res;
+	struct rusage ru;
+	pid_t *pids, pid;
+	double *cpu;
+	int *fds, fd[2], st;
+	unsigned nrun = 1, next = 0, running = 0, u;
+	char buf[BUFSIZ];
+
+	for (u = 0; u < nsw; u++)
+		nrun *= sw[u].nval;
+	res = calloc(nrun, sizeof *res);
+	pids = calloc(nrun, sizeof *pids);
+	fds = calloc(nrun, sizeof *fds);
+	cpu = calloc(nrun, sizeof *cpu);
+	AN(res);
+	AN(pids);
+	AN(fds);
+	AN(cpu);
+
+	while (next < nrun || running > 0) {
+		while (next < nrun && running < jobs) {
+			AZ(pipe(fd));
+			pid = fork();
+			if (pid < 0)
+				Fail(NULL, 1, "fork failed");
+			if (pid == 0) {
+				AZ(close(fd[0]));
+				msc_child(sf, tdl, npl, sw, nsw, next, fd[1]);
+			}
+			AZ(close(fd[1]));
+			pids[next] = pid;
+			fds[next] = fd[0];
+			next++;
+			running++;
+		}
+		pid = wait4(-1, &st, 0, &ru);
+		if (pid < 0)
+			Fail(NULL, 1, "wait4 failed");
+		for (u = 0; u < next; u++)
+			if (pids[u] == pid)
+				break;
+		assert(u < next);
+		running--;
+		cpu[u] = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		    1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+		if (!WIFEXITED(st) || WEXITSTATUS(st) != 0 ||
+		    read(fds[u], &res[u], sizeof res[u]) != sizeof res[u])
+			memset(&res[u], 0, sizeof res[u]);
+		AZ(close(fds[u]));
+	}
+
+	printf("#%4s %10s %10s %10s %10s %8s  %s\n",
+	    "run", "lock", "rms", "peak", "simtime", "cpu", "params");
+	for (u = 0; u < nrun; u++) {
+		msc_sweep_args(buf, sizeof buf, sw, nsw, u);
+		if (res[u].magic != SIM_RESULT_MAGIC) {
+			printf(" %4u %10s %10s %10s %10s %8.2f  %s\n",
+			    u, "FAILED", "-", "-", "-", cpu[u], buf);
+		} else if (!res[u].locked) {
+			printf(" %4u %10s %10s %10s %10.0f %8.2f  %s\n",
+			    u, "-", "-", "-", res[u].simtime, cpu[u], buf);
+		} else {
+			printf(" %4u %10.0f %10.3e %10.3e %10.0f %8.2f  %s\n",
+			    u, res[u].lock, res[u].rms, res[u].peak,
+			    res[u].simtime, cpu[u], buf);
+		}
+	}
+	free(res);
+	free(pids);
+	free(fds);
+	free(cpu);
+}
+
+/**********************************************************************/
+
 int
 main_sim_client(int argc, char *const *argv)
 {
@@ -225,14 +739,19 @@ main_sim_client(int argc, char *const *argv)
 	const char *s_filename = NULL;
 	struct sim_file *sf;
 	struct ntp_peerset *npl;
-	struct ntp_peer *np;
 	struct todolist *tdl;
-	struct combine_delta *cd;
+	struct msc_sweep sw[MSC_MAXSWEEP];
+	unsigned nsw = 0, jobs = 0;
+	int tracing = 0;
 	double a, b, c;
+	char *p;
+	long l;
 
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
 
+	TraceLossless(1);
+
 	tdl = TODO_NewList();
 	Time_Sim(tdl);
 
@@ -243,7 +762,7 @@ main_sim_client(int argc, char *const *argv)
 	Param_Register(client_param_table);
 	NF_Init();
 
-	while ((ch = getopt(argc, argv, "B:s:p:t:")) != -1) {
+	while ((ch = getopt(argc, argv, "B:j:l:M:P:s:p:t:T:")) != -1) {
 		switch(ch) {
 		case 'B':
 			ch = sscanf(optarg, "%lg,%lg,%lg", &a, &b, &c);
@@ -252,6 +771,25 @@ main_sim_client(int argc, char *const *argv)
 				    "bad -B argument \"when,freq,phase\"");
 			Time_Sim_Bump(tdl, a, b, c);
 			break;
+		case 'j':
+			l = strtol(optarg, &p, 0);
+			if (*p != '\0' || l < 1 || l > 1024)
+				Fail(NULL, 0, "bad -j argument");
+			jobs = (unsigned)l;
+			break;
+		case 'l':
+			msc_lock_thr = strtod(optarg, &p);
+			if (*p != '\0' || msc_lock_thr <= 0.0)
+				Fail(NULL, 0, "bad -l argument");
+			break;
+		case 'M':
+			ArgTraceMask(optarg);
+			break;
+		case 'P':
+			if (nsw == MSC_MAXSWEEP)
+				Fail(NULL, 0, "Too many -P arguments");
+			msc_sweep_arg(&sw[nsw++], optarg);
+			break;
 		case 's':
 			s_filename = optarg;
 			break;
@@ -260,33 +798,45 @@ main_sim_client(int argc, char *const *argv)
 			break;
 		case 't':
 			ArgTracefile(optarg);
+			tracing = 1;
+			break;
+		case 'T':
+			ArgTracefileBin(optarg);
+			tracing = 1;
 			break;
 		default:
 			Fail(NULL, 0,
 			    "Usage %s [-s simfile] [-p params] [-t tracefile]"
-			    " [-B when,freq,phase]", argv[0]);
+			    " [-T binary-tracefile] [-B when,freq,phase]"
+			    " [-M tracemask] [-P param=val,...] [-j jobs]"
+			    " [-l lock]",
+			    argv[0]);
 			break;
 		}
 	}
 	// argc -= optind;
 	// argv += optind;
 
-	Param_Report(NULL, OCX_TRACE);
-
 	if (s_filename == NULL)
 		Fail(NULL, 1, "You must specify -s file.");
 
-	sf = SimFile_Open(NULL, s_filename, tdl, npl);
+	sf = SimFile_Open(NULL, s_filename);
 	AN(sf);
 
-	cd = CD_New();
-
-	NTP_PeerSet_Foreach(np, npl) {
-		NF_New(np);
-		np->combiner = CD_AddSource(cd, np->hostname, np->ip);
+	if (nsw > 0) {
+		if (tracing)
+			Fail(NULL, 0, "Cannot trace (-t/-T) a sweep (-P)");
+		if (jobs == 0) {
+			l = sysconf(_SC_NPROCESSORS_ONLN);
+			jobs = l > 0 ? (unsigned)l : 1;
+		}
+		msc_sweep(sf, tdl, npl, sw, nsw, jobs);
+		return (0);
 	}
 
-	(void)TODO_Run(NULL, tdl);
+	Param_Report(NULL, OCX_TRACE);
+
+	msc_simulate(sf, tdl, npl);
 
 	return (0);
 }
@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * sim_gen
+ *	[-d duration]	Simulated seconds to generate (default: one day)
+ *	[-n servers]	Number of servers (default: 4)
+ *	[-p param=val]	Tweak model parameter (-p '?' lists them)
+ *	[-S seed]	Random seed (default: 1)
+ *	[-t tracefile]	Where to save the output (if not stdout)
+ *	[-T tracefile]	Same, but in the binary format (see trace.h)
+ *
+ * Generate a synthetic poll-server trace, for --sim-client to replay.
+ *
+ * The client clock is a free running oscillator with an initial
+ * frequency error, random walk and flicker frequency noise and a
+ * daily temperature cycle.  The servers have the right time, apart
+ * from the falsetickers, and are reached over paths with a fixed
+ * delay, exponentially distributed queueing delays in each direction,
+ * the occasional route change and some packet loss.
+ *
+ * All the model parameters are -p parameters, and the trace ends up
+ * documenting them with "# param" lines.  The same seed and parameters
+ * always give the same trace.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "ntimed_endian.h"
+#include "trace.h"
+
+#define PARAM_SIM_GEN PARAM_INSTANCE
+#define PARAM_TABLE_NAME sim_gen_param_table
+#include "param_instance.h"
+#undef PARAM_TABLE_NAME
+#undef PARAM_SIM_GEN
+
+#define SG_EPOCH	1400000000
+#define SG_NFLICKER	5
+
+struct sg_server {
+	unsigned		magic;
+#define SG_SERVER_MAGIC		0x51d2a07c
+	struct ntp_peer		*np;
+	double			offset;
+	double			up;
+	double			down;
+	double			next_route;
+};
+
+/**********************************************************************
+ * A small PRNG of our own (splitmix64), so that traces can be
+ * reproduced on any platform.
+ */
+
+static uint64_t sg_seed;
+
+static double
+sg_uniform(void)
+{
+	uint64_t z;
+
+	z = (sg_seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return (((z >> 11) + 0.5) * 0x1.0p-53);		// (0,1)
+}
+
+static double
+sg_normal(void)
+{
+	static int have;
+	static double other;
+	double r, a;
+
+	if (have) {
+		have = 0;
+		return (other);
+	}
+	r = sqrt(-2.0 * log(sg_uniform()));
+	a = 2.0 * M_PI * sg_uniform();
+	other = r * sin(a);
+	have = 1;
+	return (r * cos(a));
+}
+
+static double
+sg_expo(double mean)
+{
+
+	return (-mean * log(sg_uniform()));
+}
+
+/**********************************************************************
+ * The oscillator, its phase is the client clock minus true time.
+ *
+ * Flicker noise is approximated by a sum of Ornstein-Uhlenbeck
+ * processes with time-constants a decade apart.
+ */
+
+static double sg_phase;
+static double sg_rw;
+static double sg_flicker[SG_NFLICKER];
+
+static double
+sg_freq(double t)
+{
+	double y;
+	int i;
+
+	y = param_sim_gen_freq * 1e-6 + sg_rw;
+	for (i = 0; i < SG_NFLICKER; i++)
+		y += sg_flicker[i];
+	y += param_sim_gen_tempco * 1e-6 *
+	    param_sim_gen_temp_swing * sin(2 * M_PI * t / 86400.);
+	return (y);
+}
+
+static void
+sg_osc_step(double t, double dt)
+{
+	double a, s, tau;
+	int i;
+
+	if (dt <= 0.0)
+		return;
+	sg_phase += sg_freq(t) * dt;
+	sg_rw += param_sim_gen_rwfm * sqrt(dt) * sg_normal();
+	s = param_sim_gen_flicker / sqrt(SG_NFLICKER);
+	for (i = 0, tau = 10.; i < SG_NFLICKER; i++, tau *= 10.) {
+		a = exp(-dt / tau);
+		sg_flicker[i] = sg_flicker[i] * a +
+		    s * sqrt(1 - a * a) * sg_normal();
+	}
+}
+
+/**********************************************************************/
+
+static void
+sg_route(struct sg_server *ss, double t)
+{
+	double rtt, asym;
+
+	rtt = 2 * param_sim_gen_delay *
+	    (1 + param_sim_gen_route_delta * (2 * sg_uniform() - 1));
+	asym = param_sim_gen_asymmetry *
+	    (1 + param_sim_gen_route_delta * (2 * sg_uniform() - 1));
+	if (asym > 0.95)
+		asym = 0.95;
+	ss->up = rtt * asym;
+	ss->down = rtt - ss->up;
+	if (param_sim_gen_route_rate > 0)
+		ss->next_route =
+		    t + sg_expo(86400. / param_sim_gen_route_rate);
+	else
+		ss->next_route = 1e300;
+}
+
+static void
+sg_ts(struct timestamp *ts, double t)
+{
+
+	INIT_OBJ(ts, TIMESTAMP_MAGIC);
+	ts->sec = SG_EPOCH;
+	TS_Add(ts, t);
+}
+
+static void
+sg_poll(struct sg_server *ss, double t, struct ntp_packet *pkt)
+{
+	struct timestamp ts;
+	double t2, t3, t4, y;
+
+	if (t >= ss->next_route)
+		sg_route(ss, t);
+
+	y = sg_freq(t);
+	t2 = t + ss->up + sg_expo(param_sim_gen_queue_up);
+	t3 = t2 + 20e-6 + sg_expo(5e-6);
+	t4 = t3 + ss->down + sg_expo(param_sim_gen_queue_down);
+
+	sg_ts(&ts, t + sg_phase);
+	Trace_Now(NULL, &ts, "SimGen");
+
+	if (sg_uniform() < param_sim_gen_loss)
+		return;
+
+	pkt->ntp_leap = NTP_LEAP_NONE;
+	pkt->ntp_version = 4;
+	pkt->ntp_mode = NTP_MODE_SERVER;
+	pkt->ntp_stratum = 2;
+	pkt->ntp_poll = 6;
+	pkt->ntp_precision = -20;
+	TS_Double(&pkt->ntp_delay, 2 * param_sim_gen_delay);
+	TS_Double(&pkt->ntp_dispersion, 1e-3);
+	Be32enc(pkt->ntp_refid, 0x0a000001);
+	sg_ts(&pkt->ntp_origin, t + sg_phase);
+	sg_ts(&pkt->ntp_reference, t2 + ss->offset - 16.);
+	sg_ts(&pkt->ntp_receive, t2 + ss->offset);
+	sg_ts(&pkt->ntp_transmit, t3 + ss->offset);
+	sg_ts(&pkt->ts_rx, t4 + sg_phase + y * (t4 - t));
+	Trace_Pkt(NULL, TRACE_PKT_POLL, ss->np, pkt);
+}
+
+/**********************************************************************/
+
+void
+SimGen_Init(void)
+{
+
+	Param_Register(sim_gen_param_table);
+}
+
+void
+SimGen_Run(double duration, unsigned nserver, uint64_t seed)
+{
+	char buf[40];
+	double t, t_last, dt;
+	unsigned u;
+	struct sg_server *ss;
+	struct sockaddr_in sin;
+	struct ntp_packet *pkt;
+	uintmax_t k;
+
+	assert(nserver > 0);
+	ss = calloc(nserver, sizeof *ss);
+	AN(ss);
+	ALLOC_OBJ(pkt, NTP_PACKET_MAGIC);
+	AN(pkt);
+	sg_seed = seed;
+
+	Put(NULL, OCX_TRACE, "# NTIMED Format poll-server 1.0\n");
+	Put(NULL, OCX_TRACE, "# Found %u peers\n", nserver);
+	for (u = 0; u < nserver; u++) {
+		INIT_OBJ(&ss[u], SG_SERVER_MAGIC);
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(123);
+		sin.sin_addr.s_addr = htonl(0x0a000001 + u);
+		bprintf(buf, "server%u", u);
+		ss[u].np = NTP_Peer_New(buf, &sin, sizeof sin);
+		AN(ss[u].np);
+		if (u < param_sim_gen_falsetickers)
+			ss[u].offset = (u & 1) ?
+			    -param_sim_gen_false_offset :
+			    param_sim_gen_false_offset;
+		sg_route(&ss[u], 0.0);
+		Trace_Peer(NULL, TRACE_PEER_PEER, ss[u].np);
+	}
+	Param_Report(NULL, OCX_TRACE);
+	Put(NULL, OCX_TRACE, "# Seed %ju\n", (uintmax_t)seed);
+
+	/* Servers are polled round-robin, evenly spread */
+	dt = param_sim_gen_poll / nserver;
+	t_last = 0.0;
+	for (k = 0; ; k++) {
+		t = k * dt;
+		if (t > duration)
+			break;
+		sg_osc_step(t_last, t - t_last);
+		t_last = t;
+		sg_poll(&ss[k % nserver], t, pkt);
+	}
+	Put(NULL, OCX_TRACE, "# Run completed\n");
+	for (u = 0; u < nserver; u++)
+		NTP_Peer_Destroy(ss[u].np);
+	FREE_OBJ(pkt);
+	free(ss);
+}
+
+/**********************************************************************/
+
+int
+main_sim_gen(int argc, char *const *argv)
+{
+	int ch;
+	char *p;
+	double duration = 86400;
+	unsigned nserver = 4;
+	uint64_t seed = 1;
+
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	ArgTracefile("-");
+	TraceLossless(1);
+	SimGen_Init();
+
+	while ((ch = getopt(argc, argv, "d:n:p:S:t:T:")) != -1) {
+		switch(ch) {
+		case 'd':
+			duration = strtod(optarg, &p);
+			if (*p != '\0' || duration < 1.0)
+				Fail(NULL, 0, "Invalid -d argument");
+			break;
+		case 'n':
+			nserver = (unsigned)strtoul(optarg, &p, 0);
+			if (*p != '\0' || nserver < 1 || nserver > 250)
+				Fail(NULL, 0, "Invalid -n argument");
+			break;
+		case 'p':
+			Param_Tweak(NULL, optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, &p, 0);
+			if (*p != '\0')
+				Fail(NULL, 0, "Invalid -S argument");
+			break;
+		case 't':
+			ArgTracefile(optarg);
+			break;
+		case 'T':
+			ArgTracefileBin(optarg);
+			break;
+		default:
+			Fail(NULL, 0,
+			    "Usage %s [-d duration] [-n servers] [-p param] "
+			    "[-S seed] [-t tracefile] [-T binary-tracefile]",
+			    argv[0]);
+			break;
+		}
+	}
+
+	SimGen_Run(duration, nserver, seed);
+	return (0);
+}
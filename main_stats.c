@@ -0,0 +1,144 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * stats
+ *	[-i interval]	Repeat every this many seconds (default: once)
+ *	[-n count]	Stop after this many snapshots
+ *	statsfile	As given to the client with -s
+ *
+ * Dumps the shared memory statistics segment (see stats.h) of a
+ * running client.  It is also the reference implementation of how
+ * to read it: map it read-only, check the header, copy snapshots
+ * with Stats_Read().
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ntimed.h"
+#include "stats.h"
+
+static void
+mst_dump(const struct stats_seg *ss)
+{
+	const struct stats_peer *sp;
+
+	printf("Stats pid %u seq %u updates %ju\n",
+	    ss->pid, ss->stats_seq, (uintmax_t)ss->nupdate);
+	printf("Combine nsrc %u peak %.3e weight %.3e\n",
+	    ss->cd_nsrc, ss->cd_peak, ss->cd_weight);
+	printf("PLL mode %u offset %.3e p_term %.3e integrator %.3e"
+	    " a %.3e b %.3e\n",
+	    ss->pll_mode, ss->pll_offset, ss->pll_p_term,
+	    ss->pll_integrator, ss->pll_a, ss->pll_b);
+	printf("Todo run %ju fail %ju\n",
+	    (uintmax_t)ss->todo_run, (uintmax_t)ss->todo_fail);
+	printf("UDP rx %ju rx_err %ju tx %ju tx_err %ju\n",
+	    (uintmax_t)ss->udp_rx, (uintmax_t)ss->udp_rx_err,
+	    (uintmax_t)ss->udp_tx, (uintmax_t)ss->udp_tx_err);
+	for (sp = ss->peer; sp < ss->peer + STATS_NPEER; sp++) {
+		if (!sp->inuse)
+			continue;
+		printf("Peer %s %s pkt %ju branch %ju %ju %ju %ju last %u"
+		    " trust %.3f\n", sp->hostname, sp->ip,
+		    (uintmax_t)sp->npkt,
+		    (uintmax_t)sp->branch[0], (uintmax_t)sp->branch[1],
+		    (uintmax_t)sp->branch[2], (uintmax_t)sp->branch[3],
+		    sp->branch_last, sp->trust);
+		printf("    lo %.3e mid %.3e hi %.3e"
+		    " alo %.3e amid %.3e ahi %.3e noise %.3e %.3e\n",
+		    sp->lo, sp->mid, sp->hi, sp->alo, sp->amid, sp->ahi,
+		    sp->lo_noise, sp->hi_noise);
+	}
+}
+
+int
+main_stats(int argc, char *const *argv)
+{
+	int ch, fd;
+	double interval = 0;
+	int count = -1;
+	struct stat st;
+	const struct stats_seg *ss;
+	struct stats_seg *snap;
+
+	setbuf(stdout, NULL);
+	setbuf(stderr, NULL);
+
+	while ((ch = getopt(argc, argv, "i:n:")) != -1) {
+		switch(ch) {
+		case 'i':
+			interval = strtod(optarg, NULL);
+			break;
+		case 'n':
+			count = (int)strtol(optarg, NULL, 0);
+			break;
+		default:
+			Fail(NULL, 0,
+			    "Usage %s [-i interval] [-n count] statsfile",
+			    argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		Fail(NULL, 0, "Need exactly one statsfile argument");
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0)
+		Fail(NULL, 1, "Could not open '%s'", argv[0]);
+	AZ(fstat(fd, &st));
+	if (st.st_size < (off_t)sizeof *ss)
+		Fail(NULL, 0, "'%s' is too small to be a stats file",
+		    argv[0]);
+	ss = mmap(NULL, sizeof *ss, PROT_READ, MAP_SHARED, fd, 0);
+	if (ss == MAP_FAILED)
+		Fail(NULL, 1, "Could not map '%s'", argv[0]);
+	AZ(close(fd));
+	if (ss->magic != STATS_MAGIC || ss->version != STATS_VERSION ||
+	    ss->size != sizeof *ss || ss->npeer != STATS_NPEER)
+		Fail(NULL, 0, "'%s' is not a (compatible) stats file",
+		    argv[0]);
+
+	snap = calloc(1, sizeof *snap);
+	AN(snap);
+	while (count != 0) {
+		Stats_Read(ss, snap);
+		mst_dump(snap);
+		if (count > 0)
+			count--;
+		if (interval <= 0.0 || count == 0)
+			break;
+		(void)usleep((useconds_t)lround(interval * 1e6));
+	}
+	free(snap);
+	return (0);
+}
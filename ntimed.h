@@ -37,6 +37,7 @@
 #include "ntimed_queue.h"
 #include "ntimed_tricks.h"
 
+struct ntp_peerset;
 struct todolist;
 struct udp_socket;
 
@@ -49,6 +50,13 @@ enum ocx_chan {
 	OCX_TRACE,		// think: /var/run/stats
 	OCX_DEBUG,		// think: stdout
 };
+#define OCX_NCHAN	3
+
+struct ocx *OCX_New(void);
+void OCX_Destroy(struct ocx **);
+void OCX_Sink(struct ocx *, enum ocx_chan, int fd);
+void OCX_Flush(struct ocx *);
+uintmax_t OCX_Count(const struct ocx *, enum ocx_chan, uintmax_t *bytes);
 
 void Put(struct ocx *, enum ocx_chan, const char *, ...)
     __printflike(3, 4);
@@ -61,10 +69,58 @@ void Fail(struct ocx *, int err, const char *, ...) \
     __attribute__((__noreturn__))
     __printflike(3, 4);
 
-#define Debug(ocx, ...)		Put(ocx, OCX_DEBUG, __VA_ARGS__)
+/*
+ * Output on a channel, and trace output from each subsystem, can be
+ * turned off.  The predicates are macros so the arguments of a
+ * disabled Debug() or Trace() are never even evaluated.  The masks
+ * apply to the global (NULL) context, a struct ocx with a sink of its
+ * own for a channel always gets output on it.
+ *
+ * Compiling with -DNTIMED_NO_TRACE removes all subsystem tracing.
+ */
+
+enum ocx_trace {
+	OCX_TRC_FILTER,
+	OCX_TRC_COMBINE,
+	OCX_TRC_PLL,
+	OCX_TRC_TODO,
+	OCX_TRC_PACKET,
+};
+
+extern unsigned ocx_chan_mask;
+extern unsigned ocx_trace_mask;
+
+int OCX_Enabled(const struct ocx *, enum ocx_chan);
+
+#define OCX_ENABLED(ocx, chan)						\
+	((ocx) == NULL ?						\
+	    (int)((ocx_chan_mask >> (chan)) & 1) : OCX_Enabled(ocx, chan))
+#ifdef NTIMED_NO_TRACE
+#define TRACING(ocx, sub)	0
+#else
+#define TRACING(ocx, sub)						\
+	(OCX_ENABLED(ocx, OCX_TRACE) && (ocx_trace_mask & (1U << (sub))))
+#endif
+
+#define Debug(ocx, ...)							\
+	do {								\
+		if (OCX_ENABLED(ocx, OCX_DEBUG))			\
+			Put(ocx, OCX_DEBUG, __VA_ARGS__);		\
+	} while (0)
 #define DebugHex(ocx, ptr, len)	PutHex(ocx, OCX_DEBUG, ptr, len)
+#define Trace(ocx, sub, ...)						\
+	do {								\
+		if (TRACING(ocx, sub))					\
+			Put(ocx, OCX_TRACE, __VA_ARGS__);		\
+	} while (0)
 
 void ArgTracefile(const char *fn);
+void ArgTracefileBin(const char *fn);
+void ArgTraceMask(const char *spec);
+int TraceBinary(const struct ocx *);
+void PutBin(struct ocx *, enum ocx_chan, const void *, size_t len);
+uintmax_t TraceDrops(void);
+void TraceLossless(int);
 
 /* param.c -- Parameters **********************************************/
 
@@ -79,6 +135,7 @@ struct param_tbl {
 };
 
 void Param_Register(struct param_tbl *pt);
+int Param_Cmd(struct ocx *, const char *arg);
 void Param_Tweak(struct ocx *, const char *arg);
 void Param_Report(struct ocx *ocx, enum ocx_chan);
 
@@ -89,9 +146,14 @@ extern pll_f *PLL;
 
 void PLL_Init(void);
 
+/* stats.c -- Shared memory statistics ********************************/
+
+void Stats_Open(struct ocx *, const char *fn);
+
 /* suckaddr.c -- Sockaddr utils ***************************************/
 
 int SA_Equal(const void *sa1, size_t sl1, const void *sa2, size_t sl2);
+uint32_t SA_Hash(const void *sa, size_t sl);
 
 /* time_sim.c -- Simulated timebase ***********************************/
 
@@ -114,6 +176,7 @@ struct timestamp {
 };
 
 typedef int tb_sleep_f(double dur);
+typedef int tb_sleepuntil_f(const struct timestamp *);
 typedef struct timestamp *tb_now_f(struct timestamp *);
 typedef void tb_step_f(struct ocx *, double offset);
 typedef void tb_adjust_f(struct ocx *, double offset, double duration,
@@ -121,6 +184,7 @@ typedef void tb_adjust_f(struct ocx *, double offset, double duration,
 
 extern int TB_generation;
 extern tb_sleep_f *TB_Sleep;
+extern tb_sleepuntil_f *TB_SleepUntil;
 extern tb_now_f *TB_Now;
 extern tb_step_f *TB_Step;
 extern tb_adjust_f *TB_Adjust;
@@ -132,6 +196,7 @@ struct timestamp *TS_Nanosec(struct timestamp *storage,
 struct timestamp *TS_Double(struct timestamp *storage, double);
 double TS_Diff(const struct timestamp *t1, const struct timestamp *t2);
 int TS_SleepUntil(const struct timestamp *);
+void TS_ToNanosec(const struct timestamp *, uint64_t *sec, uint32_t *nsec);
 void TS_Format(char *buf, size_t len, const struct timestamp *ts);
 
 void TS_RunTest(struct ocx *ocx);
@@ -160,6 +225,9 @@ uintptr_t TODO_ScheduleAbs(struct todolist *,
     const char *fmt, ...) __printflike(6, 7);
 enum todo_e TODO_Run(struct ocx *ocx, struct todolist *);
 void TODO_Cancel(struct todolist *tdl, uintptr_t *);
+void TODO_RescheduleAbs(struct todolist *, uintptr_t,
+    const struct timestamp *when);
+void TODO_RescheduleRel(struct todolist *, uintptr_t, double when);
 
 /* combine_delta.c -- Source Combiner based on delta-pdfs *************/
 
@@ -181,11 +249,104 @@ struct combiner {
 struct combine_delta *CD_New(void);
 struct combiner *CD_AddSource(struct combine_delta *,
     const char *name1, const char *name2);
+void CD_RemoveSource(struct combiner *);
+int CD_Estimate(const struct combiner *, double *offset);
+
+/* crypto.c -- Cryptographic primitives *******************************/
+
+#ifdef HAVE_OPENSSL
+
+struct evp_md_ctx_st;
+
+struct cmac {
+	uint8_t			key[16];
+};
+
+struct sha1 {
+	struct evp_md_ctx_st	*ctx;
+};
+
+struct aes_siv {
+	uint8_t			key[32];
+};
+
+#else
+
+struct aes128 {
+	uint8_t			rk[176];
+};
+
+struct cmac {
+	struct aes128		aes;
+	uint8_t			k1[16];
+	uint8_t			k2[16];
+};
+
+struct sha1 {
+	uint32_t		h[5];
+	uint64_t		len;
+	uint8_t			buf[64];
+};
+
+struct aes_siv {
+	struct cmac		s2v;
+	struct aes128		ctr;
+};
+
+#endif
+
+struct crypto_vec {
+	const void		*ptr;
+	size_t			len;
+};
+
+void CMAC_Key(struct cmac *, const uint8_t *key);
+void CMAC_Sum(const struct cmac *, const void *, size_t, uint8_t *mac);
+void Sha1_Init(struct sha1 *);
+void Sha1_Update(struct sha1 *, const void *, size_t);
+void Sha1_Final(struct sha1 *, uint8_t *digest);
+int Crypto_Equal(const void *, const void *, size_t);
+void Crypto_Random(void *, size_t);
+void AES_SIV_Key(struct aes_siv *, const uint8_t *key);
+void AES_SIV_Seal(const struct aes_siv *, const struct crypto_vec *ad,
+    unsigned nad, const void *pt, size_t len, void *out);
+int AES_SIV_Open(const struct aes_siv *, const struct crypto_vec *ad,
+    unsigned nad, const void *ct, size_t len, void *out);
+void Crypto_RunTest(struct ocx *);
+
+/* control.c -- Control socket ***************************************/
+
+void Control_New(struct ocx *, const char *path, struct todolist *,
+    struct ntp_peerset *);
+
+/* main_sim_*.c -- Simulation building blocks *************************/
+
+struct sim_result {
+	unsigned		magic;
+#define SIM_RESULT_MAGIC	0x3e1b0c47
+	int			locked;
+	double			lock;
+	double			rms;
+	double			peak;
+	double			simtime;
+	unsigned		nsample;
+};
+
+void SimClient_Measure(const char *fn, double lock_thr, struct sim_result *);
+void SimGen_Init(void);
+void SimGen_Run(double duration, unsigned nserver, uint64_t seed);
 
 /**********************************************************************
  * Main functions
  */
 
 int main_client(int argc, char *const *argv);
+int main_control(int argc, char *const *argv);
+int main_convert(int argc, char *const *argv);
 int main_poll_server(int argc, char *const *argv);
+int main_serve(int argc, char *const *argv);
+int main_shm_write(int argc, char *const *argv);
+int main_sim_bench(int argc, char *const *argv);
 int main_sim_client(int argc, char *const *argv);
+int main_sim_gen(int argc, char *const *argv);
+int main_stats(int argc, char *const *argv);
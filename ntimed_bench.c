@@ -0,0 +1,602 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Micro-benchmarks
+ * ================
+ *
+ * Stand-alone program, "make ntimed-bench", which times the primitives
+ * on the hot paths, so that performance work on them can be measured:
+ *
+ *	ntimed-bench [-n samples] [name ...]
+ *
+ * Each benchmark is run as -n (default: 1000) samples of a batch of
+ * operations, and the time per operation of the samples is reported
+ * as the mean and percentiles in nanoseconds.  Fast operations are
+ * batched so the clock_gettime(2) overhead drowns in the noise.
+ *
+ * Only benchmarks whose name contains one of the arguments are run.
+ *
+ * The static functions nf_filter() and cd_find_peak() are reached
+ * through the function pointers the rest of the code uses for them.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "udp.h"
+
+typedef void nb_f(unsigned n);
+
+struct nb_bench {
+	const char		*name;
+	nb_f			*func;
+	unsigned		batch;
+};
+
+static unsigned nb_nsample = 1000;
+static uint64_t nb_seed = 1;
+static struct timestamp nb_sink;
+
+static double
+nb_uniform(void)
+{
+
+	nb_seed = nb_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return ((nb_seed >> 11) * 0x1.0p-53);
+}
+
+static double
+nb_now(void)
+{
+	struct timespec ts;
+
+	AZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static int
+nb_cmp(const void *p1, const void *p2)
+{
+	const double *a = p1, *b = p2;
+
+	return ((*a > *b) - (*a < *b));
+}
+
+/**********************************************************************
+ * ntp_packet.c
+ */
+
+static uint8_t nb_wire[48];
+static struct ntp_packet nb_pkt;
+
+static void
+nb_packet_init(void)
+{
+	struct timestamp now;
+
+	INIT_OBJ(&nb_pkt, NTP_PACKET_MAGIC);
+	nb_pkt.ntp_leap = NTP_LEAP_NONE;
+	nb_pkt.ntp_version = 4;
+	nb_pkt.ntp_mode = NTP_MODE_SERVER;
+	nb_pkt.ntp_stratum = 2;
+	nb_pkt.ntp_poll = 6;
+	nb_pkt.ntp_precision = -20;
+	TS_Double(&nb_pkt.ntp_delay, 0.01);
+	TS_Double(&nb_pkt.ntp_dispersion, 0.001);
+	TB_Now(&now);
+	nb_pkt.ntp_reference = now;
+	TS_Add(&nb_pkt.ntp_reference, -16.);
+	nb_pkt.ntp_origin = now;
+	nb_pkt.ntp_receive = now;
+	TS_Add(&nb_pkt.ntp_receive, 0.003);
+	nb_pkt.ntp_transmit = nb_pkt.ntp_receive;
+	TS_Add(&nb_pkt.ntp_transmit, 30e-6);
+	nb_pkt.ts_rx = now;
+	TS_Add(&nb_pkt.ts_rx, 0.006);
+	AN(NTP_Packet_Pack(nb_wire, sizeof nb_wire, &nb_pkt));
+}
+
+static void __match_proto__(nb_f)
+nb_packet_pack(unsigned n)
+{
+	uint8_t buf[48];
+
+	while (n--)
+		AN(NTP_Packet_Pack(buf, sizeof buf, &nb_pkt));
+}
+
+static void __match_proto__(nb_f)
+nb_packet_unpack(unsigned n)
+{
+	struct ntp_packet pkt;
+
+	while (n--)
+		AN(NTP_Packet_Unpack(&pkt, nb_wire, sizeof nb_wire));
+}
+
+/**********************************************************************
+ * nts.c
+ *
+ * A request, the answer to it, and taking that apart again, with and
+ * without NTS, so the cost of NTS per request shows.  The client gets
+ * its keys and cookies by hand rather than by NTS-KE.
+ */
+
+static struct nts_server *nb_nts_srv;
+static struct nts *nb_nts;
+static uint8_t nb_nts_wire[NTP_MAXLEN];
+static size_t nb_nts_len;
+
+static void
+nb_nts_init(void)
+{
+	uint8_t c2s[NTS_KEYLEN], s2c[NTS_KEYLEN], ck[NTS_COOKIE_MAX];
+	struct sockaddr_in sin;
+	unsigned u;
+	size_t l;
+
+	nb_nts_srv = NTS_Server_New();
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	nb_nts = NTS_New("bench", &sin, sizeof sin, NULL);
+	Crypto_Random(c2s, sizeof c2s);
+	Crypto_Random(s2c, sizeof s2c);
+	NTS_SetKeys(nb_nts, c2s, s2c);
+	for (u = 0; u < NTS_NCOOKIE; u++) {
+		l = NTS_Server_Cookie(nb_nts_srv, c2s, s2c, ck, sizeof ck);
+		AZ(NTS_AddCookie(nb_nts, ck, l));
+	}
+
+	/* A full size request for NTP_Ext_Validate, and refill */
+	l = NTP_Packet_Pack(nb_nts_wire, sizeof nb_nts_wire, &nb_pkt);
+	nb_nts_len = NTS_Request(NULL, nb_nts, nb_nts_wire, l,
+	    sizeof nb_nts_wire);
+	AN(nb_nts_len);
+	l = NTS_Server_Cookie(nb_nts_srv, c2s, s2c, ck, sizeof ck);
+	AZ(NTS_AddCookie(nb_nts, ck, l));
+}
+
+static void __match_proto__(nb_f)
+nb_ext_validate(unsigned n)
+{
+
+	while (n--)
+		assert(NTP_Ext_Validate(nb_nts_wire, nb_nts_len, NULL) ==
+		    (ssize_t)nb_nts_len);
+}
+
+static void __match_proto__(nb_f)
+nb_ntp_exchange(unsigned n)
+{
+	uint8_t req[NTP_MAXLEN], rep[NTP_MAXLEN];
+	struct ntp_packet pkt;
+	size_t l;
+
+	while (n--) {
+		l = NTP_Packet_Pack(req, sizeof req, &nb_pkt);
+		AN(NTP_Packet_Unpack(&pkt, req, (ssize_t)l));
+		l = NTP_Packet_Pack(rep, sizeof rep, &pkt);
+		AN(NTP_Packet_Unpack(&pkt, rep, (ssize_t)l));
+	}
+}
+
+static void __match_proto__(nb_f)
+nb_nts_exchange(unsigned n)
+{
+	uint8_t req[NTP_MAXLEN], rep[NTP_MAXLEN];
+	struct ntp_packet pkt;
+	size_t l, rl;
+
+	while (n--) {
+		l = NTP_Packet_Pack(req, sizeof req, &nb_pkt);
+		l = NTS_Request(NULL, nb_nts, req, l, sizeof req);
+		AN(l);
+		AN(NTP_Packet_Unpack(&pkt, req, (ssize_t)l));
+		rl = NTP_Packet_Pack(rep, sizeof rep, &pkt);
+		rl = NTS_Serve(nb_nts_srv, req, l, rep, rl, sizeof rep);
+		AN(rl);
+		assert(NTS_Reply(NULL, nb_nts, rep, rl) == NTP_AUTH_OK);
+		AN(NTP_Packet_Unpack(&pkt, rep, (ssize_t)rl));
+	}
+}
+
+/**********************************************************************
+ * time_stuff.c
+ */
+
+static void __match_proto__(nb_f)
+nb_ts_add(unsigned n)
+{
+	struct timestamp ts;
+
+	INIT_OBJ(&ts, TIMESTAMP_MAGIC);
+	while (n--)
+		TS_Add(&ts, 1.000000123);
+	nb_sink = ts;
+}
+
+static void __match_proto__(nb_f)
+nb_ts_diff(unsigned n)
+{
+	volatile double d = 0;
+
+	while (n--)
+		d += TS_Diff(&nb_pkt.ntp_transmit, &nb_pkt.ntp_receive);
+}
+
+static void __match_proto__(nb_f)
+nb_ts_format(unsigned n)
+{
+	char buf[40];
+
+	while (n--)
+		TS_Format(buf, sizeof buf, &nb_pkt.ntp_receive);
+}
+
+/**********************************************************************
+ * todo.c
+ *
+ * A list with some entries in it already, like a client with a
+ * handful of servers, then a batch of schedules followed by
+ * cancelling them again.
+ */
+
+#define NB_TODO_BG	32
+#define NB_TODO_BATCH	64
+
+static struct todolist *nb_tdl;
+static uintptr_t nb_todo[NB_TODO_BATCH];
+static struct timestamp nb_todo_when[NB_TODO_BATCH];
+
+static enum todo_e __match_proto__(todo_f)
+nb_todo_func(struct ocx *ocx, struct todolist *tdl, void *priv)
+{
+
+	(void)ocx;
+	(void)tdl;
+	return (TODO_OK);
+}
+
+static void
+nb_todo_init(void)
+{
+	struct timestamp when;
+	unsigned u;
+
+	nb_tdl = TODO_NewList();
+	TB_Now(&when);
+	for (u = 0; u < NB_TODO_BG; u++)
+		(void)TODO_ScheduleRel(nb_tdl, nb_todo_func, NULL,
+		    1000 * nb_uniform(), 64.0, "Background %u", u);
+	for (u = 0; u < NB_TODO_BATCH; u++) {
+		nb_todo_when[u] = when;
+		TS_Add(&nb_todo_when[u], 1000 * nb_uniform());
+	}
+}
+
+static void __match_proto__(nb_f)
+nb_todo_schedule(unsigned n)
+{
+	unsigned u;
+
+	assert(n == NB_TODO_BATCH);
+	for (u = 0; u < n; u++)
+		nb_todo[u] = TODO_ScheduleAbs(nb_tdl, nb_todo_func, NULL,
+		    &nb_todo_when[u], 0.0, "Bench %u", u);
+}
+
+static void __match_proto__(nb_f)
+nb_todo_cancel(unsigned n)
+{
+	unsigned u;
+
+	assert(n == NB_TODO_BATCH);
+	for (u = 0; u < n; u++)
+		TODO_Cancel(nb_tdl, &nb_todo[u]);
+}
+
+/**********************************************************************
+ * ntp_filter.c and combine_delta.c
+ *
+ * The filter is fed packets with some noise in them, so all of its
+ * branches get exercised.  For the filter itself the combiner is
+ * disconnected, for the combiner the PLL is.
+ */
+
+#define NB_NPKT		256
+#define NB_NPEER	4
+
+static struct ntp_peer *nb_np[NB_NPEER];
+static struct ntp_packet *nb_np_pkt[NB_NPEER];
+static struct ntp_packet nb_pkts[NB_NPKT];
+static struct combiner nb_nocombine;
+static struct combiner *nb_cb[NB_NPEER];
+
+static void __match_proto__(pll_f)
+nb_pll(struct ocx *ocx, double offset, double weight)
+{
+
+	(void)ocx;
+	(void)offset;
+	(void)weight;
+}
+
+static void
+nb_filter_init(void)
+{
+	struct combine_delta *cd;
+	struct sockaddr_in sin;
+	char buf[20];
+	unsigned u;
+
+	NF_Init();
+	PLL = nb_pll;
+	INIT_OBJ(&nb_nocombine, COMBINER_MAGIC);
+	for (u = 0; u < NB_NPKT; u++) {
+		nb_pkts[u] = nb_pkt;
+		TS_Add(&nb_pkts[u].ntp_origin, u * 64.);
+		TS_Add(&nb_pkts[u].ntp_receive, u * 64. + 1e-3 * nb_uniform());
+		TS_Add(&nb_pkts[u].ntp_transmit, u * 64. + 1e-3 * nb_uniform());
+		TS_Add(&nb_pkts[u].ts_rx, u * 64. + 3e-3 * nb_uniform());
+	}
+	cd = CD_New();
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	for (u = 0; u < NB_NPEER; u++) {
+		bprintf(buf, "bench%u", u);
+		sin.sin_addr.s_addr = htonl(0x7f000001 + u);
+		nb_np[u] = NTP_Peer_New(buf, &sin, sizeof sin);
+		AN(nb_np[u]);
+		NF_New(nb_np[u]);
+		nb_np_pkt[u] = nb_np[u]->rx_pkt;
+		nb_np[u]->combiner = &nb_nocombine;
+		nb_cb[u] = CD_AddSource(cd, nb_np[u]->hostname, nb_np[u]->ip);
+		nb_cb[u]->func(NULL, nb_cb[u], 0.5, -1e-3, 0, 1e-3);
+	}
+}
+
+static void __match_proto__(nb_f)
+nb_nf_filter(unsigned n)
+{
+	struct ntp_peer *np;
+	static unsigned u;
+
+	while (n--) {
+		np = nb_np[u % NB_NPEER];
+		np->rx_pkt = &nb_pkts[u % NB_NPKT];
+		np->filter_func(NULL, np);
+		u++;
+	}
+}
+
+static void __match_proto__(nb_f)
+nb_cd_find_peak(unsigned n)
+{
+	static unsigned u;
+	double m;
+
+	while (n--) {
+		m = 1e-4 * (nb_uniform() - .5);
+		nb_cb[u % NB_NPEER]->func(NULL, nb_cb[u % NB_NPEER],
+		    0.5, m - 3e-3, m, m + 3e-3);
+		u++;
+	}
+}
+
+static void
+nb_filter_fini(void)
+{
+	unsigned u;
+
+	for (u = 0; u < NB_NPEER; u++) {
+		nb_np[u]->rx_pkt = nb_np_pkt[u];
+		NF_Destroy(nb_np[u]);
+		NTP_Peer_Destroy(nb_np[u]);
+	}
+}
+
+/**********************************************************************
+ * udp.c
+ *
+ * A plain socket on the loopback sends a packet to the timed socket,
+ * only the UdpTimedRx() is timed.
+ */
+
+static struct udp_socket *nb_usc;
+static int nb_udp_fd;
+static struct sockaddr_storage nb_udp_ss;
+static socklen_t nb_udp_sl;
+
+static void
+nb_udp_init(void)
+{
+	struct sockaddr_in sin;
+	socklen_t sl;
+	uint8_t buf[48];
+	ssize_t l;
+
+	nb_usc = UdpTimedSocket(NULL);
+	nb_udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(nb_udp_fd >= 0);
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	AZ(bind(nb_udp_fd, (void*)&sin, sizeof sin));
+	sl = sizeof sin;
+	AZ(getsockname(nb_udp_fd, (void*)&sin, &sl));
+
+	/* Find out which port the timed socket got */
+	l = Udp_Send(NULL, nb_usc, &sin, sizeof sin, nb_wire, sizeof nb_wire);
+	assert(l == sizeof nb_wire);
+	nb_udp_sl = sizeof nb_udp_ss;
+	l = recvfrom(nb_udp_fd, buf, sizeof buf, 0,
+	    (void*)&nb_udp_ss, &nb_udp_sl);
+	assert(l == sizeof buf);
+}
+
+static void __match_proto__(nb_f)
+nb_udp_rx(unsigned n)
+{
+	struct sockaddr_storage ss;
+	struct timestamp ts;
+	socklen_t sl;
+	uint8_t buf[128];
+	ssize_t l;
+
+	while (n--) {
+		l = UdpTimedRx(NULL, nb_usc, AF_INET, &ss, &sl, &ts,
+		    buf, sizeof buf, 1.0);
+		assert(l == sizeof nb_wire);
+	}
+}
+
+static void
+nb_udp_send(unsigned n)
+{
+	ssize_t l;
+
+	while (n--) {
+		l = sendto(nb_udp_fd, nb_wire, sizeof nb_wire, 0,
+		    (void*)&nb_udp_ss, nb_udp_sl);
+		assert(l == sizeof nb_wire);
+	}
+}
+
+/**********************************************************************/
+
+static const struct nb_bench nb_benches[] = {
+	{ "NTP_Packet_Pack",	nb_packet_pack,		1000 },
+	{ "NTP_Packet_Unpack",	nb_packet_unpack,	1000 },
+	{ "NTP_Ext_Validate",	nb_ext_validate,	1000 },
+	{ "NTP exchange",	nb_ntp_exchange,	100 },
+	{ "NTS exchange",	nb_nts_exchange,	10 },
+	{ "TS_Add",		nb_ts_add,		1000 },
+	{ "TS_Diff",		nb_ts_diff,		1000 },
+	{ "TS_Format",		nb_ts_format,		100 },
+	{ "TODO_ScheduleAbs",	nb_todo_schedule,	NB_TODO_BATCH },
+	{ "TODO_Cancel",	nb_todo_cancel,		NB_TODO_BATCH },
+	{ "nf_filter",		nb_nf_filter,		100 },
+	{ "cd_find_peak",	nb_cd_find_peak,	100 },
+	{ "UdpTimedRx",		nb_udp_rx,		1 },
+};
+
+#define NB_NBENCH	(sizeof nb_benches / sizeof nb_benches[0])
+
+static void
+nb_report(const char *name, double *ns, unsigned n)
+{
+	double sum = 0;
+	unsigned u;
+
+	for (u = 0; u < n; u++)
+		sum += ns[u];
+	qsort(ns, n, sizeof *ns, nb_cmp);
+	printf("%-20s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+	    sum / n, ns[n / 2], ns[n * 9 / 10], ns[n * 99 / 100], ns[n - 1]);
+}
+
+static int
+nb_selected(const char *name, int argc, char * const *argv)
+{
+	int i;
+
+	if (argc == 0)
+		return (1);
+	for (i = 0; i < argc; i++)
+		if (strstr(name, argv[i]) != NULL)
+			return (1);
+	return (0);
+}
+
+int
+main(int argc, char * const *argv)
+{
+	const struct nb_bench *nb;
+	double *ns, t0;
+	unsigned u;
+	int ch;
+	char *p;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nb_nsample = (unsigned)strtoul(optarg, &p, 0);
+			if (*p != '\0' || nb_nsample < 1)
+				Fail(NULL, 0, "bad -n argument");
+			break;
+		default:
+			Fail(NULL, 0, "Usage %s [-n samples] [name ...]",
+			    argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	Time_Unix_Passive();
+	nb_packet_init();
+	nb_nts_init();
+	nb_todo_init();
+	nb_filter_init();
+	nb_udp_init();
+
+	ns = calloc(nb_nsample, sizeof *ns);
+	AN(ns);
+
+	printf("# %u samples, nanoseconds per operation\n", nb_nsample);
+	printf("#%-19s %10s %10s %10s %10s %10s\n",
+	    "name", "mean", "p50", "p90", "p99", "max");
+	for (nb = nb_benches; nb < nb_benches + NB_NBENCH; nb++) {
+		if (!nb_selected(nb->name, argc, argv))
+			continue;
+		for (u = 0; u < nb_nsample; u++) {
+			/* Untimed setup for the benchmarks which need it */
+			if (nb->func == nb_todo_cancel)
+				nb_todo_schedule(NB_TODO_BATCH);
+			if (nb->func == nb_udp_rx)
+				nb_udp_send(nb->batch);
+
+			t0 = nb_now();
+			nb->func(nb->batch);
+			ns[u] = (nb_now() - t0) / nb->batch;
+
+			if (nb->func == nb_todo_schedule)
+				nb_todo_cancel(NB_TODO_BATCH);
+		}
+		nb_report(nb->name, ns, nb_nsample);
+	}
+
+	nb_filter_fini();
+	free(ns);
+	return (0);
+}
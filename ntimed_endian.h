@@ -50,6 +50,14 @@ Be32dec(const void *pp)
 	return (((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
 }
 
+static __inline uint64_t
+Be64dec(const void *pp)
+{
+	uint8_t const *p = (uint8_t const *)pp;
+
+	return (((uint64_t)Be32dec(p) << 32) | Be32dec(p + 4));
+}
+
 static __inline void
 Be16enc(void *pp, uint16_t u)
 {
@@ -69,3 +77,12 @@ Be32enc(void *pp, uint32_t u)
 	p[2] = (u >> 8) & 0xff;
 	p[3] = u & 0xff;
 }
+
+static __inline void
+Be64enc(void *pp, uint64_t u)
+{
+	uint8_t *p = (uint8_t *)pp;
+
+	Be32enc(p, (uint32_t)(u >> 32));
+	Be32enc(p + 4, (uint32_t)(u & 0xffffffffU));
+}
@@ -55,6 +55,8 @@ enum ntp_state {
 
 /* ntp_packet.c -- [De]Serialisation **********************************/
 
+#define NTP_MAXLEN		1024	// Largest packet we deal with
+
 struct ntp_packet {
 	unsigned		magic;
 #define NTP_PACKET_MAGIC	0x78b7f0be
@@ -74,25 +76,167 @@ struct ntp_packet {
 	struct timestamp	ntp_transmit;
 
 	struct timestamp	ts_rx;
+	int			ntp_interleaved;	// See ntp_peer.c
+
+	/* Extension fields, if any, between header and MAC */
+	unsigned		ntp_next;
+	size_t			ntp_extlen;
+
+	/* MAC, if any, see ntp_auth.c */
+	uint32_t		ntp_keyid;
+	unsigned		ntp_maclen;
 };
 
 struct ntp_packet *NTP_Packet_Unpack(struct ntp_packet *dst, void *ptr,
     ssize_t len);
 size_t NTP_Packet_Pack(void *ptr, ssize_t len, struct ntp_packet *);
+void NTP_Packet_Transmit(void *ptr, const struct timestamp *);
+
+struct ntp_ext {
+	unsigned		type;
+	size_t			off;	// Of the field in the packet
+	const uint8_t		*body;
+	size_t			len;	// Of the value, including padding
+};
+
+struct ntp_ext_iter {
+	unsigned		magic;
+#define NTP_EXT_ITER_MAGIC	0x3ab1e7d2
+	const uint8_t		*ptr;
+	size_t			len;
+	size_t			off;
+};
+
+struct ntp_ext_build {
+	unsigned		magic;
+#define NTP_EXT_BUILD_MAGIC	0x9c4f2a61
+	uint8_t			*ptr;
+	size_t			len;
+	size_t			size;
+	size_t			last;
+	int			full;
+};
+
+void NTP_Ext_Iter(struct ntp_ext_iter *, const void *, size_t len,
+    size_t off);
+int NTP_Ext_Next(struct ntp_ext_iter *, struct ntp_ext *);
+ssize_t NTP_Ext_Validate(const void *, size_t len, unsigned *nfield);
+void NTP_Ext_Build(struct ntp_ext_build *, void *, size_t len, size_t size);
+uint8_t *NTP_Ext_Reserve(struct ntp_ext_build *, unsigned type, size_t vlen);
+int NTP_Ext_Add(struct ntp_ext_build *, unsigned type, const void *,
+    size_t vlen);
+size_t NTP_Ext_Finish(struct ntp_ext_build *, int mac);
+void NTP_Packet_RunTest(struct ocx *);
+
+/* ntp_auth.c -- Symmetric key authentication *************************/
+
+#define NTP_AUTH_HDRLEN		48
+#define NTP_AUTH_MAXLEN		(NTP_AUTH_HDRLEN + 4 + 20)
+
+enum ntp_auth {
+	NTP_AUTH_NONE = 0,	// No MAC
+	NTP_AUTH_OK,
+	NTP_AUTH_NAK,		// crypto-NAK
+	NTP_AUTH_NOKEY,		// Unknown (or unexpected) key-ID
+	NTP_AUTH_BAD,		// Wrong MAC
+	NTP_AUTH_MALFORMED,	// Length does not fit
+};
+
+struct ntp_key;
+struct ntp_keys;
+
+struct ntp_auth_msg {
+	const void		*ptr;
+	size_t			len;
+	enum ntp_auth		result;
+	const struct ntp_key	*key;
+};
+
+struct ntp_keys *NTP_Keys_New(void);
+void NTP_Keys_Destroy(struct ntp_keys **);
+int NTP_Keys_Add(struct ocx *, struct ntp_keys *, uint32_t keyid,
+    const char *type, const char *key);
+void NTP_Keys_Load(struct ocx *, struct ntp_keys *, const char *fn);
+const struct ntp_key *NTP_Keys_Find(const struct ntp_keys *, uint32_t keyid);
+size_t NTP_Auth_Sign(const struct ntp_key *, void *, size_t len, size_t size);
+enum ntp_auth NTP_Auth_Check(const struct ntp_key *, const void *, size_t);
+enum ntp_auth NTP_Auth_Verify(const struct ntp_keys *, const void *, size_t,
+    const struct ntp_key **);
+void NTP_Auth_VerifyBatch(const struct ntp_keys *, struct ntp_auth_msg *,
+    unsigned n);
+void NTP_Auth_RunTest(struct ocx *);
+
+/* nts.c -- Network Time Security *************************************/
+
+#define NTS_KE_PORT		4460
+#define NTS_KEYLEN		32	// AEAD_AES_SIV_CMAC_256
+#define NTS_NCOOKIE		8
+#define NTS_COOKIE_MAX		256
+
+struct nts;
+struct nts_server;
+
+struct nts *NTS_New(const char *hostname, const void *sa, unsigned salen,
+    const char *cafile);
+void NTS_Destroy(struct nts **);
+void NTS_SetKeys(struct nts *, const uint8_t *c2s, const uint8_t *s2c);
+int NTS_AddCookie(struct nts *, const void *, size_t);
+void NTS_SetAddr(struct nts *, const void *sa, unsigned salen);
+const struct sockaddr *NTS_Addr(const struct nts *, unsigned *salen);
+void NTS_Start(struct ocx *, struct nts *);
+void NTS_Wait(struct nts *);
+size_t NTS_Request(struct ocx *, struct nts *, void *, size_t len,
+    size_t size);
+enum ntp_auth NTS_Reply(struct ocx *, struct nts *, const void *, size_t);
+struct nts_server *NTS_Server_New(void);
+size_t NTS_Server_Cookie(const struct nts_server *, const uint8_t *c2s,
+    const uint8_t *s2c, void *, size_t size);
+size_t NTS_Serve(const struct nts_server *, const void *req, size_t reqlen,
+    void *rep, size_t replen, size_t size);
+void NTS_RunTest(struct ocx *);
+
+/* nts_ke.c -- NTS Key Establishment **********************************/
+
+int NTS_KE(struct ocx *, struct nts *, const char *hostname, const void *sa,
+    unsigned salen, const char *cafile);
+void NTS_KE_Server(struct ocx *, const struct nts_server *,
+    const char *pemfile, const char *addr, unsigned ntp_port);
 
 /* ntp_tools.c -- Handy tools *****************************************/
 
+struct ntp_fields;
+
 void NTP_Tool_Client_Req(struct ntp_packet *);
+void NTP_Tool_Fields(struct ntp_fields *, const struct ntp_packet *);
+void NTP_Tool_FormatFields(char *p, ssize_t len, const struct ntp_fields *);
 void NTP_Tool_Format(char *p, ssize_t len, const struct ntp_packet *pkt);
+int NTP_Tool_ScanFields(struct ntp_fields *, const char *buf);
+void NTP_Tool_Packet(struct ntp_packet *, const struct ntp_fields *);
 int NTP_Tool_Scan(struct ntp_packet *pkt, const char *buf);
 
 /* ntp_filter.c -- NTP sanity checking ********************************/
 
-typedef void ntp_filter_f(struct ocx *, const struct ntp_peer *);
+typedef void ntp_filter_f(struct ocx *, struct ntp_peer *);
 
 void NF_New(struct ntp_peer *);
+void NF_Destroy(struct ntp_peer *);
+void NF_Report(struct ocx *, enum ocx_chan, const struct ntp_peer *);
 void NF_Init(void);
 
+/* ntp_ratelimit.c -- Per source rate limiting ************************/
+
+enum ntp_rate {
+	NTP_RATE_OK,
+	NTP_RATE_KOD,		// Answer with a RATE Kiss-o'-Death
+	NTP_RATE_DROP,
+};
+
+struct ntp_ratelimit *NTP_RateLimit_New(double rate, unsigned burst);
+void NTP_RateLimit_Destroy(struct ntp_ratelimit **);
+enum ntp_rate NTP_RateLimit(struct ntp_ratelimit *, const void *sa,
+    const struct timestamp *);
+void NTP_RateLimit_RunTest(struct ocx *);
+
 /* ntp_peer.c -- State management *************************************/
 
 
@@ -111,28 +255,56 @@ struct ntp_peer {
 
 	struct combiner			*combiner;
 
+	const struct ntp_key		*key;	// Authenticate if set
+	struct nts			*nts;	// NTS if set
+	struct ntp_ileave		*ileave;	// Interleaved if set
+
+	// For trace_bin.c
+	uint32_t			trace_id;
+
 	// For ntp_peerset.c
 	TAILQ_ENTRY(ntp_peer)		list;
+	TAILQ_ENTRY(ntp_peer)		sa_list;
+	TAILQ_ENTRY(ntp_peer)		name_list;
+	uint32_t			sa_hash;
+	uint32_t			name_hash;
 	struct ntp_group		*group;
 	enum ntp_state			state;
 	const struct ntp_peer		*other;
+	unsigned			nmiss;
+	unsigned			kod_backoff;	// See ntp_filter.c
+	unsigned			poll_skip;
 };
 
 struct ntp_peer *NTP_Peer_New(const char *name, const void *, unsigned);
 struct ntp_peer *NTP_Peer_NewLookup(struct ocx *ocx, const char *name);
 void NTP_Peer_Destroy(struct ntp_peer *np);
+void NTP_Peer_Interleave(struct ntp_peer *np);
 int NTP_Peer_Poll(struct ocx *, const struct udp_socket *,
     const struct ntp_peer *, double tmo);
 
 /* ntp_peerset.c -- Peer set management ****************************/
 
+typedef void ntp_peerset_f(struct ocx *, struct ntp_peer *, void *priv);
+
 struct ntp_peerset *NTP_PeerSet_New(struct ocx *);
+void NTP_PeerSet_Hooks(struct ntp_peerset *, ntp_peerset_f *attach,
+    ntp_peerset_f *detach, void *priv);
 void NTP_PeerSet_AddSim(struct ocx *, struct ntp_peerset *,
     const char *hostname, const char *ip);
 int NTP_PeerSet_Add(struct ocx *, struct ntp_peerset *, const char *hostname);
+int NTP_PeerSet_Insert(struct ocx *, struct ntp_peerset *,
+    const char *hostname);
+int NTP_PeerSet_Remove(struct ocx *, struct ntp_peerset *,
+    const char *hostname);
 void NTP_PeerSet_Poll(struct ocx *, struct ntp_peerset *, struct udp_socket *,
     struct todolist *);
 
+struct ntp_peer *NTP_PeerSet_FindSa(const struct ntp_peerset *,
+    const void *sa, unsigned salen);
+struct ntp_peer *NTP_PeerSet_FindName(const struct ntp_peerset *,
+    const char *hostname, const char *ip);
+
 struct ntp_peer *NTP_PeerSet_Iter0(const struct ntp_peerset *);
 struct ntp_peer *NTP_PeerSet_IterN(const struct ntp_peerset *,
     const struct ntp_peer *);
@@ -141,3 +313,12 @@ struct ntp_peer *NTP_PeerSet_IterN(const struct ntp_peerset *,
 	for(var = NTP_PeerSet_Iter0(nps); \
 	var != NULL; \
 	var = NTP_PeerSet_IterN(nps, var))
+
+void NTP_PeerSet_RunTest(struct ocx *);
+
+/* ntp_bcast.c -- Broadcast and multicast client **********************/
+
+struct ntp_bcast *NTP_Bcast_New(struct ocx *, struct todolist *,
+    const struct ntp_peerset *, const char *group, const char *ifaddr,
+    const struct ntp_key *);
+void NTP_Bcast_RunTest(struct ocx *);
@@ -0,0 +1,474 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * NTP symmetric key authentication
+ * ================================
+ *
+ * A MAC is appended to the packet, after the header and extension
+ * fields if any, as a 32 bit key-ID followed by the MAC proper over
+ * everything before it (RFC 5905 section 7.3, RFC 7822):
+ *
+ *	AES128	AES-CMAC(key, packet), 16 bytes (RFC 8573)
+ *	SHA1	SHA-1(key || packet), 20 bytes (the traditional ntpd way)
+ *
+ * A MAC field with only a zero key-ID (52 byte packet) is a crypto-NAK,
+ * a server telling us it could not authenticate our request.
+ *
+ * Keys are precomputed when loaded: the AES key schedule and CMAC
+ * subkeys, or the SHA-1 state after the key, so each packet costs only
+ * the MAC over its own 48 bytes.  Keys are found by key-ID in a small
+ * hash table, and NTP_Auth_VerifyBatch() remembers the last key used,
+ * since a batch of packets for a server is usually all the same key.
+ *
+ * Keyfiles have the ntpd format, one key per line:
+ *
+ *	keyid	type	key
+ *
+ * Where type is AES128 (or AES128CMAC) or SHA1, and key is ASCII if
+ * it is 20 characters or less, otherwise hex.  AES128 keys must be
+ * exactly 16 bytes.  '#' starts a comment.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "ntimed_endian.h"
+
+#define NTP_KEYS_HASH		64	// Power of two
+
+enum ntp_key_type {
+	NTP_KEY_AES128,
+	NTP_KEY_SHA1,
+};
+
+struct ntp_key {
+	unsigned		magic;
+#define NTP_KEY_MAGIC		0x4b1e3f20
+	TAILQ_ENTRY(ntp_key)	list;
+	uint32_t		keyid;
+	enum ntp_key_type	type;
+	unsigned		maclen;
+	union {
+		struct cmac	cmac;
+		struct {
+			uint8_t	key[64];
+			size_t	len;
+		}		sha1;
+	} ctx;
+};
+
+struct ntp_keys {
+	unsigned		magic;
+#define NTP_KEYS_MAGIC		0x8e05c1b3
+	unsigned		nkey;
+	TAILQ_HEAD(, ntp_key)	hash[NTP_KEYS_HASH];
+};
+
+struct ntp_keys *
+NTP_Keys_New(void)
+{
+	struct ntp_keys *nks;
+	unsigned u;
+
+	ALLOC_OBJ(nks, NTP_KEYS_MAGIC);
+	AN(nks);
+	for (u = 0; u < NTP_KEYS_HASH; u++)
+		TAILQ_INIT(&nks->hash[u]);
+	return (nks);
+}
+
+void
+NTP_Keys_Destroy(struct ntp_keys **pnks)
+{
+	struct ntp_keys *nks;
+	struct ntp_key *nk;
+	unsigned u;
+
+	AN(pnks);
+	nks = *pnks;
+	*pnks = NULL;
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	for (u = 0; u < NTP_KEYS_HASH; u++) {
+		while (!TAILQ_EMPTY(&nks->hash[u])) {
+			nk = TAILQ_FIRST(&nks->hash[u]);
+			TAILQ_REMOVE(&nks->hash[u], nk, list);
+			memset(&nk->ctx, 0, sizeof nk->ctx);
+			FREE_OBJ(nk);
+		}
+	}
+	FREE_OBJ(nks);
+}
+
+const struct ntp_key *
+NTP_Keys_Find(const struct ntp_keys *nks, uint32_t keyid)
+{
+	const struct ntp_key *nk;
+
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	TAILQ_FOREACH(nk, &nks->hash[keyid & (NTP_KEYS_HASH - 1)], list)
+		if (nk->keyid == keyid)
+			return (nk);
+	return (NULL);
+}
+
+/**********************************************************************
+ * Adding keys
+ */
+
+static int
+ntp_keys_decode(uint8_t *dst, size_t dstlen, const char *src)
+{
+	size_t l;
+	unsigned u, v;
+
+	l = strlen(src);
+	if (l <= 20) {
+		if (l > dstlen)
+			return (-1);
+		memcpy(dst, src, l);
+		return ((int)l);
+	}
+	if ((l & 1) || l / 2 > dstlen)
+		return (-1);
+	for (u = 0; u < l / 2; u++) {
+		if (!isxdigit((int)src[2 * u]) ||
+		    !isxdigit((int)src[2 * u + 1]) ||
+		    sscanf(src + 2 * u, "%2x", &v) != 1)
+			return (-1);
+		dst[u] = (uint8_t)v;
+	}
+	return ((int)(l / 2));
+}
+
+int
+NTP_Keys_Add(struct ocx *ocx, struct ntp_keys *nks, uint32_t keyid,
+    const char *type, const char *key)
+{
+	struct ntp_key *nk;
+	uint8_t kb[64];
+	int l;
+
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	AN(type);
+	AN(key);
+
+	if (keyid == 0) {
+		Put(ocx, OCX_DIAG, "Key-ID 0 is reserved\n");
+		return (-1);
+	}
+	if (NTP_Keys_Find(nks, keyid) != NULL) {
+		Put(ocx, OCX_DIAG, "Key-ID %u is duplicated\n", keyid);
+		return (-1);
+	}
+	l = ntp_keys_decode(kb, sizeof kb, key);
+	if (l <= 0) {
+		Put(ocx, OCX_DIAG, "Key-ID %u has a bad key\n", keyid);
+		return (-1);
+	}
+
+	ALLOC_OBJ(nk, NTP_KEY_MAGIC);
+	AN(nk);
+	nk->keyid = keyid;
+	if (!strcasecmp(type, "AES128") || !strcasecmp(type, "AES128CMAC")) {
+		if (l != 16) {
+			Put(ocx, OCX_DIAG,
+			    "Key-ID %u: AES128 keys must be 16 bytes\n", keyid);
+			FREE_OBJ(nk);
+			return (-1);
+		}
+		nk->type = NTP_KEY_AES128;
+		nk->maclen = 16;
+		CMAC_Key(&nk->ctx.cmac, kb);
+	} else if (!strcasecmp(type, "SHA1") || !strcasecmp(type, "SHA")) {
+		nk->type = NTP_KEY_SHA1;
+		nk->maclen = 20;
+		assert((size_t)l <= sizeof nk->ctx.sha1.key);
+		memcpy(nk->ctx.sha1.key, kb, (size_t)l);
+		nk->ctx.sha1.len = (size_t)l;
+	} else {
+		Put(ocx, OCX_DIAG, "Key-ID %u has unknown type '%s'\n",
+		    keyid, type);
+		FREE_OBJ(nk);
+		return (-1);
+	}
+	memset(kb, 0, sizeof kb);
+	TAILQ_INSERT_TAIL(&nks->hash[keyid & (NTP_KEYS_HASH - 1)], nk, list);
+	nks->nkey++;
+	return (0);
+}
+
+void
+NTP_Keys_Load(struct ocx *ocx, struct ntp_keys *nks, const char *fn)
+{
+	FILE *fi;
+	char buf[512], type[32], key[256], *p;
+	unsigned long keyid;
+	int n = 0;
+
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	AN(fn);
+	fi = fopen(fn, "r");
+	if (fi == NULL)
+		Fail(ocx, 1, "Could not open keyfile '%s'", fn);
+	while (fgets(buf, sizeof buf, fi) != NULL) {
+		n++;
+		p = strchr(buf, '#');
+		if (p != NULL)
+			*p = '\0';
+		for (p = buf; isspace((int)*p); p++)
+			continue;
+		if (*p == '\0')
+			continue;
+		if (sscanf(p, "%lu %31s %255s", &keyid, type, key) != 3 ||
+		    keyid > 0xffffffffUL)
+			Fail(ocx, 0, "%s:%d: Bad key line", fn, n);
+		if (NTP_Keys_Add(ocx, nks, (uint32_t)keyid, type, key))
+			Fail(ocx, 0, "%s:%d: Bad key", fn, n);
+	}
+	AZ(fclose(fi));
+	memset(key, 0, sizeof key);
+	memset(buf, 0, sizeof buf);
+}
+
+/**********************************************************************
+ * The MACs
+ */
+
+static void
+ntp_auth_mac(const struct ntp_key *nk, const void *ptr, size_t len,
+    uint8_t *mac)
+{
+	struct sha1 sc;
+	uint8_t dig[20];
+
+	switch (nk->type) {
+	case NTP_KEY_AES128:
+		CMAC_Sum(&nk->ctx.cmac, ptr, len, mac);
+		break;
+	case NTP_KEY_SHA1:
+		Sha1_Init(&sc);
+		Sha1_Update(&sc, nk->ctx.sha1.key, nk->ctx.sha1.len);
+		Sha1_Update(&sc, ptr, len);
+		Sha1_Final(&sc, dig);
+		memcpy(mac, dig, nk->maclen);
+		break;
+	default:
+		WRONG("Wrong NTP key type");
+	}
+}
+
+/* Append key-ID and MAC to a packet of len bytes, returns new length */
+
+size_t
+NTP_Auth_Sign(const struct ntp_key *nk, void *ptr, size_t len, size_t size)
+{
+	uint8_t *p = ptr;
+
+	CHECK_OBJ_NOTNULL(nk, NTP_KEY_MAGIC);
+	AN(ptr);
+	assert(len >= NTP_AUTH_HDRLEN && !(len & 3));
+	assert(size >= len + 4 + nk->maclen);
+	Be32enc(p + len, nk->keyid);
+	ntp_auth_mac(nk, p, len, p + len + 4);
+	return (len + 4 + nk->maclen);
+}
+
+/*
+ * Where the MAC starts, -1 if the packet is malformed.  Without
+ * extension fields this takes no walking.
+ */
+
+static ssize_t
+ntp_auth_macoff(const void *ptr, size_t len)
+{
+
+	switch (len) {
+	case NTP_AUTH_HDRLEN:
+	case NTP_AUTH_HDRLEN + 4:
+	case NTP_AUTH_HDRLEN + 4 + 16:
+	case NTP_AUTH_HDRLEN + 4 + 20:
+		return (NTP_AUTH_HDRLEN);
+	default:
+		return (NTP_Ext_Validate(ptr, len, NULL));
+	}
+}
+
+static enum ntp_auth
+ntp_auth_check(const struct ntp_key *nk, const uint8_t *p, size_t len,
+    size_t off)
+{
+	uint8_t mac[20];
+
+	if (off == len)
+		return (NTP_AUTH_NONE);
+	if (len - off == 4 && Be32dec(p + off) == 0)
+		return (NTP_AUTH_NAK);
+	if (len - off != 4 + nk->maclen)
+		return (NTP_AUTH_MALFORMED);
+	if (Be32dec(p + off) != nk->keyid)
+		return (NTP_AUTH_NOKEY);
+	ntp_auth_mac(nk, p, off, mac);
+	if (!Crypto_Equal(mac, p + off + 4, nk->maclen))
+		return (NTP_AUTH_BAD);
+	return (NTP_AUTH_OK);
+}
+
+/* Check a packet against a specific key */
+
+enum ntp_auth
+NTP_Auth_Check(const struct ntp_key *nk, const void *ptr, size_t len)
+{
+	ssize_t off;
+
+	CHECK_OBJ_NOTNULL(nk, NTP_KEY_MAGIC);
+	AN(ptr);
+	off = ntp_auth_macoff(ptr, len);
+	if (off < 0)
+		return (NTP_AUTH_MALFORMED);
+	return (ntp_auth_check(nk, ptr, len, (size_t)off));
+}
+
+/* Check a packet against whichever key it claims to be signed with */
+
+enum ntp_auth
+NTP_Auth_Verify(const struct ntp_keys *nks, const void *ptr, size_t len,
+    const struct ntp_key **nkp)
+{
+	const uint8_t *p = ptr;
+	const struct ntp_key *nk;
+	ssize_t off;
+
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	AN(ptr);
+	AN(nkp);
+	*nkp = NULL;
+	off = ntp_auth_macoff(ptr, len);
+	if (off < 0)
+		return (NTP_AUTH_MALFORMED);
+	if ((size_t)off == len)
+		return (NTP_AUTH_NONE);
+	nk = NTP_Keys_Find(nks, Be32dec(p + off));
+	if (nk == NULL)
+		return (len - (size_t)off == 4 && Be32dec(p + off) == 0 ?
+		    NTP_AUTH_NAK : NTP_AUTH_NOKEY);
+	*nkp = nk;
+	return (ntp_auth_check(nk, p, len, (size_t)off));
+}
+
+/*
+ * Verify a batch of packets, as received by UdpTimedRxMany().
+ * The key lookup is skipped when the key-ID is the same as the
+ * previous packet's.
+ */
+
+void
+NTP_Auth_VerifyBatch(const struct ntp_keys *nks, struct ntp_auth_msg *am,
+    unsigned n)
+{
+	const struct ntp_key *nk = NULL;
+	const uint8_t *p;
+
+	CHECK_OBJ_NOTNULL(nks, NTP_KEYS_MAGIC);
+	AN(am);
+	for (; n > 0; n--, am++) {
+		AN(am->ptr);
+		p = am->ptr;
+		if (nk != NULL && am->len == NTP_AUTH_HDRLEN + 4 + nk->maclen &&
+		    Be32dec(p + NTP_AUTH_HDRLEN) == nk->keyid) {
+			am->key = nk;
+			am->result = NTP_Auth_Check(nk, p, am->len);
+			continue;
+		}
+		am->result = NTP_Auth_Verify(nks, p, am->len, &am->key);
+		if (am->key != NULL)
+			nk = am->key;
+	}
+}
+
+/**********************************************************************
+ * Self test, on top of Crypto_RunTest()
+ */
+
+void
+NTP_Auth_RunTest(struct ocx *ocx)
+{
+	struct ntp_keys *nks;
+	const struct ntp_key *nk;
+	struct ntp_auth_msg am[3];
+	struct ntp_ext_build eb;
+	uint8_t pkt[3][NTP_AUTH_MAXLEN], big[128];
+	size_t l;
+	int nf = 0;
+
+	nks = NTP_Keys_New();
+	AZ(NTP_Keys_Add(ocx, nks, 1, "AES128",
+	    "000102030405060708090a0b0c0d0e0f"));
+	AZ(NTP_Keys_Add(ocx, nks, 2, "SHA1", "Tellus"));
+
+	memset(pkt, 0x5a, sizeof pkt);
+	am[0].ptr = pkt[0];
+	am[0].len = NTP_Auth_Sign(NTP_Keys_Find(nks, 1), pkt[0],
+	    NTP_AUTH_HDRLEN, sizeof pkt[0]);
+	am[1].ptr = pkt[1];
+	am[1].len = NTP_Auth_Sign(NTP_Keys_Find(nks, 2), pkt[1],
+	    NTP_AUTH_HDRLEN, sizeof pkt[1]);
+	am[2].ptr = pkt[2];
+	am[2].len = NTP_Auth_Sign(NTP_Keys_Find(nks, 1), pkt[2],
+	    NTP_AUTH_HDRLEN, sizeof pkt[2]);
+	pkt[2][7] ^= 1;
+	NTP_Auth_VerifyBatch(nks, am, 3);
+	nf += am[0].len != 68 || am[0].result != NTP_AUTH_OK;
+	nf += am[1].len != 72 || am[1].result != NTP_AUTH_OK;
+	nf += am[2].result != NTP_AUTH_BAD;
+
+	memset(pkt[0] + NTP_AUTH_HDRLEN, 0, 4);
+	nf += NTP_Auth_Verify(nks, pkt[0], 52, &nk) != NTP_AUTH_NAK;
+	Be32enc(pkt[0] + NTP_AUTH_HDRLEN, 3);
+	nf += NTP_Auth_Verify(nks, pkt[0], 68, &nk) != NTP_AUTH_NOKEY;
+	nf += NTP_Auth_Verify(nks, pkt[0], 48, &nk) != NTP_AUTH_NONE;
+	l = NTP_Auth_Sign(NTP_Keys_Find(nks, 2), pkt[0], 48, sizeof pkt[0]);
+	nf += NTP_Auth_Check(NTP_Keys_Find(nks, 1), pkt[0], l) !=
+	    NTP_AUTH_MALFORMED;
+
+	/* After extension fields */
+	memset(big, 0x5a, sizeof big);
+	NTP_Ext_Build(&eb, big, NTP_AUTH_HDRLEN, sizeof big);
+	AZ(NTP_Ext_Add(&eb, 0x2005, NULL, 12));
+	l = NTP_Ext_Finish(&eb, 1);
+	l = NTP_Auth_Sign(NTP_Keys_Find(nks, 1), big, l, sizeof big);
+	nf += l != 48 + 16 + 20;
+	nf += NTP_Auth_Verify(nks, big, l, &nk) != NTP_AUTH_OK;
+	big[40] ^= 1;
+	nf += NTP_Auth_Verify(nks, big, l, &nk) != NTP_AUTH_BAD;
+	nf += NTP_Auth_Verify(nks, big, l - 4, &nk) != NTP_AUTH_MALFORMED;
+
+	NTP_Keys_Destroy(&nks);
+	Debug(ocx, "NTP_Auth_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
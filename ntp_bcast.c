@@ -0,0 +1,289 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Broadcast and multicast client
+ * ==============================
+ *
+ * Rather than thousands of clients polling the same server, the server
+ * can send one packet per interval to a multicast group or broadcast
+ * address (mode 5, see --serve -m), and clients listen.
+ *
+ * A broadcast packet only tells how late it arrived relative to the
+ * server's transmit timestamp, which is the offset plus the one-way
+ * delay.  The delay is calibrated by polling the same server as usual:
+ * the filter (ntp_filter.c) uses the round trip from those polls to
+ * turn a broadcast into a lo/mid/hi sample for the combiner, and while
+ * broadcasts keep coming, the unicast polls only happen now and then.
+ *
+ * Broadcasts are only taken from servers which are also peers, matched
+ * on source address, and if a key is given, only with a valid MAC.
+ * Peers are known by their address and the ntp port, but a server
+ * may broadcast from any port, so that is not compared.
+ *
+ * Packets are picked up once a second, the kernel receive timestamp
+ * tells when they arrived.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "udp.h"
+
+#define NTP_BCAST_BATCH		8
+
+struct ntp_bcast {
+	unsigned		magic;
+#define NTP_BCAST_MAGIC		0x6b1a0c57
+	struct udp_socket	*usc;
+	const struct ntp_peerset *nps;
+	const struct ntp_key	*key;
+
+	struct udp_msg		um[NTP_BCAST_BATCH];
+	uint8_t			buf[NTP_BCAST_BATCH][NTP_MAXLEN];
+};
+
+static void
+ntp_bcast_rx1(struct ocx *ocx, const struct ntp_bcast *bc,
+    const struct udp_msg *um)
+{
+	struct ntp_packet pkt;
+	struct ntp_peer *np;
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin4;
+	struct sockaddr_in6 *sin6;
+
+	if (um->len <= 0)
+		return;
+	if (bc->key != NULL &&
+	    NTP_Auth_Check(bc->key, um->ptr, (size_t)um->len) != NTP_AUTH_OK) {
+		Debug(ocx, "Broadcast with bad or no MAC\n");
+		return;
+	}
+	if (NTP_Packet_Unpack(&pkt, um->ptr, um->len) == NULL ||
+	    pkt.ntp_mode != NTP_MODE_BCAST)
+		return;
+	ss = um->ss;
+	if (ss.ss_family == AF_INET) {
+		sin4 = (void*)&ss;
+		sin4->sin_port = htons(123);
+	} else if (ss.ss_family == AF_INET6) {
+		sin6 = (void*)&ss;
+		sin6->sin6_port = htons(123);
+	}
+	np = NTP_PeerSet_FindSa(bc->nps, &ss, um->sl);
+	if (np == NULL) {
+		Debug(ocx, "Broadcast from a stranger\n");
+		return;
+	}
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	pkt.ts_rx = um->ts;
+	*np->rx_pkt = pkt;
+	if (np->filter_func != NULL)
+		np->filter_func(ocx, np);
+}
+
+static enum todo_e __match_proto__(todo_f)
+ntp_bcast_rx(struct ocx *ocx, struct todolist *tdl, void *priv)
+{
+	struct ntp_bcast *bc;
+	unsigned u, n;
+
+	AN(tdl);
+	CAST_OBJ_NOTNULL(bc, priv, NTP_BCAST_MAGIC);
+	do {
+		/* Whatever is queued, do not wait */
+		n = UdpTimedRxMany(ocx, bc->usc, bc->um, NTP_BCAST_BATCH,
+		    1e-4);
+		for (u = 0; u < n; u++)
+			ntp_bcast_rx1(ocx, bc, &bc->um[u]);
+	} while (n == NTP_BCAST_BATCH);
+	return (TODO_OK);
+}
+
+static struct ntp_bcast *
+ntp_bcast_new(struct ocx *ocx, struct todolist *tdl,
+    const struct ntp_peerset *nps, const char *group, const char *port,
+    const char *ifaddr, const struct ntp_key *key)
+{
+	struct ntp_bcast *bc;
+	unsigned u;
+
+	AN(tdl);
+	AN(nps);
+	AN(group);
+	ALLOC_OBJ(bc, NTP_BCAST_MAGIC);
+	AN(bc);
+	bc->usc = UdpMcastSocket(ocx, group, port, ifaddr);
+	bc->nps = nps;
+	bc->key = key;
+	for (u = 0; u < NTP_BCAST_BATCH; u++) {
+		bc->um[u].ptr = bc->buf[u];
+		bc->um[u].size = sizeof bc->buf[u];
+	}
+	(void)TODO_ScheduleRel(tdl, ntp_bcast_rx, bc, 1.0, 1.0,
+	    "NTP_Bcast Rx");
+	return (bc);
+}
+
+struct ntp_bcast *
+NTP_Bcast_New(struct ocx *ocx, struct todolist *tdl,
+    const struct ntp_peerset *nps, const char *group, const char *ifaddr,
+    const struct ntp_key *key)
+{
+
+	return (ntp_bcast_new(ocx, tdl, nps, group, "ntp", ifaddr, key));
+}
+
+/**********************************************************************
+ * Over loopback multicast, a peer which has been polled a few times
+ * gets its broadcasts through the filter to the combiner, and a
+ * replayed one does not.
+ *
+ * Not on the ntp port, so it can run without privileges, which the
+ * port-blind matching above allows.
+ */
+
+static unsigned ntp_bcast_ncomb;
+
+static void __match_proto__(combine_f)
+ntp_bcast_test_comb(struct ocx *ocx, const struct combiner *cb,
+    double trust, double lo, double mid, double hi)
+{
+
+	(void)ocx;
+	(void)cb;
+	(void)lo;
+	(void)mid;
+	(void)hi;
+	assert(trust > 0.0);
+	ntp_bcast_ncomb++;
+}
+
+static void
+ntp_bcast_test_poll(struct ocx *ocx, struct ntp_peer *np, double jitter)
+{
+	struct ntp_packet *rxp;
+
+	rxp = np->rx_pkt;
+	INIT_OBJ(rxp, NTP_PACKET_MAGIC);
+	rxp->ntp_leap = NTP_LEAP_NONE;
+	rxp->ntp_version = 4;
+	rxp->ntp_mode = NTP_MODE_SERVER;
+	rxp->ntp_stratum = 2;
+	memcpy(rxp->ntp_refid, "TEST", 4);
+	TB_Now(&rxp->ntp_origin);
+	TS_Add(&rxp->ntp_origin, -1e-3);
+	rxp->ntp_reference = rxp->ntp_origin;
+	TS_Add(&rxp->ntp_reference, -1.0);
+	rxp->ntp_receive = rxp->ntp_origin;
+	TS_Add(&rxp->ntp_receive, 20e-6 + jitter);
+	rxp->ntp_transmit = rxp->ntp_receive;
+	TS_Add(&rxp->ntp_transmit, 10e-6);
+	rxp->ts_rx = rxp->ntp_transmit;
+	TS_Add(&rxp->ts_rx, 20e-6 + jitter);
+	np->filter_func(ocx, np);
+}
+
+void
+NTP_Bcast_RunTest(struct ocx *ocx)
+{
+	struct todolist *tdl;
+	struct ntp_peerset *nps;
+	struct ntp_peer *np;
+	struct ntp_bcast *bc;
+	struct combiner cb;
+	struct udp_socket *usc;
+	struct sockaddr_in sin;
+	struct ntp_packet tx;
+	uint8_t buf[NTP_MAXLEN], first[NTP_MAXLEN];
+	size_t len = 0;
+	unsigned u, n;
+	int nf = 0;
+
+	tdl = TODO_NewList();
+	AN(tdl);
+	nps = NTP_PeerSet_New(ocx);
+	NTP_PeerSet_AddSim(ocx, nps, "bcast.test", "127.0.0.1");
+	NTP_PeerSet_Foreach(np, nps)
+		break;
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	INIT_OBJ(&cb, COMBINER_MAGIC);
+	cb.func = ntp_bcast_test_comb;
+	np->combiner = &cb;
+	NF_New(np);
+
+	bc = ntp_bcast_new(ocx, tdl, nps, "239.255.0.1", "12323",
+	    "127.0.0.1", NULL);
+	usc = UdpTimedServer(ocx, "127.0.0.1", "0");
+	Udp_McastTx(ocx, usc, "127.0.0.1", 1);
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(12323);
+	sin.sin_addr.s_addr = htonl(0xefff0001);	// 239.255.0.1
+
+	for (u = 0; u < 6; u++)
+		ntp_bcast_test_poll(ocx, np, (u & 1) * 4e-6);
+	ntp_bcast_ncomb = 0;
+
+	INIT_OBJ(&tx, NTP_PACKET_MAGIC);
+	tx.ntp_leap = NTP_LEAP_NONE;
+	tx.ntp_version = 4;
+	tx.ntp_mode = NTP_MODE_BCAST;
+	tx.ntp_stratum = 1;
+	memcpy(tx.ntp_refid, "TEST", 4);
+	INIT_OBJ(&tx.ntp_delay, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_dispersion, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_origin, TIMESTAMP_MAGIC);
+	INIT_OBJ(&tx.ntp_receive, TIMESTAMP_MAGIC);
+	for (u = 0; u < 16; u++) {
+		TB_Now(&tx.ntp_reference);
+		TS_Add(&tx.ntp_reference, -1.0);
+		len = NTP_Packet_Pack(buf, sizeof buf, &tx);
+		if (u == 0)
+			memcpy(first, buf, len);
+		assert(Udp_Send(ocx, usc, &sin, sizeof sin, buf, len) ==
+		    (ssize_t)len);
+		(void)TB_Sleep(1e-3);
+		(void)ntp_bcast_rx(ocx, tdl, bc);
+	}
+	n = ntp_bcast_ncomb;
+	Debug(ocx, "Broadcasts combined: %u of 16\n", n);
+	nf += n == 0;
+
+	assert(Udp_Send(ocx, usc, &sin, sizeof sin, first, len) ==
+	    (ssize_t)len);
+	(void)TB_Sleep(1e-3);
+	(void)ntp_bcast_rx(ocx, tdl, bc);
+	nf += ntp_bcast_ncomb != n;
+
+	Debug(ocx, "NTP_Bcast_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
@@ -29,10 +29,13 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ntimed.h"
 
 #include "ntp.h"
+#include "stats.h"
+#include "trace.h"
 
 #define PARAM_NTP_FILTER PARAM_INSTANCE
 #define PARAM_TABLE_NAME ntp_filter_param_table
@@ -51,34 +54,188 @@ struct ntp_filter {
 	double			trust;
 
 	int			generation;
+	int			interleaved;
+	int			recal;
+	unsigned		nkod;
+	unsigned		kod_good;	// Good packets since KoD
+	unsigned		nbcast;
+	struct timestamp	bc_last;	// Last accepted broadcast
+	double			bc_lat, bc_latlat;
+	unsigned		nbc_cal;
+
+	struct stats_peer	*sp;
 };
 
+/*
+ * Kiss-o'-Death (RFC 5905 section 7.4): RATE doubles the time between
+ * polls of this peer, up to NF_KOD_MAX doublings, DENY and RSTR go
+ * straight to the maximum.  Every NF_KOD_DECAY good packets halve it
+ * again, so the server gets a long rest before we speed up.  Other
+ * kiss codes are not for us and the packet is just ignored.
+ *
+ * The backoff is carried out by ntp_peerset.c skipping the peer's turn,
+ * for as long as it lasts.
+ */
+
+#define NF_KOD_MAX	6
+#define NF_KOD_DECAY	8
+
+static void
+nf_kod(struct ocx *ocx, struct ntp_filter *nf, struct ntp_peer *np,
+    const struct ntp_packet *rxp)
+{
+
+	if (!memcmp(rxp->ntp_refid, "RATE", 4)) {
+		if (np->kod_backoff < NF_KOD_MAX)
+			np->kod_backoff++;
+	} else if (!memcmp(rxp->ntp_refid, "DENY", 4) ||
+	    !memcmp(rxp->ntp_refid, "RSTR", 4)) {
+		np->kod_backoff = NF_KOD_MAX;
+	} else {
+		Trace(ocx, OCX_TRC_FILTER, "NF KoD %.4s ignored\n",
+		    (const char *)rxp->ntp_refid);
+		return;
+	}
+	nf->nkod++;
+	nf->kod_good = 0;
+	np->poll_skip = (1U << np->kod_backoff) - 1;
+	Trace(ocx, OCX_TRC_FILTER, "NF KoD %.4s backoff %u\n",
+	    (const char *)rxp->ntp_refid, np->kod_backoff);
+}
+
+/*
+ * A broadcast (see ntp_bcast.c) arrives offset + one-way delay after
+ * it was sent.  The round trip of the unicast polls, ahi - alo, tells
+ * the delay, assuming it is the same both ways and for both kinds of
+ * packets.  Once a poll has calibrated it, the next NF_BCAST_SKIP
+ * polls are skipped, so polls continue, but seldom.
+ *
+ * That assumption does not hold for the server's end: a broadcast
+ * goes out from a cold send path some time after it was stamped
+ * (tens of microseconds on loopback multicast, against a few for the
+ * unicast noise), where a reply is sent hot.  So the first
+ * NF_BCAST_CAL broadcasts only measure how much later than the
+ * unicast hi they arrive, bc_lat, and the spread of that, and this
+ * is taken off the broadcasts after them.  bc_lat keeps tracking
+ * slowly, like the unicast averages.
+ *
+ * A MAC does not stop a broadcast from being replayed, or held up on
+ * the way, either of which makes it look like the server is behind.
+ * Broadcasts must be newer than the last one accepted, and their
+ * arrival must be inside the noise window around bc_lat, so
+ * calibration waits until there are enough unicast polls.
+ *
+ * XXX: Holding up the calibration broadcasts still skews bc_lat.
+ */
+
+#define NF_BCAST_SKIP	15
+#define NF_BCAST_CAL	4
+
+static void
+nf_bcast(struct ocx *ocx, struct ntp_filter *nf, struct ntp_peer *np,
+    const struct ntp_packet *rxp)
+{
+	double lo, mid, hi, rt, d, noise, r;
+
+	if (nf->navg <= 2) {
+		Trace(ocx, OCX_TRC_FILTER, "NF broadcast, not calibrated\n");
+		return;
+	}
+	if (TS_Diff(&rxp->ntp_transmit, &nf->bc_last) <= 0.0) {
+		Trace(ocx, OCX_TRC_FILTER, "NF broadcast not newer\n");
+		return;
+	}
+	hi = TS_Diff(&rxp->ts_rx, &rxp->ntp_transmit);
+	d = hi - nf->ahi;
+	if (nf->nbc_cal < NF_BCAST_CAL) {
+		r = ++nf->nbc_cal;
+		nf->bc_lat += (d - nf->bc_lat) / r;
+		nf->bc_latlat += (d * d - nf->bc_latlat) / r;
+		nf->bc_last = rxp->ntp_transmit;
+		Trace(ocx, OCX_TRC_FILTER,
+		    "NF broadcast calibrating latency %.3e\n", nf->bc_lat);
+		return;
+	}
+	noise = sqrt(nf->ahihi - nf->ahi * nf->ahi);
+	r = nf->bc_latlat - nf->bc_lat * nf->bc_lat;
+	if (r > noise * noise)
+		noise = sqrt(r);
+	if (fabs(d - nf->bc_lat) > noise * param_ntp_filter_threshold) {
+		Trace(ocx, OCX_TRC_FILTER,
+		    "NF broadcast hi %.3e outside %.3e +/- %.3e\n",
+		    hi, nf->ahi + nf->bc_lat,
+		    noise * param_ntp_filter_threshold);
+		return;
+	}
+	nf->bc_last = rxp->ntp_transmit;
+	nf->bc_lat += (d - nf->bc_lat) / param_ntp_filter_average;
+	nf->bc_latlat += (d * d - nf->bc_latlat) / param_ntp_filter_average;
+	hi -= nf->bc_lat;
+	rt = nf->ahi - nf->alo;
+	lo = hi - rt;
+	mid = hi - .5 * rt;
+	nf->nbcast++;
+	if (nf->recal) {
+		nf->recal = 0;
+		np->poll_skip += NF_BCAST_SKIP;
+	}
+	if (rxp->ntp_stratum == 15)
+		nf->trust = 0.0;
+	else
+		nf->trust = 1.0 / rxp->ntp_stratum;
+	Trace(ocx, OCX_TRC_FILTER, "NF broadcast %.3e %.3e %.3e\n",
+	    lo, mid, hi);
+	if (np->combiner->func != NULL)
+		np->combiner->func(ocx, np->combiner,
+		    nf->trust, lo, mid, hi);
+}
+
 static void __match_proto__(ntp_filter_f)
-nf_filter(struct ocx *ocx, const struct ntp_peer *np)
+nf_filter(struct ocx *ocx, struct ntp_peer *np)
 {
 	struct ntp_filter *nf;
 	struct ntp_packet *rxp;
 	int branch, fail_hi, fail_lo;
 	double lo_noise, hi_noise;
 	double lo_lim, hi_lim;
-	double r;
-	char buf[256];
+	double r, d[6];
 
 	CAST_OBJ_NOTNULL(nf, np->filter_priv, NTP_FILTER_MAGIC);
 
-	if (nf->generation != TB_generation) {
+	rxp = np->rx_pkt;
+	CHECK_OBJ_NOTNULL(rxp, NTP_PACKET_MAGIC);
+
+	/*
+	 * Interleaved samples have less delay and noise than basic ones,
+	 * do not judge one kind by the averages of the other.  Broadcasts
+	 * only use the averages, they must not reset them.
+	 */
+	if (rxp->ntp_mode != NTP_MODE_BCAST &&
+	    (nf->generation != TB_generation ||
+	    nf->interleaved != rxp->ntp_interleaved)) {
 		nf->navg = 0;
 		nf->alo = nf->amid = nf->ahi = 0.0;
 		nf->alolo = nf->ahihi = 0.0;
+		nf->bc_lat = nf->bc_latlat = 0.0;
+		nf->nbc_cal = 0;
+		nf->interleaved = rxp->ntp_interleaved;
+		nf->generation = TB_generation;
 	}
 
-	rxp = np->rx_pkt;
-	CHECK_OBJ_NOTNULL(rxp, NTP_PACKET_MAGIC);
+	if (nf->sp != NULL) {
+		Stats_Begin();
+		nf->sp->npkt++;
+		nf->sp->branch_last = 0;
+		Stats_End();
+	}
 
-	NTP_Tool_Format(buf, sizeof buf, rxp);
+	if (TRACING(ocx, OCX_TRC_PACKET))
+		Trace_Pkt(ocx, TRACE_PKT_NTP_PACKET, np, rxp);
 
-	Put(NULL, OCX_TRACE, "NTP_Packet %s %s %s\n",
-	    np->hostname, np->ip, buf);
+	if (rxp->ntp_leap == NTP_LEAP_UNKNOWN && rxp->ntp_stratum == 0) {
+		nf_kod(ocx, nf, np, rxp);
+		return;
+	}
 
 	if (rxp->ntp_leap == NTP_LEAP_UNKNOWN)
 		return;		// XXX diags
@@ -87,40 +244,54 @@ nf_filter(struct ocx *ocx, const struct ntp_peer *np)
 	// XXX: Check leap warnings against other sources
 
 	if (rxp->ntp_version < 3 || rxp->ntp_version > 4) {
-		Put(ocx, OCX_TRACE, "NF Bad version %d\n", rxp->ntp_version);
+		Trace(ocx, OCX_TRC_FILTER, "NF Bad version %d\n",
+		    rxp->ntp_version);
 		return;
 	}
 
-	if (rxp->ntp_mode != NTP_MODE_SERVER) {
-		Put(ocx, OCX_TRACE, "NF Bad mode %d\n", rxp->ntp_mode);
+	if (rxp->ntp_mode != NTP_MODE_SERVER &&
+	    rxp->ntp_mode != NTP_MODE_BCAST) {
+		Trace(ocx, OCX_TRC_FILTER, "NF Bad mode %d\n", rxp->ntp_mode);
 		return;
 	}
 
 	if (rxp->ntp_stratum == 0 || rxp->ntp_stratum > 15) {
-		Put(ocx, OCX_TRACE, "NF Bad stratum %d\n", rxp->ntp_stratum);
+		Trace(ocx, OCX_TRC_FILTER, "NF Bad stratum %d\n",
+		    rxp->ntp_stratum);
 		return;
 	}
 
 	r = TS_Diff(&rxp->ntp_transmit, &rxp->ntp_receive);
-	if (r <= 0.0) {
-		Put(ocx, OCX_TRACE, "NF rx after tx %.3e\n", r);
+	if (rxp->ntp_mode == NTP_MODE_SERVER && r <= 0.0) {
+		Trace(ocx, OCX_TRC_FILTER, "NF rx after tx %.3e\n", r);
 		return;
 	}
 
 	r = TS_Diff(&rxp->ntp_transmit, &rxp->ntp_reference);
 	if (r < -2e-9) {
 		/* two nanoseconds to Finagle rounding errors */
-		Put(ocx, OCX_TRACE, "NF ref after tx %.3e\n", r);
+		Trace(ocx, OCX_TRC_FILTER, "NF ref after tx %.3e\n", r);
 		return;		// XXX diags
 	}
 
 	// This is almost never a good sign.
 	if (r > 2048) {
 		/* XXX: 2048 -> param */
-		Put(ocx, OCX_TRACE, "NF ancient ref %.3e\n", r);
+		Trace(ocx, OCX_TRC_FILTER, "NF ancient ref %.3e\n", r);
+		return;
+	}
+
+	if (rxp->ntp_mode == NTP_MODE_BCAST) {
+		nf_bcast(ocx, nf, np, rxp);
 		return;
 	}
 
+	if (np->kod_backoff > 0 && ++nf->kod_good == NF_KOD_DECAY) {
+		np->kod_backoff--;
+		nf->kod_good = 0;
+	}
+	nf->recal = 1;
+
 	if (nf->navg < param_ntp_filter_average)
 		nf->navg += 1;
 
@@ -171,11 +342,30 @@ nf_filter(struct ocx *ocx, const struct ntp_peer *np)
 	else
 		nf->trust = 1.0 / rxp->ntp_stratum;
 
-	Put(ocx, OCX_TRACE,
-	    "NTP_Filter %s %s %d %.3e %.3e %.3e %.3e %.3e %.3e\n",
-	    np->hostname, np->ip, branch,
-	    nf->lo, nf->mid, nf->hi,
-	    lo_lim, nf->amid, hi_lim);
+	d[0] = nf->lo;
+	d[1] = nf->mid;
+	d[2] = nf->hi;
+	d[3] = lo_lim;
+	d[4] = nf->amid;
+	d[5] = hi_lim;
+	if (TRACING(ocx, OCX_TRC_FILTER))
+		Trace_Filter(ocx, np, branch, d);
+
+	if (nf->sp != NULL) {
+		Stats_Begin();
+		nf->sp->branch_last = (uint32_t)branch;
+		nf->sp->branch[branch - 1]++;
+		nf->sp->lo = nf->lo;
+		nf->sp->mid = nf->mid;
+		nf->sp->hi = nf->hi;
+		nf->sp->alo = nf->alo;
+		nf->sp->amid = nf->amid;
+		nf->sp->ahi = nf->ahi;
+		nf->sp->lo_noise = lo_noise;
+		nf->sp->hi_noise = hi_noise;
+		nf->sp->trust = nf->trust;
+		Stats_End();
+	}
 
 	if (np->combiner->func != NULL)
 		np->combiner->func(ocx, np->combiner,
@@ -189,10 +379,41 @@ NF_New(struct ntp_peer *np)
 
 	ALLOC_OBJ(nf, NTP_FILTER_MAGIC);
 	AN(nf);
+	INIT_OBJ(&nf->bc_last, TIMESTAMP_MAGIC);
+	nf->sp = Stats_PeerNew(np->hostname, np->ip);
 	np->filter_func = nf_filter;
 	np->filter_priv = nf;
 }
 
+void
+NF_Destroy(struct ntp_peer *np)
+{
+	struct ntp_filter *nf;
+
+	CAST_OBJ_NOTNULL(nf, np->filter_priv, NTP_FILTER_MAGIC);
+	if (nf->sp != NULL)
+		Stats_PeerDestroy(&nf->sp);
+	FREE_OBJ(nf);
+	np->filter_func = NULL;
+	np->filter_priv = NULL;
+}
+
+/* One line of filter state, for the control socket */
+
+void
+NF_Report(struct ocx *ocx, enum ocx_chan chan, const struct ntp_peer *np)
+{
+	struct ntp_filter *nf;
+
+	CAST_OBJ_NOTNULL(nf, np->filter_priv, NTP_FILTER_MAGIC);
+	Put(ocx, chan, "navg %.0f trust %.3f lo %.3e mid %.3e hi %.3e"
+	    " alo %.3e amid %.3e ahi %.3e kod %u/%u bcast %u%s\n",
+	    nf->navg, nf->trust, nf->lo, nf->mid, nf->hi,
+	    nf->alo, nf->amid, nf->ahi, nf->nkod, np->kod_backoff,
+	    nf->nbcast,
+	    nf->interleaved ? " interleaved" : "");
+}
+
 void
 NF_Init(void)
 {
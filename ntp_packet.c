@@ -96,9 +96,15 @@ struct ntp_packet *
 NTP_Packet_Unpack(struct ntp_packet *np, void *ptr, ssize_t len)
 {
 	uint8_t *p = ptr;
+	ssize_t mac;
+	unsigned next = 0;
 
 	AN(ptr);
-	if (len != 48) {
+	/* Extension fields and a MAC may follow, see below and ntp_auth.c */
+	if (len < 48 || len > NTP_MAXLEN)
+		return (NULL);
+	mac = NTP_Ext_Validate(ptr, (size_t)len, &next);
+	if (mac < 0) {
 		/* XXX: Diagnostic */
 		return (NULL);
 	}
@@ -123,9 +129,189 @@ NTP_Packet_Unpack(struct ntp_packet *np, void *ptr, ssize_t len)
 	ntp64_2ts(&np->ntp_origin, p + 24);
 	ntp64_2ts(&np->ntp_receive, p + 32);
 	ntp64_2ts(&np->ntp_transmit, p + 40);
+	np->ntp_next = next;
+	np->ntp_extlen = (size_t)mac - 48;
+	if (mac < len) {
+		np->ntp_keyid = Be32dec(p + mac);
+		np->ntp_maclen = (unsigned)(len - mac - 4);
+	}
 	return (np);
 }
 
+/**********************************************************************
+ * Extension fields (RFC 7822)
+ *
+ *	+-------------------------------+-------------------------------+
+ *	|          Field Type           |        Field Length           |
+ *	+-------------------------------+-------------------------------+
+ *	.                    Value, padded to 32 bits                   .
+ *	+-------------------------------+-------------------------------+
+ *
+ * The length covers the whole field, is a multiple of four and at
+ * least 16.  Fields go between the header and the MAC, if any.  As a
+ * MAC has no length field of its own, the trailing 4 (crypto-NAK), 20
+ * or 24 bytes are a MAC, and a last field not followed by a MAC must
+ * be at least 28 bytes, so it cannot be mistaken for one.
+ *
+ * NTP_Ext_Next() walks the fields where they are, and leaves it->off
+ * at the MAC, or the end, when it returns zero.
+ */
+
+static int
+ntp_ext_is_mac(size_t len)
+{
+
+	return (len == 4 || len == 20 || len == 24);
+}
+
+void
+NTP_Ext_Iter(struct ntp_ext_iter *it, const void *ptr, size_t len,
+    size_t off)
+{
+
+	AN(ptr);
+	assert(off <= len);
+	INIT_OBJ(it, NTP_EXT_ITER_MAGIC);
+	it->ptr = ptr;
+	it->len = len;
+	it->off = off;
+}
+
+/* Returns 1 for a field, 0 at the MAC or end, -1 if malformed */
+
+int
+NTP_Ext_Next(struct ntp_ext_iter *it, struct ntp_ext *ef)
+{
+	size_t r, l;
+
+	CHECK_OBJ_NOTNULL(it, NTP_EXT_ITER_MAGIC);
+	AN(ef);
+	r = it->len - it->off;
+	if (r == 0 || ntp_ext_is_mac(r))
+		return (0);
+	if (r < 16)
+		return (-1);
+	l = Be16dec(it->ptr + it->off + 2);
+	if (l < 16 || (l & 3) || l > r)
+		return (-1);
+	ef->type = Be16dec(it->ptr + it->off);
+	ef->off = it->off;
+	ef->body = it->ptr + it->off + 4;
+	ef->len = l - 4;
+	it->off += l;
+	return (1);
+}
+
+/*
+ * Check the fields of a packet in one pass.
+ * Returns the offset of the MAC (len if none), or -1 if malformed.
+ */
+
+ssize_t
+NTP_Ext_Validate(const void *ptr, size_t len, unsigned *nfield)
+{
+	struct ntp_ext_iter it;
+	struct ntp_ext ef;
+	unsigned n = 0;
+	int i;
+
+	if (len < 48 || (len & 3))
+		return (-1);
+	NTP_Ext_Iter(&it, ptr, len, 48);
+	while ((i = NTP_Ext_Next(&it, &ef)) > 0)
+		n++;
+	if (i < 0)
+		return (-1);
+	if (nfield != NULL)
+		*nfield = n;
+	return ((ssize_t)it.off);
+}
+
+/*
+ * Fields are appended to the caller's buffer, after the len bytes
+ * already in it.  NTP_Ext_Reserve() returns the (zeroed) value of the
+ * field for the caller to fill in, so large fields need not be built
+ * elsewhere first.  If the buffer runs out, all further calls fail and
+ * NTP_Ext_Finish() returns zero.
+ */
+
+void
+NTP_Ext_Build(struct ntp_ext_build *eb, void *ptr, size_t len, size_t size)
+{
+
+	AN(ptr);
+	assert(len >= 48 && !(len & 3));
+	assert(len <= size);
+	INIT_OBJ(eb, NTP_EXT_BUILD_MAGIC);
+	eb->ptr = ptr;
+	eb->len = len;
+	eb->size = size;
+}
+
+uint8_t *
+NTP_Ext_Reserve(struct ntp_ext_build *eb, unsigned type, size_t vlen)
+{
+	uint8_t *p;
+	size_t l;
+
+	CHECK_OBJ_NOTNULL(eb, NTP_EXT_BUILD_MAGIC);
+	assert(type <= 0xffff);
+	l = 4 + ((vlen + 3) & ~(size_t)3);
+	if (l < 16)
+		l = 16;
+	if (eb->full || l > 0xffff || l > eb->size - eb->len) {
+		eb->full = 1;
+		return (NULL);
+	}
+	p = eb->ptr + eb->len;
+	Be16enc(p, (uint16_t)type);
+	Be16enc(p + 2, (uint16_t)l);
+	memset(p + 4, 0, l - 4);
+	eb->last = eb->len;
+	eb->len += l;
+	return (p + 4);
+}
+
+/* A NULL value is all zeros */
+
+int
+NTP_Ext_Add(struct ntp_ext_build *eb, unsigned type, const void *ptr,
+    size_t vlen)
+{
+	uint8_t *p;
+
+	p = NTP_Ext_Reserve(eb, type, vlen);
+	if (p == NULL)
+		return (-1);
+	if (ptr != NULL)
+		memcpy(p, ptr, vlen);
+	return (0);
+}
+
+/*
+ * Returns the length of the packet, or zero if it did not fit.
+ * Unless a MAC is going to follow, the last field is padded to 28.
+ */
+
+size_t
+NTP_Ext_Finish(struct ntp_ext_build *eb, int mac)
+{
+	size_t l;
+
+	CHECK_OBJ_NOTNULL(eb, NTP_EXT_BUILD_MAGIC);
+	if (eb->full)
+		return (0);
+	l = eb->len - eb->last;
+	if (!mac && eb->last > 0 && l < 28) {
+		if (eb->size - eb->len < 28 - l)
+			return (0);
+		memset(eb->ptr + eb->len, 0, 28 - l);
+		Be16enc(eb->ptr + eb->last + 2, 28);
+		eb->len += 28 - l;
+	}
+	return (eb->len);
+}
+
 /**********************************************************************
  * Putting a NTP packet apart in a safe, byte-order agnostic manner
  */
@@ -178,8 +364,91 @@ NTP_Packet_Pack(void *ptr, ssize_t len, struct ntp_packet *np)
 	TB_Now(&np->ntp_transmit);
 	ts_2ntp64(pbuf + 40, &np->ntp_transmit);
 
-	/* Reverse again, to avoid subsequent trouble from rounding. */
+	/*
+	 * Reverse again, to avoid subsequent trouble from rounding.
+	 * Interleaved mode (ntp_peer.c) matches on the receive timestamp.
+	 */
+	ntp64_2ts(&np->ntp_origin, pbuf + 24);
+	ntp64_2ts(&np->ntp_receive, pbuf + 32);
 	ntp64_2ts(&np->ntp_transmit, pbuf + 40);
 
 	return (48);
 }
+
+/*
+ * In interleaved mode the transmit timestamp is not "now", but when the
+ * previous packet actually left.  Must be done before any MAC or NTS.
+ */
+
+void
+NTP_Packet_Transmit(void *ptr, const struct timestamp *ts)
+{
+
+	AN(ptr);
+	ts_2ntp64((uint8_t *)ptr + 40, ts);
+}
+
+/**********************************************************************
+ * Extension fields, built, walked and broken
+ */
+
+void
+NTP_Packet_RunTest(struct ocx *ocx)
+{
+	struct ntp_ext_build eb;
+	struct ntp_ext_iter it;
+	struct ntp_ext ef;
+	struct ntp_packet np;
+	uint8_t buf[256];
+	unsigned n;
+	size_t l;
+	int nf = 0;
+
+	memset(buf, 0, sizeof buf);
+	buf[0] = 0x23;
+
+	/* Without a MAC, the last field is padded to 28 */
+	NTP_Ext_Build(&eb, buf, 48, sizeof buf);
+	AZ(NTP_Ext_Add(&eb, 0x0104, "0123456789abcdef0123456789abcdef", 32));
+	AZ(NTP_Ext_Add(&eb, 0x0200, "12345", 5));
+	l = NTP_Ext_Finish(&eb, 0);
+	nf += l != 48 + 36 + 28;
+	nf += NTP_Ext_Validate(buf, l, &n) != (ssize_t)l || n != 2;
+	NTP_Ext_Iter(&it, buf, l, 48);
+	nf += NTP_Ext_Next(&it, &ef) != 1 || ef.type != 0x0104 ||
+	    ef.off != 48 || ef.len != 32 || memcmp(ef.body, "0123", 4);
+	nf += NTP_Ext_Next(&it, &ef) != 1 || ef.type != 0x0200 ||
+	    ef.len != 24 || memcmp(ef.body, "12345\0\0\0", 8);
+	nf += NTP_Ext_Next(&it, &ef) != 0 || it.off != l;
+
+	/* With a MAC it is not */
+	NTP_Ext_Build(&eb, buf, 48, sizeof buf);
+	AZ(NTP_Ext_Add(&eb, 0x0104, "0123456789abcdef0123456789abcdef", 32));
+	AZ(NTP_Ext_Add(&eb, 0x0200, NULL, 0));
+	l = NTP_Ext_Finish(&eb, 1);
+	nf += l != 48 + 36 + 16;
+	nf += NTP_Ext_Validate(buf, l + 20, &n) != (ssize_t)l || n != 2;
+	nf += NTP_Packet_Unpack(&np, buf, (ssize_t)l + 20) == NULL;
+	nf += np.ntp_next != 2 || np.ntp_extlen != 52 || np.ntp_maclen != 16;
+	nf += NTP_Ext_Validate(buf, 48 + 4, &n) != 48 || n != 0;
+
+	/* Broken lengths */
+	nf += NTP_Ext_Validate(buf, 48 + 8, NULL) != -1;
+	nf += NTP_Ext_Validate(buf, l + 2, NULL) != -1;
+	buf[48 + 3] = 18;
+	nf += NTP_Ext_Validate(buf, l, NULL) != -1;
+	buf[48 + 3] = 12;
+	nf += NTP_Ext_Validate(buf, l, NULL) != -1;
+	buf[48 + 3] = 200;
+	nf += NTP_Ext_Validate(buf, l, NULL) != -1;
+	nf += NTP_Packet_Unpack(&np, buf, (ssize_t)l) != NULL;
+
+	/* Out of room */
+	NTP_Ext_Build(&eb, buf, 48, 80);
+	nf += NTP_Ext_Add(&eb, 0x0104, NULL, 32) != -1;
+	nf += NTP_Ext_Reserve(&eb, 0x0104, 0) != NULL;
+	nf += NTP_Ext_Finish(&eb, 1) != 0;
+
+	Debug(ocx, "NTP_Packet_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
@@ -35,6 +35,39 @@
 #include "udp.h"
 #include "ntp.h"
 
+/*
+ * Interleaved basic mode
+ * ----------------------
+ *
+ * The transmit timestamp a server puts in its reply is necessarily
+ * taken before the reply is sent, and so is ours in the request, so
+ * whatever time the packets spend getting out of the two hosts ends
+ * up as delay, and as often as not, asymmetric delay.
+ *
+ * In interleaved mode (draft-ietf-ntp-interleaved-modes) the request
+ * carries the server's receive timestamp and our receive timestamp
+ * from the previous exchange, in its origin and receive fields.  If the
+ * server still remembers that exchange, it answers with our receive
+ * timestamp as origin and the time its previous reply actually left
+ * as transmit.  Together with when our previous request actually left,
+ * which Udp_SendTimed() tells us, that is a full set of precise
+ * timestamps for the previous exchange, which is what the filter gets.
+ *
+ * A server which does not know about interleaved mode, or has forgotten
+ * us, answers in basic mode, which we take as usual.
+ */
+
+struct ntp_ileave {
+	unsigned		magic;
+#define NTP_ILEAVE_MAGIC	0x4e1ea7e5
+	int			valid;
+	struct timestamp	t1;	// Our request left
+	struct timestamp	t2;	// Server received it
+	struct timestamp	t4;	// We received the reply
+};
+
+static uint32_t ntp_peer_trace_id;
+
 struct ntp_peer *
 NTP_Peer_New(const char *hostname, const void *sa, unsigned salen)
 {
@@ -46,6 +79,7 @@ NTP_Peer_New(const char *hostname, const void *sa, unsigned salen)
 
 	ALLOC_OBJ(np, NTP_PEER_MAGIC);
 	AN(np);
+	np->trace_id = ++ntp_peer_trace_id;
 
 	np->sa_len = salen;
 	np->sa = calloc(1, np->sa_len);
@@ -98,42 +132,121 @@ NTP_Peer_Destroy(struct ntp_peer *np)
 	free(np->ip);
 	free(np->tx_pkt);
 	free(np->rx_pkt);
+	if (np->nts != NULL)
+		NTS_Destroy(&np->nts);
+	free(np->ileave);
 	FREE_OBJ(np);
 }
 
+void
+NTP_Peer_Interleave(struct ntp_peer *np)
+{
+
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	if (np->ileave != NULL)
+		return;
+	ALLOC_OBJ(np->ileave, NTP_ILEAVE_MAGIC);
+	AN(np->ileave);
+}
+
+/*
+ * Turn an interleaved reply (il->valid) into the previous exchange, as
+ * seen with precise transmit timestamps, and remember this exchange for
+ * the next.
+ */
+
+static void
+ntp_peer_ileave(struct ntp_ileave *il, struct ntp_packet *rxp,
+    const struct timestamp *t1)
+{
+	struct timestamp t2, t4;
+
+	CHECK_OBJ_NOTNULL(il, NTP_ILEAVE_MAGIC);
+	CHECK_OBJ_NOTNULL(rxp, NTP_PACKET_MAGIC);
+	t2 = rxp->ntp_receive;
+	t4 = rxp->ts_rx;
+	if (il->valid) {
+		rxp->ntp_origin = il->t1;
+		rxp->ntp_receive = il->t2;
+		rxp->ts_rx = il->t4;
+		rxp->ntp_interleaved = 1;
+	} else {
+		/* Basic mode, but at least our side is precise */
+		rxp->ntp_origin = *t1;
+	}
+	il->t1 = *t1;
+	il->t2 = t2;
+	il->t4 = t4;
+	il->valid = 1;
+}
+
 int
 NTP_Peer_Poll(struct ocx *ocx, const struct udp_socket *usc,
     const struct ntp_peer *np, double tmo)
 {
-	char buf[100];
+	char buf[NTP_MAXLEN];
 	size_t len;
 	struct sockaddr_storage rss;
 	socklen_t rssl;
+	const struct sockaddr *sa;
+	unsigned salen;
 	ssize_t l;
 	int i;
 	struct timestamp t0, t1, t2;
+	struct ntp_ileave *il;
+	enum ntp_auth a;
 	double d;
+	int ileave;
 
 	AN(usc);
 	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
 	assert(tmo > 0.0 && tmo <= 1.0);
 
+	il = np->ileave;
+	ileave = 0;
+	if (il != NULL) {
+		CHECK_OBJ_NOTNULL(il, NTP_ILEAVE_MAGIC);
+		ileave = il->valid;
+		if (ileave) {
+			np->tx_pkt->ntp_origin = il->t2;
+			np->tx_pkt->ntp_receive = il->t4;
+		} else {
+			INIT_OBJ(&np->tx_pkt->ntp_origin, TIMESTAMP_MAGIC);
+			INIT_OBJ(&np->tx_pkt->ntp_receive, TIMESTAMP_MAGIC);
+		}
+		/* Until we get a reply */
+		il->valid = 0;
+	}
+
+	sa = np->sa;
+	salen = np->sa_len;
 	len = NTP_Packet_Pack(buf, sizeof buf, np->tx_pkt);
+	if (np->nts != NULL) {
+		len = NTS_Request(ocx, np->nts, buf, len, sizeof buf);
+		if (len == 0)
+			return (0);
+		sa = NTS_Addr(np->nts, &salen);
+	} else if (np->key != NULL)
+		len = NTP_Auth_Sign(np->key, buf, len, sizeof buf);
 
-	l = Udp_Send(ocx, usc, np->sa, np->sa_len, buf, len);
+	if (il != NULL)
+		l = Udp_SendTimed(ocx, usc, sa, salen, buf, len, &t0);
+	else
+		l = Udp_Send(ocx, usc, sa, salen, buf, len);
 	if (l != (ssize_t)len) {
 		Debug(ocx, "Tx peer %s %s got %zd (%s)\n",
 		    np->hostname, np->ip, l, strerror(errno));
 		return (0);
 	}
 
-	(void)TB_Now(&t0);
+	if (il == NULL)
+		(void)TB_Now(&t0);
 
 	while (1) {
 		(void)TB_Now(&t1);
 		d = TS_Diff(&t1, &t0);
 
-		i = UdpTimedRx(ocx, usc, np->sa->sa_family, &rss, &rssl, &t2,
+		i = UdpTimedRx(ocx, usc, sa->sa_family, &rss, &rssl, &t2,
 		    buf, sizeof buf, tmo - d);
 
 		if (i == 0)
@@ -142,25 +255,49 @@ NTP_Peer_Poll(struct ocx *ocx, const struct udp_socket *usc,
 		if (i < 0)
 			Fail(ocx, 1, "Rx failed\n");
 
-		if (i != 48) {
-			Debug(ocx, "Rx peer %s %s got len=%d\n",
-			    np->hostname, np->ip, i);
+		/* Ignore packets from other hosts */
+		if (!SA_Equal(sa, salen, &rss, rssl))
 			continue;
+
+		if (np->nts != NULL) {
+			a = NTS_Reply(ocx, np->nts, buf, (size_t)i);
+			if (a != NTP_AUTH_OK) {
+				Debug(ocx, "Rx peer %s %s NTS failed (%d)\n",
+				    np->hostname, np->ip, (int)a);
+				if (a == NTP_AUTH_NAK)
+					return (0);
+				continue;
+			}
+		} else if (np->key != NULL) {
+			a = NTP_Auth_Check(np->key, buf, (size_t)i);
+			if (a != NTP_AUTH_OK) {
+				Debug(ocx, "Rx peer %s %s auth failed (%d)\n",
+				    np->hostname, np->ip, (int)a);
+				continue;
+			}
 		}
 
-		/* Ignore packets from other hosts */
-		if (!SA_Equal(np->sa, np->sa_len, &rss, rssl))
+		if (NTP_Packet_Unpack(np->rx_pkt, buf, i) == NULL) {
+			Debug(ocx, "Rx peer %s %s got len=%d\n",
+			    np->hostname, np->ip, i);
 			continue;
-
-		AN(NTP_Packet_Unpack(np->rx_pkt, buf, i));
+		}
 		np->rx_pkt->ts_rx = t2;
 
-		/* Ignore packets which are not replies to our packet */
+		/* A reply to our packet in basic mode... */
 		if (TS_Diff(&np->tx_pkt->ntp_transmit,
-		    &np->rx_pkt->ntp_origin) != 0.0) {
-			continue;
+		    &np->rx_pkt->ntp_origin) == 0.0) {
+			if (il != NULL)
+				ntp_peer_ileave(il, np->rx_pkt, &t0);
+			return (1);
 		}
 
-		return (1);
+		/* ...or in interleaved mode, otherwise ignore it */
+		if (ileave && TS_Diff(&np->tx_pkt->ntp_receive,
+		    &np->rx_pkt->ntp_origin) == 0.0) {
+			il->valid = 1;
+			ntp_peer_ileave(il, np->rx_pkt, &t0);
+			return (1);
+		}
 	}
 }
@@ -36,9 +36,14 @@
  * the same IP# is trivial, multihomed servers can be spotted on
  * {stratum,refid,reftime} triplet.
  *
+ * Peers are hashed both on sockaddr and on {hostname, IP#}, so that
+ * spotting duplicates, matching replies and finding simulated peers
+ * does not get slower as the set grows.
+ *
  */
 
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
@@ -54,8 +59,18 @@ struct ntp_group {
 
 	char				*hostname;
 	int				npeer;
+	int				maxpeer;
+	int				removed;
+
+	/* Asynchronous re-lookup, protected by herd_mtx */
+	int				resolving;
+	int				resolved;
+	int				gai_error;
+	struct addrinfo			*res0;
 };
 
+TAILQ_HEAD(ntp_peer_head, ntp_peer);
+
 struct ntp_peerset {
 	unsigned			magic;
 #define NTP_PEERSET_MAGIC		0x0bf873d0
@@ -63,16 +78,146 @@ struct ntp_peerset {
 	TAILQ_HEAD(,ntp_peer)		head;
 	int				npeer;
 
+	unsigned			hash_mask;
+	struct ntp_peer_head		*sa_hash;
+	struct ntp_peer_head		*name_hash;
+
 	TAILQ_HEAD(,ntp_group)		group;
 	int				ngroup;
 
 	struct udp_socket		*usc;
+	struct todolist			*tdl;
 	double				t0;
 	double				init_duration;
 	double				poll_period;
 	double				init_packets;
+
+	ntp_peerset_f			*attach;
+	ntp_peerset_f			*detach;
+	void				*hook_priv;
+	struct ntp_group		*herd_next;
+
+	uintptr_t			poll_hdl;
+	uintptr_t			herd_hdl;
 };
 
+static pthread_mutex_t herd_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static todo_f ntp_peerset_poll;
+
+/**********************************************************************
+ * Hash indices
+ */
+
+static uint32_t
+ntp_peerset_namehash(const char *hostname, const char *ip)
+{
+	uint32_t h = 2166136261U;
+	const char *p;
+
+	for (p = hostname; *p != '\0'; p++)
+		h = (h ^ (uint8_t)*p) * 16777619U;
+	h *= 16777619U;
+	for (p = ip; *p != '\0'; p++)
+		h = (h ^ (uint8_t)*p) * 16777619U;
+	return (h);
+}
+
+static void
+ntp_peerset_rehash(struct ntp_peerset *nps, unsigned nbucket)
+{
+	struct ntp_peer *np;
+	unsigned u;
+
+	assert(nbucket > 0 && (nbucket & (nbucket - 1)) == 0);
+	free(nps->sa_hash);
+	free(nps->name_hash);
+	nps->sa_hash = calloc(nbucket, sizeof *nps->sa_hash);
+	AN(nps->sa_hash);
+	nps->name_hash = calloc(nbucket, sizeof *nps->name_hash);
+	AN(nps->name_hash);
+	for (u = 0; u < nbucket; u++) {
+		TAILQ_INIT(&nps->sa_hash[u]);
+		TAILQ_INIT(&nps->name_hash[u]);
+	}
+	nps->hash_mask = nbucket - 1;
+	TAILQ_FOREACH(np, &nps->head, list) {
+		TAILQ_INSERT_TAIL(&nps->sa_hash[np->sa_hash & nps->hash_mask],
+		    np, sa_list);
+		TAILQ_INSERT_TAIL(
+		    &nps->name_hash[np->name_hash & nps->hash_mask],
+		    np, name_list);
+	}
+}
+
+/* The peer must already be on the nps->head list */
+static void
+ntp_peerset_hash_add(struct ntp_peerset *nps, struct ntp_peer *np)
+{
+
+	if ((unsigned)nps->npeer > nps->hash_mask + 1) {
+		ntp_peerset_rehash(nps, 2 * (nps->hash_mask + 1));
+		return;
+	}
+	TAILQ_INSERT_TAIL(&nps->sa_hash[np->sa_hash & nps->hash_mask],
+	    np, sa_list);
+	TAILQ_INSERT_TAIL(&nps->name_hash[np->name_hash & nps->hash_mask],
+	    np, name_list);
+}
+
+static void
+ntp_peerset_hash_del(struct ntp_peerset *nps, struct ntp_peer *np)
+{
+
+	TAILQ_REMOVE(&nps->sa_hash[np->sa_hash & nps->hash_mask],
+	    np, sa_list);
+	TAILQ_REMOVE(&nps->name_hash[np->name_hash & nps->hash_mask],
+	    np, name_list);
+}
+
+/**********************************************************************
+ * Find a peer by address.  If the address is duplicated, any one of
+ * the duplicates may be returned.
+ */
+
+struct ntp_peer *
+NTP_PeerSet_FindSa(const struct ntp_peerset *nps, const void *sa,
+    unsigned salen)
+{
+	struct ntp_peer *np;
+	uint32_t h;
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	h = SA_Hash(sa, salen);
+	TAILQ_FOREACH(np, &nps->sa_hash[h & nps->hash_mask], sa_list)
+		if (np->sa_hash == h &&
+		    SA_Equal(np->sa, np->sa_len, sa, salen))
+			return (np);
+	return (NULL);
+}
+
+/**********************************************************************
+ * Find a peer by the {hostname, IP#} it was configured with.
+ */
+
+struct ntp_peer *
+NTP_PeerSet_FindName(const struct ntp_peerset *nps, const char *hostname,
+    const char *ip)
+{
+	struct ntp_peer *np;
+	uint32_t h;
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	AN(hostname);
+	AN(ip);
+	h = ntp_peerset_namehash(hostname, ip);
+	TAILQ_FOREACH(np, &nps->name_hash[h & nps->hash_mask], name_list)
+		if (np->name_hash == h && !strcmp(np->hostname, hostname) &&
+		    !strcmp(np->ip, ip))
+			return (np);
+	return (NULL);
+}
+
 /**********************************************************************/
 
 struct ntp_peerset *
@@ -86,6 +231,7 @@ NTP_PeerSet_New(struct ocx *ocx)
 
 	TAILQ_INIT(&nps->head);
 	TAILQ_INIT(&nps->group);
+	ntp_peerset_rehash(nps, 16);
 	return (nps);
 }
 
@@ -110,56 +256,133 @@ NTP_PeerSet_IterN(const struct ntp_peerset *nps, const struct ntp_peer *np)
 	return (TAILQ_NEXT(np, list));
 }
 
+/**********************************************************************
+ * Register functions to be called when the herd admits or retires a
+ * peer, so the caller can hook up (and tear down) filters and combiners.
+ *
+ * Without these, the set stays exactly as it was configured.
+ */
+
+void
+NTP_PeerSet_Hooks(struct ntp_peerset *nps, ntp_peerset_f *attach,
+    ntp_peerset_f *detach, void *priv)
+{
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	nps->attach = attach;
+	nps->detach = detach;
+	nps->hook_priv = priv;
+}
+
 /**********************************************************************/
 
+static struct addrinfo *
+ntp_peerset_lookup(const char *lookup, int *error)
+{
+	struct addrinfo hints, *res0;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	res0 = NULL;
+	*error = getaddrinfo(lookup, "ntp", &hints, &res0);
+	if (*error)
+		return (NULL);
+	return (res0);
+}
+
+static struct ntp_peer *
+ntp_peerset_addpeer(struct ocx *ocx, struct ntp_peerset *nps,
+    struct ntp_group *ng, const struct addrinfo *res)
+{
+	struct ntp_peer *np, *np2;
+
+	np = NTP_Peer_New(ng->hostname, res->ai_addr, res->ai_addrlen);
+	AN(np);
+	np->sa_hash = SA_Hash(np->sa, np->sa_len);
+	np->name_hash = ntp_peerset_namehash(np->hostname, np->ip);
+	np2 = NTP_PeerSet_FindSa(nps, np->sa, np->sa_len);
+	if (np2 != NULL) {
+		/* All duplicates point to the same "master" */
+		np->state = NTP_STATE_DUPLICATE;
+		np->other = np2->other;
+		if (np->other == NULL)
+			np->other = np2;
+		TAILQ_INSERT_TAIL(&nps->head, np, list);
+		Debug(ocx, "Peer {%s %s} is duplicate of {%s %s}\n",
+		    np->hostname, np->ip, np2->hostname, np2->ip);
+	} else {
+		np->state = NTP_STATE_NEW;
+		TAILQ_INSERT_HEAD(&nps->head, np, list);
+	}
+	nps->npeer++;
+	ntp_peerset_hash_add(nps, np);
+	np->group = ng;
+	ng->npeer++;
+	return (np);
+}
+
 static int
 ntp_peerset_fillgroup(struct ocx *ocx, struct ntp_peerset *nps,
     struct ntp_group *ng, const char *lookup)
 {
-	struct addrinfo hints, *res, *res0;
+	struct addrinfo *res, *res0;
 	int error, n = 0;
-	struct ntp_peer *np, *np2;
 
 	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
 	CHECK_OBJ_NOTNULL(ng, NTP_GROUP_MAGIC);
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	error = getaddrinfo(lookup, "ntp", &hints, &res0);
+	res0 = ntp_peerset_lookup(lookup, &error);
 	if (error)
 		Fail(ocx, 1, "hostname '%s', port 'ntp': %s\n",
 		    lookup, gai_strerror(error));
 	for (res = res0; res; res = res->ai_next) {
 		if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
 			continue;
-		np = NTP_Peer_New(ng->hostname, res->ai_addr, res->ai_addrlen);
-		AN(np);
-		TAILQ_FOREACH(np2, &nps->head, list)
-			if (SA_Equal(np->sa, np->sa_len, np2->sa, np2->sa_len))
-				break;
-		if (np2 != NULL) {
-			/* All duplicates point to the same "master" */
-			np->state = NTP_STATE_DUPLICATE;
-			np->other = np2->other;
-			if (np->other == NULL)
-				np->other = np2;
-			TAILQ_INSERT_TAIL(&nps->head, np, list);
-			Debug(ocx, "Peer {%s %s} is duplicate of {%s %s}\n",
-			    np->hostname, np->ip, np2->hostname, np2->ip);
-		} else {
-			np->state = NTP_STATE_NEW;
-			TAILQ_INSERT_HEAD(&nps->head, np, list);
-		}
-		nps->npeer++;
-		np->group = ng;
-		ng->npeer++;
+		(void)ntp_peerset_addpeer(ocx, nps, ng, res);
 		n++;
 	}
 	freeaddrinfo(res0);
+	if (ng->maxpeer < ng->npeer)
+		ng->maxpeer = ng->npeer;
 	return (n);
 }
 
+/**********************************************************************
+ * Remove a peer from the set, handing the "master" role to the first
+ * of its duplicates, if any.
+ */
+
+static void
+ntp_peerset_retire(struct ocx *ocx, struct ntp_peerset *nps,
+    struct ntp_peer *np)
+{
+	struct ntp_peer *np2, *master = NULL;
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+
+	Debug(ocx, "Retiring peer {%s %s}\n", np->hostname, np->ip);
+	TAILQ_REMOVE(&nps->head, np, list);
+	ntp_peerset_hash_del(nps, np);
+	TAILQ_FOREACH(np2, &nps->head, list) {
+		if (np2->other != np)
+			continue;
+		if (master == NULL) {
+			master = np2;
+			np2->other = NULL;
+			np2->state = NTP_STATE_NEW;
+		} else {
+			np2->other = master;
+		}
+	}
+	nps->npeer--;
+	np->group->npeer--;
+	if (nps->detach != NULL)
+		nps->detach(ocx, np, nps->hook_priv);
+	NTP_Peer_Destroy(np);
+}
+
 /**********************************************************************/
 
 static struct ntp_group *
@@ -208,7 +431,7 @@ NTP_PeerSet_Add(struct ocx *ocx, struct ntp_peerset *nps, const char *hostname)
 	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
 
 	TAILQ_FOREACH(ng, &nps->group, list)
-		if (!strcasecmp(ng->hostname, hostname))
+		if (!ng->removed && !strcasecmp(ng->hostname, hostname))
 			Fail(ocx, 0, "hostname %s is duplicated\n", hostname);
 
 	ng = ntp_peerset_add_group(nps, hostname);
@@ -219,10 +442,142 @@ NTP_PeerSet_Add(struct ocx *ocx, struct ntp_peerset *nps, const char *hostname)
 	return (ng->npeer);
 }
 
+/**********************************************************************
+ * Add and remove groups while running (see control.c).
+ *
+ * Unlike NTP_PeerSet_Add() these explain trouble on the ocx and return
+ * -1 rather than Fail().  Removed groups stay on the list, marked as
+ * such, because a herd lookup may still be running for them.
+ *
+ * XXX: The lookup blocks the todo-list, like it does at startup.
+ */
+
+int
+NTP_PeerSet_Insert(struct ocx *ocx, struct ntp_peerset *nps,
+    const char *hostname)
+{
+	struct ntp_group *ng;
+	struct addrinfo *res, *res0;
+	struct ntp_peer *np;
+	int error;
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	AN(hostname);
+
+	TAILQ_FOREACH(ng, &nps->group, list)
+		if (!strcasecmp(ng->hostname, hostname))
+			break;
+	if (ng != NULL && !ng->removed) {
+		Put(ocx, OCX_DIAG, "hostname %s is already a peer\n",
+		    hostname);
+		return (-1);
+	}
+
+	res0 = ntp_peerset_lookup(hostname, &error);
+	if (error) {
+		Put(ocx, OCX_DIAG, "hostname '%s', port 'ntp': %s\n",
+		    hostname, gai_strerror(error));
+		return (-1);
+	}
+
+	if (ng == NULL)
+		ng = ntp_peerset_add_group(nps, hostname);
+	CHECK_OBJ_NOTNULL(ng, NTP_GROUP_MAGIC);
+	ng->removed = 0;
+	for (res = res0; res; res = res->ai_next) {
+		if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+			continue;
+		np = ntp_peerset_addpeer(ocx, nps, ng, res);
+		Debug(ocx, "Adding peer {%s %s}\n", np->hostname, np->ip);
+		if (nps->attach != NULL)
+			nps->attach(ocx, np, nps->hook_priv);
+	}
+	freeaddrinfo(res0);
+	ng->maxpeer = ng->npeer;
+	if (ng->npeer == 0) {
+		Put(ocx, OCX_DIAG, "hostname %s no IP# found.\n", hostname);
+		ng->removed = 1;
+		return (-1);
+	}
+
+	/* Polling stops when the set runs empty */
+	if (nps->tdl != NULL && nps->poll_hdl == 0)
+		nps->poll_hdl = TODO_ScheduleRel(nps->tdl, ntp_peerset_poll,
+		    nps, 0.0, 0.0, "NTP_PeerSet Poll");
+	return (ng->npeer);
+}
+
+int
+NTP_PeerSet_Remove(struct ocx *ocx, struct ntp_peerset *nps,
+    const char *hostname)
+{
+	struct ntp_group *ng;
+	struct ntp_peer *np, *np2;
+	int n = 0;
+
+	CHECK_OBJ_NOTNULL(nps, NTP_PEERSET_MAGIC);
+	AN(hostname);
+
+	TAILQ_FOREACH(ng, &nps->group, list)
+		if (!ng->removed && !strcasecmp(ng->hostname, hostname))
+			break;
+	if (ng == NULL) {
+		Put(ocx, OCX_DIAG, "hostname %s is not a peer\n", hostname);
+		return (-1);
+	}
+	TAILQ_FOREACH_SAFE(np, &nps->head, list, np2) {
+		if (np->group != ng)
+			continue;
+		ntp_peerset_retire(ocx, nps, np);
+		n++;
+	}
+	AZ(ng->npeer);
+	ng->maxpeer = 0;
+	ng->removed = 1;
+	return (n);
+}
+
+/**********************************************************************
+ * Keep score of replies.  A peer which answers again is no longer
+ * unresponsive, and must not be retired by the herd as if it were.
+ */
+
+static void
+ntp_peerset_tally(struct ntp_peer *np, int replied)
+{
+
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	if (replied) {
+		np->nmiss = 0;
+		if (np->state == NTP_STATE_UNRESPONSIVE)
+			np->state = NTP_STATE_NEW;
+	} else if (++np->nmiss >= 8) {		// XXX param
+		np->state = NTP_STATE_UNRESPONSIVE;
+	}
+}
+
 /**********************************************************************
  * This function is responsible for polling the peers in the set.
  */
 
+/*
+ * Skip the peer's turn if it told us to slow down, or is fed by
+ * broadcasts, see ntp_filter.c.  A Kiss-o'-Death backoff holds for
+ * every poll until it decays, not just the one after the kiss.
+ */
+
+static int
+ntp_peerset_skip(struct ntp_peer *np)
+{
+
+	if (np->poll_skip > 0) {
+		np->poll_skip--;
+		return (1);
+	}
+	np->poll_skip = (1U << np->kod_backoff) - 1;
+	return (0);
+}
+
 static enum todo_e __match_proto__(todo_f)
 ntp_peerset_poll(struct ocx *ocx, struct todolist *tdl, void *priv)
 {
@@ -235,8 +590,10 @@ ntp_peerset_poll(struct ocx *ocx, struct todolist *tdl, void *priv)
 	AN(tdl);
 
 	np = TAILQ_FIRST(&nps->head);
-	if (np == NULL)
+	if (np == NULL) {
+		nps->poll_hdl = 0;
 		return(TODO_DONE);
+	}
 
 	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
 	TAILQ_REMOVE(&nps->head, np, list);
@@ -250,37 +607,161 @@ ntp_peerset_poll(struct ocx *ocx, struct todolist *tdl, void *priv)
 			d = nps->t0 * dt - nps->t0;
 	}
 	nps->t0 += d;
-	TODO_ScheduleRel(tdl, ntp_peerset_poll, nps, d, 0.0, "NTP_PeerSet");
+	TODO_RescheduleRel(tdl, nps->poll_hdl, d);
+	if (ntp_peerset_skip(np))
+		return (TODO_OK);
 	if (NTP_Peer_Poll(ocx, nps->usc, np, 0.8)) {
+		ntp_peerset_tally(np, 1);
 		if (np->filter_func != NULL)
 			np->filter_func(ocx, np);
+	} else {
+		ntp_peerset_tally(np, 0);
 	}
 
 	return (TODO_OK);
 }
 
 /**********************************************************************
- * This function will be responsible for maintaining the peers in the set
+ * The herd keeps the set current by re-resolving one group at a time
+ * and, once the answer is in, retiring peers which are both unresponsive
+ * and no longer in the DNS, and admitting new IP#s to fill the holes.
+ *
+ * The lookups run on a thread of their own, so a slow or dead DNS server
+ * can never hold up polling.  The result is parked in the group and
+ * picked up at the next herd tick.
  *
  * XXX: Pick only the best N (3?) servers from any hostname as active.
- * XXX: Re-lookup hostnames on periodic basis to keep the set current
  * XXX: Implement (a future) pool.ntp.org load-balancing protocol
  */
 
-static enum todo_e
+static void *
+ntp_peerset_resolver(void *priv)
+{
+	struct ntp_group *ng;
+	struct addrinfo *res0;
+	int error;
+
+	CAST_OBJ_NOTNULL(ng, priv, NTP_GROUP_MAGIC);
+	res0 = ntp_peerset_lookup(ng->hostname, &error);
+	AZ(pthread_mutex_lock(&herd_mtx));
+	ng->res0 = res0;
+	ng->gai_error = error;
+	ng->resolved = 1;
+	AZ(pthread_mutex_unlock(&herd_mtx));
+	return (NULL);
+}
+
+static void
+ntp_peerset_merge(struct ocx *ocx, struct ntp_peerset *nps,
+    struct ntp_group *ng, const struct addrinfo *res0)
+{
+	const struct addrinfo *res;
+	struct ntp_peer *np, *np2;
+	uint32_t h;
+
+	/* Retire the dead which DNS no longer vouches for */
+	TAILQ_FOREACH_SAFE(np, &nps->head, list, np2) {
+		if (np->group != ng || np->state != NTP_STATE_UNRESPONSIVE)
+			continue;
+		for (res = res0; res != NULL; res = res->ai_next)
+			if (SA_Equal(np->sa, np->sa_len,
+			    res->ai_addr, res->ai_addrlen))
+				break;
+		if (res == NULL)
+			ntp_peerset_retire(ocx, nps, np);
+	}
+
+	/* Admit newcomers, until the group is back at its original size */
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (ng->npeer >= ng->maxpeer)
+			break;
+		if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+			continue;
+		h = SA_Hash(res->ai_addr, res->ai_addrlen);
+		TAILQ_FOREACH(np, &nps->sa_hash[h & nps->hash_mask], sa_list)
+			if (np->group == ng && SA_Equal(np->sa, np->sa_len,
+			    res->ai_addr, res->ai_addrlen))
+				break;
+		if (np != NULL)
+			continue;
+		np = ntp_peerset_addpeer(ocx, nps, ng, res);
+		Debug(ocx, "Admitting peer {%s %s}\n", np->hostname, np->ip);
+		if (nps->attach != NULL)
+			nps->attach(ocx, np, nps->hook_priv);
+	}
+}
+
+static enum todo_e __match_proto__(todo_f)
 ntp_peerset_herd(struct ocx *ocx, struct todolist *tdl, void *priv)
 {
-	(void)ocx;
-	(void)tdl;
-	(void)priv;
-	return (TODO_DONE);
+	struct ntp_peerset *nps;
+	struct ntp_group *ng;
+	struct addrinfo *res0;
+	pthread_t thr;
+	int error, start;
+
+	AN(tdl);
+	CAST_OBJ_NOTNULL(nps, priv, NTP_PEERSET_MAGIC);
+
+	/* Merge whatever lookups have completed since last time */
+	TAILQ_FOREACH(ng, &nps->group, list) {
+		AZ(pthread_mutex_lock(&herd_mtx));
+		res0 = NULL;
+		error = 0;
+		if (ng->resolved) {
+			res0 = ng->res0;
+			error = ng->gai_error;
+			ng->res0 = NULL;
+			ng->resolved = 0;
+			ng->resolving = 0;
+		}
+		AZ(pthread_mutex_unlock(&herd_mtx));
+		if (ng->removed) {
+			if (res0 != NULL)
+				freeaddrinfo(res0);
+		} else if (error) {
+			Put(ocx, OCX_TRACE, "Herd %s lookup failed: %s\n",
+			    ng->hostname, gai_strerror(error));
+		} else if (res0 != NULL) {
+			ntp_peerset_merge(ocx, nps, ng, res0);
+			freeaddrinfo(res0);
+		}
+	}
+
+	/* Kick off the next lookup, round-robin over the groups */
+	ng = nps->herd_next;
+	if (ng == NULL)
+		ng = TAILQ_FIRST(&nps->group);
+	if (ng == NULL) {
+		nps->herd_hdl = 0;
+		return (TODO_DONE);
+	}
+	CHECK_OBJ_NOTNULL(ng, NTP_GROUP_MAGIC);
+	nps->herd_next = TAILQ_NEXT(ng, list);
+	if (ng->removed)
+		return (TODO_OK);
+
+	AZ(pthread_mutex_lock(&herd_mtx));
+	start = !ng->resolving;
+	ng->resolving = 1;
+	AZ(pthread_mutex_unlock(&herd_mtx));
+	if (!start)
+		return (TODO_OK);
+
+	if (pthread_create(&thr, NULL, ntp_peerset_resolver, ng)) {
+		Put(ocx, OCX_TRACE, "Herd %s could not start lookup\n",
+		    ng->hostname);
+		AZ(pthread_mutex_lock(&herd_mtx));
+		ng->resolving = 0;
+		AZ(pthread_mutex_unlock(&herd_mtx));
+		return (TODO_OK);
+	}
+	AZ(pthread_detach(thr));
+	return (TODO_OK);
 }
 
 /**********************************************************************/
 
-static uintptr_t poll_hdl;
-static uintptr_t herd_hdl;
-
 void
 NTP_PeerSet_Poll(struct ocx *ocx, struct ntp_peerset *nps,
     struct udp_socket *usc,
@@ -296,19 +777,123 @@ NTP_PeerSet_Poll(struct ocx *ocx, struct ntp_peerset *nps,
 	TAILQ_FOREACH(np, &nps->head, list)
 		np->state = NTP_STATE_NEW;
 	nps->usc = usc;
+	nps->tdl = tdl;
 	nps->t0 = 1.0;
 	nps->init_duration = 64.;
 	nps->init_packets = 6.;
 	nps->poll_period = 64.;
 
-	if (poll_hdl != 0)
-		TODO_Cancel(tdl, &poll_hdl);
-	poll_hdl = TODO_ScheduleRel(tdl, ntp_peerset_poll, nps, 0.0, 0.0,
-		"NTP_PeerSet Poll");
+	if (nps->poll_hdl != 0)
+		TODO_RescheduleRel(tdl, nps->poll_hdl, 0.0);
+	else
+		nps->poll_hdl = TODO_ScheduleRel(tdl, ntp_peerset_poll, nps,
+		    0.0, 0.0, "NTP_PeerSet Poll");
+
+	if (nps->herd_hdl != 0)
+		TODO_Cancel(tdl, &nps->herd_hdl);
+	if (nps->attach != NULL && nps->ngroup > 0)
+		nps->herd_hdl = TODO_ScheduleRel(tdl, ntp_peerset_herd, nps,
+		    15. * 60. / nps->ngroup, 15. * 60. / nps->ngroup,
+		    "NTP_PeerSet Herd");
+}
+
+/**********************************************************************/
+
+static void
+ntp_peerset_test_reply(struct ocx *ocx, struct ntp_peer *np, const char *kod)
+{
+	struct ntp_packet *rxp;
+
+	rxp = np->rx_pkt;
+	INIT_OBJ(rxp, NTP_PACKET_MAGIC);
+	rxp->ntp_version = 4;
+	rxp->ntp_mode = NTP_MODE_SERVER;
+	TB_Now(&rxp->ntp_origin);
+	rxp->ntp_reference = rxp->ntp_origin;
+	TS_Add(&rxp->ntp_reference, -1.0);
+	rxp->ntp_receive = rxp->ntp_origin;
+	TS_Add(&rxp->ntp_receive, 1e-3);
+	rxp->ntp_transmit = rxp->ntp_receive;
+	TS_Add(&rxp->ntp_transmit, 1e-5);
+	rxp->ts_rx = rxp->ntp_transmit;
+	TS_Add(&rxp->ts_rx, 1e-3);
+	if (kod != NULL) {
+		rxp->ntp_leap = NTP_LEAP_UNKNOWN;
+		rxp->ntp_stratum = 0;
+		memcpy(rxp->ntp_refid, kod, 4);
+	} else {
+		rxp->ntp_leap = NTP_LEAP_NONE;
+		rxp->ntp_stratum = 2;
+		memcpy(rxp->ntp_refid, "TEST", 4);
+	}
+	np->filter_func(ocx, np);
+}
+
+void
+NTP_PeerSet_RunTest(struct ocx *ocx)
+{
+	struct ntp_peerset *nps;
+	struct ntp_peer *np;
+	struct ntp_group *ng;
+	struct addrinfo *res0;
+	struct combiner cb;
+	unsigned u, npoll;
+	int error, nf = 0;
+
+	nps = NTP_PeerSet_New(ocx);
+	NTP_PeerSet_AddSim(ocx, nps, "pool.test", "192.0.2.1");
+	np = TAILQ_FIRST(&nps->head);
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	ng = np->group;
+	res0 = ntp_peerset_lookup("192.0.2.2", &error);
+	AZ(error);
+	AN(res0);
+
+	/* Dead, then back again: DNS rotating it out does not retire it */
+	for (u = 0; u < 8; u++)
+		ntp_peerset_tally(np, 0);
+	nf += np->state != NTP_STATE_UNRESPONSIVE;
+	ntp_peerset_tally(np, 1);
+	nf += np->state == NTP_STATE_UNRESPONSIVE;
+	nf += np->nmiss != 0;
+	ntp_peerset_merge(ocx, nps, ng, res0);
+	nf += nps->npeer != 1 || TAILQ_FIRST(&nps->head) != np;
+
+	/* Still dead: retired, and the newcomer takes its place */
+	for (u = 0; u < 8; u++)
+		ntp_peerset_tally(np, 0);
+	ntp_peerset_merge(ocx, nps, ng, res0);
+	np = TAILQ_FIRST(&nps->head);
+	nf += nps->npeer != 1 || np == NULL || strcmp(np->ip, "192.0.2.2");
+
+	freeaddrinfo(res0);
 
-	if (herd_hdl != 0)
-		TODO_Cancel(tdl, &herd_hdl);
-	herd_hdl = TODO_ScheduleRel(tdl, ntp_peerset_herd, nps,
-	    15. * 60. / nps->ngroup, 0.0, "NTP_PeerSet Herd");
+	/* Two RATE kisses: every 4th turn, while the replies are good */
+	INIT_OBJ(&cb, COMBINER_MAGIC);
+	np->combiner = &cb;
+	NF_New(np);
+	ntp_peerset_test_reply(ocx, np, "RATE");
+	ntp_peerset_test_reply(ocx, np, "RATE");
+	nf += np->kod_backoff != 2;
+	for (npoll = u = 0; u < 16; u++) {
+		if (ntp_peerset_skip(np))
+			continue;
+		npoll++;
+		ntp_peerset_test_reply(ocx, np, NULL);
+	}
+	nf += npoll != 4 || np->kod_backoff != 2;
+
+	/* ... and it decays, slowly */
+	for (npoll = u = 0; np->kod_backoff > 0 && u < 1000; u++) {
+		if (ntp_peerset_skip(np))
+			continue;
+		npoll++;
+		ntp_peerset_test_reply(ocx, np, NULL);
+	}
+	Debug(ocx, "KoD backoff gone after %u turns, %u polls\n", u, npoll);
+	nf += np->kod_backoff != 0 || npoll < 8;
+	NF_Destroy(np);
 
+	Debug(ocx, "NTP_PeerSet_RunTest: %d failures\n", nf);
+	AZ(nf);
 }
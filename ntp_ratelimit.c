@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Per source rate limiting
+ * ========================
+ *
+ * A token bucket per source address, in a fixed size table, so a flood
+ * from many addresses costs a bounded amount of memory and the check
+ * costs one cache line.  IPv4 sources are limited per address, IPv6
+ * sources per /64, since that is what one customer usually gets.
+ *
+ * The table is NTP_RATE_SETS sets of NTP_RATE_WAYS 16 byte entries,
+ * one set per (64 byte aligned) cache line.  An unknown source takes
+ * the least recently seen entry in its set, starting with a full
+ * bucket: under a flood of many sources, the limiter forgets rather
+ * than blocks, which errs on the side of answering.
+ *
+ * When the bucket is empty the first packet gets a Kiss-o'-Death
+ * (RFC 5905 section 7.4), which puts the bucket one packet in debt,
+ * and packets are dropped until the debt is paid back.  That way an
+ * abusive source gets at most one KoD per packet's worth of refill,
+ * and we never send more than we receive.
+ *
+ * The serving loop is single threaded, so there are no locks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ntimed.h"
+#include "ntimed_endian.h"
+#include "ntp.h"
+
+#define NTP_RATE_BITS		12
+#define NTP_RATE_SETS		(1U << NTP_RATE_BITS)
+#define NTP_RATE_WAYS		4
+#define NTP_RATE_ONE		256	// Tokens per packet
+#define NTP_RATE_HZ		1024	// Ticks per second
+#define NTP_RATE_MAXDT		(1U << 22)
+
+struct ntp_rate_ent {
+	uint64_t		key;
+	uint32_t		last;	// Ticks, zero if unused
+	int32_t			tokens;
+};
+
+struct ntp_ratelimit {
+	unsigned		magic;
+#define NTP_RATELIMIT_MAGIC	0x7a3c51e9
+	uint64_t		rate;	// Tokens per NTP_RATE_HZ seconds
+	int32_t			burst;	// Tokens
+	struct ntp_rate_ent	(*set)[NTP_RATE_WAYS];
+};
+
+struct ntp_ratelimit *
+NTP_RateLimit_New(double rate, unsigned burst)
+{
+	struct ntp_ratelimit *rl;
+	void *p;
+
+	assert(rate > 0.0);
+	assert(burst > 0 && burst < 65536);
+	assert(sizeof(struct ntp_rate_ent) * NTP_RATE_WAYS == 64);
+
+	ALLOC_OBJ(rl, NTP_RATELIMIT_MAGIC);
+	AN(rl);
+	rl->rate = (uint64_t)(rate * NTP_RATE_ONE + .5);
+	if (rl->rate == 0)
+		rl->rate = 1;
+	rl->burst = (int32_t)burst * NTP_RATE_ONE;
+	AZ(posix_memalign(&p, 64, NTP_RATE_SETS * sizeof *rl->set));
+	memset(p, 0, NTP_RATE_SETS * sizeof *rl->set);
+	rl->set = p;
+	return (rl);
+}
+
+void
+NTP_RateLimit_Destroy(struct ntp_ratelimit **rlp)
+{
+	struct ntp_ratelimit *rl;
+
+	AN(rlp);
+	rl = *rlp;
+	*rlp = NULL;
+	CHECK_OBJ_NOTNULL(rl, NTP_RATELIMIT_MAGIC);
+	free(rl->set);
+	FREE_OBJ(rl);
+}
+
+/* IPv4 (also when mapped) as ffffffff:addr, IPv6 as the /64 prefix */
+
+static uint64_t
+ntp_rate_key(const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin4;
+	const struct sockaddr_in6 *sin6;
+	const uint8_t *a;
+
+	if (sa->sa_family == AF_INET) {
+		sin4 = (const void *)sa;
+		a = (const uint8_t *)&sin4->sin_addr;
+	} else if (sa->sa_family == AF_INET6) {
+		sin6 = (const void *)sa;
+		a = sin6->sin6_addr.s6_addr;
+		if (!IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+			return (Be64dec(a));
+		a += 12;
+	} else
+		return (0);
+	return (0xffffffff00000000ULL | Be32dec(a));
+}
+
+enum ntp_rate
+NTP_RateLimit(struct ntp_ratelimit *rl, const void *sa,
+    const struct timestamp *ts)
+{
+	struct ntp_rate_ent *set, *e, *old;
+	uint64_t key, add;
+	uint32_t now, dt;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(rl, NTP_RATELIMIT_MAGIC);
+	AN(sa);
+	CHECK_OBJ_NOTNULL(ts, TIMESTAMP_MAGIC);
+
+	now = (uint32_t)(ts->sec * NTP_RATE_HZ + (ts->frac >> 54));
+	if (now == 0)
+		now = 1;
+	key = ntp_rate_key(sa);
+	set = rl->set[(key * 0x9e3779b97f4a7c15ULL) >> (64 - NTP_RATE_BITS)];
+
+	e = NULL;
+	old = &set[0];
+	for (u = 0; u < NTP_RATE_WAYS; u++) {
+		if (set[u].last != 0 && set[u].key == key) {
+			e = &set[u];
+			break;
+		}
+		if (set[u].last == 0 ||
+		    now - set[u].last > now - old->last)
+			old = &set[u];
+	}
+	if (e == NULL) {
+		e = old;
+		e->key = key;
+		e->tokens = rl->burst;
+	} else {
+		dt = now - e->last;
+		if (dt > NTP_RATE_MAXDT)
+			dt = NTP_RATE_MAXDT;
+		add = (dt * rl->rate) / NTP_RATE_HZ;
+		if (add >= (uint64_t)(rl->burst - e->tokens))
+			e->tokens = rl->burst;
+		else
+			e->tokens += (int32_t)add;
+	}
+	e->last = now;
+
+	if (e->tokens >= NTP_RATE_ONE) {
+		e->tokens -= NTP_RATE_ONE;
+		return (NTP_RATE_OK);
+	}
+	if (e->tokens >= 0) {
+		e->tokens -= NTP_RATE_ONE;
+		return (NTP_RATE_KOD);
+	}
+	return (NTP_RATE_DROP);
+}
+
+/**********************************************************************/
+
+void
+NTP_RateLimit_RunTest(struct ocx *ocx)
+{
+	struct ntp_ratelimit *rl;
+	struct sockaddr_storage a, b;
+	struct sockaddr_in *sin4;
+	struct sockaddr_in6 *sin6;
+	struct timestamp ts;
+	enum ntp_rate r[8];
+	unsigned u;
+	int nf = 0;
+
+	rl = NTP_RateLimit_New(1.0, 4);
+	memset(&a, 0, sizeof a);
+	sin4 = (void *)&a;
+	sin4->sin_family = AF_INET;
+	sin4->sin_addr.s_addr = htonl(0xc0000201);
+	memset(&b, 0, sizeof b);
+	sin6 = (void *)&b;
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr.s6_addr[0] = 0x20;
+	sin6->sin6_addr.s6_addr[1] = 0x01;
+
+	/* Burst of four, one KoD, then silence */
+	(void)TS_Nanosec(&ts, 1000000, 0);
+	for (u = 0; u < 8; u++)
+		r[u] = NTP_RateLimit(rl, &a, &ts);
+	for (u = 0; u < 4; u++)
+		nf += r[u] != NTP_RATE_OK;
+	nf += r[4] != NTP_RATE_KOD;
+	for (u = 5; u < 8; u++)
+		nf += r[u] != NTP_RATE_DROP;
+
+	/* Other sources are not affected, a /64 shares one bucket */
+	for (u = 0; u < 4; u++)
+		nf += NTP_RateLimit(rl, &b, &ts) != NTP_RATE_OK;
+	sin6->sin6_addr.s6_addr[15] = 1;
+	nf += NTP_RateLimit(rl, &b, &ts) != NTP_RATE_KOD;
+	sin4->sin_addr.s_addr = htonl(0xc0000202);
+	nf += NTP_RateLimit(rl, &a, &ts) != NTP_RATE_OK;
+	sin4->sin_addr.s_addr = htonl(0xc0000201);
+
+	/* Debt of one packet, so the second after gets a KoD again */
+	TS_Add(&ts, 1.0);
+	nf += NTP_RateLimit(rl, &a, &ts) != NTP_RATE_KOD;
+	TS_Add(&ts, 2.0);
+	nf += NTP_RateLimit(rl, &a, &ts) != NTP_RATE_OK;
+
+	/* Full again, not more */
+	TS_Add(&ts, 3600.0);
+	for (u = 0; u < 5; u++)
+		r[u] = NTP_RateLimit(rl, &a, &ts);
+	nf += r[3] != NTP_RATE_OK || r[4] != NTP_RATE_KOD;
+
+	NTP_RateLimit_Destroy(&rl);
+	AZ(rl);
+	Debug(ocx, "NTP_RateLimit_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
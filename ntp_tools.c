@@ -29,14 +29,18 @@
  *
  */
 
-#include <math.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
 #include "ntimed.h"
 #include "ntp.h"
 #include "ntimed_endian.h"
+#include "trace.h"
 
 /**********************************************************************
  * Build a standard client query packet
@@ -83,118 +87,262 @@ bxprintf(char **bp, const char *e, const char *fmt, ...)
 }
 
 void
-NTP_Tool_Format(char *p, ssize_t len, const struct ntp_packet *pkt)
+NTP_Tool_Fields(struct ntp_fields *nf, const struct ntp_packet *pkt)
+{
+
+	AN(nf);
+	CHECK_OBJ_NOTNULL(pkt, NTP_PACKET_MAGIC);
+
+	memset(nf, 0, sizeof *nf);
+	nf->leap = (unsigned)pkt->ntp_leap;
+	nf->version = pkt->ntp_version;
+	nf->mode = (unsigned)pkt->ntp_mode;
+	nf->stratum = pkt->ntp_stratum;
+	nf->poll = pkt->ntp_poll;
+	nf->precision = pkt->ntp_precision;
+	TS_ToNanosec(&pkt->ntp_delay, &nf->delay_sec, &nf->delay_nsec);
+	TS_ToNanosec(&pkt->ntp_dispersion, &nf->disp_sec, &nf->disp_nsec);
+	nf->refid = Be32dec(pkt->ntp_refid);
+	nf->reference = TS_Diff(&pkt->ntp_reference, &pkt->ntp_origin);
+	TS_ToNanosec(&pkt->ntp_origin, &nf->origin_sec, &nf->origin_nsec);
+	nf->receive = TS_Diff(&pkt->ntp_receive, &pkt->ntp_origin);
+	nf->transmit = TS_Diff(&pkt->ntp_transmit, &pkt->ntp_receive);
+	if (pkt->ts_rx.sec && pkt->ts_rx.frac)
+		nf->ts_rx = TS_Diff(&pkt->ts_rx, &pkt->ntp_transmit);
+	else
+		nf->ts_rx = 0.0;
+}
+
+void
+NTP_Tool_FormatFields(char *p, ssize_t len, const struct ntp_fields *nf)
 {
 	char *e;
-	char buf[40];
 
 	AN(p);
 	assert(len > 0);
-	CHECK_OBJ_NOTNULL(pkt, NTP_PACKET_MAGIC);
+	AN(nf);
 
 	e = p + len;
 
-	bxprintf(&p, e, "[%d", pkt->ntp_leap);
-	bxprintf(&p, e, " %u", pkt->ntp_version);
+	bxprintf(&p, e, "[%d", (int)nf->leap);
+	bxprintf(&p, e, " %u", nf->version);
 
-	bxprintf(&p, e, " %d", pkt->ntp_mode);
+	bxprintf(&p, e, " %d", (int)nf->mode);
 
-	bxprintf(&p, e, " %3u", pkt->ntp_stratum);
+	bxprintf(&p, e, " %3u", nf->stratum);
 
-	bxprintf(&p, e, " %3u", pkt->ntp_poll);
+	bxprintf(&p, e, " %3u", nf->poll);
 
-	bxprintf(&p, e, " %4d", pkt->ntp_precision);
+	bxprintf(&p, e, " %4d", nf->precision);
 
-	TS_Format(buf, sizeof buf, &pkt->ntp_delay);
-	bxprintf(&p, e, " %s", buf); assert(p < e);
+	bxprintf(&p, e, " %jd.%09jd",
+	    (intmax_t)nf->delay_sec, (intmax_t)nf->delay_nsec);
+	assert(p < e);
 
-	TS_Format(buf, sizeof buf, &pkt->ntp_dispersion);
-	bxprintf(&p, e, " %s", buf); assert(p < e);
+	bxprintf(&p, e, " %jd.%09jd",
+	    (intmax_t)nf->disp_sec, (intmax_t)nf->disp_nsec);
+	assert(p < e);
 
-	bxprintf(&p, e, " 0x%02x%02x%02x%02x",
-	    pkt->ntp_refid[0], pkt->ntp_refid[1],
-	    pkt->ntp_refid[2], pkt->ntp_refid[3]);
+	bxprintf(&p, e, " 0x%08x", nf->refid);
 
-	bxprintf(&p, e, " %.9f",
-	    TS_Diff(&pkt->ntp_reference, &pkt->ntp_origin));
+	bxprintf(&p, e, " %.9f", nf->reference);
 
-	TS_Format(buf, sizeof buf, &pkt->ntp_origin);
-	bxprintf(&p, e, " %s", buf); assert(p < e);
+	bxprintf(&p, e, " %jd.%09jd",
+	    (intmax_t)nf->origin_sec, (intmax_t)nf->origin_nsec);
+	assert(p < e);
 
-	bxprintf(&p, e, " %.9f",
-	    TS_Diff(&pkt->ntp_receive, &pkt->ntp_origin));
+	bxprintf(&p, e, " %.9f", nf->receive);
 
-	bxprintf(&p, e, " %.9f",
-	    TS_Diff(&pkt->ntp_transmit, &pkt->ntp_receive));
+	bxprintf(&p, e, " %.9f", nf->transmit);
 
-	if (pkt->ts_rx.sec && pkt->ts_rx.frac) {
-		bxprintf(&p, e, " %.9f]",
-		    TS_Diff(&pkt->ts_rx, &pkt->ntp_transmit));
-	} else {
-		bxprintf(&p, e, " %.9f]", 0.0);
-	}
+	bxprintf(&p, e, " %.9f]", nf->ts_rx);
 	assert(p < e);
 }
 
+void
+NTP_Tool_Format(char *p, ssize_t len, const struct ntp_packet *pkt)
+{
+	struct ntp_fields nf;
+
+	NTP_Tool_Fields(&nf, pkt);
+	NTP_Tool_FormatFields(p, len, &nf);
+}
+
 /**********************************************************************
- * Scan a packet in NTP_Tool_Format layout.
+ * Scan a packet in NTP_Tool_Format layout into its fields, without
+ * losing anything in the conversion.
+ *
+ * This is what replaying a tracefile spends its time on, so it is done
+ * by hand rather than with sscanf(3).  Fields are separated by spaces
+ * only, so the scan never runs past the end of the line, and buf need
+ * not be NUL terminated if a newline follows.
  */
 
+static int
+nts_sep(const char **pp)
+{
+	const char *p = *pp;
+
+	if (*p != ' ')
+		return (-1);
+	while (*p == ' ')
+		p++;
+	*pp = p;
+	return (0);
+}
+
+static int
+nts_uint(const char **pp, uintmax_t *u, int base)
+{
+	char *e;
+
+	if (nts_sep(pp) || !isxdigit((unsigned char)**pp))
+		return (-1);
+	*u = strtoumax(*pp, &e, base);
+	if (e == *pp)
+		return (-1);
+	*pp = e;
+	return (0);
+}
+
+static int
+nts_nsec(const char **pp, uint64_t *sec, uint32_t *nsec)
+{
+	uintmax_t u;
+	char *e;
+
+	if (nts_uint(pp, &u, 10) || **pp != '.' ||
+	    !isdigit((unsigned char)(*pp)[1]))
+		return (-1);
+	*sec = u;
+	u = strtoumax(*pp + 1, &e, 10);
+	*pp = e;
+	if (u >= 1000000000)
+		return (-1);
+	*nsec = (uint32_t)u;
+	return (0);
+}
+
+static int
+nts_double(const char **pp, double *d)
+{
+	char *e;
+
+	if (nts_sep(pp))
+		return (-1);
+	if (**pp != '-' && !isdigit((unsigned char)**pp))
+		return (-1);
+	*d = strtod(*pp, &e);
+	if (e == *pp)
+		return (-1);
+	*pp = e;
+	return (0);
+}
+
 int
-NTP_Tool_Scan(struct ntp_packet *pkt, const char *buf)
+NTP_Tool_ScanFields(struct ntp_fields *nf, const char *buf)
 {
-	unsigned u_fields[8];
-	double d_fields[7];
-	char cc;
+	uintmax_t u[6];
+	const char *p;
+	char *e;
+	long l;
 	int i;
 
-	i = sscanf(buf,
-	    "[%u %u %u %u %u %lf %lf %lf %x %lf %u.%u %lf %lf %lf%c",
-	    u_fields + 0,	/* NTP_leap */
-	    u_fields + 1,	/* NTP_version */
-	    u_fields + 2,	/* NTP_mode */
-	    u_fields + 3,	/* NTP_stratum */
-	    u_fields + 4,	/* NTP_poll */
-	    d_fields + 0,	/* NTP_precision */
-	    d_fields + 1,	/* NTP_delay */
-	    d_fields + 2,	/* NTP_dispersion */
-	    u_fields + 5,	/* NTP_refid */
-	    d_fields + 3,	/* NTP_reference - NTP_origin */
-	    u_fields + 6,	/* NTP_origin:sec */
-	    u_fields + 7,	/* NTP_origin:nsec */
-	    d_fields + 4,	/* NTP_receive - NTP_origin */
-	    d_fields + 5,	/* NTP_transmit - NTP_receive */
-	    d_fields + 6,	/* ts_rx - NTP_transmit*/
-	    &cc);
-	if (i != 16 || cc != ']')
+	AN(nf);
+	AN(buf);
+	memset(nf, 0, sizeof *nf);
+	if (*buf != '[')
+		return (-1);
+	p = buf + 1;
+	if (!isdigit((unsigned char)*p))
+		return (-1);
+	u[0] = strtoumax(p, &e, 10);
+	p = e;
+	for (i = 1; i < 5; i++)
+		if (nts_uint(&p, &u[i], 10))
+			return (-1);
+	if (nts_sep(&p))
+		return (-1);
+	l = strtol(p, &e, 10);
+	if (e == p)
+		return (-1);
+	p = e;
+	if (nts_nsec(&p, &nf->delay_sec, &nf->delay_nsec) ||
+	    nts_nsec(&p, &nf->disp_sec, &nf->disp_nsec) ||
+	    nts_uint(&p, &u[5], 16) ||
+	    nts_double(&p, &nf->reference) ||
+	    nts_nsec(&p, &nf->origin_sec, &nf->origin_nsec) ||
+	    nts_double(&p, &nf->receive) ||
+	    nts_double(&p, &nf->transmit) ||
+	    nts_double(&p, &nf->ts_rx) ||
+	    *p != ']')
+		return (-1);
+	for (i = 0; i < 5; i++)
+		if (u[i] > UINT_MAX)
+			return (-1);
+	if (u[5] > UINT32_MAX || l < INT_MIN || l > INT_MAX)
 		return (-1);
+	nf->leap = (unsigned)u[0];
+	nf->version = (unsigned)u[1];
+	nf->mode = (unsigned)u[2];
+	nf->stratum = (unsigned)u[3];
+	nf->poll = (unsigned)u[4];
+	nf->precision = (int)l;
+	nf->refid = (uint32_t)u[5];
+	return (0);
+}
+
+/**********************************************************************
+ * Turn fields back into a packet
+ */
 
+void
+NTP_Tool_Packet(struct ntp_packet *pkt, const struct ntp_fields *nf)
+{
+
+	AN(pkt);
+	AN(nf);
 	INIT_OBJ(pkt, NTP_PACKET_MAGIC);
-	pkt->ntp_leap = (enum ntp_leap)u_fields[0];
-	pkt->ntp_version = (uint8_t)u_fields[1];
-	pkt->ntp_mode = (enum ntp_mode)u_fields[2];
-	pkt->ntp_stratum = (uint8_t)u_fields[3];
-	pkt->ntp_poll = (uint8_t)u_fields[4];
-	pkt->ntp_precision = (int8_t)floor(d_fields[0]);
-	TS_Double(&pkt->ntp_delay, d_fields[1]);
-	TS_Double(&pkt->ntp_dispersion, d_fields[2]);
-	Be32enc(pkt->ntp_refid, u_fields[5]);
-
-	TS_Nanosec(&pkt->ntp_origin, u_fields[6], u_fields[7]);
+	pkt->ntp_leap = (enum ntp_leap)nf->leap;
+	pkt->ntp_version = (uint8_t)nf->version;
+	pkt->ntp_mode = (enum ntp_mode)nf->mode;
+	pkt->ntp_stratum = (uint8_t)nf->stratum;
+	pkt->ntp_poll = (uint8_t)nf->poll;
+	pkt->ntp_precision = (int8_t)nf->precision;
+	TS_Double(&pkt->ntp_delay, nf->delay_sec + nf->delay_nsec / 1e9);
+	TS_Double(&pkt->ntp_dispersion, nf->disp_sec + nf->disp_nsec / 1e9);
+	Be32enc(pkt->ntp_refid, nf->refid);
+
+	TS_Nanosec(&pkt->ntp_origin, (int64_t)nf->origin_sec,
+	    nf->origin_nsec);
 
 	pkt->ntp_reference = pkt->ntp_origin;
-	TS_Add(&pkt->ntp_reference, d_fields[3]);
+	TS_Add(&pkt->ntp_reference, nf->reference);
 
 	pkt->ntp_receive = pkt->ntp_origin;
-	TS_Add(&pkt->ntp_receive, d_fields[4]);
+	TS_Add(&pkt->ntp_receive, nf->receive);
 
 	pkt->ntp_transmit = pkt->ntp_receive;
-	TS_Add(&pkt->ntp_transmit, d_fields[5]);
+	TS_Add(&pkt->ntp_transmit, nf->transmit);
 
-	if (d_fields[6] != 0.0) {
+	if (nf->ts_rx != 0.0) {
 		pkt->ts_rx = pkt->ntp_transmit;
-		TS_Add(&pkt->ts_rx, d_fields[6]);
+		TS_Add(&pkt->ts_rx, nf->ts_rx);
 	} else
 		INIT_OBJ(&pkt->ts_rx, TIMESTAMP_MAGIC);
+}
+
+/**********************************************************************
+ * Scan a packet in NTP_Tool_Format layout.
+ */
+
+int
+NTP_Tool_Scan(struct ntp_packet *pkt, const char *buf)
+{
+	struct ntp_fields nf;
+
+	if (NTP_Tool_ScanFields(&nf, buf))
+		return (-1);
+	NTP_Tool_Packet(pkt, &nf);
 	return (0);
 }
@@ -0,0 +1,701 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Network Time Security for NTP (RFC 8915)
+ * ========================================
+ *
+ * NTS-KE (nts_ke.c) hands the client two AEAD keys, client-to-server
+ * and server-to-client, and a handful of cookies, which are opaque to
+ * the client, but from which the server can recover the keys.  Each
+ * request carries these extension fields:
+ *
+ *	Unique Identifier	32 random bytes, echoed in the reply
+ *	NTS Cookie		One cookie, never used twice
+ *	Cookie Placeholder	One per extra cookie we want back
+ *	NTS Authenticator	Nonce and AEAD tag over the packet so far
+ *
+ * The reply echoes the Unique Identifier, and its Authenticator holds
+ * one fresh cookie per cookie and placeholder in the request, encrypted
+ * with the server-to-client key.
+ *
+ * The only AEAD is AEAD_AES_SIV_CMAC_256, which crypto.c gets from
+ * OpenSSL's EVP "AES-128-SIV" (NTS-KE needs OpenSSL anyway).  Each peer
+ * has a preallocated ring of cookies, and requests and replies are built
+ * and taken apart in the packet buffer, so nothing is allocated per
+ * packet.
+ *
+ * The TLS handshake can take seconds, so NTS-KE runs on a thread of its
+ * own, into a scratch struct nts, and NTS_Request() picks the keys and
+ * cookies up from there once it is done.  When the ring runs dry, or the
+ * server NAKs our cookie, NTS_Request() starts a new NTS-KE and skips
+ * polls until it has finished.  NTS_Wait() lets the client get its first
+ * cookies before it starts polling.
+ *
+ * The server side is for the "--serve" stand-in: Cookies are the keys
+ * sealed with a random master key, which is made at startup and never
+ * rotated.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "ntimed_endian.h"
+
+#define NTS_EXT_UID		0x0104
+#define NTS_EXT_COOKIE		0x0204
+#define NTS_EXT_PLACEHOLDER	0x0304
+#define NTS_EXT_AUTH		0x0404
+
+#define NTS_UIDLEN		32
+#define NTS_NONCELEN		16
+#define NTS_TAGLEN		16
+#define NTS_AUTHLEN		(4 + 4 + NTS_NONCELEN + NTS_TAGLEN)
+
+struct nts_cookie {
+	size_t			len;
+	uint8_t			data[NTS_COOKIE_MAX];
+};
+
+struct nts {
+	unsigned		magic;
+#define NTS_MAGIC		0x6e7a5c31
+	char			*hostname;
+	const char		*cafile;
+	struct sockaddr_storage	ke_ss;
+	unsigned		ke_sl;
+	struct sockaddr_storage	ntp_ss;
+	unsigned		ntp_sl;
+
+	struct aes_siv		c2s;
+	struct aes_siv		s2c;
+	uint8_t			uid[NTS_UIDLEN];
+
+	unsigned		head;
+	unsigned		ncookie;
+	struct nts_cookie	cookie[NTS_NCOOKIE];
+
+	/* Background NTS-KE, ke_done and ke_err protected by nts_mtx */
+	struct nts		*ke;
+	pthread_t		ke_thr;
+	int			ke_running;
+	int			ke_done;
+	int			ke_err;
+};
+
+struct nts_server {
+	unsigned		magic;
+#define NTS_SERVER_MAGIC	0x2f41b7d9
+	uint8_t			keyid[4];
+	struct aes_siv		master;
+};
+
+static pthread_mutex_t nts_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/**********************************************************************
+ * Client side
+ */
+
+struct nts *
+NTS_New(const char *hostname, const void *sa, unsigned salen,
+    const char *cafile)
+{
+	struct nts *nts;
+
+	AN(hostname);
+	AN(sa);
+	assert(salen <= sizeof nts->ke_ss);
+	ALLOC_OBJ(nts, NTS_MAGIC);
+	AN(nts);
+	nts->hostname = strdup(hostname);
+	AN(nts->hostname);
+	nts->cafile = cafile;
+	memcpy(&nts->ke_ss, sa, salen);
+	nts->ke_sl = salen;
+	NTS_SetAddr(nts, sa, salen);
+	return (nts);
+}
+
+void
+NTS_Destroy(struct nts **ntsp)
+{
+	struct nts *nts;
+
+	AN(ntsp);
+	nts = *ntsp;
+	*ntsp = NULL;
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	NTS_Wait(nts);
+	if (nts->ke != NULL)
+		NTS_Destroy(&nts->ke);
+	free(nts->hostname);
+	/* Keys and cookies */
+	memset(nts, 0, sizeof *nts);
+	free(nts);
+}
+
+void
+NTS_SetKeys(struct nts *nts, const uint8_t *c2s, const uint8_t *s2c)
+{
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	AES_SIV_Key(&nts->c2s, c2s);
+	AES_SIV_Key(&nts->s2c, s2c);
+	nts->head = 0;
+	nts->ncookie = 0;
+}
+
+/* Returns zero if the cookie was kept */
+
+int
+NTS_AddCookie(struct nts *nts, const void *ptr, size_t len)
+{
+	struct nts_cookie *ck;
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	if (len == 0 || len > NTS_COOKIE_MAX || nts->ncookie == NTS_NCOOKIE)
+		return (-1);
+	ck = &nts->cookie[(nts->head + nts->ncookie) % NTS_NCOOKIE];
+	memcpy(ck->data, ptr, len);
+	ck->len = len;
+	nts->ncookie++;
+	return (0);
+}
+
+void
+NTS_SetAddr(struct nts *nts, const void *sa, unsigned salen)
+{
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	AN(sa);
+	assert(salen <= sizeof nts->ntp_ss);
+	memcpy(&nts->ntp_ss, sa, salen);
+	nts->ntp_sl = salen;
+}
+
+/**********************************************************************
+ * Background NTS-KE
+ */
+
+static void *
+nts_ke_thread(void *priv)
+{
+	struct nts *nts;
+	int i;
+
+	CAST_OBJ_NOTNULL(nts, priv, NTS_MAGIC);
+	i = NTS_KE(NULL, nts->ke, nts->hostname, &nts->ke_ss, nts->ke_sl,
+	    nts->cafile);
+	AZ(pthread_mutex_lock(&nts_mtx));
+	nts->ke_err = i;
+	nts->ke_done = 1;
+	AZ(pthread_mutex_unlock(&nts_mtx));
+	return (NULL);
+}
+
+void
+NTS_Start(struct ocx *ocx, struct nts *nts)
+{
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	if (nts->ke_running)
+		return;
+	if (nts->ke == NULL)
+		nts->ke = NTS_New(nts->hostname, &nts->ke_ss, nts->ke_sl,
+		    nts->cafile);
+	nts->ke_done = 0;
+	nts->ke_err = 0;
+	if (pthread_create(&nts->ke_thr, NULL, nts_ke_thread, nts)) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: Could not start thread\n",
+		    nts->hostname);
+		return;
+	}
+	nts->ke_running = 1;
+}
+
+/* Adopt the keys and cookies of a finished NTS-KE, optionally waiting */
+
+static void
+nts_collect(struct nts *nts, int wait)
+{
+	const struct nts *ke;
+	int done;
+
+	if (!nts->ke_running)
+		return;
+	if (!wait) {
+		AZ(pthread_mutex_lock(&nts_mtx));
+		done = nts->ke_done;
+		AZ(pthread_mutex_unlock(&nts_mtx));
+		if (!done)
+			return;
+	}
+	AZ(pthread_join(nts->ke_thr, NULL));
+	nts->ke_running = 0;
+	if (nts->ke_err)
+		return;
+
+	ke = nts->ke;
+	CHECK_OBJ_NOTNULL(ke, NTS_MAGIC);
+	nts->c2s = ke->c2s;
+	nts->s2c = ke->s2c;
+	nts->head = ke->head;
+	nts->ncookie = ke->ncookie;
+	memcpy(nts->cookie, ke->cookie, sizeof nts->cookie);
+	memset(nts->uid, 0, sizeof nts->uid);
+	NTS_SetAddr(nts, &ke->ntp_ss, ke->ntp_sl);
+}
+
+void
+NTS_Wait(struct nts *nts)
+{
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	nts_collect(nts, 1);
+}
+
+const struct sockaddr *
+NTS_Addr(const struct nts *nts, unsigned *salen)
+{
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	AN(salen);
+	*salen = nts->ntp_sl;
+	return ((const void *)&nts->ntp_ss);
+}
+
+/*
+ * Reserve the authenticator extension field for ptlen bytes of
+ * plaintext.  Returns where the caller should put the plaintext,
+ * before sealing it in place with nts_seal().
+ */
+
+static uint8_t *
+nts_auth(struct ntp_ext_build *eb, size_t ptlen)
+{
+	uint8_t *q;
+
+	q = NTP_Ext_Reserve(eb, NTS_EXT_AUTH,
+	    4 + NTS_NONCELEN + NTS_TAGLEN + ptlen);
+	if (q == NULL)
+		return (NULL);
+	Be16enc(q, NTS_NONCELEN);
+	Be16enc(q + 2, (uint16_t)(NTS_TAGLEN + ptlen));
+	Crypto_Random(q + 4, NTS_NONCELEN);
+	return (q + 4 + NTS_NONCELEN + NTS_TAGLEN);
+}
+
+/* The packet up to the authenticator is the associated data */
+
+static void
+nts_seal(const struct aes_siv *siv, const struct ntp_ext_build *eb,
+    size_t ptlen)
+{
+	struct crypto_vec ad[2];
+	uint8_t *q;
+
+	q = eb->ptr + eb->last + 4;
+	ad[0].ptr = eb->ptr;
+	ad[0].len = eb->last;
+	ad[1].ptr = q + 4;
+	ad[1].len = NTS_NONCELEN;
+	q += 4 + NTS_NONCELEN;
+	AES_SIV_Seal(siv, ad, 2, q + NTS_TAGLEN, ptlen, q);
+}
+
+/*
+ * Open the authenticator extension field ef of the packet p into pt.
+ * Returns the length of the plaintext, or -1.
+ */
+
+static ssize_t
+nts_open(const struct aes_siv *siv, const uint8_t *p,
+    const struct ntp_ext *ef, uint8_t *pt, size_t ptsize)
+{
+	struct crypto_vec ad[2];
+	size_t nl, cl;
+
+	if (ef->len < 4)
+		return (-1);
+	nl = Be16dec(ef->body);
+	cl = Be16dec(ef->body + 2);
+	if (nl < NTS_NONCELEN || cl < NTS_TAGLEN ||
+	    4 + ((nl + 3) & ~(size_t)3) + cl > ef->len ||
+	    cl - NTS_TAGLEN > ptsize)
+		return (-1);
+	ad[0].ptr = p;
+	ad[0].len = ef->off;
+	ad[1].ptr = ef->body + 4;
+	ad[1].len = nl;
+	if (AES_SIV_Open(siv, ad, 2, ef->body + 4 + ((nl + 3) & ~(size_t)3),
+	    cl, pt))
+		return (-1);
+	return ((ssize_t)(cl - NTS_TAGLEN));
+}
+
+/*
+ * Add the NTS extension fields to the 48 byte request in ptr.
+ * Returns the length of the request, or zero if we have no cookies yet.
+ */
+
+size_t
+NTS_Request(struct ocx *ocx, struct nts *nts, void *ptr, size_t len,
+    size_t size)
+{
+	struct ntp_ext_build eb;
+	const struct nts_cookie *ck;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	AN(ptr);
+	assert(len == 48);
+
+	if (nts->ncookie == 0)
+		nts_collect(nts, 0);
+	if (nts->ncookie == 0) {
+		NTS_Start(ocx, nts);
+		return (0);
+	}
+
+	ck = &nts->cookie[nts->head];
+	nts->head = (nts->head + 1) % NTS_NCOOKIE;
+	nts->ncookie--;
+
+	Crypto_Random(nts->uid, sizeof nts->uid);
+	NTP_Ext_Build(&eb, ptr, len, size);
+	(void)NTP_Ext_Add(&eb, NTS_EXT_UID, nts->uid, sizeof nts->uid);
+	(void)NTP_Ext_Add(&eb, NTS_EXT_COOKIE, ck->data, ck->len);
+
+	/* Ask for enough cookies to fill the ring again */
+	for (u = nts->ncookie + 1; u < NTS_NCOOKIE; u++) {
+		if (eb.len + 4 + ck->len + NTS_AUTHLEN > size)
+			break;
+		(void)NTP_Ext_Add(&eb, NTS_EXT_PLACEHOLDER, NULL, ck->len);
+	}
+
+	if (nts_auth(&eb, 0) != NULL)
+		nts_seal(&nts->c2s, &eb, 0);
+	len = NTP_Ext_Finish(&eb, 0);
+	AN(len);
+	return (len);
+}
+
+/*
+ * Check the NTS reply in ptr, and harvest the cookies from it.
+ */
+
+enum ntp_auth
+NTS_Reply(struct ocx *ocx, struct nts *nts, const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+	uint8_t pt[NTP_MAXLEN];
+	struct ntp_ext_iter it;
+	struct ntp_ext ef;
+	ssize_t l;
+	int i, uid = 0;
+
+	CHECK_OBJ_NOTNULL(nts, NTS_MAGIC);
+	AN(ptr);
+	if (len < 48)
+		return (NTP_AUTH_MALFORMED);
+
+	NTP_Ext_Iter(&it, p, len, 48);
+	while ((i = NTP_Ext_Next(&it, &ef)) > 0) {
+		if (ef.type == NTS_EXT_UID) {
+			if (ef.len != NTS_UIDLEN ||
+			    !Crypto_Equal(ef.body, nts->uid, NTS_UIDLEN))
+				return (NTP_AUTH_BAD);
+			uid = 1;
+		} else if (ef.type == NTS_EXT_AUTH)
+			break;
+	}
+	if (i < 0)
+		return (NTP_AUTH_MALFORMED);
+	if (!uid)
+		return (NTP_AUTH_BAD);
+
+	if (p[1] == 0 && !memcmp(p + 12, "NTSN", 4)) {
+		Put(ocx, OCX_DIAG, "NTS NAK from %s, new NTS-KE\n",
+		    nts->hostname);
+		nts->ncookie = 0;
+		memset(nts->uid, 0, sizeof nts->uid);
+		return (NTP_AUTH_NAK);
+	}
+	if (i == 0)
+		return (NTP_AUTH_NONE);
+
+	l = nts_open(&nts->s2c, p, &ef, pt, sizeof pt);
+	if (l < 0)
+		return (NTP_AUTH_BAD);
+
+	/* The same reply twice shall not give us cookies twice */
+	memset(nts->uid, 0, sizeof nts->uid);
+
+	NTP_Ext_Iter(&it, pt, (size_t)l, 0);
+	while (NTP_Ext_Next(&it, &ef) > 0)
+		if (ef.type == NTS_EXT_COOKIE)
+			(void)NTS_AddCookie(nts, ef.body, ef.len);
+	return (NTP_AUTH_OK);
+}
+
+/**********************************************************************
+ * Server side
+ *
+ * A cookie is the master key-ID, a nonce and the two keys sealed with
+ * the master key:
+ *
+ *	keyid(4) nonce(16) tag(16) c2s(32) s2c(32)
+ */
+
+#define NTS_SCOOKIE_LEN	(4 + NTS_NONCELEN + NTS_TAGLEN + 2 * NTS_KEYLEN)
+
+struct nts_server *
+NTS_Server_New(void)
+{
+	struct nts_server *ns;
+	uint8_t key[2 * 16];
+
+	ALLOC_OBJ(ns, NTS_SERVER_MAGIC);
+	AN(ns);
+	Crypto_Random(ns->keyid, sizeof ns->keyid);
+	Crypto_Random(key, sizeof key);
+	AES_SIV_Key(&ns->master, key);
+	memset(key, 0, sizeof key);
+	return (ns);
+}
+
+size_t
+NTS_Server_Cookie(const struct nts_server *ns, const uint8_t *c2s,
+    const uint8_t *s2c, void *ptr, size_t size)
+{
+	uint8_t *p = ptr, k[2 * NTS_KEYLEN];
+	struct crypto_vec ad[2];
+
+	CHECK_OBJ_NOTNULL(ns, NTS_SERVER_MAGIC);
+	if (size < NTS_SCOOKIE_LEN)
+		return (0);
+	memcpy(p, ns->keyid, 4);
+	Crypto_Random(p + 4, NTS_NONCELEN);
+	memcpy(k, c2s, NTS_KEYLEN);
+	memcpy(k + NTS_KEYLEN, s2c, NTS_KEYLEN);
+	ad[0].ptr = p;
+	ad[0].len = 4;
+	ad[1].ptr = p + 4;
+	ad[1].len = NTS_NONCELEN;
+	AES_SIV_Seal(&ns->master, ad, 2, k, sizeof k, p + 4 + NTS_NONCELEN);
+	memset(k, 0, sizeof k);
+	return (NTS_SCOOKIE_LEN);
+}
+
+static int
+nts_server_keys(const struct nts_server *ns, const uint8_t *p, size_t len,
+    uint8_t *k)
+{
+	struct crypto_vec ad[2];
+
+	if (len != NTS_SCOOKIE_LEN || memcmp(p, ns->keyid, 4))
+		return (-1);
+	ad[0].ptr = p;
+	ad[0].len = 4;
+	ad[1].ptr = p + 4;
+	ad[1].len = NTS_NONCELEN;
+	return (AES_SIV_Open(&ns->master, ad, 2, p + 4 + NTS_NONCELEN,
+	    NTS_TAGLEN + 2 * NTS_KEYLEN, k));
+}
+
+/*
+ * Add the NTS extension fields to the reply (of replen bytes) in rep,
+ * for the request in req.  If the request cannot be authenticated the
+ * reply is turned into a NTS NAK.  Returns the length of the reply,
+ * zero if it should not be sent.
+ */
+
+size_t
+NTS_Serve(const struct nts_server *ns, const void *req, size_t reqlen,
+    void *rep, size_t replen, size_t size)
+{
+	const uint8_t *q = req;
+	uint8_t *p = rep, *c, pt[NTP_MAXLEN], k[2 * NTS_KEYLEN];
+	struct ntp_ext_iter it;
+	struct ntp_ext_build eb;
+	struct ntp_ext ef, uid, ck, auth;
+	struct aes_siv c2s, s2c;
+	unsigned nph = 0, n, u;
+	int i = 0;
+
+	CHECK_OBJ_NOTNULL(ns, NTS_SERVER_MAGIC);
+	AN(req);
+	AN(rep);
+	assert(replen == 48);
+
+	memset(&uid, 0, sizeof uid);
+	memset(&ck, 0, sizeof ck);
+	memset(&auth, 0, sizeof auth);
+	NTP_Ext_Iter(&it, q, reqlen, 48);
+	while (auth.body == NULL && (i = NTP_Ext_Next(&it, &ef)) > 0) {
+		switch (ef.type) {
+		case NTS_EXT_UID:
+			uid = ef;
+			break;
+		case NTS_EXT_COOKIE:
+			if (ck.body != NULL)
+				return (0);
+			ck = ef;
+			break;
+		case NTS_EXT_PLACEHOLDER:
+			nph++;
+			break;
+		case NTS_EXT_AUTH:
+			auth = ef;
+			break;
+		default:
+			break;
+		}
+	}
+	if (i < 0 || uid.len < NTS_UIDLEN || ck.body == NULL ||
+	    auth.body == NULL)
+		return (0);
+
+	/* The reply is never bigger than the request */
+	if (size > reqlen)
+		size = reqlen;
+	NTP_Ext_Build(&eb, p, replen, size);
+
+	i = nts_server_keys(ns, ck.body, ck.len, k);
+	if (i == 0) {
+		AES_SIV_Key(&c2s, k);
+		AES_SIV_Key(&s2c, k + NTS_KEYLEN);
+	}
+	if (i != 0 || nts_open(&c2s, q, &auth, pt, sizeof pt) < 0) {
+		memset(k, 0, sizeof k);
+		p[0] = (uint8_t)((NTP_LEAP_UNKNOWN << 6) | (p[0] & 0x3f));
+		p[1] = 0;
+		memcpy(p + 12, "NTSN", 4);
+		(void)NTP_Ext_Add(&eb, NTS_EXT_UID, uid.body, uid.len);
+		return (NTP_Ext_Finish(&eb, 0));
+	}
+
+	(void)NTP_Ext_Add(&eb, NTS_EXT_UID, uid.body, uid.len);
+
+	/* A cookie for the cookie and each placeholder, as far as fits */
+	n = nph + 1;
+	if (n > NTS_NCOOKIE)
+		n = NTS_NCOOKIE;
+	while (n > 0 && eb.len + NTS_AUTHLEN + n * (4 + NTS_SCOOKIE_LEN) > size)
+		n--;
+
+	/* Built in place and sealed there */
+	c = nts_auth(&eb, n * (4 + NTS_SCOOKIE_LEN));
+	if (c != NULL) {
+		for (u = 0; u < n; u++) {
+			Be16enc(c, NTS_EXT_COOKIE);
+			Be16enc(c + 2, 4 + NTS_SCOOKIE_LEN);
+			AN(NTS_Server_Cookie(ns, k, k + NTS_KEYLEN,
+			    c + 4, NTS_SCOOKIE_LEN));
+			c += 4 + NTS_SCOOKIE_LEN;
+		}
+		nts_seal(&s2c, &eb, n * (4 + NTS_SCOOKIE_LEN));
+	}
+	memset(k, 0, sizeof k);
+	return (NTP_Ext_Finish(&eb, 0));
+}
+
+/**********************************************************************
+ * Round trips between the client and server sides, keyed by hand
+ * instead of by NTS-KE.
+ */
+
+void
+NTS_RunTest(struct ocx *ocx)
+{
+	struct nts_server *ns;
+	struct nts *nts;
+	struct ntp_packet tx;
+	struct sockaddr_storage ss;
+	uint8_t c2s[NTS_KEYLEN], s2c[NTS_KEYLEN], ck[NTS_COOKIE_MAX];
+	uint8_t req[NTP_MAXLEN], rep[NTP_MAXLEN];
+	size_t rql = 0, rpl = 0, l;
+	unsigned u;
+	int nf = 0;
+
+	ns = NTS_Server_New();
+	memset(&ss, 0, sizeof ss);
+	ss.ss_family = AF_INET;
+	nts = NTS_New("localhost", &ss, sizeof ss, NULL);
+	Crypto_Random(c2s, sizeof c2s);
+	Crypto_Random(s2c, sizeof s2c);
+	NTS_SetKeys(nts, c2s, s2c);
+	for (u = 0; u < NTS_NCOOKIE; u++) {
+		l = NTS_Server_Cookie(ns, c2s, s2c, ck, sizeof ck);
+		AZ(NTS_AddCookie(nts, ck, l));
+	}
+	nf += NTS_AddCookie(nts, ck, l) != -1;
+
+	INIT_OBJ(&tx, NTP_PACKET_MAGIC);
+	NTP_Tool_Client_Req(&tx);
+
+	/* The ring stays full */
+	for (u = 0; u < 2 * NTS_NCOOKIE; u++) {
+		rql = NTP_Packet_Pack(req, sizeof req, &tx);
+		rql = NTS_Request(ocx, nts, req, rql, sizeof req);
+		memcpy(rep, req, 48);
+		rpl = NTS_Serve(ns, req, rql, rep, 48, sizeof rep);
+		nf += rpl == 0 || rpl > rql;
+		nf += NTS_Reply(ocx, nts, rep, rpl) != NTP_AUTH_OK;
+		nf += nts->ncookie != NTS_NCOOKIE;
+	}
+
+	/* Once only */
+	nf += NTS_Reply(ocx, nts, rep, rpl) != NTP_AUTH_BAD;
+
+	/* Tampered with */
+	rql = NTP_Packet_Pack(req, sizeof req, &tx);
+	rql = NTS_Request(ocx, nts, req, rql, sizeof req);
+	memcpy(rep, req, 48);
+	rpl = NTS_Serve(ns, req, rql, rep, 48, sizeof rep);
+	rep[40] ^= 1;
+	nf += NTS_Reply(ocx, nts, rep, rpl) != NTP_AUTH_BAD;
+	rep[40] ^= 1;
+	nf += NTS_Reply(ocx, nts, rep, rpl) != NTP_AUTH_OK;
+
+	/* A cookie the server cannot open gets a NAK */
+	rql = NTP_Packet_Pack(req, sizeof req, &tx);
+	rql = NTS_Request(ocx, nts, req, rql, sizeof req);
+	req[48 + 4 + NTS_UIDLEN + 4 + 20] ^= 1;
+	memcpy(rep, req, 48);
+	rpl = NTS_Serve(ns, req, rql, rep, 48, sizeof rep);
+	nf += rpl != 48 + 4 + NTS_UIDLEN;
+	nf += NTS_Reply(ocx, nts, rep, rpl) != NTP_AUTH_NAK;
+	nf += nts->ncookie != 0;
+
+	NTS_Destroy(&nts);
+	FREE_OBJ(ns);
+	Debug(ocx, "NTS_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
@@ -0,0 +1,635 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * NTS Key Establishment (RFC 8915 section 4)
+ * ==========================================
+ *
+ * NTS-KE is a short exchange of records over TLS 1.3 (ALPN "ntske/1")
+ * on TCP port 4460:
+ *
+ *	Client: Next Protocol [NTPv4], AEAD [AES-SIV-CMAC-256], End
+ *	Server: Next Protocol [NTPv4], AEAD [AES-SIV-CMAC-256],
+ *		(NTPv4 Server), (NTPv4 Port), New Cookie..., End
+ *
+ * after which both ends export the two AEAD keys from the TLS session,
+ * and the client goes on to NTP with the cookies (nts.c).
+ *
+ * TLS comes from OpenSSL, which configure enables when it finds it.
+ * Without it, NTS-KE fails and so does NTS.
+ *
+ * The server side is for the "--serve" stand-in, it handles one
+ * connection at a time, in a thread of its own.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "ntimed_endian.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <pthread.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#define NTS_KE_CRITICAL		0x8000
+#define NTS_KE_END		0
+#define NTS_KE_NEXTPROTO	1
+#define NTS_KE_ERROR		2
+#define NTS_KE_WARNING		3
+#define NTS_KE_AEAD		4
+#define NTS_KE_COOKIE		5
+#define NTS_KE_SERVER		6
+#define NTS_KE_PORT_REC		7
+
+#define NTS_KE_PROTO_NTPV4	0
+#define NTS_KE_AEAD_SIV		15	// AEAD_AES_SIV_CMAC_256
+
+#define NTS_KE_ERR_CRITICAL	0
+#define NTS_KE_ERR_BADREQ	1
+
+#define NTS_KE_BUFSIZE		8192
+#define NTS_KE_TMO		5	// seconds
+
+static const unsigned char nts_ke_alpn[] = "\x07ntske/1";
+
+/**********************************************************************
+ * Records and keys, used by both sides
+ */
+
+static size_t
+ke_rec(uint8_t *p, size_t off, unsigned type, const void *body, size_t len)
+{
+
+	assert(off + 4 + len <= NTS_KE_BUFSIZE);
+	Be16enc(p + off, (uint16_t)type);
+	Be16enc(p + off + 2, (uint16_t)len);
+	if (len > 0)
+		memcpy(p + off + 4, body, len);
+	return (off + 4 + len);
+}
+
+static size_t
+ke_rec16(uint8_t *p, size_t off, unsigned type, unsigned val)
+{
+	uint8_t b[2];
+
+	Be16enc(b, (uint16_t)val);
+	return (ke_rec(p, off, type, b, sizeof b));
+}
+
+/*
+ * Read records until the End of Message record.
+ * Returns the length of the message, or -1.
+ */
+
+static ssize_t
+ke_read(SSL *ssl, uint8_t *buf, size_t size)
+{
+	size_t len = 0, off;
+	unsigned type;
+	int i;
+
+	while (1) {
+		off = 0;
+		while (off + 4 <= len) {
+			type = Be16dec(buf + off) & ~NTS_KE_CRITICAL;
+			off += 4 + Be16dec(buf + off + 2);
+			if (off > len)
+				break;
+			if (type == NTS_KE_END)
+				return ((ssize_t)off);
+		}
+		if (len == size)
+			return (-1);
+		i = SSL_read(ssl, buf + len, (int)(size - len));
+		if (i <= 0)
+			return (-1);
+		len += (size_t)i;
+	}
+}
+
+static int
+ke_write(SSL *ssl, const uint8_t *buf, size_t len)
+{
+
+	return (SSL_write(ssl, buf, (int)len) == (int)len ? 0 : -1);
+}
+
+static int
+ke_export(SSL *ssl, uint8_t *c2s, uint8_t *s2c)
+{
+	static const char label[] = "EXPORTER-network-time-security";
+	uint8_t ctx[5];
+
+	Be16enc(ctx, NTS_KE_PROTO_NTPV4);
+	Be16enc(ctx + 2, NTS_KE_AEAD_SIV);
+	ctx[4] = 0;
+	if (SSL_export_keying_material(ssl, c2s, NTS_KEYLEN,
+	    label, sizeof label - 1, ctx, sizeof ctx, 1) != 1)
+		return (-1);
+	ctx[4] = 1;
+	if (SSL_export_keying_material(ssl, s2c, NTS_KEYLEN,
+	    label, sizeof label - 1, ctx, sizeof ctx, 1) != 1)
+		return (-1);
+	return (0);
+}
+
+static void
+ke_setport(struct sockaddr_storage *ss, unsigned port)
+{
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		((struct sockaddr_in *)(void *)ss)->sin_port =
+		    htons((uint16_t)port);
+		break;
+	case AF_INET6:
+		((struct sockaddr_in6 *)(void *)ss)->sin6_port =
+		    htons((uint16_t)port);
+		break;
+	default:
+		WRONG("Wrong address family");
+	}
+}
+
+static const char *
+ke_tls_err(char *buf, size_t len)
+{
+	unsigned long e;
+
+	e = ERR_get_error();
+	if (e == 0)
+		return ("no TLS error");
+	ERR_error_string_n(e, buf, len);
+	ERR_clear_error();
+	return (buf);
+}
+
+static void
+ke_timeouts(int fd)
+{
+	struct timeval tv;
+
+	tv.tv_sec = NTS_KE_TMO;
+	tv.tv_usec = 0;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+/**********************************************************************
+ * Client side
+ */
+
+static SSL_CTX *nts_ke_cctx;
+
+static SSL_CTX *
+ke_client_ctx(struct ocx *ocx, const char *cafile)
+{
+	SSL_CTX *ctx;
+	char buf[256];
+
+	if (nts_ke_cctx != NULL)
+		return (nts_ke_cctx);
+	(void)signal(SIGPIPE, SIG_IGN);
+	ctx = SSL_CTX_new(TLS_client_method());
+	AN(ctx);
+	AN(SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION));
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (cafile != NULL) {
+		if (SSL_CTX_load_verify_locations(ctx, cafile, NULL) != 1)
+			Fail(ocx, 0, "NTS-KE: Cannot load CA file %s: %s",
+			    cafile, ke_tls_err(buf, sizeof buf));
+	} else
+		AN(SSL_CTX_set_default_verify_paths(ctx));
+	AZ(SSL_CTX_set_alpn_protos(ctx, nts_ke_alpn, sizeof nts_ke_alpn - 1));
+	nts_ke_cctx = ctx;
+	return (ctx);
+}
+
+static SSL *
+ke_connect(struct ocx *ocx, const char *hostname, const void *sa,
+    unsigned salen, const char *cafile, int *fdp)
+{
+	struct sockaddr_storage ss;
+	struct in6_addr ia;
+	const unsigned char *alpn;
+	unsigned alpnlen;
+	SSL *ssl;
+	char buf[256];
+	int fd;
+
+	assert(salen <= sizeof ss);
+	memcpy(&ss, sa, salen);
+	ke_setport(&ss, NTS_KE_PORT);
+
+	fd = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: socket: %s\n",
+		    hostname, strerror(errno));
+		return (NULL);
+	}
+	ke_timeouts(fd);
+	if (connect(fd, (void *)&ss, salen)) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: connect: %s\n",
+		    hostname, strerror(errno));
+		AZ(close(fd));
+		return (NULL);
+	}
+
+	ssl = SSL_new(ke_client_ctx(ocx, cafile));
+	AN(ssl);
+	AN(SSL_set_fd(ssl, fd));
+	if (inet_pton(AF_INET, hostname, &ia) == 1 ||
+	    inet_pton(AF_INET6, hostname, &ia) == 1) {
+		AN(X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+		    hostname));
+	} else {
+		AN(SSL_set_tlsext_host_name(ssl, hostname));
+		AN(SSL_set1_host(ssl, hostname));
+	}
+	if (SSL_connect(ssl) != 1) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: TLS: %s\n",
+		    hostname, ke_tls_err(buf, sizeof buf));
+		SSL_free(ssl);
+		AZ(close(fd));
+		return (NULL);
+	}
+	SSL_get0_alpn_selected(ssl, &alpn, &alpnlen);
+	if (alpnlen != sizeof nts_ke_alpn - 2 ||
+	    memcmp(alpn, nts_ke_alpn + 1, alpnlen)) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: Server did not agree to %s\n",
+		    hostname, nts_ke_alpn + 1);
+		SSL_free(ssl);
+		AZ(close(fd));
+		return (NULL);
+	}
+	*fdp = fd;
+	return (ssl);
+}
+
+/*
+ * Get keys and cookies for nts, and the address to use for NTP.
+ * Returns zero on success.
+ */
+
+int
+NTS_KE(struct ocx *ocx, struct nts *nts, const char *hostname, const void *sa,
+    unsigned salen, const char *cafile)
+{
+	struct addrinfo hints, *res0;
+	struct sockaddr_storage ss;
+	uint8_t buf[NTS_KE_BUFSIZE], c2s[NTS_KEYLEN], s2c[NTS_KEYLEN];
+	char server[NI_MAXHOST], port[8];
+	const char *err = NULL;
+	unsigned type, ntp_port = 123, ncookie = 0;
+	size_t off, len;
+	ssize_t l = 0;
+	SSL *ssl;
+	int fd = -1, proto = 0, aead = 0, i;
+
+	AN(hostname);
+	AN(sa);
+	server[0] = '\0';
+
+	ssl = ke_connect(ocx, hostname, sa, salen, cafile, &fd);
+	if (ssl == NULL)
+		return (-1);
+
+	off = ke_rec16(buf, 0, NTS_KE_CRITICAL | NTS_KE_NEXTPROTO,
+	    NTS_KE_PROTO_NTPV4);
+	off = ke_rec16(buf, off, NTS_KE_AEAD, NTS_KE_AEAD_SIV);
+	off = ke_rec(buf, off, NTS_KE_CRITICAL | NTS_KE_END, NULL, 0);
+	if (ke_write(ssl, buf, off) || (l = ke_read(ssl, buf, sizeof buf)) < 0)
+		err = "request failed";
+
+	for (off = 0; err == NULL && off < (size_t)l; off += 4 + len) {
+		type = Be16dec(buf + off);
+		len = Be16dec(buf + off + 2);
+		switch (type & ~NTS_KE_CRITICAL) {
+		case NTS_KE_END:
+			break;
+		case NTS_KE_NEXTPROTO:
+			if (len != 2 || Be16dec(buf + off + 4) !=
+			    NTS_KE_PROTO_NTPV4)
+				err = "NTPv4 not offered";
+			proto = 1;
+			break;
+		case NTS_KE_ERROR:
+			err = "server sent error";
+			break;
+		case NTS_KE_WARNING:
+			Put(ocx, OCX_DIAG, "NTS-KE %s: Warning %u\n", hostname,
+			    len == 2 ? Be16dec(buf + off + 4) : 0);
+			break;
+		case NTS_KE_AEAD:
+			if (len != 2 || Be16dec(buf + off + 4) !=
+			    NTS_KE_AEAD_SIV)
+				err = "AES-SIV-CMAC-256 not offered";
+			aead = 1;
+			break;
+		case NTS_KE_COOKIE:
+			ncookie++;
+			break;
+		case NTS_KE_SERVER:
+			if (len == 0 || len >= sizeof server)
+				err = "bad server record";
+			else {
+				memcpy(server, buf + off + 4, len);
+				server[len] = '\0';
+			}
+			break;
+		case NTS_KE_PORT_REC:
+			if (len != 2)
+				err = "bad port record";
+			else
+				ntp_port = Be16dec(buf + off + 4);
+			break;
+		default:
+			if (type & NTS_KE_CRITICAL)
+				err = "unknown critical record";
+			break;
+		}
+	}
+	if (err == NULL && (!proto || !aead || ncookie == 0))
+		err = "incomplete reply";
+	if (err == NULL && ke_export(ssl, c2s, s2c))
+		err = "cannot export keys";
+	(void)SSL_shutdown(ssl);
+	SSL_free(ssl);
+	AZ(close(fd));
+
+	if (err == NULL && server[0] != '\0') {
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		bprintf(port, "%u", ntp_port);
+		i = getaddrinfo(server, port, &hints, &res0);
+		if (i != 0) {
+			err = "cannot resolve NTP server";
+		} else {
+			assert(res0->ai_addrlen <= sizeof ss);
+			NTS_SetAddr(nts, res0->ai_addr,
+			    (unsigned)res0->ai_addrlen);
+			freeaddrinfo(res0);
+		}
+	} else if (err == NULL) {
+		memcpy(&ss, sa, salen);
+		ke_setport(&ss, ntp_port);
+		NTS_SetAddr(nts, &ss, salen);
+	}
+	if (err != NULL) {
+		Put(ocx, OCX_DIAG, "NTS-KE %s: %s\n", hostname, err);
+		return (-1);
+	}
+
+	NTS_SetKeys(nts, c2s, s2c);
+	memset(c2s, 0, sizeof c2s);
+	memset(s2c, 0, sizeof s2c);
+	for (off = 0; off < (size_t)l; off += 4 + len) {
+		type = Be16dec(buf + off);
+		len = Be16dec(buf + off + 2);
+		if ((type & ~NTS_KE_CRITICAL) == NTS_KE_COOKIE)
+			(void)NTS_AddCookie(nts, buf + off + 4, len);
+	}
+	Debug(ocx, "NTS-KE %s: %u cookies\n", hostname, ncookie);
+	return (0);
+}
+
+/**********************************************************************
+ * Server side
+ */
+
+struct nts_ke_server {
+	unsigned		magic;
+#define NTS_KE_SERVER_MAGIC	0x5d0e93a6
+	const struct nts_server	*ns;
+	SSL_CTX			*ctx;
+	int			fd;
+	unsigned		ntp_port;
+};
+
+static int
+ke_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned inlen, void *priv)
+{
+
+	(void)ssl;
+	(void)priv;
+	if (SSL_select_next_proto((unsigned char **)(uintptr_t)out, outlen,
+	    nts_ke_alpn, sizeof nts_ke_alpn - 1, in, inlen) !=
+	    OPENSSL_NPN_NEGOTIATED)
+		return (SSL_TLSEXT_ERR_ALERT_FATAL);
+	return (SSL_TLSEXT_ERR_OK);
+}
+
+static void
+ke_serve(const struct nts_ke_server *ks, int fd)
+{
+	uint8_t buf[NTS_KE_BUFSIZE], c2s[NTS_KEYLEN], s2c[NTS_KEYLEN];
+	uint8_t ck[NTS_COOKIE_MAX];
+	unsigned type, u;
+	size_t off, len, i;
+	ssize_t l;
+	int proto = 0, aead = 0, bad = 0;
+	SSL *ssl;
+
+	ssl = SSL_new(ks->ctx);
+	AN(ssl);
+	AN(SSL_set_fd(ssl, fd));
+	if (SSL_accept(ssl) != 1 || (l = ke_read(ssl, buf, sizeof buf)) < 0) {
+		SSL_free(ssl);
+		return;
+	}
+	for (off = 0; off < (size_t)l; off += 4 + len) {
+		type = Be16dec(buf + off);
+		len = Be16dec(buf + off + 2);
+		switch (type & ~NTS_KE_CRITICAL) {
+		case NTS_KE_NEXTPROTO:
+			for (i = 0; i + 2 <= len; i += 2)
+				if (Be16dec(buf + off + 4 + i) ==
+				    NTS_KE_PROTO_NTPV4)
+					proto = 1;
+			break;
+		case NTS_KE_AEAD:
+			for (i = 0; i + 2 <= len; i += 2)
+				if (Be16dec(buf + off + 4 + i) ==
+				    NTS_KE_AEAD_SIV)
+					aead = 1;
+			break;
+		case NTS_KE_END:
+		case NTS_KE_WARNING:
+			break;
+		default:
+			if (type & NTS_KE_CRITICAL)
+				bad = 1;
+			break;
+		}
+	}
+
+	if (bad) {
+		off = ke_rec16(buf, 0, NTS_KE_CRITICAL | NTS_KE_ERROR,
+		    NTS_KE_ERR_CRITICAL);
+	} else if (!proto || !aead || ke_export(ssl, c2s, s2c)) {
+		off = ke_rec16(buf, 0, NTS_KE_CRITICAL | NTS_KE_ERROR,
+		    NTS_KE_ERR_BADREQ);
+	} else {
+		off = ke_rec16(buf, 0, NTS_KE_CRITICAL | NTS_KE_NEXTPROTO,
+		    NTS_KE_PROTO_NTPV4);
+		off = ke_rec16(buf, off, NTS_KE_CRITICAL | NTS_KE_AEAD,
+		    NTS_KE_AEAD_SIV);
+		if (ks->ntp_port != 123)
+			off = ke_rec16(buf, off, NTS_KE_PORT_REC,
+			    ks->ntp_port);
+		for (u = 0; u < NTS_NCOOKIE; u++) {
+			len = NTS_Server_Cookie(ks->ns, c2s, s2c,
+			    ck, sizeof ck);
+			AN(len);
+			off = ke_rec(buf, off, NTS_KE_COOKIE, ck, len);
+		}
+		memset(c2s, 0, sizeof c2s);
+		memset(s2c, 0, sizeof s2c);
+	}
+	off = ke_rec(buf, off, NTS_KE_CRITICAL | NTS_KE_END, NULL, 0);
+	(void)ke_write(ssl, buf, off);
+	(void)SSL_shutdown(ssl);
+	SSL_free(ssl);
+}
+
+static void *
+ke_server_thread(void *priv)
+{
+	struct nts_ke_server *ks;
+	int fd;
+
+	CAST_OBJ_NOTNULL(ks, priv, NTS_KE_SERVER_MAGIC);
+	while (1) {
+		fd = accept(ks->fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		ke_timeouts(fd);
+		ke_serve(ks, fd);
+		AZ(close(fd));
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
+void
+NTS_KE_Server(struct ocx *ocx, const struct nts_server *ns,
+    const char *pemfile, const char *addr, unsigned ntp_port)
+{
+	struct nts_ke_server *ks;
+	struct addrinfo hints, *res0;
+	pthread_t thr;
+	char buf[256], port[8];
+	int i;
+
+	AN(ns);
+	AN(pemfile);
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	ALLOC_OBJ(ks, NTS_KE_SERVER_MAGIC);
+	AN(ks);
+	ks->ns = ns;
+	ks->ntp_port = ntp_port;
+
+	ks->ctx = SSL_CTX_new(TLS_server_method());
+	AN(ks->ctx);
+	AN(SSL_CTX_set_min_proto_version(ks->ctx, TLS1_3_VERSION));
+	if (SSL_CTX_use_certificate_chain_file(ks->ctx, pemfile) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ks->ctx, pemfile,
+	    SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ks->ctx) != 1)
+		Fail(ocx, 0, "NTS-KE: Cannot use %s: %s",
+		    pemfile, ke_tls_err(buf, sizeof buf));
+	SSL_CTX_set_alpn_select_cb(ks->ctx, ke_alpn_select, NULL);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	bprintf(port, "%u", NTS_KE_PORT);
+	i = getaddrinfo(addr, port, &hints, &res0);
+	if (i != 0)
+		Fail(ocx, 0, "NTS-KE: %s: %s", addr == NULL ? "*" : addr,
+		    gai_strerror(i));
+	ks->fd = socket(res0->ai_family, res0->ai_socktype,
+	    res0->ai_protocol);
+	if (ks->fd < 0)
+		Fail(ocx, 1, "NTS-KE: socket");
+	i = 1;
+	(void)setsockopt(ks->fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+	if (bind(ks->fd, res0->ai_addr, res0->ai_addrlen))
+		Fail(ocx, 1, "NTS-KE: bind");
+	freeaddrinfo(res0);
+	if (listen(ks->fd, 16))
+		Fail(ocx, 1, "NTS-KE: listen");
+
+	AZ(pthread_create(&thr, NULL, ke_server_thread, ks));
+	AZ(pthread_detach(thr));
+}
+
+#else /* HAVE_OPENSSL */
+
+int
+NTS_KE(struct ocx *ocx, struct nts *nts, const char *hostname, const void *sa,
+    unsigned salen, const char *cafile)
+{
+
+	(void)nts;
+	(void)sa;
+	(void)salen;
+	(void)cafile;
+	Put(ocx, OCX_DIAG, "NTS-KE %s: Built without OpenSSL\n", hostname);
+	return (-1);
+}
+
+void
+NTS_KE_Server(struct ocx *ocx, const struct nts_server *ns,
+    const char *pemfile, const char *addr, unsigned ntp_port)
+{
+
+	(void)ns;
+	(void)pemfile;
+	(void)addr;
+	(void)ntp_port;
+	Fail(ocx, 0, "NTS-KE: Built without OpenSSL");
+}
+
+#endif /* HAVE_OPENSSL */
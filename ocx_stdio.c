@@ -52,23 +52,292 @@
  *
  * About this implementation:
  *
- * This is a very naive implementation spitting things out to stdout/stderr,
- * knowing that we are a single threaded program.
+ * The NULL context is a very naive implementation spitting things out
+ * to stdout/stderr, knowing that we are a single threaded program.
+ *
+ * OCX_New() makes a real context, which can be given a file descriptor
+ * for any of the channels with OCX_Sink(), for instance a CLI session.
+ * It buffers and counts its own output, channels without a sink fall
+ * through to the NULL context's destinations.
+ *
+ * The exception is TRACE to a file, which happens all over the timing
+ * critical code.  That output is formatted straight into a ring of
+ * preallocated slots, and a writer thread drains the ring to disk, so
+ * no timestamp ever waits for a write(2).  If the writer falls behind
+ * and the ring fills up, output is dropped and counted rather than
+ * blocking; the count is reported when the tracefile is closed.
+ * Simulations, which run flat out and where the trace is the whole
+ * point, can ask for the producer to wait instead with TraceLossless().
+ *
+ * The ring has exactly one producer (the main thread) and one consumer
+ * (the writer), so the two indices is all the synchronization it needs.
  *
  * XXX: Pull in sbufs to do it right.
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "ntimed.h"
+#include "ntimed_endian.h"
+#include "trace.h"
 
 static FILE *tracefile;
 
+/**********************************************************************
+ * Asynchronous trace writer
+ */
+
+#define TRACE_SLOTS	8192		// Must be power of two
+#define TRACE_SLOTSIZE	256
+#define TRACE_IOV	64
+
+struct trace_slot {
+	unsigned		len;
+	char			buf[TRACE_SLOTSIZE];
+};
+
+static struct trace_slot *trace_ring;
+static atomic_uint trace_head;		// Written by producer
+static atomic_uint trace_tail;		// Written by writer
+static atomic_int trace_stop;
+static uintmax_t trace_drops;
+static int trace_lossless;
+static int trace_binary;
+static pthread_t trace_thread;
+static int trace_fd = -1;
+
+/*
+ * Write all of it, picking up after short writes and signals.
+ * On any other error the rest is lost, there is nowhere to report it.
+ */
+
+static void
+trace_writev(struct iovec *iov, unsigned n)
+{
+	ssize_t l;
+
+	while (n > 0) {
+		l = writev(trace_fd, iov, (int)n);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return;
+		while (n > 0 && (size_t)l >= iov->iov_len) {
+			l -= (ssize_t)iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + l;
+			iov->iov_len -= (size_t)l;
+		}
+	}
+}
+
+static void
+trace_drain(void)
+{
+	struct iovec iov[TRACE_IOV];
+	unsigned head, tail, n;
+
+	while (1) {
+		head = atomic_load_explicit(&trace_head, memory_order_acquire);
+		tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+		if (head == tail)
+			return;
+		for (n = 0; n < TRACE_IOV && tail + n != head; n++) {
+			iov[n].iov_base =
+			    trace_ring[(tail + n) & (TRACE_SLOTS - 1)].buf;
+			iov[n].iov_len =
+			    trace_ring[(tail + n) & (TRACE_SLOTS - 1)].len;
+		}
+		trace_writev(iov, n);
+		atomic_store_explicit(&trace_tail, tail + n,
+		    memory_order_release);
+	}
+}
+
+static void *
+trace_writer(void *priv)
+{
+	struct timespec ts;
+
+	(void)priv;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10 * 1000 * 1000;
+	while (!atomic_load(&trace_stop)) {
+		trace_drain();
+		(void)nanosleep(&ts, NULL);
+	}
+	trace_drain();
+	return (NULL);
+}
+
+static void
+trace_stop_writer(void)
+{
+	char buf[80], *p;
+	size_t l;
+	struct iovec iov;
+
+	if (trace_ring == NULL)
+		return;
+	atomic_store(&trace_stop, 1);
+	AZ(pthread_join(trace_thread, NULL));
+	if (trace_drops > 0) {
+		p = buf + TRACE_BIN_RECHDR;
+		l = (size_t)snprintf(p, sizeof buf - TRACE_BIN_RECHDR,
+		    "# Trace dropped %ju records\n", trace_drops);
+		assert(l < sizeof buf - TRACE_BIN_RECHDR);
+		if (trace_binary) {
+			buf[0] = TRACE_TEXT;
+			buf[1] = 0;
+			Be16enc(buf + 2, (uint16_t)l);
+			p = buf;
+			l += TRACE_BIN_RECHDR;
+		}
+		iov.iov_base = p;
+		iov.iov_len = l;
+		trace_writev(&iov, 1);
+	}
+	free(trace_ring);
+	trace_ring = NULL;
+	trace_fd = -1;
+}
+
+static void
+trace_start_writer(FILE *fo)
+{
+
+	trace_ring = calloc(TRACE_SLOTS, sizeof *trace_ring);
+	AN(trace_ring);
+	trace_fd = fileno(fo);
+	trace_drops = 0;
+	atomic_store(&trace_head, 0);
+	atomic_store(&trace_tail, 0);
+	atomic_store(&trace_stop, 0);
+	AZ(pthread_create(&trace_thread, NULL, trace_writer, NULL));
+}
+
+static int
+trace_slots_free(unsigned head, unsigned want)
+{
+	struct timespec ts;
+	int n;
+
+	while (1) {
+		n = (int)(TRACE_SLOTS - (head -
+		    atomic_load_explicit(&trace_tail, memory_order_acquire)));
+		if (n >= (int)want || !trace_lossless)
+			return (n >= (int)want);
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1000 * 1000;
+		(void)nanosleep(&ts, NULL);
+	}
+}
+
+static void
+trace_put_raw(const void *ptr, size_t len)
+{
+	struct trace_slot *ts;
+	const char *p = ptr;
+	unsigned head, n;
+
+	head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+	n = (unsigned)((len + TRACE_SLOTSIZE - 1) / TRACE_SLOTSIZE);
+	if (!trace_slots_free(head, n)) {
+		trace_drops++;
+		return;
+	}
+	for (; len > 0; head++) {
+		ts = &trace_ring[head & (TRACE_SLOTS - 1)];
+		ts->len = len > TRACE_SLOTSIZE ? TRACE_SLOTSIZE : len;
+		memcpy(ts->buf, p, ts->len);
+		p += ts->len;
+		len -= ts->len;
+	}
+	atomic_store_explicit(&trace_head, head, memory_order_release);
+}
+
+static void
+trace_put(const char *fmt, va_list ap)
+{
+	struct trace_slot *ts;
+	char big[TRACE_BIN_RECHDR + 4096];
+	unsigned head;
+	va_list ap2;
+	int l;
+	size_t len;
+
+	if (trace_binary) {
+		/* Wrap it up as a TRACE_TEXT record */
+		l = vsnprintf(big + TRACE_BIN_RECHDR,
+		    sizeof big - TRACE_BIN_RECHDR, fmt, ap);
+		if (l <= 0)
+			return;
+		len = (size_t)l;
+		if (len >= sizeof big - TRACE_BIN_RECHDR)
+			len = sizeof big - TRACE_BIN_RECHDR - 1;
+		big[0] = TRACE_TEXT;
+		big[1] = 0;
+		Be16enc(big + 2, (uint16_t)len);
+		trace_put_raw(big, len + TRACE_BIN_RECHDR);
+		return;
+	}
+
+	head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+	if (!trace_slots_free(head, 1)) {
+		trace_drops++;
+		return;
+	}
+
+	/* The common case: It fits in a slot */
+	ts = &trace_ring[head & (TRACE_SLOTS - 1)];
+	va_copy(ap2, ap);
+	l = vsnprintf(ts->buf, sizeof ts->buf, fmt, ap2);
+	va_end(ap2);
+	if (l < 0)
+		return;
+	if (l < (int)sizeof ts->buf) {
+		ts->len = (unsigned)l;
+		atomic_store_explicit(&trace_head, head + 1,
+		    memory_order_release);
+		return;
+	}
+
+	/* Long records are spread over consecutive slots */
+	l = vsnprintf(big, sizeof big, fmt, ap);
+	len = (size_t)l;
+	if (len >= sizeof big)
+		len = sizeof big - 1;
+	trace_put_raw(big, len);
+}
+
+uintmax_t
+TraceDrops(void)
+{
+
+	return (trace_drops);
+}
+
+void
+TraceLossless(int yes)
+{
+
+	trace_lossless = yes;
+}
+
+/**********************************************************************/
+
 static FILE *
 getdst(enum ocx_chan chan)
 {
@@ -82,39 +351,344 @@ getdst(enum ocx_chan chan)
 	NEEDLESS_RETURN(NULL);
 }
 
+/**********************************************************************
+ * Operational contexts
+ *
+ * A struct ocx can have a sink (a file descriptor) of its own for any
+ * channel, output on channels without one goes wherever the global
+ * (NULL) context sends it.
+ *
+ * Output to a sink is collected in a buffer owned by the context and
+ * written when it is half full, at the end of each DIAG and DEBUG
+ * line, on OCX_Flush() and when the context is destroyed.  A context
+ * must only be used by one thread at a time, so none of this needs
+ * any locking.
+ */
+
+#define OCX_BUFSIZE	8192
+
+struct ocx_sink {
+	int			fd;
+	char			*buf;
+	size_t			len;
+	uintmax_t		nput;
+	uintmax_t		nbyte;
+};
+
+struct ocx {
+	unsigned		magic;
+#define OCX_MAGIC		0x5a21e0c4
+	struct ocx_sink		sink[OCX_NCHAN];
+};
+
+struct ocx *
+OCX_New(void)
+{
+	struct ocx *ocx;
+	unsigned u;
+
+	ALLOC_OBJ(ocx, OCX_MAGIC);
+	AN(ocx);
+	for (u = 0; u < OCX_NCHAN; u++)
+		ocx->sink[u].fd = -1;
+	return (ocx);
+}
+
+static void
+ocx_flush_sink(struct ocx_sink *os, const char *ptr, size_t len)
+{
+	ssize_t l;
+
+	while (len > 0) {
+		l = write(os->fd, ptr, len);
+		if (l <= 0)
+			break;		// XXX: Nowhere to report this
+		ptr += l;
+		len -= (size_t)l;
+	}
+}
+
+void
+OCX_Flush(struct ocx *ocx)
+{
+	struct ocx_sink *os;
+
+	CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+	for (os = ocx->sink; os < ocx->sink + OCX_NCHAN; os++) {
+		if (os->fd >= 0 && os->len > 0)
+			ocx_flush_sink(os, os->buf, os->len);
+		os->len = 0;
+	}
+}
+
+void
+OCX_Destroy(struct ocx **pocx)
+{
+	struct ocx *ocx;
+	unsigned u;
+
+	AN(pocx);
+	ocx = *pocx;
+	*pocx = NULL;
+	OCX_Flush(ocx);
+	for (u = 0; u < OCX_NCHAN; u++)
+		free(ocx->sink[u].buf);
+	FREE_OBJ(ocx);
+}
+
+/* The caller still owns the fd, -1 reverts to the global destination */
+
+void
+OCX_Sink(struct ocx *ocx, enum ocx_chan chan, int fd)
+{
+	struct ocx_sink *os;
+
+	CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+	assert(chan < OCX_NCHAN);
+	OCX_Flush(ocx);
+	os = &ocx->sink[chan];
+	os->fd = fd;
+	if (fd >= 0 && os->buf == NULL) {
+		os->buf = malloc(OCX_BUFSIZE);
+		AN(os->buf);
+	}
+}
+
+int
+OCX_Enabled(const struct ocx *ocx, enum ocx_chan chan)
+{
+
+	CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+	assert(chan < OCX_NCHAN);
+	if (ocx->sink[chan].fd >= 0)
+		return (1);
+	return ((ocx_chan_mask >> chan) & 1);
+}
+
+/* Number of Put()s to the context's own sink, and optionally bytes */
+
+uintmax_t
+OCX_Count(const struct ocx *ocx, enum ocx_chan chan, uintmax_t *bytes)
+{
+
+	CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+	assert(chan < OCX_NCHAN);
+	if (bytes != NULL)
+		*bytes = ocx->sink[chan].nbyte;
+	return (ocx->sink[chan].nput);
+}
+
+static void
+ocx_putv(struct ocx_sink *os, enum ocx_chan chan, const char *fmt,
+    va_list ap)
+{
+	va_list ap2;
+	char *p;
+	int i;
+
+	va_copy(ap2, ap);
+	i = vsnprintf(os->buf + os->len, OCX_BUFSIZE - os->len, fmt, ap);
+	assert(i >= 0);
+	if (os->len + (size_t)i >= OCX_BUFSIZE) {
+		/* Did not fit, make room and try again */
+		ocx_flush_sink(os, os->buf, os->len);
+		os->len = 0;
+		if (i < OCX_BUFSIZE) {
+			(void)vsnprintf(os->buf, OCX_BUFSIZE, fmt, ap2);
+		} else {
+			p = malloc((size_t)i + 1L);
+			AN(p);
+			(void)vsnprintf(p, (size_t)i + 1L, fmt, ap2);
+			ocx_flush_sink(os, p, (size_t)i);
+			free(p);
+		}
+	}
+	va_end(ap2);
+	os->nput++;
+	os->nbyte += (size_t)i;
+	if (i < OCX_BUFSIZE)
+		os->len += (size_t)i;
+	if (os->len >= OCX_BUFSIZE / 2 || (chan != OCX_TRACE &&
+	    os->len > 0 && os->buf[os->len - 1] == '\n')) {
+		ocx_flush_sink(os, os->buf, os->len);
+		os->len = 0;
+	}
+}
+
+/**********************************************************************/
+
 static void __match_proto__()
 putv(struct ocx *ocx, enum ocx_chan chan, const char *fmt, va_list ap)
 {
-	FILE *dst = getdst(chan);
+	FILE *dst;
 	va_list ap2;
 
+	if (ocx != NULL) {
+		CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+		assert(chan < OCX_NCHAN);
+		if (ocx->sink[chan].fd >= 0) {
+			ocx_putv(&ocx->sink[chan], chan, fmt, ap);
+			return;
+		}
+	}
+
 	va_copy(ap2, ap);
-	AZ(ocx);
-	if (dst != NULL)
-		(void)vfprintf(dst, fmt, ap);
 	if (chan == OCX_DIAG)
 		vsyslog(LOG_ERR, fmt, ap2);
 	va_end(ap2);
+
+	dst = getdst(chan);
+	if (chan == OCX_TRACE && trace_ring != NULL)
+		trace_put(fmt, ap);
+	else if (dst != NULL)
+		(void)vfprintf(dst, fmt, ap);
 }
 
 /**********************************************************************
- * XXX: take strftime format string to chop tracefiles in time.
+ * Channel and trace subsystem masks, see ntimed.h
+ *
+ * The OCX_TRACE bit in ocx_chan_mask follows the global tracefile,
+ * unless -M turned the channel off.  OCX_DIAG can not be turned off.
  */
 
+unsigned ocx_chan_mask = (1U << OCX_DIAG) | (1U << OCX_DEBUG);
+unsigned ocx_trace_mask = ~0U;
+static unsigned ocx_chan_off;
+
+static const char * const ocx_chan_names[] = {
+	[OCX_TRACE] =		"trace",
+	[OCX_DEBUG] =		"debug",
+};
+
+static const char * const ocx_trace_names[] = {
+	[OCX_TRC_FILTER] =	"filter",
+	[OCX_TRC_COMBINE] =	"combine",
+	[OCX_TRC_PLL] =		"pll",
+	[OCX_TRC_TODO] =	"todo",
+	[OCX_TRC_PACKET] =	"packet",
+};
+
+#define OCX_NTRACE (sizeof ocx_trace_names / sizeof ocx_trace_names[0])
+
+static void
+ocx_trace_update(void)
+{
+
+	if (tracefile != NULL && !(ocx_chan_off & (1U << OCX_TRACE)))
+		ocx_chan_mask |= 1U << OCX_TRACE;
+	else
+		ocx_chan_mask &= ~(1U << OCX_TRACE);
+}
+
+/*
+ * "filter,pll" traces only those, "-todo,-packet" everything else,
+ * "all" and "none" do what they say.  The first subsystem decides
+ * whether the rest are added to nothing or taken from everything.
+ *
+ * The channels "debug" and "trace" can be turned off ("-debug") and
+ * on again, without affecting the subsystems.
+ */
+
+static int
+ocx_chan_arg(const char *p, int neg)
+{
+	unsigned u;
+
+	for (u = 0; u < OCX_NCHAN; u++)
+		if (ocx_chan_names[u] != NULL &&
+		    !strcmp(p, ocx_chan_names[u]))
+			break;
+	if (u == OCX_NCHAN)
+		return (0);
+	if (neg) {
+		ocx_chan_off |= 1U << u;
+		ocx_chan_mask &= ~(1U << u);
+	} else {
+		ocx_chan_off &= ~(1U << u);
+		if (u != OCX_TRACE)
+			ocx_chan_mask |= 1U << u;
+	}
+	ocx_trace_update();
+	return (1);
+}
+
 void
-ArgTracefile(const char *fn)
+ArgTraceMask(const char *spec)
+{
+	char *p, *q, *s;
+	unsigned u;
+	int neg, first = 1;
+
+	AN(spec);
+	s = strdup(spec);
+	AN(s);
+	for (p = strtok_r(s, ",", &q); p != NULL; p = strtok_r(NULL, ",", &q)) {
+		neg = *p == '-';
+		if (neg)
+			p++;
+		if (ocx_chan_arg(p, neg))
+			continue;
+		if (first)
+			ocx_trace_mask = neg ? ~0U : 0U;
+		first = 0;
+		if (!strcmp(p, "all")) {
+			ocx_trace_mask = neg ? 0U : ~0U;
+			continue;
+		}
+		if (!strcmp(p, "none")) {
+			ocx_trace_mask = neg ? ~0U : 0U;
+			continue;
+		}
+		for (u = 0; u < OCX_NTRACE; u++)
+			if (!strcmp(p, ocx_trace_names[u]))
+				break;
+		if (u == OCX_NTRACE)
+			Fail(NULL, 0, "Unknown trace subsystem or channel "
+			    "'%s' (filter, combine, pll, todo, packet, all, "
+			    "none, debug, trace)", p);
+		if (neg)
+			ocx_trace_mask &= ~(1U << u);
+		else
+			ocx_trace_mask |= 1U << u;
+	}
+	free(s);
+}
+
+/**********************************************************************
+ * XXX: take strftime format string to chop tracefiles in time.
+ */
+
+static void
+trace_close(void)
 {
 
+	trace_stop_writer();
+	trace_binary = 0;
 	if (tracefile != NULL && tracefile != stdout) {
 		AZ(fclose(tracefile));
 		tracefile = NULL;
 	}
+	ocx_trace_update();
+}
+
+void
+ArgTracefile(const char *fn)
+{
+
+	static int once;
+
+	if (!once) {
+		AZ(atexit(trace_close));
+		once = 1;
+	}
+	trace_close();
 
 	if (fn == NULL)
 		return;
 
 	if (!strcmp(fn, "-")) {
 		tracefile = stdout;
+		ocx_trace_update();
 		return;
 	}
 
@@ -122,6 +696,52 @@ ArgTracefile(const char *fn)
 	if (tracefile == NULL)
 		Fail(NULL, 1, "Could not open '%s' for writing", fn);
 	setbuf(tracefile, NULL);
+	trace_start_writer(tracefile);
+	ocx_trace_update();
+}
+
+/**********************************************************************
+ * Binary tracefile, see trace.h
+ */
+
+void
+ArgTracefileBin(const char *fn)
+{
+	char buf[TRACE_BIN_HDRLEN];
+	size_t l;
+
+	AN(fn);
+	if (!strcmp(fn, "-"))
+		Fail(NULL, 0, "Binary tracefile cannot be stdout");
+	ArgTracefile(fn);
+	l = TraceBin_Header(buf, sizeof buf);
+	if (write(fileno(tracefile), buf, l) != (ssize_t)l)
+		Fail(NULL, 1, "Could not write to '%s'", fn);
+	trace_binary = 1;
+}
+
+/* Contexts with a trace sink of their own always get text */
+
+int
+TraceBinary(const struct ocx *ocx)
+{
+
+	if (ocx != NULL) {
+		CHECK_OBJ_NOTNULL(ocx, OCX_MAGIC);
+		if (ocx->sink[OCX_TRACE].fd >= 0)
+			return (0);
+	}
+	return (trace_binary);
+}
+
+void
+PutBin(struct ocx *ocx, enum ocx_chan chan, const void *ptr, size_t len)
+{
+
+	AN(TraceBinary(ocx));
+	AN(ptr);
+	assert(chan == OCX_TRACE);
+	trace_put_raw(ptr, len);
 }
 
 /**********************************************************************
@@ -134,7 +754,8 @@ Put(struct ocx *ocx, enum ocx_chan chan, const char *fmt, ...)
 {
 	va_list ap;
 
-	AZ(ocx);
+	if (!OCX_ENABLED(ocx, chan))
+		return;
 	va_start(ap, fmt);
 	putv(ocx, chan, fmt, ap);
 	va_end(ap);
@@ -169,5 +790,7 @@ Fail(struct ocx *ocx, int err, const char *fmt, ...)
 	Put(ocx, OCX_DIAG, "\n");
 	if (err)
 		Put(ocx, OCX_DIAG, "errno = %d (%s)\n", err, strerror(err));
+	if (ocx != NULL)
+		OCX_Flush(ocx);
 	exit(1);
 }
@@ -87,8 +87,16 @@ param_wrapline(struct ocx *ocx, const char *b)
 	}
 }
 
-void
-Param_Tweak(struct ocx *ocx, const char *arg)
+/**********************************************************************
+ * List, describe or set parameters:
+ *	"?"		List names
+ *	"name"		Describe it
+ *	"name=value"	Set it
+ * Returns -1 (with an explanation on DIAG) if arg makes no sense.
+ */
+
+int
+Param_Cmd(struct ocx *ocx, const char *arg)
 {
 	struct param_tbl *pt;
 	const char *q;
@@ -96,11 +104,12 @@ Param_Tweak(struct ocx *ocx, const char *arg)
 	double d;
 	size_t l;
 
+	AN(arg);
 	if (!strcmp(arg, "?")) {
 		Put(ocx, OCX_DIAG, "List of available parameters:\n");
 		TAILQ_FOREACH(pt, &param_tbl, list)
 			Put(ocx, OCX_DIAG, "\t%s\n", pt->name);
-		Fail(ocx, 0, "Stopping after parameter query.\n");
+		return (0);
 	}
 
 	q = strchr(arg, '=');
@@ -108,17 +117,20 @@ Param_Tweak(struct ocx *ocx, const char *arg)
 		TAILQ_FOREACH(pt, &param_tbl, list)
 			if (!strcmp(pt->name, arg))
 				break;
-		if (pt == NULL)
-			Fail(ocx, 0, "-p unknown parameter '%s' (try -p '?')",
-			    arg);
+		if (pt == NULL) {
+			Put(ocx, OCX_DIAG,
+			    "Unknown parameter '%s' (try '?')\n", arg);
+			return (-1);
+		}
 		Put(ocx, OCX_DIAG, "Parameter:\n\t%s\n", pt->name);
+		Put(ocx, OCX_DIAG, "Value:\n\t%.3e\n", *pt->val);
 		Put(ocx, OCX_DIAG, "Minimum:\n\t%.3e\n", pt->min);
 		Put(ocx, OCX_DIAG, "Maximum:\n\t%.3e\n", pt->max);
 		Put(ocx, OCX_DIAG, "Default:\n\t%.3e\n", pt->def);
 		Put(ocx, OCX_DIAG, "Description:\n");
 		param_wrapline(ocx, pt->doc);
 		Put(ocx, OCX_DIAG, "\n\n");
-		Fail(ocx, 0, "Stopping after parameter query.\n");
+		return (0);
 	}
 
 	assert (q >= arg);
@@ -130,24 +142,44 @@ Param_Tweak(struct ocx *ocx, const char *arg)
 		if (!strncmp(pt->name, arg, l))
 			break;
 	}
-	if (pt == NULL)
-		Fail(ocx, 0, "-p unknown parameter '%.*s' (try -p '?')",
+	if (pt == NULL) {
+		Put(ocx, OCX_DIAG, "Unknown parameter '%.*s' (try '?')\n",
 		    (int)(q - arg), arg);
+		return (-1);
+	}
 
 	r = NULL;
 	d = strtod(q + 1, &r);
-	if (*r != '\0')
-		Fail(ocx, 0, "-p '%.*s' bad value '%s'\n",
+	if (q[1] == '\0' || *r != '\0') {
+		Put(ocx, OCX_DIAG, "'%.*s' bad value '%s'\n",
 		    (int)(q - arg), arg, q + 1);
-	if (d < pt->min)
-		Fail(ocx, 0, "-p '%.*s' below min value (%g)\n",
+		return (-1);
+	}
+	if (d < pt->min) {
+		Put(ocx, OCX_DIAG, "'%.*s' below min value (%g)\n",
 		    (int)(q - arg), arg, pt->min);
-	if (d > pt->max)
-		Fail(ocx, 0, "-p '%.*s' above max value (%g)\n",
+		return (-1);
+	}
+	if (d > pt->max) {
+		Put(ocx, OCX_DIAG, "'%.*s' above max value (%g)\n",
 		    (int)(q - arg), arg, pt->max);
+		return (-1);
+	}
 	Put(ocx, OCX_DIAG, "# Tweak(%s -> %.3e)\n", arg, d);
 	*(pt->val) = d;
-	return;
+	return (0);
+}
+
+/* The -p argument: Anything but setting a parameter stops the program */
+
+void
+Param_Tweak(struct ocx *ocx, const char *arg)
+{
+
+	if (Param_Cmd(ocx, arg))
+		Fail(ocx, 0, "Bad -p argument '%s'\n", arg);
+	if (strchr(arg, '=') == NULL)
+		Fail(ocx, 0, "Stopping after parameter query.\n");
 }
 
 void
@@ -111,5 +111,97 @@ PARAM_PLL_STD(pll_std_p_limit,
 
 #endif
 
+/**********************************************************************
+ * Parameters for main_sim_gen.c
+ */
+
+#ifdef PARAM_SIM_GEN
+
+PARAM_SIM_GEN(sim_gen_freq,
+	-500, 500, 10,
+	"Initial frequency error of the simulated oscillator, in PPM."
+)
+
+PARAM_SIM_GEN(sim_gen_rwfm,
+	0, 1e-6, 1e-10,
+	"Random walk frequency noise.\n\n"
+	"Standard deviation of the fractional frequency change per"
+	" square root of a second."
+	"  The default gives about 0.03 PPM after a day."
+)
+
+PARAM_SIM_GEN(sim_gen_flicker,
+	0, 1e-5, 1e-9,
+	"Flicker frequency noise.\n\n"
+	"Standard deviation of the fractional frequency, in a 1/f"
+	" spectrum from about ten seconds to a day."
+)
+
+PARAM_SIM_GEN(sim_gen_temp_swing,
+	0, 50, 5,
+	"Amplitude of the daily temperature swing, in degrees."
+)
+
+PARAM_SIM_GEN(sim_gen_tempco,
+	0, 10, 0.1,
+	"Frequency change of the oscillator per degree, in PPM."
+)
+
+PARAM_SIM_GEN(sim_gen_delay,
+	1e-6, 1, 5e-3,
+	"One-way network delay to the servers, in seconds."
+)
+
+PARAM_SIM_GEN(sim_gen_asymmetry,
+	0.05, 0.95, 0.5,
+	"Fraction of the round-trip delay spent on the way to the server."
+)
+
+PARAM_SIM_GEN(sim_gen_queue_up,
+	0, 1, 1e-4,
+	"Mean exponentially distributed queueing delay towards the servers,"
+	" in seconds."
+)
+
+PARAM_SIM_GEN(sim_gen_queue_down,
+	0, 1, 5e-4,
+	"Mean exponentially distributed queueing delay from the servers,"
+	" in seconds."
+)
+
+PARAM_SIM_GEN(sim_gen_route_rate,
+	0, 1000, 1,
+	"Route changes per server per day.\n\n"
+	"A route change moves both the delay and its asymmetry by up to"
+	" sim_gen_route_delta."
+)
+
+PARAM_SIM_GEN(sim_gen_route_delta,
+	0, 0.99, 0.5,
+	"Largest relative change of the path delay on a route change."
+)
+
+PARAM_SIM_GEN(sim_gen_falsetickers,
+	0, 100, 0,
+	"Number of servers which serve the wrong time."
+)
+
+PARAM_SIM_GEN(sim_gen_false_offset,
+	-1e3, 1e3, 0.1,
+	"How wrong the falsetickers are, in seconds, alternating in sign."
+)
+
+PARAM_SIM_GEN(sim_gen_loss,
+	0, 0.99, 0.01,
+	"Fraction of polls which get no reply."
+)
+
+PARAM_SIM_GEN(sim_gen_poll,
+	1, 4096, 64,
+	"Poll interval for each server, in seconds."
+)
+
+#endif
+
 
 /*lint -restore */
@@ -32,6 +32,8 @@
 #include <math.h>
 
 #include "ntimed.h"
+#include "stats.h"
+#include "trace.h"
 
 #define PARAM_PLL_STD PARAM_INSTANCE
 #define PARAM_TABLE_NAME pll_std_param_table
@@ -50,7 +52,7 @@ static void __match_proto__(pll_f)
 pll_std(struct ocx *ocx, double offset, double weight)
 {
 	double p_term, dur, dt, rt;
-	double used_a, used_b;
+	double used_a, used_b, d[8];
 	struct timestamp t0;
 
 	TB_Now(&t0);
@@ -147,11 +149,26 @@ pll_std(struct ocx *ocx, double offset, double weight)
 		p_term = dur * -500e-6;
 
 	pll_last_time = t0;
-	Put(ocx, OCX_TRACE,
-	    "PLL %d %.3e %.3e %.3e -> %.3e %.3e %.3e %.3e %.3e\n",
-	    pll_mode, dt, offset, weight,
-	    p_term, dur, pll_integrator,
-	    used_a, used_b);
+	d[0] = dt;
+	d[1] = offset;
+	d[2] = weight;
+	d[3] = p_term;
+	d[4] = dur;
+	d[5] = pll_integrator;
+	d[6] = used_a;
+	d[7] = used_b;
+	if (TRACING(ocx, OCX_TRC_PLL))
+		Trace_PLL(ocx, pll_mode, d);
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		stats_seg->pll_mode = (uint32_t)pll_mode;
+		stats_seg->pll_offset = offset;
+		stats_seg->pll_p_term = p_term;
+		stats_seg->pll_integrator = pll_integrator;
+		stats_seg->pll_a = used_a;
+		stats_seg->pll_b = used_b;
+		Stats_End();
+	}
 	if (dur > 0.0)
 		TB_Adjust(ocx, p_term, dur, pll_integrator);
 }
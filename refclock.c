@@ -0,0 +1,254 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Reference clocks
+ * ================
+ *
+ * A reference clock is a source which tells the time directly, a GNSS
+ * receiver for instance, rather than by exchanging packets with it.
+ * The driver is polled, and each new sample is fed to the combiner
+ * next to the NTP peers.
+ *
+ * The offset of a single sample is jittery, so the last RC_NSAMPLE
+ * offsets are kept: the median is reported as the most probable value,
+ * and the spread, widened by the precision of the driver, as the low
+ * and high bounds.
+ *
+ * Samples our clock considers older than RC_MAXAGE are ignored, that
+ * catches a writer which died and left its last sample behind.
+ *
+ * A pulse (PPS) tells precisely where a second starts, but not which
+ * second it is.  That comes from what all the other sources say, through
+ * the combiner, and pulses are ignored while there are no others, or
+ * when their estimate is more than RC_PULSE_MAX from the pulse.  Once
+ * numbered, pulses go to the combiner and pll_std.c like any other
+ * source, and with their far smaller spread they will dominate.
+ *
+ * XXX: No way to remove a refclock again.
+ * XXX: Trust is fixed at 1.0, as for a stratum 1 peer.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "refclock.h"
+#include "stats.h"
+
+#define RC_NSAMPLE		5
+#define RC_MAXAGE		4.0
+#define RC_PULSE_MAX		0.4
+
+struct refclock {
+	unsigned			magic;
+#define REFCLOCK_MAGIC			0x7ec10c4b
+
+	const struct refclock_driver	*drv;
+	void				*priv;
+	char				*name;
+	char				*arg;
+
+	struct combiner			*combiner;
+	struct stats_peer		*sp;
+
+	int				generation;
+	unsigned			nsample;
+	double				off[RC_NSAMPLE];
+};
+
+static const struct refclock_driver * const rc_drivers[] = {
+	&RC_PPS_Driver,
+	&RC_SHM_Driver,
+	NULL
+};
+
+static int
+rc_cmp(const void *p1, const void *p2)
+{
+	const double *left = p1;
+	const double *right = p2;
+
+	/*lint -save -e514 */
+	return ((*left > *right) - (*left < *right));
+	/*lint -restore */
+}
+
+/**********************************************************************
+ * Number the second of a pulse seen at 'local', given the 'coarse'
+ * offset of our clock.  Returns zero if that is too far from any second
+ * to tell.
+ */
+
+int
+RC_PulseOffset(const struct timestamp *local, double coarse, double *offset)
+{
+	struct timestamp sec;
+	double d;
+
+	AN(local);
+	AN(offset);
+	sec = *local;
+	sec.frac = 0;
+	d = TS_Diff(local, &sec);
+	d -= nearbyint(d - coarse);
+	if (fabs(d - coarse) > RC_PULSE_MAX)
+		return (0);
+	*offset = d;
+	return (1);
+}
+
+static void
+rc_sample(struct ocx *ocx, struct refclock *rc,
+    const struct refclock_sample *rs)
+{
+	double d[RC_NSAMPLE];
+	double lo, mid, hi, age, coarse, off;
+	struct timestamp now, ref;
+	unsigned n;
+
+	if (rs->leap == NTP_LEAP_UNKNOWN) {
+		Trace(ocx, OCX_TRC_FILTER, "RC %s:%s not in sync\n",
+		    rc->name, rc->arg);
+		return;
+	}
+	age = TS_Diff(TB_Now(&now), &rs->local);
+	if (age > RC_MAXAGE) {
+		Trace(ocx, OCX_TRC_FILTER, "RC %s:%s stale %.3e\n",
+		    rc->name, rc->arg, age);
+		return;
+	}
+
+	if (rs->pulse) {
+		if (!CD_Estimate(rc->combiner, &coarse)) {
+			Trace(ocx, OCX_TRC_FILTER,
+			    "RC %s:%s no other source to number seconds\n",
+			    rc->name, rc->arg);
+			return;
+		}
+		if (!RC_PulseOffset(&rs->local, coarse, &off)) {
+			Trace(ocx, OCX_TRC_FILTER,
+			    "RC %s:%s pulse far from estimate %.3e\n",
+			    rc->name, rc->arg, coarse);
+			return;
+		}
+		ref = rs->local;
+		TS_Add(&ref, -off);
+	} else {
+		ref = rs->ref;
+	}
+
+	/* The clock was stepped, older offsets are meaningless */
+	if (rc->generation != TB_generation) {
+		rc->generation = TB_generation;
+		rc->nsample = 0;
+	}
+
+	/* Sign: local - reference -> positive is ahead */
+	rc->off[rc->nsample++ % RC_NSAMPLE] = TS_Diff(&rs->local, &ref);
+	n = rc->nsample < RC_NSAMPLE ? rc->nsample : RC_NSAMPLE;
+	memcpy(d, rc->off, sizeof d);
+	qsort(d, n, sizeof d[0], rc_cmp);
+
+	lo = d[0] - rs->precision;
+	mid = d[n / 2];
+	hi = d[n - 1] + rs->precision;
+
+	Trace(ocx, OCX_TRC_FILTER, "RC %s:%s %u %.3e %.3e %.3e\n",
+	    rc->name, rc->arg, n, lo, mid, hi);
+
+	if (rc->sp != NULL) {
+		Stats_Begin();
+		rc->sp->npkt++;
+		rc->sp->lo = lo;
+		rc->sp->mid = mid;
+		rc->sp->hi = hi;
+		rc->sp->trust = 1.0;
+		Stats_End();
+	}
+
+	rc->combiner->func(ocx, rc->combiner, 1.0, lo, mid, hi);
+}
+
+static enum todo_e __match_proto__(todo_f)
+rc_poll(struct ocx *ocx, struct todolist *tdl, void *priv)
+{
+	struct refclock *rc;
+	struct refclock_sample rs;
+
+	(void)tdl;
+	CAST_OBJ_NOTNULL(rc, priv, REFCLOCK_MAGIC);
+
+	memset(&rs, 0, sizeof rs);
+	if (rc->drv->poll(ocx, rc->priv, &rs))
+		rc_sample(ocx, rc, &rs);
+	return (TODO_OK);
+}
+
+/**********************************************************************
+ * Spec is "driver[:argument]", fx: "shm:0"
+ */
+
+struct refclock *
+RC_New(struct ocx *ocx, struct todolist *tdl, struct combine_delta *cd,
+    const char *spec)
+{
+	struct refclock *rc;
+	const struct refclock_driver * const *drv;
+	char *p;
+
+	AN(tdl);
+	AN(cd);
+	AN(spec);
+
+	ALLOC_OBJ(rc, REFCLOCK_MAGIC);
+	AN(rc);
+	rc->name = strdup(spec);
+	AN(rc->name);
+	p = strchr(rc->name, ':');
+	if (p != NULL)
+		*p++ = '\0';
+	else
+		p = strchr(rc->name, '\0');
+	rc->arg = p;
+
+	for (drv = rc_drivers; *drv != NULL; drv++)
+		if (!strcmp((*drv)->name, rc->name))
+			break;
+	if (*drv == NULL)
+		Fail(ocx, 0, "Unknown reference clock driver '%s'", rc->name);
+	rc->drv = *drv;
+	rc->priv = rc->drv->init(ocx, rc->arg);
+	AN(rc->priv);
+
+	rc->generation = TB_generation;
+	rc->combiner = CD_AddSource(cd, rc->name, rc->arg);
+	rc->sp = Stats_PeerNew(rc->name, rc->arg);
+
+	(void)TODO_ScheduleRel(tdl, rc_poll, rc, 0.0, rc->drv->interval,
+	    "RC %s:%s", rc->name, rc->arg);
+	return (rc);
+}
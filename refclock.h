@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Reference clock driver interface
+ * ================================
+ *
+ * A driver is polled by refclock.c, and when it has a new sample it
+ * hands back what the reference said the time was, and what our
+ * clock said at that same instant.
+ *
+ * Drivers for pulses (PPS) only know that the reference was on a
+ * whole second, they set 'pulse' and leave 'ref' for refclock.c.
+ */
+
+#ifdef REFCLOCK_H_INCLUDED
+#error "refclock.h included multiple times"
+#endif
+#define REFCLOCK_H_INCLUDED
+
+struct refclock_sample {
+	struct timestamp	ref;		// Reference time
+	struct timestamp	local;		// Our time at that instant
+	double			precision;	// Seconds
+	int			leap;		// enum ntp_leap
+	int			pulse;		// On the second
+};
+
+typedef void *refclock_init_f(struct ocx *, const char *arg);
+typedef int refclock_poll_f(struct ocx *, void *priv,
+    struct refclock_sample *);
+
+struct refclock_driver {
+	const char		*name;
+	double			interval;	// Seconds between polls
+	refclock_init_f		*init;
+	refclock_poll_f		*poll;		// 1 if new sample
+};
+
+/* refclock.c -- Reference clock framework ****************************/
+
+struct refclock;
+
+struct refclock *RC_New(struct ocx *, struct todolist *,
+    struct combine_delta *, const char *spec);
+int RC_PulseOffset(const struct timestamp *local, double coarse,
+    double *offset);
+
+/* refclock_shm.c -- Shared memory driver *****************************/
+
+extern const struct refclock_driver RC_SHM_Driver;
+
+struct rc_shm;
+
+struct rc_shm *RC_SHM_Open(struct ocx *, unsigned unit);
+void RC_SHM_Put(struct rc_shm *, const struct refclock_sample *);
+void RC_SHM_RunTest(struct ocx *);
+
+/* refclock_pps.c -- PPS driver ***************************************/
+
+extern const struct refclock_driver RC_PPS_Driver;
+
+void RC_PPS_RunTest(struct ocx *);
@@ -0,0 +1,316 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * PPS reference clock driver
+ * ==========================
+ *
+ * Reads the assert edges the kernel timestamped on a PPS device, with
+ * the RFC 2783 API, fx: "pps:/dev/pps0".  Only the latest edge is
+ * fetched, without waiting, and the sequence number tells if it is new.
+ * The edge is on a whole second, refclock.c finds out which.
+ *
+ * Without hardware, "pps:file:edges" plays a script instead of calling
+ * time_pps_fetch(): one line per second, starting at the next second,
+ * with the offset of our clock at that pulse (in seconds), or '-' for a
+ * missing pulse.  Empty lines and lines starting with '#' are ignored.
+ * When the script runs out, the pulses stop.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_TIMEPPS_H
+#include <fcntl.h>
+#include <sys/timepps.h>
+#endif
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "refclock.h"
+
+#define RC_PPS_PRECISION	1e-6
+
+struct rc_pps;
+
+typedef int rc_pps_fetch_f(struct rc_pps *, const struct timestamp *now,
+    struct timestamp *assert, unsigned long *seq);
+
+struct rc_pps {
+	unsigned		magic;
+#define RC_PPS_MAGIC		0x9b5e12a7
+	rc_pps_fetch_f		*fetch;
+	unsigned long		seq;		// Last one used
+
+#ifdef HAVE_TIMEPPS_H
+	pps_handle_t		handle;
+#endif
+
+	/* The script stand-in */
+	double			*edge;		// NAN: missing pulse
+	unsigned		nedge;
+	unsigned		next;
+	uint64_t		sec;
+	unsigned long		nseq;
+	struct timestamp	assert;
+};
+
+/**********************************************************************
+ * RFC 2783 PPS API
+ */
+
+#ifdef HAVE_TIMEPPS_H
+
+static int __match_proto__(rc_pps_fetch_f)
+rc_pps_kernel(struct rc_pps *rp, const struct timestamp *now,
+    struct timestamp *assert, unsigned long *seq)
+{
+	pps_info_t pi;
+	struct timespec tmo;
+
+	(void)now;
+	tmo.tv_sec = 0;
+	tmo.tv_nsec = 0;
+	if (time_pps_fetch(rp->handle, PPS_TSFMT_TSPEC, &pi, &tmo) < 0)
+		return (0);
+	(void)TS_Nanosec(assert, pi.assert_timestamp.tv_sec,
+	    pi.assert_timestamp.tv_nsec);
+	*seq = pi.assert_sequence;
+	return (1);
+}
+
+static void
+rc_pps_open(struct ocx *ocx, struct rc_pps *rp, const char *dev)
+{
+	pps_params_t pp;
+	int fd, mode;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0)
+		Fail(ocx, errno, "Could not open PPS device %s", dev);
+	if (time_pps_create(fd, &rp->handle) < 0)
+		Fail(ocx, errno, "%s is not a PPS device", dev);
+	if (time_pps_getcap(rp->handle, &mode) < 0)
+		Fail(ocx, errno, "Could not get PPS capabilities of %s", dev);
+	if (!(mode & PPS_CAPTUREASSERT) || !(mode & PPS_TSFMT_TSPEC))
+		Fail(ocx, 0, "%s cannot timestamp assert edges", dev);
+	if (time_pps_getparams(rp->handle, &pp) < 0)
+		Fail(ocx, errno, "Could not get PPS parameters of %s", dev);
+	pp.mode = PPS_CAPTUREASSERT | PPS_TSFMT_TSPEC;
+	if (time_pps_setparams(rp->handle, &pp) < 0)
+		Fail(ocx, errno, "Could not set PPS parameters of %s", dev);
+	rp->fetch = rc_pps_kernel;
+}
+
+#else
+
+static void
+rc_pps_open(struct ocx *ocx, struct rc_pps *rp, const char *dev)
+{
+
+	(void)rp;
+	Fail(ocx, 0, "No PPS API (sys/timepps.h), cannot use %s", dev);
+}
+
+#endif
+
+/**********************************************************************
+ * Scripted stand-in for time_pps_fetch()
+ */
+
+static int __match_proto__(rc_pps_fetch_f)
+rc_pps_script(struct rc_pps *rp, const struct timestamp *now,
+    struct timestamp *assert, unsigned long *seq)
+{
+	struct timestamp t;
+	double e;
+
+	if (rp->sec == 0)
+		rp->sec = now->sec + 1;
+	for (; rp->next < rp->nedge; rp->next++, rp->sec++) {
+		e = rp->edge[rp->next];
+		(void)TS_Nanosec(&t, (int64_t)rp->sec, 0);
+		if (!isnan(e))
+			TS_Add(&t, e);
+		if (TS_Diff(now, &t) < 0.0)
+			break;
+		if (!isnan(e)) {
+			rp->assert = t;
+			rp->nseq++;
+		}
+	}
+	if (rp->nseq == 0)
+		return (0);
+	*assert = rp->assert;
+	*seq = rp->nseq;
+	return (1);
+}
+
+static void
+rc_pps_load(struct ocx *ocx, struct rc_pps *rp, FILE *f)
+{
+	char buf[BUFSIZ], *p, *e;
+	unsigned lineno = 0;
+	double d;
+
+	while (fgets(buf, sizeof buf, f) != NULL) {
+		lineno++;
+		p = buf + strspn(buf, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (*p == '-' && strspn(p + 1, " \t\n") == strlen(p + 1)) {
+			d = NAN;
+		} else {
+			d = strtod(p, &e);
+			if (e == p || strspn(e, " \t\n") != strlen(e) ||
+			    fabs(d) >= 1.0)
+				Fail(ocx, 0, "Bad PPS script line %u", lineno);
+		}
+		rp->edge = realloc(rp->edge, (rp->nedge + 1L) * sizeof d);
+		AN(rp->edge);
+		rp->edge[rp->nedge++] = d;
+	}
+	rp->fetch = rc_pps_script;
+}
+
+/**********************************************************************/
+
+static int
+rc_pps_sample(struct rc_pps *rp, const struct timestamp *now,
+    struct refclock_sample *smp)
+{
+	struct timestamp ts;
+	unsigned long seq;
+
+	if (!rp->fetch(rp, now, &ts, &seq) || seq == rp->seq)
+		return (0);
+	rp->seq = seq;
+	smp->local = ts;
+	smp->pulse = 1;
+	smp->precision = RC_PPS_PRECISION;
+	smp->leap = NTP_LEAP_NONE;
+	return (1);
+}
+
+static int __match_proto__(refclock_poll_f)
+rc_pps_poll(struct ocx *ocx, void *priv, struct refclock_sample *smp)
+{
+	struct rc_pps *rp;
+	struct timestamp now;
+
+	(void)ocx;
+	CAST_OBJ_NOTNULL(rp, priv, RC_PPS_MAGIC);
+	AN(smp);
+	return (rc_pps_sample(rp, TB_Now(&now), smp));
+}
+
+static void * __match_proto__(refclock_init_f)
+rc_pps_init(struct ocx *ocx, const char *arg)
+{
+	struct rc_pps *rp;
+	FILE *f;
+
+	AN(arg);
+	ALLOC_OBJ(rp, RC_PPS_MAGIC);
+	AN(rp);
+	if (!strncmp(arg, "file:", 5)) {
+		f = fopen(arg + 5, "r");
+		if (f == NULL)
+			Fail(ocx, errno, "Could not open PPS script %s",
+			    arg + 5);
+		rc_pps_load(ocx, rp, f);
+		AZ(fclose(f));
+	} else {
+		rc_pps_open(ocx, rp, arg);
+	}
+	return (rp);
+}
+
+const struct refclock_driver RC_PPS_Driver = {
+	.name =		"pps",
+	.interval =	1.0,
+	.init =		rc_pps_init,
+	.poll =		rc_pps_poll,
+};
+
+/**********************************************************************/
+
+static const char rc_pps_test_script[] =
+    "# Test\n"
+    "0.0001\n"
+    "-\n"
+    "\n"
+    "-0.0002\n";
+
+void
+RC_PPS_RunTest(struct ocx *ocx)
+{
+	struct rc_pps *rp;
+	struct refclock_sample smp;
+	struct timestamp now, sec;
+	double d;
+	FILE *f;
+	int nf = 0;
+
+	ALLOC_OBJ(rp, RC_PPS_MAGIC);
+	AN(rp);
+	f = fmemopen((void *)(uintptr_t)rc_pps_test_script,
+	    sizeof rc_pps_test_script - 1L, "r");
+	AN(f);
+	rc_pps_load(ocx, rp, f);
+	AZ(fclose(f));
+	nf += rp->nedge != 3;
+
+	/* The script starts at the next second */
+	memset(&smp, 0, sizeof smp);
+	nf += rc_pps_sample(rp, TS_Double(&now, 1000.5), &smp) != 0;
+	nf += rc_pps_sample(rp, TS_Double(&now, 1001.00005), &smp) != 0;
+	nf += rc_pps_sample(rp, TS_Double(&now, 1001.5), &smp) != 1;
+	nf += !smp.pulse;
+	nf += fabs(TS_Diff(&smp.local, TS_Nanosec(&sec, 1001, 100000)))
+	    > 1e-9;
+
+	/* A missing pulse is nothing new */
+	nf += rc_pps_sample(rp, TS_Double(&now, 1002.5), &smp) != 0;
+
+	/* Early pulses belong to the next second */
+	nf += rc_pps_sample(rp, TS_Double(&now, 1002.9999), &smp) != 1;
+	nf += !RC_PulseOffset(&smp.local, 0.05, &d);
+	nf += fabs(d + 0.0002) > 1e-9;
+	nf += rc_pps_sample(rp, TS_Double(&now, 1010.0), &smp) != 0;
+
+	/* Second numbering */
+	(void)TS_Double(&now, 1001.7);
+	nf += !RC_PulseOffset(&now, 0.0, &d) || fabs(d + 0.3) > 1e-9;
+	nf += !RC_PulseOffset(&now, 0.6, &d) || fabs(d - 0.7) > 1e-9;
+	nf += RC_PulseOffset(&now, 0.2, &d) != 0;
+
+	free(rp->edge);
+	FREE_OBJ(rp);
+	Debug(ocx, "RC_PPS_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
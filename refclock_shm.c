@@ -0,0 +1,269 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Shared memory reference clock driver
+ * ====================================
+ *
+ * The SysV shared memory segment ntpd introduced, and which gpsd and
+ * others write to, one segment per unit, with key 0x4e545030 + unit.
+ * Units 0 and 1 are only accessible to root, the rest to everybody.
+ *
+ * The writer clears 'valid', bumps 'count', writes the sample, bumps
+ * 'count' again and sets 'valid'.  The reader takes the sample if it is
+ * valid, and in mode 1 only if 'count' did not change while it copied
+ * it, then clears 'valid' so the same sample is not used twice.
+ * Polling the segment costs no system calls.
+ *
+ * The nanosecond fields came later than the microsecond ones, they are
+ * only trusted if they agree with them.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "refclock.h"
+
+#define RC_SHM_KEY		0x4e545030
+
+/* The layout is fixed by ntpd, native types and all */
+struct shm_time {
+	int			mode;
+	volatile int		count;
+	time_t			clock_sec;
+	int			clock_usec;
+	time_t			rx_sec;
+	int			rx_usec;
+	int			leap;
+	int			precision;
+	int			nsamples;
+	volatile int		valid;
+	unsigned		clock_nsec;
+	unsigned		rx_nsec;
+	int			dummy[8];
+};
+
+struct rc_shm {
+	unsigned		magic;
+#define RC_SHM_MAGIC		0x5e3a11c9
+	int			id;
+	volatile struct shm_time *shm;
+	unsigned		nsample;
+	unsigned		ntorn;
+};
+
+static struct rc_shm *
+rc_shm_attach(struct ocx *ocx, key_t key, int perm)
+{
+	struct rc_shm *rs;
+	void *p;
+
+	ALLOC_OBJ(rs, RC_SHM_MAGIC);
+	AN(rs);
+	rs->id = shmget(key, sizeof *rs->shm, IPC_CREAT | perm);
+	if (rs->id < 0)
+		Fail(ocx, errno, "Could not get SHM segment 0x%08lx",
+		    (unsigned long)key);
+	p = shmat(rs->id, NULL, 0);
+	if (p == (void *)-1)
+		Fail(ocx, errno, "Could not attach SHM segment 0x%08lx",
+		    (unsigned long)key);
+	rs->shm = p;
+	return (rs);
+}
+
+static void
+rc_shm_ts(struct timestamp *ts, time_t sec, int usec, unsigned nsec)
+{
+
+	if (nsec < 1000000000U && nsec / 1000 == (unsigned)usec)
+		(void)TS_Nanosec(ts, sec, nsec);
+	else
+		(void)TS_Nanosec(ts, sec, usec * 1000LL);
+}
+
+static int __match_proto__(refclock_poll_f)
+rc_shm_poll(struct ocx *ocx, void *priv, struct refclock_sample *smp)
+{
+	struct rc_shm *rs;
+	volatile struct shm_time *shm;
+	struct shm_time st;
+	int cnt;
+
+	CAST_OBJ_NOTNULL(rs, priv, RC_SHM_MAGIC);
+	AN(smp);
+	shm = rs->shm;
+
+	if (!shm->valid)
+		return (0);
+	cnt = shm->count;
+	atomic_thread_fence(memory_order_acquire);
+	st.mode = shm->mode;
+	st.clock_sec = shm->clock_sec;
+	st.clock_usec = shm->clock_usec;
+	st.clock_nsec = shm->clock_nsec;
+	st.rx_sec = shm->rx_sec;
+	st.rx_usec = shm->rx_usec;
+	st.rx_nsec = shm->rx_nsec;
+	st.leap = shm->leap;
+	st.precision = shm->precision;
+	atomic_thread_fence(memory_order_acquire);
+	if (st.mode == 1 && shm->count != cnt) {
+		/* The writer was at it, try again next time */
+		rs->ntorn++;
+		Trace(ocx, OCX_TRC_FILTER, "RC shm torn sample\n");
+		return (0);
+	}
+	shm->valid = 0;
+
+	rc_shm_ts(&smp->ref, st.clock_sec, st.clock_usec, st.clock_nsec);
+	rc_shm_ts(&smp->local, st.rx_sec, st.rx_usec, st.rx_nsec);
+	smp->precision = ldexp(1.0, st.precision);
+	smp->leap = st.leap;
+	rs->nsample++;
+	return (1);
+}
+
+static void * __match_proto__(refclock_init_f)
+rc_shm_init(struct ocx *ocx, const char *arg)
+{
+	unsigned long u;
+	char *e;
+
+	AN(arg);
+	u = strtoul(arg, &e, 0);
+	if (*arg == '\0' || *e != '\0' || u > 255)
+		Fail(ocx, 0, "Bad SHM unit '%s'", arg);
+	return (RC_SHM_Open(ocx, (unsigned)u));
+}
+
+const struct refclock_driver RC_SHM_Driver = {
+	.name =		"shm",
+	.interval =	1.0,
+	.init =		rc_shm_init,
+	.poll =		rc_shm_poll,
+};
+
+/**********************************************************************
+ * The writer side, for the --shm-write stand-in and the tests
+ */
+
+struct rc_shm *
+RC_SHM_Open(struct ocx *ocx, unsigned unit)
+{
+
+	return (rc_shm_attach(ocx, (key_t)(RC_SHM_KEY + unit),
+	    unit < 2 ? 0600 : 0666));
+}
+
+void
+RC_SHM_Put(struct rc_shm *rs, const struct refclock_sample *smp)
+{
+	volatile struct shm_time *shm;
+	uint64_t sec;
+	uint32_t nsec;
+	int p;
+
+	CHECK_OBJ_NOTNULL(rs, RC_SHM_MAGIC);
+	AN(smp);
+	shm = rs->shm;
+
+	shm->valid = 0;
+	shm->count++;
+	atomic_thread_fence(memory_order_release);
+	shm->mode = 1;
+	TS_ToNanosec(&smp->ref, &sec, &nsec);
+	shm->clock_sec = (time_t)sec;
+	shm->clock_usec = (int)(nsec / 1000);
+	shm->clock_nsec = nsec;
+	TS_ToNanosec(&smp->local, &sec, &nsec);
+	shm->rx_sec = (time_t)sec;
+	shm->rx_usec = (int)(nsec / 1000);
+	shm->rx_nsec = nsec;
+	shm->leap = smp->leap;
+	(void)frexp(smp->precision, &p);
+	shm->precision = p;
+	shm->nsamples = 1;
+	atomic_thread_fence(memory_order_release);
+	shm->count++;
+	shm->valid = 1;
+}
+
+/**********************************************************************/
+
+void
+RC_SHM_RunTest(struct ocx *ocx)
+{
+	struct rc_shm *rs;
+	struct refclock_sample in, out;
+	int nf = 0;
+
+	rs = rc_shm_attach(ocx, IPC_PRIVATE, 0600);
+	/* Removed once the last process detaches */
+	AZ(shmctl(rs->id, IPC_RMID, NULL));
+
+	/* Empty segment, nothing to read */
+	nf += rc_shm_poll(ocx, rs, &out) != 0;
+
+	memset(&in, 0, sizeof in);
+	(void)TS_Nanosec(&in.ref, 1400000000, 123456789);
+	(void)TS_Nanosec(&in.local, 1400000000, 124456789);
+	in.precision = 1e-6;
+	in.leap = NTP_LEAP_NONE;
+	RC_SHM_Put(rs, &in);
+	nf += rc_shm_poll(ocx, rs, &out) != 1;
+	nf += fabs(TS_Diff(&out.local, &out.ref) - 1e-3) > 1e-9;
+	nf += out.precision != ldexp(1.0, -19);
+	nf += out.leap != NTP_LEAP_NONE;
+
+	/* Each sample is only used once */
+	nf += rc_shm_poll(ocx, rs, &out) != 0;
+
+	/* Mode 0 writers only have 'valid' */
+	RC_SHM_Put(rs, &in);
+	rs->shm->mode = 0;
+	nf += rc_shm_poll(ocx, rs, &out) != 1;
+
+	/* Writers which only fill in microseconds */
+	RC_SHM_Put(rs, &in);
+	rs->shm->clock_nsec = 0;
+	rs->shm->rx_nsec = 0;
+	nf += rc_shm_poll(ocx, rs, &out) != 1;
+	nf += fabs(TS_Diff(&out.local, &out.ref) - 1e-3) > 1e-9;
+	nf += rs->nsample != 3;
+
+	AZ(shmdt((void *)(uintptr_t)rs->shm));
+	FREE_OBJ(rs);
+	Debug(ocx, "RC_SHM_RunTest: %d failures\n", nf);
+	AZ(nf);
+}
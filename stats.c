@@ -0,0 +1,186 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Shared memory statistics
+ * ========================
+ *
+ * See stats.h for the layout and the rules.
+ *
+ * The segment is a plain file mapped MAP_SHARED, put it on a memory
+ * backed filesystem (/dev/shm, /var/run, ...) to keep the pages from
+ * being written to disk all the time.
+ *
+ * The segment is set up in a new file, which is then renamed into
+ * place.  Truncating the old file instead would pull the pages out
+ * from under readers who still have it mapped, and they would die of
+ * SIGBUS.
+ *
+ * The seqlock needs only fences, no atomic read-modify-write, because
+ * there is a single writer.  The data themselves are copied with plain
+ * loads and stores, which is why readers must not trust a copy unless
+ * the sequence number says it is consistent.
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ntimed.h"
+#include "stats.h"
+
+struct stats_seg *stats_seg;
+
+void
+Stats_Open(struct ocx *ocx, const char *fn)
+{
+	struct stats_seg *ss;
+	char *tmp;
+	size_t l;
+	int fd;
+
+	AN(fn);
+	AZ(stats_seg);
+	l = strlen(fn) + 8;
+	tmp = malloc(l);
+	AN(tmp);
+	(void)snprintf(tmp, l, "%s.XXXXXX", fn);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		Fail(ocx, 1, "Could not create stats file '%s'", tmp);
+	if (fchmod(fd, 0644) || ftruncate(fd, sizeof *ss))
+		Fail(ocx, 1, "Could not size stats file '%s'", tmp);
+	ss = mmap(NULL, sizeof *ss, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (ss == MAP_FAILED)
+		Fail(ocx, 1, "Could not map stats file '%s'", tmp);
+	AZ(close(fd));
+
+	/* ftruncate(2) zeroed it, so stats_seq is already even */
+	ss->version = STATS_VERSION;
+	ss->size = sizeof *ss;
+	ss->npeer = STATS_NPEER;
+	ss->pid = (uint32_t)getpid();
+	atomic_thread_fence(memory_order_release);
+	ss->magic = STATS_MAGIC;
+	if (rename(tmp, fn))
+		Fail(ocx, 1, "Could not rename stats file to '%s'", fn);
+	free(tmp);
+	stats_seg = ss;
+}
+
+/**********************************************************************
+ * Writer side
+ */
+
+void
+Stats_Begin(void)
+{
+
+	AN(stats_seg);
+	assert(!(stats_seg->stats_seq & 1));
+	stats_seg->stats_seq++;
+	atomic_thread_fence(memory_order_release);
+}
+
+void
+Stats_End(void)
+{
+
+	AN(stats_seg);
+	assert(stats_seg->stats_seq & 1);
+	stats_seg->nupdate++;
+	atomic_thread_fence(memory_order_release);
+	stats_seg->stats_seq++;
+}
+
+struct stats_peer *
+Stats_PeerNew(const char *hostname, const char *ip)
+{
+	struct stats_peer *sp;
+
+	AN(hostname);
+	AN(ip);
+	if (stats_seg == NULL)
+		return (NULL);
+	for (sp = stats_seg->peer; sp < stats_seg->peer + STATS_NPEER; sp++)
+		if (!sp->inuse)
+			break;
+	if (sp == stats_seg->peer + STATS_NPEER)
+		return (NULL);		// XXX: Report overflow somewhere
+	Stats_Begin();
+	memset(sp, 0, sizeof *sp);
+	sp->inuse = 1;
+	(void)strncpy(sp->hostname, hostname, sizeof sp->hostname - 1L);
+	(void)strncpy(sp->ip, ip, sizeof sp->ip - 1L);
+	Stats_End();
+	return (sp);
+}
+
+void
+Stats_PeerDestroy(struct stats_peer **psp)
+{
+	struct stats_peer *sp;
+
+	AN(psp);
+	sp = *psp;
+	*psp = NULL;
+	if (sp == NULL)
+		return;
+	AN(stats_seg);
+	Stats_Begin();
+	memset(sp, 0, sizeof *sp);
+	Stats_End();
+}
+
+/**********************************************************************
+ * Reader side: Copy a consistent snapshot of the segment
+ */
+
+void
+Stats_Read(const struct stats_seg *ss, struct stats_seg *dst)
+{
+	uint32_t s1, s2;
+
+	AN(ss);
+	AN(dst);
+	while (1) {
+		s1 = ss->stats_seq;
+		atomic_thread_fence(memory_order_acquire);
+		memcpy(dst, ss, sizeof *dst);
+		atomic_thread_fence(memory_order_acquire);
+		s2 = ss->stats_seq;
+		if (s1 == s2 && !(s1 & 1))
+			break;
+		(void)usleep(10);
+	}
+	dst->stats_seq = s1;
+}
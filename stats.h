@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Shared memory statistics
+ * ========================
+ *
+ * When asked to (client -s option), ntimed publishes its live state in
+ * a file which it maps shared, so monitoring tools can map it too and
+ * read it without any system calls and without bothering the daemon.
+ *
+ * The file contains exactly one struct stats_seg in the native byte
+ * order and alignment of the host.  Readers must check magic, version
+ * and size before trusting anything else.
+ *
+ * All updates happen in the main thread, inside a seqlock: stats_seq
+ * is odd while an update is in progress and is incremented again when
+ * it is done.  A reader copies the segment and uses the copy only if
+ * stats_seq was even and unchanged before and after, otherwise tries
+ * again.  Stats_Read() does exactly that.
+ *
+ * Peers get a slot in peer[] when the filter is attached to them, the
+ * slot is zeroed when they go away.  Slots with inuse == 0 are free.
+ *
+ * A restarted client puts a new file in place of the old one, so a
+ * reader which still has the old one mapped sees it stop updating, and
+ * should map the file again if it wants to follow the new client.
+ */
+
+#ifdef STATS_H_INCLUDED
+#error "stats.h included multiple times"
+#endif
+#define STATS_H_INCLUDED
+
+#define STATS_MAGIC		0x4e545353
+#define STATS_VERSION		1
+#define STATS_NPEER		64
+#define STATS_NAMELEN		64
+
+struct stats_peer {
+	uint32_t		inuse;
+	uint32_t		branch_last;	// 0 = rejected
+	char			hostname[STATS_NAMELEN];
+	char			ip[STATS_NAMELEN];
+
+	/* ntp_filter.c */
+	uint64_t		npkt;		// Seen by filter
+	uint64_t		branch[4];	// Packets per branch 1...4
+	double			lo, mid, hi;
+	double			alo, amid, ahi;
+	double			lo_noise, hi_noise;
+	double			trust;
+};
+
+struct stats_seg {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		size;		// sizeof(struct stats_seg)
+	uint32_t		npeer;		// Slots in peer[]
+	volatile uint32_t	stats_seq;	// Odd while updating
+	uint32_t		pid;
+	uint64_t		nupdate;
+
+	/* combine_delta.c */
+	double			cd_peak;	// Most probable offset
+	double			cd_weight;	// PDF at the peak
+	uint32_t		cd_nsrc;
+
+	/* pll_std.c */
+	uint32_t		pll_mode;
+	double			pll_offset;
+	double			pll_p_term;
+	double			pll_integrator;
+	double			pll_a, pll_b;
+
+	/* todo.c */
+	uint64_t		todo_run;
+	uint64_t		todo_fail;
+
+	/* udp.c */
+	uint64_t		udp_rx;
+	uint64_t		udp_rx_err;
+	uint64_t		udp_tx;
+	uint64_t		udp_tx_err;
+
+	struct stats_peer	peer[STATS_NPEER];
+};
+
+/*
+ * Writer side, only the main thread may call these.
+ * Everything must check stats_seg != NULL first, so nothing is paid
+ * unless the segment has been opened.
+ */
+
+extern struct stats_seg *stats_seg;
+
+void Stats_Begin(void);
+void Stats_End(void);
+struct stats_peer *Stats_PeerNew(const char *hostname, const char *ip);
+void Stats_PeerDestroy(struct stats_peer **);
+
+/* Reader side */
+
+void Stats_Read(const struct stats_seg *, struct stats_seg *);
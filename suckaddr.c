@@ -82,3 +82,47 @@ SA_Equal(const void *sa1, size_t sl1, const void *sa2, size_t sl2)
 	}
 	return (0);
 }
+
+/**********************************************************************
+ * Hash the parts of a sockaddr which SA_Equal() compares, so that
+ * equal addresses hash equal.  (FNV-1a)
+ */
+
+static uint32_t
+sa_fnv(uint32_t h, const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+uint32_t
+SA_Hash(const void *sa, size_t sl)
+{
+	const struct sockaddr *s;
+	const struct sockaddr_in *s4;
+	const struct sockaddr_in6 *s6;
+	uint32_t h = 2166136261U;
+
+	AN(sa);
+	assert(sl >= sizeof(struct sockaddr));
+	s = sa;
+	h = sa_fnv(h, &s->sa_family, sizeof s->sa_family);
+	if (s->sa_family == AF_INET) {
+		assert(sl >= sizeof(struct sockaddr_in));
+		s4 = sa;
+		h = sa_fnv(h, &s4->sin_port, sizeof s4->sin_port);
+		h = sa_fnv(h, &s4->sin_addr, sizeof s4->sin_addr);
+	} else if (s->sa_family == AF_INET6) {
+		assert(sl >= sizeof(struct sockaddr_in6));
+		s6 = sa;
+		h = sa_fnv(h, &s6->sin6_port, sizeof s6->sin6_port);
+		h = sa_fnv(h, &s6->sin6_scope_id, sizeof s6->sin6_scope_id);
+		h = sa_fnv(h, &s6->sin6_addr, sizeof s6->sin6_addr);
+	}
+	return (h);
+}
@@ -28,6 +28,15 @@
  *
  * Very simple minded:  Time advances when TB_Sleep() is called only.
  *
+ * The simulated kernel PLL runs once per second, but rather than being
+ * a todo of its own, the ticks are computed when we sleep past them.
+ * Nothing else can happen between events, so all the ticks in an idle
+ * stretch are done back to back, with the exact same arithmetic as if
+ * we had slept from tick to tick, and only ticks which change anything
+ * are traced.  A month long simulation no longer spends its time on
+ * millions of todo dispatches and trace lines.
+ *
+ * A tick falling at the exact same time as an event runs after it.
  */
 
 #include <math.h>
@@ -35,6 +44,7 @@
 #include <string.h>
 
 #include "ntimed.h"
+#include "trace.h"
 
 static struct timestamp st_now;
 
@@ -45,6 +55,9 @@ static double adj_offset = 0;
 static double adj_duration = 0;
 static double adj_freq = 0;
 
+static struct timestamp st_tick;
+static double st_traced[3];
+
 /*
  * This variable is public and represent the amount of time the simulated
  * clock has been tweaked by the TB_Step() and TB_Adjust() functions.
@@ -80,6 +93,53 @@ st_Sleep(double dur)
 
 /**********************************************************************/
 
+static void
+st_kern_pll(void)
+{
+	double d, t[3];
+
+	freq = freq0 + adj_freq;
+	if (adj_duration > 0.0) {
+		d = adj_offset / adj_duration;
+		freq += d;
+		adj_offset -= d;
+		adj_duration -= 1.0;
+	}
+	t[0] = adj_freq;
+	t[1] = adj_offset;
+	t[2] = adj_duration;
+	if (TRACING(NULL, OCX_TRC_PLL) && memcmp(t, st_traced, sizeof t)) {
+		Trace_Now(NULL, &st_tick, "SIMPLL");
+		Trace_SimPLL(NULL, t);
+		memcpy(st_traced, t, sizeof t);
+	}
+}
+
+static void
+st_sleep_to(const struct timestamp *t)
+{
+	double dt;
+
+	dt = TS_Diff(t, &st_now);
+	if (dt > 0.)
+		(void)st_Sleep(dt);
+}
+
+static int __match_proto__(tb_sleepuntil_f)
+st_SleepUntil(const struct timestamp *t)
+{
+
+	while (TS_Diff(&st_tick, t) < 0.0) {
+		st_sleep_to(&st_tick);
+		st_kern_pll();
+		TS_Add(&st_tick, 1.0);
+	}
+	st_sleep_to(t);
+	return (0);
+}
+
+/**********************************************************************/
+
 static void __match_proto__(tb_step_f)
 st_Step(struct ocx *ocx, double offset)
 {
@@ -103,28 +163,6 @@ st_Adjust(struct ocx *ocx, double offset, double duration, double frequency)
 	adj_freq = frequency;
 }
 
-/**********************************************************************/
-
-static enum todo_e __match_proto__(todo_f)
-st_kern_pll(struct ocx *ocx, struct todolist *tdl, void *priv)
-{
-	double d;
-
-	(void)ocx;
-	AN(tdl);
-	AZ(priv);
-	freq = freq0 + adj_freq;
-	if (adj_duration > 0.0) {
-		d = adj_offset / adj_duration;
-		freq += d;
-		adj_offset -= d;
-		adj_duration -= 1.0;
-	}
-	Put(ocx, OCX_TRACE, "SIMPLL %.3e %.3e %.3e\n",
-	    adj_freq, adj_offset, adj_duration);
-	return (TODO_OK);
-}
-
 /**********************************************************************
  * Mechanism to artificially bump simulated clock around.
  */
@@ -169,11 +207,13 @@ void
 Time_Sim(struct todolist *tdl)
 {
 
+	AN(tdl);
 	INIT_OBJ(&st_now, TIMESTAMP_MAGIC);
 	TS_Add(&st_now, 1e6);
+	st_tick = st_now;
 	TB_Now = st_Now;
 	TB_Sleep = st_Sleep;
+	TB_SleepUntil = st_SleepUntil;
 	TB_Step = st_Step;
 	TB_Adjust = st_Adjust;
-	(void)TODO_ScheduleRel(tdl, st_kern_pll, NULL, 0.0, 1.0, "SIMPLL");
 }
@@ -122,10 +122,13 @@ TS_Diff(const struct timestamp *t1, const struct timestamp *t2)
 	return (d);
 }
 
-/**********************************************************************/
+/**********************************************************************
+ * Timebases which can do better than sleeping for the difference, can
+ * override TB_SleepUntil.
+ */
 
-int
-TS_SleepUntil(const struct timestamp *t)
+static int __match_proto__(tb_sleepuntil_f)
+tb_SleepUntil(const struct timestamp *t)
 {
 	struct timestamp now;
 	double dt;
@@ -137,14 +140,26 @@ TS_SleepUntil(const struct timestamp *t)
 	return (TB_Sleep(dt));
 }
 
+tb_sleepuntil_f *TB_SleepUntil = tb_SleepUntil;
+
+int
+TS_SleepUntil(const struct timestamp *t)
+{
+
+	CHECK_OBJ_NOTNULL(t, TIMESTAMP_MAGIC);
+	return (TB_SleepUntil(t));
+}
+
 /**********************************************************************/
 
 void
-TS_Format(char *buf, size_t len, const struct timestamp *ts)
+TS_ToNanosec(const struct timestamp *ts, uint64_t *sec, uint32_t *nsec)
 {
-	CHECK_OBJ_NOTNULL(ts, TIMESTAMP_MAGIC);
 	uint64_t x, y;
-	int i;
+
+	CHECK_OBJ_NOTNULL(ts, TIMESTAMP_MAGIC);
+	AN(sec);
+	AN(nsec);
 
 	/* XXX: Nanosecond precision is enough for everybody. */
 	x = ts->sec;
@@ -153,6 +168,20 @@ TS_Format(char *buf, size_t len, const struct timestamp *ts)
 		y -= 1000000000ULL;
 		x += 1;
 	}
+	*sec = x;
+	*nsec = (uint32_t)y;
+}
+
+/**********************************************************************/
+
+void
+TS_Format(char *buf, size_t len, const struct timestamp *ts)
+{
+	uint64_t x;
+	uint32_t y;
+	int i;
+
+	TS_ToNanosec(ts, &x, &y);
 	i = snprintf(buf, len, "%jd.%09jd", (intmax_t)x, (intmax_t)y);
 	assert(i < (int)len);
 }
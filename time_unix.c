@@ -93,7 +93,7 @@ kt_setfreq(struct ocx *ocx, double frequency)
 	tx.freq = (long)floor(frequency * (65536 * 1e6));
 	errno = 0;
 	i = ntp_adjtime(&tx);
-	Put(ocx, OCX_TRACE, "KERNPLL %.6e %d\n", frequency, i);
+	Trace(ocx, OCX_TRC_PLL, "KERNPLL %.6e %d\n", frequency, i);
 	/* XXX: what is the correct error test here ? */
 	assert(i >= 0);
 }
@@ -118,9 +118,6 @@ kt_adjust(struct ocx *ocx, double offset, double duration, double frequency)
 	(void)ocx;
 	assert(duration >= 0.0);
 
-	if (ticker)
-		TODO_Cancel(kt_tdl, &ticker);
-
 	adj_offset = offset;
 	adj_duration = floor(duration);
 	if (adj_offset > 0.0 && adj_duration == 0.0)
@@ -131,9 +128,13 @@ kt_adjust(struct ocx *ocx, double offset, double duration, double frequency)
 	if (adj_duration > 0.0)
 		freq += adj_offset / adj_duration;
 	kt_setfreq(ocx, freq);
-	if (adj_duration > 0.0)
+	if (adj_duration > 0.0 && ticker)
+		TODO_RescheduleRel(kt_tdl, ticker, adj_duration);
+	else if (adj_duration > 0.0)
 		ticker = TODO_ScheduleRel(kt_tdl, kt_ticker, NULL,
 		    adj_duration, 0.0, "KT_TICK");
+	else if (ticker)
+		TODO_Cancel(kt_tdl, &ticker);
 }
 
 /**********************************************************************/
@@ -146,7 +147,7 @@ kt_step(struct ocx *ocx, double offset)
 	double d;
 	struct timespec ts;
 
-	Put(ocx, OCX_TRACE, "KERNTIME_STEP %.3e\n", offset);
+	Trace(ocx, OCX_TRC_PLL, "KERNTIME_STEP %.3e\n", offset);
 	d = floor(offset);
 	offset -= d;
 
@@ -172,7 +173,7 @@ kt_step(struct ocx *ocx, double offset)
 	double d;
 	struct timeval tv;
 
-	Put(ocx, OCX_TRACE, "KERNTIME_STEP %.3e\n", offset);
+	Trace(ocx, OCX_TRC_PLL, "KERNTIME_STEP %.3e\n", offset);
 	d = floor(offset);
 	offset -= d;
 
@@ -29,14 +29,24 @@
  * This is a simple "TODO-list" scheduler for calling things at certain
  * times.  Jobs can be one-shot or repeated and repeated jobs can abort.
  *
- * For ease of debugging, TODO jobs have a name.
+ * For ease of debugging, TODO jobs have a name.  It is only formatted
+ * if "todo" tracing is enabled when the job is scheduled, otherwise the
+ * format string is used as it is, so it must be a string constant.
+ *
+ * The todo entries are carved out of slabs owned by the todolist and
+ * recycled through a free-list, and jobs which want to run again at
+ * an irregular interval can reschedule themselves in place, so once
+ * things are up and running no heap allocation happens here at all.
  */
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ntimed.h"
+#include "stats.h"
+#include "trace.h"
 
 struct todo {
 	unsigned		magic;
@@ -47,14 +57,21 @@ struct todo {
 	void			*priv;
 	struct timestamp	when;
 	double			repeat;
+	int			resched;
+	int			cancelled;
 
-	char			what[40];
+	const char		*what;
+	char			buf[40];
 };
 
+#define TODO_SLAB		16
+
 struct todolist {
 	unsigned		magic;
 #define TODOLIST_MAGIC		0x7db66255
 	TAILQ_HEAD(,todo)	todolist;
+	TAILQ_HEAD(,todo)	freelist;
+	struct todo		*running;
 };
 
 struct todolist *
@@ -65,9 +82,54 @@ TODO_NewList(void)
 	ALLOC_OBJ(tdl, TODOLIST_MAGIC);
 	AN(tdl);
 	TAILQ_INIT(&tdl->todolist);
+	TAILQ_INIT(&tdl->freelist);
 	return (tdl);
 }
 
+/**********************************************************************
+ * Entries on the free-list have no func, which is how handles to
+ * them are told apart from live ones.
+ */
+
+static struct todo *
+todo_alloc(struct todolist *tdl)
+{
+	struct todo *tp;
+	unsigned u;
+
+	if (TAILQ_EMPTY(&tdl->freelist)) {
+		tp = calloc(TODO_SLAB, sizeof *tp);
+		AN(tp);
+		for (u = 0; u < TODO_SLAB; u++)
+			TAILQ_INSERT_TAIL(&tdl->freelist, &tp[u], list);
+	}
+	tp = TAILQ_FIRST(&tdl->freelist);
+	TAILQ_REMOVE(&tdl->freelist, tp, list);
+	INIT_OBJ(tp, TODO_MAGIC);
+	return (tp);
+}
+
+static void
+todo_free(struct todolist *tdl, struct todo *tp)
+{
+
+	CHECK_OBJ_NOTNULL(tp, TODO_MAGIC);
+	tp->func = NULL;
+	TAILQ_INSERT_HEAD(&tdl->freelist, tp, list);
+}
+
+static struct todo *
+todo_handle(uintptr_t hdl)
+{
+	struct todo *tp;
+
+	AN(hdl);
+	tp = (struct todo *)hdl;
+	CHECK_OBJ_NOTNULL(tp, TODO_MAGIC);
+	AN(tp->func);
+	return (tp);
+}
+
 static void
 todo_insert(struct todolist *tdl, struct todo *tp)
 {
@@ -92,20 +154,71 @@ TODO_Cancel(struct todolist *tdl, uintptr_t *tp)
 
 	CHECK_OBJ_NOTNULL(tdl, TODOLIST_MAGIC);
 	AN(tp);
-	AN(*tp);
+	tp2 = todo_handle(*tp);
+	*tp = 0;
 
-	TAILQ_FOREACH(tp2, &tdl->todolist, list)
-		if ((uintptr_t)tp2 == *tp)
-			break;
-	CHECK_OBJ_NOTNULL(tp2, TODO_MAGIC);
+	if (tp2 == tdl->running) {
+		/* TODO_Run() will clean up after it */
+		tp2->cancelled = 1;
+		return;
+	}
 	TAILQ_REMOVE(&tdl->todolist, tp2, list);
-	FREE_OBJ(tp2);
-	*tp = 0;
+	todo_free(tdl, tp2);
 }
 
 /**********************************************************************
+ * Move a job to a new time, keeping its func, priv, repeat and name.
+ *
+ * A job can reschedule itself while it runs, in which case it will
+ * run again at the new time, no matter what it returns.
  */
 
+void
+TODO_RescheduleAbs(struct todolist *tdl, uintptr_t hdl,
+    const struct timestamp *when)
+{
+	struct todo *tp;
+
+	CHECK_OBJ_NOTNULL(tdl, TODOLIST_MAGIC);
+	CHECK_OBJ_NOTNULL(when, TIMESTAMP_MAGIC);
+	tp = todo_handle(hdl);
+	assert(!tp->cancelled);
+
+	tp->when = *when;
+	if (tp == tdl->running) {
+		tp->resched = 1;
+		return;
+	}
+	TAILQ_REMOVE(&tdl->todolist, tp, list);
+	todo_insert(tdl, tp);
+}
+
+void
+TODO_RescheduleRel(struct todolist *tdl, uintptr_t hdl, double when)
+{
+	struct timestamp t;
+
+	assert(when >= 0.0);
+	TB_Now(&t);
+	TS_Add(&t, when);
+	TODO_RescheduleAbs(tdl, hdl, &t);
+}
+
+/**********************************************************************
+ */
+
+static void
+todo_name(struct todo *tp, const char *fmt, va_list ap)
+{
+
+	if (!TRACING(NULL, OCX_TRC_TODO) || strchr(fmt, '%') == NULL) {
+		tp->what = fmt;
+		return;
+	}
+	(void)vsnprintf(tp->buf, sizeof tp->buf, fmt, ap);
+	tp->what = tp->buf;
+}
+
 uintptr_t
 TODO_ScheduleAbs(struct todolist *tdl, todo_f *func, void *priv,
     const struct timestamp *when, double repeat, const char *fmt, ...)
@@ -119,14 +232,13 @@ TODO_ScheduleAbs(struct todolist *tdl, todo_f *func, void *priv,
 	assert(repeat >= 0.0);
 	AN(fmt);
 
-	ALLOC_OBJ(tp, TODO_MAGIC);
-	AN(tp);
+	tp = todo_alloc(tdl);
 	tp->func = func;
 	tp->priv = priv;
 	tp->when = *when;
 	tp->repeat = repeat;
 	va_start(ap, fmt);
-	(void)vsnprintf(tp->what, sizeof tp->what, fmt, ap);
+	todo_name(tp, fmt, ap);
 	va_end(ap);
 	todo_insert(tdl, tp);
 	return ((uintptr_t)tp);
@@ -145,15 +257,14 @@ TODO_ScheduleRel(struct todolist *tdl, todo_f *func, void *priv,
 	assert(repeat >= 0.0);
 	AN(fmt);
 
-	ALLOC_OBJ(tp, TODO_MAGIC);
-	AN(tp);
+	tp = todo_alloc(tdl);
 	tp->func = func;
 	tp->priv = priv;
 	TB_Now(&tp->when);
 	TS_Add(&tp->when, when);
 	tp->repeat = repeat;
 	va_start(ap, fmt);
-	(void)vsnprintf(tp->what, sizeof tp->what, fmt, ap);
+	todo_name(tp, fmt, ap);
 	va_end(ap);
 	todo_insert(tdl, tp);
 	return ((uintptr_t)tp);
@@ -168,7 +279,6 @@ TODO_Run(struct ocx *ocx, struct todolist *tdl)
 {
 	struct todo *tp;
 	enum todo_e ret = TODO_OK;
-	char buf[40];
 	int i;
 
 	CHECK_OBJ_NOTNULL(tdl, TODOLIST_MAGIC);
@@ -178,14 +288,30 @@ TODO_Run(struct ocx *ocx, struct todolist *tdl)
 		if (i == 1)
 			return (TODO_INTR);
 		AZ(i);
-		TS_Format(buf, sizeof buf, &tp->when);
-		Put(ocx, OCX_TRACE, "Now %s %s\n", buf, tp->what);
+		if (TRACING(ocx, OCX_TRC_TODO))
+			Trace_Now(ocx, &tp->when, tp->what);
+		tdl->running = tp;
 		ret = tp->func(ocx, tdl, tp->priv);
-		if (ret == TODO_FAIL)
-			break;
-		if (ret == TODO_DONE || tp->repeat == 0.0) {
+		tdl->running = NULL;
+		if (stats_seg != NULL) {
+			Stats_Begin();
+			stats_seg->todo_run++;
+			if (ret == TODO_FAIL)
+				stats_seg->todo_fail++;
+			Stats_End();
+		}
+		if (tp->cancelled) {
 			TAILQ_REMOVE(&tdl->todolist, tp, list);
-			FREE_OBJ(tp);
+			todo_free(tdl, tp);
+		} else if (tp->resched) {
+			tp->resched = 0;
+			TAILQ_REMOVE(&tdl->todolist, tp, list);
+			todo_insert(tdl, tp);
+		} else if (ret == TODO_FAIL) {
+			/* Leave it be */
+		} else if (ret == TODO_DONE || tp->repeat == 0.0) {
+			TAILQ_REMOVE(&tdl->todolist, tp, list);
+			todo_free(tdl, tp);
 		} else if (ret == TODO_OK) {
 			TS_Add(&tp->when, tp->repeat);
 			TAILQ_REMOVE(&tdl->todolist, tp, list);
@@ -193,6 +319,8 @@ TODO_Run(struct ocx *ocx, struct todolist *tdl)
 		} else {
 			WRONG("Invalid Return from todo->func");
 		}
+		if (ret == TODO_FAIL)
+			break;
 	}
 	return (ret);
 }
@@ -0,0 +1,150 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Trace records
+ * =============
+ *
+ * Trace output can be written either as text lines or as a compact
+ * binary file of tagged records, which --convert turns back into
+ * exactly the text lines which would otherwise have been written
+ * (and vice versa).
+ *
+ * The binary file starts with TRACE_BIN_HDRLEN bytes:
+ *	"NTTB"		magic
+ *	u16		version (TRACE_BIN_VERSION)
+ *	u16		zero
+ *
+ * Followed by records, all integers big-endian, doubles as their
+ * IEEE-754 bits in an u64:
+ *	u8		type (enum trace_type)
+ *	u8		tag (type specific)
+ *	u16		payload length
+ *	...		payload
+ *
+ * Peers are declared with a TRACE_PEER record before their id is
+ * referenced by other records.
+ */
+
+#ifdef TRACE_H_INCLUDED
+#error "trace.h included multiple times"
+#endif
+#define TRACE_H_INCLUDED
+
+struct ntp_peer;
+struct ntp_packet;
+
+#define TRACE_BIN_VERSION	1
+#define TRACE_BIN_HDRLEN	8
+#define TRACE_BIN_RECHDR	4
+#define TRACE_BIN_MAXREC	(TRACE_BIN_RECHDR + 65535)
+#define TRACE_BIN_MAXID		(1U << 20)	// Readers refuse higher ids
+
+enum trace_type {
+	TRACE_TEXT	= 1,	// Verbatim text
+	TRACE_NOW	= 2,	// "Now %s %s"
+	TRACE_PEER	= 3,	// "# Peer %s %s", tag: enum trace_peer_tag
+	TRACE_PKT	= 4,	// "Poll %s %s [...]", tag: enum trace_pkt_tag
+	TRACE_FILTER	= 5,	// "NTP_Filter ..."
+	TRACE_PLL	= 6,	// "PLL ..."
+	TRACE_SIMPLL	= 7,	// "SIMPLL ..."
+};
+
+enum trace_peer_tag {
+	TRACE_PEER_PEER		= 0,	// "# Peer"
+	TRACE_PEER_MONITOR	= 1,	// "# Monitor"
+	TRACE_PEER_SILENT	= 2,	// Only declares the id
+};
+
+enum trace_pkt_tag {
+	TRACE_PKT_POLL		= 0,	// "Poll"
+	TRACE_PKT_MONITOR	= 1,	// "Monitor"
+	TRACE_PKT_NTP_PACKET	= 2,	// "NTP_Packet"
+};
+
+/*
+ * A NTP packet, as it is represented in traces (see NTP_Tool_Format())
+ */
+
+struct ntp_fields {
+	unsigned		leap;
+	unsigned		version;
+	unsigned		mode;
+	unsigned		stratum;
+	unsigned		poll;
+	int			precision;
+	uint64_t		delay_sec;
+	uint32_t		delay_nsec;
+	uint64_t		disp_sec;
+	uint32_t		disp_nsec;
+	uint32_t		refid;
+	double			reference;	// - origin
+	uint64_t		origin_sec;
+	uint32_t		origin_nsec;
+	double			receive;	// - origin
+	double			transmit;	// - receive
+	double			ts_rx;		// - transmit, 0.0 if none
+};
+
+#define TRACE_NDVAL		8
+
+struct trace_rec {
+	unsigned		magic;
+#define TRACE_REC_MAGIC		0x2c5f61e3
+	enum trace_type		type;
+	unsigned		tag;
+	uint32_t		id;
+
+	const char		*str;		// TEXT, NOW, PEER hostname
+	size_t			strlen;
+	const char		*str2;		// PEER ip
+	size_t			str2len;
+
+	uint64_t		sec;		// NOW
+	uint32_t		nsec;
+
+	int			ival;		// FILTER branch, PLL mode
+	double			dval[TRACE_NDVAL];
+
+	struct ntp_fields	pkt;
+};
+
+/* trace_bin.c -- Trace record codec **********************************/
+
+size_t TraceBin_Header(void *ptr, size_t len);
+ssize_t TraceBin_CheckHeader(const void *ptr, size_t len);
+size_t TraceBin_Encode(void *ptr, size_t len, const struct trace_rec *);
+ssize_t TraceBin_Decode(struct trace_rec *, const void *ptr, size_t len);
+int TraceBin_Format(char *buf, size_t len, const struct trace_rec *,
+    const char *hostname, const char *ip);
+int TraceBin_Scan(struct trace_rec *, const char *line);
+
+void Trace_Now(struct ocx *, const struct timestamp *, const char *what);
+void Trace_Peer(struct ocx *, enum trace_peer_tag, const struct ntp_peer *);
+void Trace_Pkt(struct ocx *, enum trace_pkt_tag, const struct ntp_peer *,
+    const struct ntp_packet *);
+void Trace_Filter(struct ocx *, const struct ntp_peer *, int branch,
+    const double *d6);
+void Trace_PLL(struct ocx *, int mode, const double *d8);
+void Trace_SimPLL(struct ocx *, const double *d3);
@@ -0,0 +1,686 @@
+/*-
+ * Copyright (c) 2014 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Trace record codec
+ * ==================
+ *
+ * See trace.h for the binary layout.
+ *
+ * The text formatting in this file is the one and only definition of
+ * what these trace lines look like, both when written directly and when
+ * converted from binary, so the two cannot drift apart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntimed.h"
+#include "ntp.h"
+#include "ntimed_endian.h"
+#include "trace.h"
+
+static const char * const trace_pkt_name[] = {
+	[TRACE_PKT_POLL] =		"Poll",
+	[TRACE_PKT_MONITOR] =		"Monitor",
+	[TRACE_PKT_NTP_PACKET] =	"NTP_Packet",
+};
+
+#define TRACE_PKT_LEN	(4 + 8 + 12 + 12 + 4 + 8 + 12 + 24)
+
+/**********************************************************************
+ * Byte-order agnostic field (de)serialization
+ */
+
+static uint8_t *
+tb_put32(uint8_t *p, uint32_t u)
+{
+	Be32enc(p, u);
+	return (p + 4);
+}
+
+static uint8_t *
+tb_put64(uint8_t *p, uint64_t u)
+{
+	Be64enc(p, u);
+	return (p + 8);
+}
+
+static uint8_t *
+tb_putd(uint8_t *p, double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof u);
+	return (tb_put64(p, u));
+}
+
+static const uint8_t *
+tb_get32(const uint8_t *p, uint32_t *u)
+{
+	*u = Be32dec(p);
+	return (p + 4);
+}
+
+static const uint8_t *
+tb_get64(const uint8_t *p, uint64_t *u)
+{
+	*u = Be64dec(p);
+	return (p + 8);
+}
+
+static const uint8_t *
+tb_getd(const uint8_t *p, double *d)
+{
+	uint64_t u;
+
+	p = tb_get64(p, &u);
+	memcpy(d, &u, sizeof *d);
+	return (p);
+}
+
+/**********************************************************************/
+
+size_t
+TraceBin_Header(void *ptr, size_t len)
+{
+	uint8_t *p = ptr;
+
+	AN(ptr);
+	assert(len >= TRACE_BIN_HDRLEN);
+	memcpy(p, "NTTB", 4);
+	Be16enc(p + 4, TRACE_BIN_VERSION);
+	Be16enc(p + 6, 0);
+	return (TRACE_BIN_HDRLEN);
+}
+
+/*
+ * Returns the header length if this is a binary trace we understand,
+ * zero if it is not a binary trace and -1 if it is one of the wrong
+ * version.
+ */
+
+ssize_t
+TraceBin_CheckHeader(const void *ptr, size_t len)
+{
+	const uint8_t *p = ptr;
+
+	AN(ptr);
+	if (len < TRACE_BIN_HDRLEN || memcmp(p, "NTTB", 4))
+		return (0);
+	if (Be16dec(p + 4) != TRACE_BIN_VERSION)
+		return (-1);
+	return (TRACE_BIN_HDRLEN);
+}
+
+/**********************************************************************
+ * Encode a record, returns length or zero if it does not fit.
+ */
+
+size_t
+TraceBin_Encode(void *ptr, size_t len, const struct trace_rec *tr)
+{
+	uint8_t *b = ptr, *p;
+	const struct ntp_fields *nf;
+	size_t pl;
+	int i;
+
+	AN(ptr);
+	CHECK_OBJ_NOTNULL(tr, TRACE_REC_MAGIC);
+
+	switch (tr->type) {
+	case TRACE_TEXT:	pl = tr->strlen; break;
+	case TRACE_NOW:		pl = 12 + tr->strlen; break;
+	case TRACE_PEER:	pl = 5 + tr->strlen + tr->str2len; break;
+	case TRACE_PKT:		pl = TRACE_PKT_LEN; break;
+	case TRACE_FILTER:	pl = 8 + 6 * 8; break;
+	case TRACE_PLL:		pl = 4 + 8 * 8; break;
+	case TRACE_SIMPLL:	pl = 3 * 8; break;
+	default:		WRONG("Bad trace_rec type");
+	}
+	if (pl > 65535 || TRACE_BIN_RECHDR + pl > len)
+		return (0);
+	if (tr->type == TRACE_PEER && tr->strlen > 255)
+		return (0);
+
+	b[0] = (uint8_t)tr->type;
+	b[1] = (uint8_t)tr->tag;
+	Be16enc(b + 2, (uint16_t)pl);
+	p = b + TRACE_BIN_RECHDR;
+
+	switch (tr->type) {
+	case TRACE_TEXT:
+		memcpy(p, tr->str, tr->strlen);
+		p += tr->strlen;
+		break;
+	case TRACE_NOW:
+		p = tb_put64(p, tr->sec);
+		p = tb_put32(p, tr->nsec);
+		memcpy(p, tr->str, tr->strlen);
+		p += tr->strlen;
+		break;
+	case TRACE_PEER:
+		p = tb_put32(p, tr->id);
+		*p++ = (uint8_t)tr->strlen;
+		memcpy(p, tr->str, tr->strlen);
+		p += tr->strlen;
+		memcpy(p, tr->str2, tr->str2len);
+		p += tr->str2len;
+		break;
+	case TRACE_PKT:
+		nf = &tr->pkt;
+		p = tb_put32(p, tr->id);
+		*p++ = (uint8_t)nf->leap;
+		*p++ = (uint8_t)nf->version;
+		*p++ = (uint8_t)nf->mode;
+		*p++ = (uint8_t)nf->stratum;
+		*p++ = (uint8_t)nf->poll;
+		*p++ = (uint8_t)(int8_t)nf->precision;
+		*p++ = 0;
+		*p++ = 0;
+		p = tb_put64(p, nf->delay_sec);
+		p = tb_put32(p, nf->delay_nsec);
+		p = tb_put64(p, nf->disp_sec);
+		p = tb_put32(p, nf->disp_nsec);
+		p = tb_put32(p, nf->refid);
+		p = tb_putd(p, nf->reference);
+		p = tb_put64(p, nf->origin_sec);
+		p = tb_put32(p, nf->origin_nsec);
+		p = tb_putd(p, nf->receive);
+		p = tb_putd(p, nf->transmit);
+		p = tb_putd(p, nf->ts_rx);
+		break;
+	case TRACE_FILTER:
+		p = tb_put32(p, tr->id);
+		p = tb_put32(p, (uint32_t)tr->ival);
+		for (i = 0; i < 6; i++)
+			p = tb_putd(p, tr->dval[i]);
+		break;
+	case TRACE_PLL:
+		p = tb_put32(p, (uint32_t)tr->ival);
+		for (i = 0; i < 8; i++)
+			p = tb_putd(p, tr->dval[i]);
+		break;
+	case TRACE_SIMPLL:
+		for (i = 0; i < 3; i++)
+			p = tb_putd(p, tr->dval[i]);
+		break;
+	default:
+		WRONG("Bad trace_rec type");
+	}
+	assert(p == b + TRACE_BIN_RECHDR + pl);
+	return (TRACE_BIN_RECHDR + pl);
+}
+
+/**********************************************************************
+ * Decode a record, returns length consumed, zero if the record is
+ * incomplete and -1 if it is garbage.
+ *
+ * Strings point into the buffer and are not NUL terminated.
+ */
+
+ssize_t
+TraceBin_Decode(struct trace_rec *tr, const void *ptr, size_t len)
+{
+	const uint8_t *b = ptr, *p, *e;
+	struct ntp_fields *nf;
+	uint32_t u;
+	size_t pl;
+	int i;
+
+	AN(tr);
+	AN(ptr);
+	if (len < TRACE_BIN_RECHDR)
+		return (0);
+	pl = Be16dec(b + 2);
+	if (len < TRACE_BIN_RECHDR + pl)
+		return (0);
+
+	INIT_OBJ(tr, TRACE_REC_MAGIC);
+	tr->type = (enum trace_type)b[0];
+	tr->tag = b[1];
+	p = b + TRACE_BIN_RECHDR;
+	e = p + pl;
+
+	switch (tr->type) {
+	case TRACE_TEXT:
+		tr->str = (const char *)p;
+		tr->strlen = pl;
+		break;
+	case TRACE_NOW:
+		if (pl < 12)
+			return (-1);
+		p = tb_get64(p, &tr->sec);
+		p = tb_get32(p, &tr->nsec);
+		tr->str = (const char *)p;
+		tr->strlen = (size_t)(e - p);
+		break;
+	case TRACE_PEER:
+		if (pl < 5 || pl < 5U + p[4])
+			return (-1);
+		p = tb_get32(p, &tr->id);
+		tr->strlen = *p++;
+		tr->str = (const char *)p;
+		p += tr->strlen;
+		tr->str2 = (const char *)p;
+		tr->str2len = (size_t)(e - p);
+		break;
+	case TRACE_PKT:
+		if (pl != TRACE_PKT_LEN || tr->tag > TRACE_PKT_NTP_PACKET)
+			return (-1);
+		nf = &tr->pkt;
+		p = tb_get32(p, &tr->id);
+		nf->leap = *p++;
+		nf->version = *p++;
+		nf->mode = *p++;
+		nf->stratum = *p++;
+		nf->poll = *p++;
+		nf->precision = (int8_t)*p++;
+		p += 2;
+		p = tb_get64(p, &nf->delay_sec);
+		p = tb_get32(p, &nf->delay_nsec);
+		p = tb_get64(p, &nf->disp_sec);
+		p = tb_get32(p, &nf->disp_nsec);
+		p = tb_get32(p, &nf->refid);
+		p = tb_getd(p, &nf->reference);
+		p = tb_get64(p, &nf->origin_sec);
+		p = tb_get32(p, &nf->origin_nsec);
+		p = tb_getd(p, &nf->receive);
+		p = tb_getd(p, &nf->transmit);
+		p = tb_getd(p, &nf->ts_rx);
+		break;
+	case TRACE_FILTER:
+		if (pl != 8 + 6 * 8)
+			return (-1);
+		p = tb_get32(p, &tr->id);
+		p = tb_get32(p, &u);
+		tr->ival = (int32_t)u;
+		for (i = 0; i < 6; i++)
+			p = tb_getd(p, &tr->dval[i]);
+		break;
+	case TRACE_PLL:
+		if (pl != 4 + 8 * 8)
+			return (-1);
+		p = tb_get32(p, &u);
+		tr->ival = (int32_t)u;
+		for (i = 0; i < 8; i++)
+			p = tb_getd(p, &tr->dval[i]);
+		break;
+	case TRACE_SIMPLL:
+		if (pl != 3 * 8)
+			return (-1);
+		for (i = 0; i < 3; i++)
+			p = tb_getd(p, &tr->dval[i]);
+		break;
+	default:
+		return (-1);
+	}
+	return ((ssize_t)(TRACE_BIN_RECHDR + pl));
+}
+
+/**********************************************************************
+ * Format a record as text.  Records which refer to a peer by id need
+ * the hostname and ip of that peer.
+ *
+ * Returns the length of the text, or -1 if it did not fit.
+ */
+
+int
+TraceBin_Format(char *buf, size_t len, const struct trace_rec *tr,
+    const char *hostname, const char *ip)
+{
+	char pbuf[256];
+	const double *d;
+	int i;
+
+	AN(buf);
+	CHECK_OBJ_NOTNULL(tr, TRACE_REC_MAGIC);
+	d = tr->dval;
+
+	switch (tr->type) {
+	case TRACE_TEXT:
+		i = snprintf(buf, len, "%.*s", (int)tr->strlen, tr->str);
+		break;
+	case TRACE_NOW:
+		i = snprintf(buf, len, "Now %jd.%09jd %.*s\n",
+		    (intmax_t)tr->sec, (intmax_t)tr->nsec,
+		    (int)tr->strlen, tr->str);
+		break;
+	case TRACE_PEER:
+		if (tr->tag == TRACE_PEER_SILENT) {
+			*buf = '\0';
+			return (0);
+		}
+		i = snprintf(buf, len, "# %s %.*s %.*s\n",
+		    tr->tag == TRACE_PEER_MONITOR ? "Monitor" : "Peer",
+		    (int)tr->strlen, tr->str, (int)tr->str2len, tr->str2);
+		break;
+	case TRACE_PKT:
+		AN(hostname);
+		AN(ip);
+		assert(tr->tag <= TRACE_PKT_NTP_PACKET);
+		NTP_Tool_FormatFields(pbuf, sizeof pbuf, &tr->pkt);
+		i = snprintf(buf, len, "%s %s %s %s\n",
+		    trace_pkt_name[tr->tag], hostname, ip, pbuf);
+		break;
+	case TRACE_FILTER:
+		AN(hostname);
+		AN(ip);
+		i = snprintf(buf, len,
+		    "NTP_Filter %s %s %d %.3e %.3e %.3e %.3e %.3e %.3e\n",
+		    hostname, ip, tr->ival, d[0], d[1], d[2], d[3], d[4], d[5]);
+		break;
+	case TRACE_PLL:
+		i = snprintf(buf, len,
+		    "PLL %d %.3e %.3e %.3e -> %.3e %.3e %.3e %.3e %.3e\n",
+		    tr->ival, d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+		break;
+	case TRACE_SIMPLL:
+		i = snprintf(buf, len, "SIMPLL %.3e %.3e %.3e\n",
+		    d[0], d[1], d[2]);
+		break;
+	default:
+		WRONG("Bad trace_rec type");
+	}
+	if (i < 0 || i >= (int)len)
+		return (-1);
+	return (i);
+}
+
+/**********************************************************************
+ * Recognize a text line (without the newline) as a record.
+ *
+ * Hostnames and ips are returned in str and str2, pointing into the line.
+ * This is not guaranteed to be loss-less, the caller should check that
+ * TraceBin_Format() gives back the same line.
+ */
+
+static const char *
+tb_word(const char *p, const char **w, size_t *l)
+{
+	const char *q;
+
+	if (*p == '\0' || *p == ' ')
+		return (NULL);
+	q = strchr(p, ' ');
+	if (q == NULL)
+		q = strchr(p, '\0');
+	*w = p;
+	*l = (size_t)(q - p);
+	return (*q == ' ' ? q + 1 : q);
+}
+
+int
+TraceBin_Scan(struct trace_rec *tr, const char *line)
+{
+	const char *p;
+	uintmax_t s;
+	unsigned u;
+	double *d;
+	int i, n;
+
+	AN(tr);
+	AN(line);
+	INIT_OBJ(tr, TRACE_REC_MAGIC);
+	d = tr->dval;
+
+	if (!strncmp(line, "Now ", 4)) {
+		n = 0;
+		if (sscanf(line, "Now %ju.%u %n", &s, &u, &n) != 2 || n == 0)
+			return (-1);
+		tr->type = TRACE_NOW;
+		tr->sec = s;
+		tr->nsec = u;
+		tr->str = line + n;
+		tr->strlen = strlen(line + n);
+		return (0);
+	}
+
+	if (!strncmp(line, "# Peer ", 7) || !strncmp(line, "# Monitor ", 10)) {
+		tr->type = TRACE_PEER;
+		tr->tag = line[2] == 'P' ? TRACE_PEER_PEER : TRACE_PEER_MONITOR;
+		p = strchr(line + 2, ' ') + 1;
+		p = tb_word(p, &tr->str, &tr->strlen);
+		if (p == NULL)
+			return (-1);
+		p = tb_word(p, &tr->str2, &tr->str2len);
+		if (p == NULL || *p != '\0')
+			return (-1);
+		return (0);
+	}
+
+	if (!strncmp(line, "PLL ", 4)) {
+		i = sscanf(line,
+		    "PLL %d %lf %lf %lf -> %lf %lf %lf %lf %lf",
+		    &tr->ival, d, d + 1, d + 2, d + 3, d + 4, d + 5, d + 6,
+		    d + 7);
+		if (i != 9)
+			return (-1);
+		tr->type = TRACE_PLL;
+		return (0);
+	}
+
+	if (!strncmp(line, "SIMPLL ", 7)) {
+		i = sscanf(line, "SIMPLL %lf %lf %lf", d, d + 1, d + 2);
+		if (i != 3)
+			return (-1);
+		tr->type = TRACE_SIMPLL;
+		return (0);
+	}
+
+	if (!strncmp(line, "NTP_Filter ", 11)) {
+		tr->type = TRACE_FILTER;
+		p = line + 11;
+	} else {
+		for (u = 0; u <= TRACE_PKT_NTP_PACKET; u++) {
+			n = (int)strlen(trace_pkt_name[u]);
+			if (!strncmp(line, trace_pkt_name[u], n) &&
+			    line[n] == ' ')
+				break;
+		}
+		if (u > TRACE_PKT_NTP_PACKET)
+			return (-1);
+		tr->type = TRACE_PKT;
+		tr->tag = u;
+		p = line + n + 1;
+	}
+	p = tb_word(p, &tr->str, &tr->strlen);
+	if (p == NULL)
+		return (-1);
+	p = tb_word(p, &tr->str2, &tr->str2len);
+	if (p == NULL)
+		return (-1);
+	if (tr->type == TRACE_PKT)
+		return (NTP_Tool_ScanFields(&tr->pkt, p));
+	i = sscanf(p, "%d %lf %lf %lf %lf %lf %lf",
+	    &tr->ival, d, d + 1, d + 2, d + 3, d + 4, d + 5);
+	return (i == 7 ? 0 : -1);
+}
+
+/**********************************************************************
+ * Helpers for writing trace records from the code, in whichever format
+ * the tracefile has.
+ */
+
+/*
+ * In binary traces a peer must be declared before its id is used, we
+ * keep track of which ones have been in a bitmap.
+ */
+
+static uint8_t *trace_declared;
+static size_t trace_ndeclared;
+
+static int
+trace_is_declared(uint32_t id)
+{
+	size_t n;
+
+	if (id / 8 >= trace_ndeclared) {
+		n = trace_ndeclared ? trace_ndeclared : 64;
+		while (id / 8 >= n)
+			n *= 2;
+		trace_declared = realloc(trace_declared, n);
+		AN(trace_declared);
+		memset(trace_declared + trace_ndeclared, 0,
+		    n - trace_ndeclared);
+		trace_ndeclared = n;
+	}
+	if (trace_declared[id / 8] & (1U << (id % 8)))
+		return (1);
+	trace_declared[id / 8] |= (uint8_t)(1U << (id % 8));
+	return (0);
+}
+
+static void
+trace_emit(struct ocx *ocx, const struct trace_rec *tr,
+    const struct ntp_peer *np)
+{
+	char buf[512];
+	size_t l;
+	int i;
+
+	if (TraceBinary(ocx)) {
+		l = TraceBin_Encode(buf, sizeof buf, tr);
+		if (l > 0)
+			PutBin(ocx, OCX_TRACE, buf, l);
+		return;
+	}
+	i = TraceBin_Format(buf, sizeof buf, tr,
+	    np == NULL ? NULL : np->hostname, np == NULL ? NULL : np->ip);
+	if (i > 0)
+		Put(ocx, OCX_TRACE, "%s", buf);
+}
+
+static void
+trace_declare(struct ocx *ocx, enum trace_peer_tag tag,
+    const struct ntp_peer *np)
+{
+	struct trace_rec tr;
+
+	CHECK_OBJ_NOTNULL(np, NTP_PEER_MAGIC);
+	if (tag == TRACE_PEER_SILENT &&
+	    (!TraceBinary(ocx) || trace_is_declared(np->trace_id)))
+		return;
+	if (tag != TRACE_PEER_SILENT && TraceBinary(ocx))
+		(void)trace_is_declared(np->trace_id);
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_PEER;
+	tr.tag = tag;
+	tr.id = np->trace_id;
+	tr.str = np->hostname;
+	tr.strlen = strlen(np->hostname);
+	tr.str2 = np->ip;
+	tr.str2len = strlen(np->ip);
+	trace_emit(ocx, &tr, np);
+}
+
+void
+Trace_Now(struct ocx *ocx, const struct timestamp *ts, const char *what)
+{
+	struct trace_rec tr;
+
+	AN(what);
+	if (!OCX_ENABLED(ocx, OCX_TRACE))
+		return;
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_NOW;
+	TS_ToNanosec(ts, &tr.sec, &tr.nsec);
+	tr.str = what;
+	tr.strlen = strlen(what);
+	trace_emit(ocx, &tr, NULL);
+}
+
+void
+Trace_Peer(struct ocx *ocx, enum trace_peer_tag tag,
+    const struct ntp_peer *np)
+{
+
+	if (OCX_ENABLED(ocx, OCX_TRACE))
+		trace_declare(ocx, tag, np);
+}
+
+void
+Trace_Pkt(struct ocx *ocx, enum trace_pkt_tag tag, const struct ntp_peer *np,
+    const struct ntp_packet *pkt)
+{
+	struct trace_rec tr;
+
+	if (!OCX_ENABLED(ocx, OCX_TRACE))
+		return;
+	trace_declare(ocx, TRACE_PEER_SILENT, np);
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_PKT;
+	tr.tag = tag;
+	tr.id = np->trace_id;
+	NTP_Tool_Fields(&tr.pkt, pkt);
+	trace_emit(ocx, &tr, np);
+}
+
+void
+Trace_Filter(struct ocx *ocx, const struct ntp_peer *np, int branch,
+    const double *d6)
+{
+	struct trace_rec tr;
+
+	AN(d6);
+	if (!OCX_ENABLED(ocx, OCX_TRACE))
+		return;
+	trace_declare(ocx, TRACE_PEER_SILENT, np);
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_FILTER;
+	tr.id = np->trace_id;
+	tr.ival = branch;
+	memcpy(tr.dval, d6, 6 * sizeof *d6);
+	trace_emit(ocx, &tr, np);
+}
+
+void
+Trace_PLL(struct ocx *ocx, int mode, const double *d8)
+{
+	struct trace_rec tr;
+
+	AN(d8);
+	if (!OCX_ENABLED(ocx, OCX_TRACE))
+		return;
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_PLL;
+	tr.ival = mode;
+	memcpy(tr.dval, d8, 8 * sizeof *d8);
+	trace_emit(ocx, &tr, NULL);
+}
+
+void
+Trace_SimPLL(struct ocx *ocx, const double *d3)
+{
+	struct trace_rec tr;
+
+	AN(d3);
+	if (!OCX_ENABLED(ocx, OCX_TRACE))
+		return;
+	INIT_OBJ(&tr, TRACE_REC_MAGIC);
+	tr.type = TRACE_SIMPLL;
+	memcpy(tr.dval, d3, 3 * sizeof *d3);
+	trace_emit(ocx, &tr, NULL);
+}
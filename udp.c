@@ -24,15 +24,28 @@
  * SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* For recvmmsg(2) */
+#endif
+
 #include <math.h>
+#include <netdb.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>		/* Compat for NetBSD */
 #include <sys/types.h>		/* Compat for OpenBSD */
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__linux__) && defined(SO_TIMESTAMPING) && \
+    defined(SCM_TIMESTAMPING)
+#include <linux/net_tstamp.h>
+#define UDP_TXTS		/* Software transmit timestamps */
+#endif
 
 #include "ntimed.h"
+#include "stats.h"
 #include "udp.h"
 
 struct udp_socket {
@@ -41,14 +54,24 @@ struct udp_socket {
 
 	int			fd4;
 	int			fd6;
+	int			txts4;
+	int			txts6;
 };
 
+/*
+ * Where the system can tell us when a packet actually left, ask it to
+ * report software transmit timestamps.  They are only generated for
+ * packets sent with Udp_SendTimed(), see below.
+ */
+
 static int
-udp_sock(int fam)
+udp_sock(int fam, int *txts)
 {
 	int fd;
 	int i;
 
+	AN(txts);
+	*txts = 0;
 	fd = socket(fam, SOCK_DGRAM, 0);
 	if (fd < 0)
 		return (fd);
@@ -59,6 +82,11 @@ udp_sock(int fam)
 #elif defined(SO_TIMESTAMP)
 	i = 1;
 	(void)setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &i, sizeof i);
+#endif
+#ifdef UDP_TXTS
+	i = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+	if (!setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &i, sizeof i))
+		*txts = 1;
 #endif
 	return (fd);
 }
@@ -70,13 +98,139 @@ UdpTimedSocket(struct ocx *ocx)
 
 	ALLOC_OBJ(usc, UDP_SOCKET_MAGIC);
 	AN(usc);
-	usc->fd4 = udp_sock(AF_INET);
-	usc->fd6 = udp_sock(AF_INET6);
+	usc->fd4 = udp_sock(AF_INET, &usc->txts4);
+	usc->fd6 = udp_sock(AF_INET6, &usc->txts6);
 	if (usc->fd4 < 0 && usc->fd6 < 0)
 		Fail(ocx, 1, "socket(2) failed");
 	return (usc);
 }
 
+/**********************************************************************
+ * Pick the kernel's receive timestamp out of the control messages,
+ * if there is one, otherwise leave *ts alone.
+ */
+
+static void
+udp_rx_ts(struct ocx *ocx, struct msghdr *msg, struct timestamp *ts)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef SCM_TIMESTAMPNS
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
+			struct timespec tsc;
+			memcpy(&tsc, CMSG_DATA(cmsg), sizeof tsc);
+			(void)TS_Nanosec(ts, tsc.tv_sec, tsc.tv_nsec);
+			continue;
+		}
+#endif
+#ifdef SCM_TIMESTAMP
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMP &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof tv);
+			(void)TS_Nanosec(ts, tv.tv_sec, tv.tv_usec * 1000LL);
+			continue;
+		}
+#endif
+#ifdef SCM_TIMESTAMPING
+		/* Also delivered once SO_TIMESTAMPING is on, [0] is software */
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPING &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(struct timespec))) {
+			struct timespec tsc;
+			memcpy(&tsc, CMSG_DATA(cmsg), sizeof tsc);
+			if (tsc.tv_sec != 0 || tsc.tv_nsec != 0)
+				(void)TS_Nanosec(ts, tsc.tv_sec, tsc.tv_nsec);
+			continue;
+		}
+#endif
+		Debug(ocx, "RX-msg: %d %d %u ",
+		    cmsg->cmsg_level, cmsg->cmsg_type, cmsg->cmsg_len);
+		DebugHex(ocx, CMSG_DATA(cmsg), cmsg->cmsg_len);
+		Debug(ocx, "\n");
+
+	}
+}
+
+/**********************************************************************
+ * Drain the transmit timestamps from the error queue.  Returns zero if
+ * there were none which were not before t0.
+ *
+ * The report for a packet can be late, and then turn up when the next
+ * one is sent, so udp_send() drains the queue first, and only takes
+ * stamps which are not before it called sendmsg(2): anything earlier
+ * belongs to a packet before it.
+ */
+
+static int
+udp_tx_ts(int fd, const struct timestamp *t0, struct timestamp *ts)
+{
+	int retval = 0;
+#ifdef UDP_TXTS
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct timespec tsc;
+	struct timestamp tt;
+	u_char ctrl[256];
+
+	while (1) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof ctrl;
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_TIMESTAMPING ||
+			    cmsg->cmsg_len < CMSG_LEN(sizeof tsc))
+				continue;
+			memcpy(&tsc, CMSG_DATA(cmsg), sizeof tsc);
+			if (tsc.tv_sec == 0 && tsc.tv_nsec == 0)
+				continue;
+			(void)TS_Nanosec(&tt, tsc.tv_sec, tsc.tv_nsec);
+			if (t0 != NULL && TS_Diff(&tt, t0) < 0.0)
+				continue;
+			if (ts != NULL)
+				*ts = tt;
+			retval = 1;
+		}
+	}
+#else
+	(void)fd;
+	(void)t0;
+	(void)ts;
+#endif
+	return (retval);
+}
+
+/*
+ * A transmit timestamp which arrived too late for udp_tx_ts() makes
+ * poll(2) report POLLERR, get it out of the way.
+ */
+
+static int
+udp_poll(struct pollfd *pfd, int tmo_msec)
+{
+	int i, j;
+
+	while (1) {
+		i = poll(pfd, 2, tmo_msec);
+		if (i <= 0)
+			return (i);
+		if ((pfd[0].revents | pfd[1].revents) & POLLIN)
+			return (i);
+		for (j = 0; j < 2; j++)
+			if (pfd[j].revents & POLLERR)
+				(void)udp_tx_ts(pfd[j].fd, NULL, NULL);
+	}
+}
+
 ssize_t
 UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
     sa_family_t fam,
@@ -85,12 +239,11 @@ UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
 {
 	struct msghdr msg;
 	struct iovec iov;
-	struct cmsghdr *cmsg;
 	u_char ctrl[1024];
 	ssize_t rl;
-	int i;
+	int i, fd;
 	int tmo_msec;
-	struct pollfd pfd[1];
+	struct pollfd pfd[2];
 
 	CHECK_OBJ_NOTNULL(usc, UDP_SOCKET_MAGIC);
 	AN(ss);
@@ -99,15 +252,21 @@ UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
 	AN(buf);
 	assert(len > 0);
 
+	/* AF_UNSPEC means whichever family has something for us */
+	pfd[0].fd = -1;
+	pfd[1].fd = -1;
 	if (fam == AF_INET)
 		pfd[0].fd = usc->fd4;
 	else if (fam == AF_INET6)
-		pfd[0].fd = usc->fd6;
-	else
+		pfd[1].fd = usc->fd6;
+	else if (fam == AF_UNSPEC) {
+		pfd[0].fd = usc->fd4;
+		pfd[1].fd = usc->fd6;
+	} else
 		WRONG("Wrong family in UdpTimedRx");
 
-	pfd[0].events = POLLIN;
-	pfd[0].revents = 0;
+	pfd[0].events = pfd[1].events = POLLIN;
+	pfd[0].revents = pfd[1].revents = 0;
 
 	if (tmo == 0.0) {
 		tmo_msec = -1;
@@ -116,7 +275,7 @@ UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
 		if (tmo_msec <= 0)
 			tmo_msec = 0;
 	}
-	i = poll(pfd, 1, tmo_msec);
+	i = udp_poll(pfd, tmo_msec);
 
 	if (i < 0)
 		Fail(ocx, 1, "poll(2) failed\n");
@@ -124,6 +283,8 @@ UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
 	if (i == 0)
 		return (0);
 
+	fd = (pfd[0].revents & POLLIN) ? pfd[0].fd : pfd[1].fd;
+
 	/* Grab a timestamp in case none of the SCM_TIMESTAMP* works */
 	TB_Now(ts);
 
@@ -137,67 +298,425 @@ UdpTimedRx(struct ocx *ocx, const struct udp_socket *usc,
 	iov.iov_base = buf;
 	iov.iov_len = (size_t)len;
 	memset(ctrl, 0, sizeof ctrl);
-	cmsg = (void*)ctrl;
 
-	rl = recvmsg(pfd[0].fd, &msg, 0);
+	rl = recvmsg(fd, &msg, 0);
+	if (rl > 0 && msg.msg_flags != 0) {
+		Debug(ocx, "msg_flags = 0x%x", msg.msg_flags);
+		rl = -1;
+	}
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		if (rl > 0)
+			stats_seg->udp_rx++;
+		else
+			stats_seg->udp_rx_err++;
+		Stats_End();
+	}
 	if (rl <= 0)
 		return (rl);
 
 	*sl = msg.msg_namelen;
 
-	if (msg.msg_flags != 0) {
-		Debug(ocx, "msg_flags = 0x%x", msg.msg_flags);
-		return (-1);
-	}
+	udp_rx_ts(ocx, &msg, ts);
+	return (rl);
+}
 
-	for(;cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-#ifdef SCM_TIMESTAMPNS
-		if (cmsg->cmsg_level == SOL_SOCKET &&
-		    cmsg->cmsg_type == SCM_TIMESTAMPNS &&
-		    cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
-			struct timespec tsc;
-			memcpy(&tsc, CMSG_DATA(cmsg), sizeof tsc);
-			(void)TS_Nanosec(ts, tsc.tv_sec, tsc.tv_nsec);
-			continue;
-		}
+/**********************************************************************
+ * Send a packet, and if ts is not NULL, report when it left.
+ *
+ * If the system does not give us a transmit timestamp, the time
+ * right after sendmsg(2) returned is the best we have.
+ */
+
+static ssize_t
+udp_send(const struct udp_socket *usc, const void *ss, socklen_t sl,
+    const void *buf, size_t len, struct timestamp *ts)
+{
+	const struct sockaddr *sa;
+	struct msghdr msg;
+	struct iovec iov;
+	struct timestamp t0;
+	int fd, txts;
+	ssize_t l;
+#ifdef UDP_TXTS
+	union {
+		struct cmsghdr	hdr;
+		u_char		buf[CMSG_SPACE(sizeof(uint32_t))];
+	} ctrl;
+	struct cmsghdr *cmsg;
+	uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
 #endif
-#ifdef SCM_TIMESTAMP
-		if (cmsg->cmsg_level == SOL_SOCKET &&
-		    cmsg->cmsg_type == SCM_TIMESTAMP &&
-		    cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
-			struct timeval tv;
-			memcpy(&tv, CMSG_DATA(cmsg), sizeof tv);
-			(void)TS_Nanosec(ts, tv.tv_sec, tv.tv_usec * 1000LL);
-			continue;
-		}
+
+	CHECK_OBJ_NOTNULL(usc, UDP_SOCKET_MAGIC);
+	AN(ss);
+	AN(sl);
+	AN(buf);
+	AN(len);
+	sa = ss;
+	if (sa->sa_family == AF_INET) {
+		fd = usc->fd4;
+		txts = usc->txts4;
+	} else if (sa->sa_family == AF_INET6) {
+		fd = usc->fd6;
+		txts = usc->txts6;
+	} else
+		WRONG("Wrong AF_");
+
+	if (ts == NULL)
+		return (sendto(fd, buf, len, 0, ss, sl));
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = (void*)(uintptr_t)ss;
+	msg.msg_namelen = sl;
+	iov.iov_base = (void*)(uintptr_t)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+#ifdef UDP_TXTS
+	if (txts) {
+		memset(&ctrl, 0, sizeof ctrl);
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof ctrl.buf;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SO_TIMESTAMPING;
+		cmsg->cmsg_len = CMSG_LEN(sizeof flags);
+		memcpy(CMSG_DATA(cmsg), &flags, sizeof flags);
+	}
 #endif
-		Debug(ocx, "RX-msg: %d %d %u ",
-		    cmsg->cmsg_level, cmsg->cmsg_type, cmsg->cmsg_len);
-		DebugHex(ocx, CMSG_DATA(cmsg), cmsg->cmsg_len);
-		Debug(ocx, "\n");
+	if (txts)
+		(void)udp_tx_ts(fd, NULL, NULL);
+	TB_Now(&t0);
+	l = sendmsg(fd, &msg, 0);
+	TB_Now(ts);
+	if (l > 0 && txts)
+		(void)udp_tx_ts(fd, &t0, ts);
+	return (l);
+}
 
+ssize_t
+Udp_SendTimed(struct ocx *ocx, const struct udp_socket *usc,
+    const void *ss, socklen_t sl, const void *buf, size_t len,
+    struct timestamp *ts)
+{
+	ssize_t l;
+
+	(void)ocx;
+	AN(ts);
+	l = udp_send(usc, ss, sl, buf, len, ts);
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		if (l == (ssize_t)len)
+			stats_seg->udp_tx++;
+		else
+			stats_seg->udp_tx_err++;
+		Stats_End();
 	}
-	return (rl);
+	return (l);
 }
 
 ssize_t
 Udp_Send(struct ocx *ocx, const struct udp_socket *usc,
     const void *ss, socklen_t sl, const void *buf, size_t len)
 {
-	const struct sockaddr *sa;
+	ssize_t l;
 
 	(void)ocx;
+	l = udp_send(usc, ss, sl, buf, len, NULL);
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		if (l == (ssize_t)len)
+			stats_seg->udp_tx++;
+		else
+			stats_seg->udp_tx_err++;
+		Stats_End();
+	}
+	return (l);
+}
+
+/**********************************************************************
+ * A socket bound to an address, for serving.  NULL host means all
+ * addresses, and both families if the system has them.
+ */
+
+struct udp_socket *
+UdpTimedServer(struct ocx *ocx, const char *host, const char *port)
+{
+	struct udp_socket *usc;
+	struct addrinfo hints, *res, *res0;
+	int error, *fdp, i;
+
+	AN(port);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error)
+		Fail(ocx, 0, "host '%s', port '%s': %s\n",
+		    host == NULL ? "*" : host, port, gai_strerror(error));
+
+	ALLOC_OBJ(usc, UDP_SOCKET_MAGIC);
+	AN(usc);
+	usc->fd4 = usc->fd6 = -1;
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (res->ai_family == AF_INET)
+			fdp = &usc->fd4;
+		else if (res->ai_family == AF_INET6)
+			fdp = &usc->fd6;
+		else
+			continue;
+		if (*fdp >= 0)
+			continue;
+		*fdp = udp_sock(res->ai_family, res->ai_family == AF_INET ?
+		    &usc->txts4 : &usc->txts6);
+		if (*fdp < 0)
+			continue;
+#ifdef IPV6_V6ONLY
+		if (res->ai_family == AF_INET6) {
+			i = 1;
+			(void)setsockopt(*fdp, IPPROTO_IPV6, IPV6_V6ONLY,
+			    &i, sizeof i);
+		}
+#endif
+		if (bind(*fdp, res->ai_addr, res->ai_addrlen))
+			Fail(ocx, 1, "Could not bind to '%s' port '%s'",
+			    host == NULL ? "*" : host, port);
+	}
+	freeaddrinfo(res0);
+	if (usc->fd4 < 0 && usc->fd6 < 0)
+		Fail(ocx, 1, "No socket for '%s' port '%s'",
+		    host == NULL ? "*" : host, port);
+	return (usc);
+}
+
+/**********************************************************************
+ * Broadcast and multicast.
+ *
+ * The receiving socket is bound to the group and port, and joins the
+ * group, on the interface with the IPv4 address ifaddr if not NULL.
+ * For a broadcast address it is bound to the wildcard address.
+ *
+ * Sending is done on a normal server socket, after Udp_McastTx() has
+ * allowed broadcasts and pointed multicast at the interface with the
+ * IPv4 address ifaddr, if not NULL.
+ */
+
+struct udp_socket *
+UdpMcastSocket(struct ocx *ocx, const char *group, const char *port,
+    const char *ifaddr)
+{
+	struct udp_socket *usc;
+	struct addrinfo hints, *res;
+	struct sockaddr_in *sin4;
+	struct sockaddr_in6 *sin6;
+	struct ip_mreq mr4;
+	struct ipv6_mreq mr6;
+	int error, fd, i, *txts;
+
+	AN(group);
+	AN(port);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	error = getaddrinfo(group, port, &hints, &res);
+	if (error)
+		Fail(ocx, 0, "group '%s', port '%s': %s\n",
+		    group, port, gai_strerror(error));
+
+	ALLOC_OBJ(usc, UDP_SOCKET_MAGIC);
+	AN(usc);
+	usc->fd4 = usc->fd6 = -1;
+	txts = res->ai_family == AF_INET6 ? &usc->txts6 : &usc->txts4;
+	fd = udp_sock(res->ai_family, txts);
+	if (fd < 0)
+		Fail(ocx, 1, "socket(2) failed");
+	i = 1;
+	(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+
+	if (res->ai_family == AF_INET) {
+		usc->fd4 = fd;
+		sin4 = (void*)res->ai_addr;
+		memset(&mr4, 0, sizeof mr4);
+		mr4.imr_multiaddr = sin4->sin_addr;
+		if (!IN_MULTICAST(ntohl(sin4->sin_addr.s_addr)))
+			sin4->sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(fd, res->ai_addr, res->ai_addrlen))
+			Fail(ocx, 1, "Could not bind to '%s' port '%s'",
+			    group, port);
+		if (ifaddr != NULL &&
+		    inet_pton(AF_INET, ifaddr, &mr4.imr_interface) != 1)
+			Fail(ocx, 0, "Interface '%s' is not an IPv4 address",
+			    ifaddr);
+		if (IN_MULTICAST(ntohl(mr4.imr_multiaddr.s_addr)) &&
+		    setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		    &mr4, sizeof mr4))
+			Fail(ocx, 1, "Could not join '%s'", group);
+	} else if (res->ai_family == AF_INET6) {
+		usc->fd6 = fd;
+		sin6 = (void*)res->ai_addr;
+		if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+			Fail(ocx, 0, "'%s' is not a multicast group", group);
+		if (bind(fd, res->ai_addr, res->ai_addrlen))
+			Fail(ocx, 1, "Could not bind to '%s' port '%s'",
+			    group, port);
+		memset(&mr6, 0, sizeof mr6);
+		mr6.ipv6mr_multiaddr = sin6->sin6_addr;
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+		    &mr6, sizeof mr6))
+			Fail(ocx, 1, "Could not join '%s'", group);
+	} else
+		WRONG("Wrong AF_");
+	freeaddrinfo(res);
+	return (usc);
+}
+
+void
+Udp_McastTx(struct ocx *ocx, const struct udp_socket *usc,
+    const char *ifaddr, unsigned ttl)
+{
+	struct in_addr ia;
+	u_char c;
+	int i;
+
 	CHECK_OBJ_NOTNULL(usc, UDP_SOCKET_MAGIC);
-	AN(ss);
-	AN(sl);
-	AN(buf);
-	AN(len);
-	sa = ss;
-	if (sa->sa_family == AF_INET)
-		return (sendto(usc->fd4, buf, len, 0, ss, sl));
-	if (sa->sa_family == AF_INET6)
-		return (sendto(usc->fd6, buf, len, 0, ss, sl));
+	assert(ttl > 0 && ttl < 256);
+	if (usc->fd4 >= 0) {
+		i = 1;
+		(void)setsockopt(usc->fd4, SOL_SOCKET, SO_BROADCAST,
+		    &i, sizeof i);
+		c = (u_char)ttl;
+		(void)setsockopt(usc->fd4, IPPROTO_IP, IP_MULTICAST_TTL,
+		    &c, sizeof c);
+		if (ifaddr != NULL && inet_pton(AF_INET, ifaddr, &ia) == 1 &&
+		    setsockopt(usc->fd4, IPPROTO_IP, IP_MULTICAST_IF,
+		    &ia, sizeof ia))
+			Fail(ocx, 1, "Cannot multicast on '%s'", ifaddr);
+	}
+	if (usc->fd6 >= 0) {
+		i = (int)ttl;
+		(void)setsockopt(usc->fd6, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+		    &i, sizeof i);
+	}
+}
+
+/**********************************************************************
+ * Receive up to n packets with one poll(2), and where recvmmsg(2) is
+ * available, one system call per socket.
+ *
+ * Returns the number of packets received, zero on timeout.
+ */
+
+#define UDP_CTRL	128
+
+static unsigned
+udp_rx_many(struct ocx *ocx, int fd, struct udp_msg *um, unsigned n)
+{
+	struct msghdr *msg;
+	struct iovec iov[n];
+	u_char ctrl[n][UDP_CTRL];
+	struct timestamp now;
+	unsigned u, m;
+	ssize_t rl;
+#ifdef MSG_WAITFORONE
+	struct mmsghdr mm[n];
+	int i;
+#else
+	struct msghdr mm1;
+#endif
 
-	WRONG("Wrong AF_");
-	NEEDLESS_RETURN(0);
+	memset(ctrl, 0, sizeof ctrl);
+	for (u = 0; u < n; u++) {
+#ifdef MSG_WAITFORONE
+		msg = &mm[u].msg_hdr;
+#else
+		msg = &mm1;
+#endif
+		memset(msg, 0, sizeof *msg);
+		iov[u].iov_base = um[u].ptr;
+		iov[u].iov_len = um[u].size;
+		msg->msg_name = (void*)&um[u].ss;
+		msg->msg_namelen = sizeof um[u].ss;
+		msg->msg_iov = &iov[u];
+		msg->msg_iovlen = 1;
+		msg->msg_control = ctrl[u];
+		msg->msg_controllen = UDP_CTRL;
+#ifndef MSG_WAITFORONE
+		rl = recvmsg(fd, msg, MSG_DONTWAIT);
+		if (rl <= 0)
+			break;
+		um[u].len = rl;
+		um[u].sl = msg->msg_namelen;
+		if (msg->msg_flags != 0)
+			um[u].len = -1;
+		TB_Now(&um[u].ts);
+		udp_rx_ts(ocx, msg, &um[u].ts);
+#endif
+	}
+#ifdef MSG_WAITFORONE
+	i = recvmmsg(fd, mm, n, MSG_DONTWAIT, NULL);
+	if (i <= 0)
+		return (0);
+	m = (unsigned)i;
+	TB_Now(&now);
+	for (u = 0; u < m; u++) {
+		msg = &mm[u].msg_hdr;
+		rl = (ssize_t)mm[u].msg_len;
+		um[u].len = rl;
+		um[u].sl = msg->msg_namelen;
+		if (msg->msg_flags != 0)
+			um[u].len = -1;
+		um[u].ts = now;
+		udp_rx_ts(ocx, msg, &um[u].ts);
+	}
+#else
+	(void)now;
+	m = u;
+#endif
+	return (m);
+}
+
+unsigned
+UdpTimedRxMany(struct ocx *ocx, const struct udp_socket *usc,
+    struct udp_msg *um, unsigned n, double tmo)
+{
+	struct pollfd pfd[2];
+	int i, tmo_msec;
+	unsigned m = 0, u;
+
+	CHECK_OBJ_NOTNULL(usc, UDP_SOCKET_MAGIC);
+	AN(um);
+	assert(n > 0 && n <= UDP_BATCH);
+
+	pfd[0].fd = usc->fd4;
+	pfd[1].fd = usc->fd6;
+	pfd[0].events = pfd[1].events = POLLIN;
+	pfd[0].revents = pfd[1].revents = 0;
+	if (tmo == 0.0) {
+		tmo_msec = -1;
+	} else {
+		tmo_msec = lround(1e3 * tmo);
+		if (tmo_msec <= 0)
+			tmo_msec = 0;
+	}
+	i = udp_poll(pfd, tmo_msec);
+	if (i < 0)
+		Fail(ocx, 1, "poll(2) failed\n");
+	if (i == 0)
+		return (0);
+	for (i = 0; i < 2 && m < n; i++)
+		if (pfd[i].revents & POLLIN)
+			m += udp_rx_many(ocx, pfd[i].fd, um + m, n - m);
+
+	if (stats_seg != NULL) {
+		Stats_Begin();
+		for (u = 0; u < m; u++) {
+			if (um[u].len > 0)
+				stats_seg->udp_rx++;
+			else
+				stats_seg->udp_rx_err++;
+		}
+		Stats_End();
+	}
+	return (m);
 }
@@ -41,6 +41,28 @@ ssize_t UdpTimedRx(struct ocx *, const struct udp_socket *,
     struct timestamp *,
     void *, ssize_t len,
     double tmo);
+struct udp_msg {
+	void			*ptr;		// Set by caller
+	size_t			size;		// Set by caller
+	ssize_t			len;		// < 0 if truncated
+	struct sockaddr_storage	ss;
+	socklen_t		sl;
+	struct timestamp	ts;
+};
+
+#define UDP_BATCH		64
+
+struct udp_socket *UdpTimedServer(struct ocx *, const char *host,
+    const char *port);
+unsigned UdpTimedRxMany(struct ocx *, const struct udp_socket *,
+    struct udp_msg *, unsigned n, double tmo);
 ssize_t Udp_Send(struct ocx *, const struct udp_socket *,
     const void *sa, socklen_t, const void *ptr, size_t);
+struct udp_socket *UdpMcastSocket(struct ocx *, const char *group,
+    const char *port, const char *ifaddr);
+void Udp_McastTx(struct ocx *, const struct udp_socket *,
+    const char *ifaddr, unsigned ttl);
+ssize_t Udp_SendTimed(struct ocx *, const struct udp_socket *,
+    const void *sa, socklen_t, const void *ptr, size_t,
+    struct timestamp *);
 